@@ -1,18 +1,25 @@
 #include "cameraaccess.hpp"
+#include "logger.hpp"
 #include <libcamera/camera.h>
 #include <libcamera/formats.h>
-#include <iostream>
 #include <fstream>
 #include <memory>
 #include <exception>
 #include <vector>
+#include <optional>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 using namespace libcamera;
 
-CameraAccess::CameraAccess(){
+static bool isSupportedFormat(const PixelFormat& format){
+	return format==formats::YUYV || format==formats::RGB888 || format==formats::BGR888;
+}
+
+CameraAccess::CameraAccess(StreamRole role,int width,int height){
+	this->imageWidth = width;
+	this->imageHeight = height;
 	//init everything we need
 	cm.start();
 	if(cm.cameras().empty()){
@@ -21,10 +28,10 @@ CameraAccess::CameraAccess(){
 	camera = cm.get(cm.cameras()[0]->id());
 	//Acquire means that only this app can use this camera
 	camera->acquire();
-	std::cout << "Camera acquired: " << camera->id() << std::endl;
+	logInfo("Camera acquired: %s",camera->id());
 
-	//Tell it that we're taking a photo
-	std::unique_ptr<CameraConfiguration> config = camera->generateConfiguration({StreamRole::StillCapture});
+	//Tell it whether we're taking photos or streaming
+	std::unique_ptr<CameraConfiguration> config = camera->generateConfiguration({role});
 	if(config->size()==0){
 		throw std::runtime_error("Failed to generate camera configuration");
 	}
@@ -33,20 +40,28 @@ CameraAccess::CameraAccess(){
 	config->at(0).pixelFormat = formats::YUYV;
 	config->at(0).size.width = this->imageWidth;
 	config->at(0).size.height = this->imageHeight;
+	//StillCapture only asks for one, streaming needs one being filled, one waiting and one being used
+	config->at(0).bufferCount = std::max(config->at(0).bufferCount,4u);
 	//Validate can adjust the camera configuration
 
 	CameraConfiguration::Status status = config->validate();
 	if(status == CameraConfiguration::Invalid){
 		throw std::runtime_error("Camera configuration is invalid");
 	}
-	else if(status = CameraConfiguration::Adjusted){
-		std::cout << "Camera configuration adjusted" << std::endl;
+	else if(status == CameraConfiguration::Adjusted){
+		logInfo("Camera configuration adjusted");
 		this->imageWidth = config->at(0).size.width;
 		this->imageHeight = config->at(0).size.height;
-		if(config->at(0).pixelFormat != formats::YUYV){
-			throw std::runtime_error("Libcamera changed format to "+config->at(0).pixelFormat.toString()+". YUYV is the only accepted format");
+		//Cameras without a YUYV output (e.g. vimc) can still stream RGB
+		if(!isSupportedFormat(config->at(0).pixelFormat)){
+			throw std::runtime_error("Libcamera changed format to "+config->at(0).pixelFormat.toString()+". Only YUYV, RGB888 and BGR888 are accepted");
 		}
 	}
+	this->pixelFormat = config->at(0).pixelFormat;
+	//libcamera names the formats by the little endian word rather than the bytes
+	if(pixelFormat==formats::YUYV) streamFormat = FRAME_YUYV;
+	else if(pixelFormat==formats::RGB888) streamFormat = FRAME_BGR;
+	else streamFormat = FRAME_RGB;
 
 	if(camera->configure(config.get()) < 0){
 		throw std::runtime_error("Failed to configure camera");
@@ -57,9 +72,12 @@ CameraAccess::CameraAccess(){
 
 	allocator = std::make_unique<FrameBufferAllocator>(camera);
 	stream = config->at(0).stream();
+	//Rows can be padded
+	this->imageStride = config->at(0).stride;
 }
 
 CameraAccess::~CameraAccess(){
+	stopStreaming();
 	//Can be called if the camera is not running
 	if(camera){
 		camera->stop();
@@ -69,55 +87,184 @@ CameraAccess::~CameraAccess(){
 	//The CameraManager destructor sorts itself out
 }
 
-CameraImage CameraAccess::takePhoto(){
-	if(allocator->allocate(stream) < 0){
-		throw std::runtime_error("Failed to allocate camera buffer");
+CameraImage CameraAccess::takePhoto(int timeoutMs){
+	//Left running afterwards so that the next photo doesn't pay for starting and settling
+	startStreaming();
+	std::future<CameraImage> future;
+	{
+		std::lock_guard<std::mutex> lock(frameMutex);
+		if(photoWanted){
+			throw std::logic_error("Only one photo can be taken at a time");
+		}
+		photoPromise = std::promise<CameraImage>();
+		future = photoPromise.get_future();
+		photoWanted = true;
+	}
+	if(future.wait_for(std::chrono::milliseconds(timeoutMs))==std::future_status::timeout){
+		std::lock_guard<std::mutex> lock(frameMutex);
+		//It may have just come in
+		if(future.wait_for(std::chrono::seconds(0))==std::future_status::timeout){
+			photoWanted = false;
+			throw std::runtime_error("Timed out waiting for the camera to take a photo");
+		}
+	}
+	return future.get();
+}
+
+//----------------------------------------------------
+//STREAMING
+
+void CameraAccess::startStreaming(int numBuffers){
+	if(streaming) return;
+	if(numBuffers<2){
+		throw std::invalid_argument("Streaming needs at least 2 buffers, one being filled and one being used");
+	}
+	if(allocator->buffers(stream).empty() && allocator->allocate(stream) < 0){
+		throw std::runtime_error("Failed to allocate camera buffers");
 	}
 	const std::vector<std::unique_ptr<FrameBuffer>>& buffers = allocator->buffers(stream);
-	std::unique_ptr<Request> request = camera->createRequest();
-	if(request.get()==nullptr){
-		throw std::runtime_error("Failed to create camera request");
-	}
-	request->addBuffer(stream,buffers[0].get());
-	request->controls() = controls;
-	//Wait for photo request to complete
-	photoPromise = std::promise<void>();
-	std::future<void> future  = photoPromise.get_future();
-	camera->requestCompleted.connect(this,&CameraAccess::photoRequestComplete);
-	//We will discard the first numDiscard photos to allow the auto exposure to stabilise
-	//This is actually necessary (at least for the first photo)
-	camera->start();
-	camera->queueRequest(request.get());
-	future.wait();
-	const int numDiscard = 5;
-	for(int i=0;i<numDiscard;i++){
-		request->reuse();
-		request->addBuffer(stream,buffers[0].get());
-		request->controls() = controls;
-		photoPromise = std::promise<void>();
-		future = photoPromise.get_future();
+	//The allocator decides how many it can give us
+	numBuffers = std::min(numBuffers,(int)buffers.size());
+	for(int i=0;i<numBuffers;i++){
+		const FrameBuffer::Plane& plane = buffers[i]->planes()[0];
+		//Mapped from the start of the dmabuf as the offset doesn't have to be page aligned
+		const size_t length = plane.offset+plane.length;
+		void *addr = mmap(nullptr,length,PROT_READ,MAP_SHARED,plane.fd.get(),0);
+		if(addr == MAP_FAILED){
+			throw std::runtime_error("Plane mmap failed");
+		}
+		mappings.push_back({addr,length});
+		mappedPlanes[buffers[i].get()] = reinterpret_cast<const uint8_t*>(addr)+plane.offset;
+
+		std::unique_ptr<Request> request = camera->createRequest(i);
+		if(request.get()==nullptr){
+			throw std::runtime_error("Failed to create camera request");
+		}
+		if(request->addBuffer(stream,buffers[i].get()) < 0){
+			throw std::runtime_error("Failed to add a buffer to a camera request");
+		}
+		streamRequests.push_back(std::move(request));
+	}
+	camera->requestCompleted.connect(this,&CameraAccess::streamRequestComplete);
+	{
+		std::lock_guard<std::mutex> lock(frameMutex);
+		streaming = true;
+		latestRequest = nullptr;
+	}
+	framesSinceStart = 0;
+	//AE and AWB carry on from frame to frame and so the controls only need setting once
+	if(camera->start(&controls) < 0){
+		throw std::runtime_error("Failed to start the camera");
+	}
+	for(std::unique_ptr<Request>& request : streamRequests){
 		camera->queueRequest(request.get());
-		future.wait();
-	}
-	//FrameBuffer::Plane is a chunk of memory where image data is written to
-	//JPEG is stored in a single plane
-	const FrameBuffer::Plane plane = buffers[0]->planes()[0];
-	void *planeAddr = mmap(nullptr,plane.length,PROT_READ,MAP_SHARED,plane.fd.get(),plane.offset);
-	if(planeAddr == MAP_FAILED) throw std::runtime_error("Plane mmap failed");
-	//The photo may not use all the bytes in the plane
-	size_t bytesUsed = buffers[0]->metadata().planes()[0].bytesused;
-	if((int)bytesUsed != this->imageHeight*this->imageWidth*2){
-		throw std::runtime_error("Image data does not match dimensions");
-	}
-	CameraImage result = CameraImage::YUYVToRGB(reinterpret_cast<uint8_t*>(planeAddr),this->imageHeight,this->imageWidth);
+	}
+	logInfo("Camera streaming %dx%d %s with %d buffers",imageWidth,imageHeight,pixelFormat.toString(),numBuffers);
+}
+
+void CameraAccess::stopStreaming(){
+	{
+		std::lock_guard<std::mutex> lock(frameMutex);
+		if(!streaming) return;
+		streaming = false;
+		latestRequest = nullptr;
+		if(photoWanted){
+			photoPromise.set_exception(std::make_exception_ptr(std::runtime_error("The camera stopped before the photo was taken")));
+			photoWanted = false;
+		}
+	}
+	frameCondition.notify_all();
+	//Cancels every queued request
 	camera->stop();
-	return result;
+	camera->requestCompleted.disconnect(this,&CameraAccess::streamRequestComplete);
+	streamRequests.clear();
+	mappedPlanes.clear();
+	for(std::pair<void*,size_t>& mapping : mappings){
+		munmap(mapping.first,mapping.second);
+	}
+	mappings.clear();
+	allocator->free(stream);
+}
+
+void CameraAccess::streamRequestComplete(Request *req){
+	if(req->status() == Request::RequestCancelled) return; //stopping
+	FrameBuffer *buffer = req->findBuffer(stream);
+	if(buffer==nullptr || buffer->metadata().status != FrameMetadata::FrameSuccess){
+		requeue(req);
+		return;
+	}
+	//Straight back to the camera, nothing sees these
+	if(framesSinceStart<numSettleFrames){
+		framesSinceStart++;
+		requeue(req);
+		return;
+	}
+	const videoFrame frame = toFrame(req);
+	if(frameListener) frameListener(frame);
+	{
+		std::lock_guard<std::mutex> lock(frameMutex);
+		if(photoWanted){
+			//Converted here as the buffer's only ours until it's passed on
+			try{
+				photoPromise.set_value(videoFrameToImage(frame));
+			}
+			catch(...){
+				photoPromise.set_exception(std::current_exception());
+			}
+			photoWanted = false;
+		}
+	}
+	Request *replaced = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(frameMutex);
+		if(!streaming) return;
+		replaced = latestRequest;
+		latestRequest = req;
+	}
+	frameCondition.notify_one();
+	//Nobody used the previous frame before this one came in
+	if(replaced) requeue(replaced);
 }
 
-void CameraAccess::photoRequestComplete(Request *req){
-	if(req->status() == Request::RequestComplete){
-		photoPromise.set_value(); //Done
+bool CameraAccess::processLatestFrame(const std::function<void(const videoFrame&)>& process,int timeoutMs){
+	Request *req = nullptr;
+	{
+		std::unique_lock<std::mutex> lock(frameMutex);
+		frameCondition.wait_for(lock,std::chrono::milliseconds(timeoutMs),[this]{ return latestRequest!=nullptr || !streaming; });
+		if(latestRequest==nullptr) return false;
+		req = latestRequest;
+		latestRequest = nullptr;
 	}
+	try{
+		process(toFrame(req));
+	}
+	catch(...){
+		requeue(req);
+		throw;
+	}
+	requeue(req);
+	return true;
 }
 
+videoFrame CameraAccess::toFrame(Request *req){
+	FrameBuffer *buffer = req->findBuffer(stream);
+	const FrameMetadata& metadata = buffer->metadata();
+	videoFrame frame;
+	frame.data = mappedPlanes.at(buffer);
+	frame.height = imageHeight;
+	frame.width = imageWidth;
+	frame.stride = imageStride;
+	frame.format = streamFormat;
+	frame.sequence = metadata.sequence;
+	frame.timestamp = metadata.timestamp;
+	//When the first row was exposed, the buffer's timestamp is when it finished
+	std::optional<int64_t> sensorTimestamp = req->metadata().get(controls::SensorTimestamp);
+	frame.captureTime = sensorTimestamp ? *sensorTimestamp : metadata.timestamp;
+	return frame;
+}
 
+void CameraAccess::requeue(Request *req){
+	req->reuse(Request::ReuseBuffers);
+	//Fails harmlessly if the camera has been stopped in the meantime
+	camera->queueRequest(req);
+}
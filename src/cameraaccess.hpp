@@ -9,26 +9,74 @@
 #include <libcamera/framebuffer.h>
 #include <libcamera/base/signal.h>
 #include <future>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <map>
 #include "cameraimage.hpp"
+#include "videoframe.hpp"
 
 
 using namespace libcamera;
 
 class CameraAccess{
 	public:
-		CameraAccess();
+		//StillCapture for takePhoto, VideoRecording for streaming
+		//width and height are what we ask for, the camera may adjust them (see getImageWidth/Height)
+		CameraAccess(StreamRole role = StreamRole::StillCapture,int width = 640,int height = 480);
 		~CameraAccess();
-		CameraImage takePhoto();
-		void photoRequestComplete(Request *req);
+		//The next frame from the stream, which is started the first time and then left running
+		//Only the first photo waits for AE/AWB to settle, after that it's one frame interval
+		//Frames still go to processLatestFrame and the listener as normal
+		CameraImage takePhoto(int timeoutMs = 2000);
+
+		//STREAMING
+		//Starts the camera and keeps numBuffers requests queued until stopStreaming
+		//The planes are mmapped once here rather than for every frame
+		void startStreaming(int numBuffers = 4);
+		//Must be called from the thread that calls processLatestFrame (or once it has stopped)
+		void stopStreaming();
+		//Waits up to timeoutMs for a frame newer than the last one and calls process with it on this thread
+		//Only the newest frame is kept, older ones go straight back to the camera
+		//The frame's buffer is requeued once process returns, so copy out anything needed later
+		//Returns false if there wasn't a frame in time
+		bool processLatestFrame(const std::function<void(const videoFrame&)>& process,int timeoutMs = 1000);
+		//Called on libcamera's thread for every frame, it must be quick and must not keep the data
+		void setFrameListener(std::function<void(const videoFrame&)> listener){ frameListener = std::move(listener); }
+		void streamRequestComplete(Request *req);
+		bool isStreaming() const{ return streaming; }
+
+		int getImageHeight() const{ return imageHeight; }
+		int getImageWidth() const{ return imageWidth; }
 	private:
 		CameraManager cm;
 		std::shared_ptr<Camera> camera;
 		std::unique_ptr<FrameBufferAllocator> allocator;
-		std::promise<void> photoPromise;
+		//Fulfilled with the next frame by streamRequestComplete when photoWanted
+		std::promise<CameraImage> photoPromise;
+		bool photoWanted = false;
 		Stream *stream;
 		ControlList controls;
 		int imageHeight = 480;
 		int imageWidth = 640;
+		int imageStride = 640*2;
+		PixelFormat pixelFormat;
+		frameFormat streamFormat;
+		//STREAMING
+		std::vector<std::unique_ptr<Request>> streamRequests;
+		std::map<const FrameBuffer*,const uint8_t*> mappedPlanes;
+		std::vector<std::pair<void*,size_t>> mappings; //for munmap
+		std::function<void(const videoFrame&)> frameListener;
+		std::mutex frameMutex;
+		std::condition_variable frameCondition;
+		Request *latestRequest = nullptr; //completed but not used yet, still holds its buffer
+		bool streaming = false;
+		//The first frames after starting are dropped whilst AE and AWB settle, only used on libcamera's thread
+		static constexpr int numSettleFrames = 5;
+		int framesSinceStart = 0;
+
+		videoFrame toFrame(Request *req);
+		void requeue(Request *req);
 };
 
 #endif
@@ -1,69 +1,191 @@
 #include "cameraimage.hpp"
-#include <iostream>
+#include "logger.hpp"
+#include "yuyv.hpp"
 #include <fstream>
 #include <stdio.h>
 #include <jpeglib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <csetjmp>
 
 CameraImage CameraImage::YUYVToRGB(uint8_t *data,int height,int width){
-	int dataSize = width*height*2;
 	int outputSize = width*height*3;
 	std::unique_ptr<uint8_t[]> output = std::unique_ptr<uint8_t[]>(new uint8_t[outputSize]);
-	for(int i=0,j=0;i<dataSize;i+=4){
-		int Y0 = data[i]; //Pixel 0 brightness
-		int U = data[i+1]; //Shared chrominanace blue-difference component
-		int Y1 = data[i+2]; //Pixel 1 brightness
-		int V = data[i+3]; //Shared chrominanace red-difference component
-		//Used for calculations - no real world significance
-		int C = Y0;
-		int D = U-128;
-		int E = V-128;
-
-		auto clip = [](int val){
-			return std::max(0,std::min(255,val));
-		};
-		//Pixel 0
-		output[j++] = clip((298*C+409*E+128)>>8);
-		output[j++] = clip((298*C-100*D-208*E+128)>>8);
-		output[j++] = clip((298*C+516*D+128)>>8);
-		//Pixel 1
-		C = Y1;
-		output[j++] = clip((298*C+409*E+128)>>8);
-		output[j++] = clip((298*C-100*D-208*E+128)>>8);
-		output[j++] = clip((298*C+516*D+128)>>8);
-	}
+	//There's no padding and so the whole image can be done as one long row
+	yuyvRowToRGB(data,width*height,output.get());
 	CameraImage result(output,height,width);
 	return result;
 }
 
 void CameraImage::saveAsJPEG(std::string fname){
-	FILE *f = fopen(fname.c_str(),"wb");
-	if(!f){
-		throw std::runtime_error("Could not open file "+fname);
-	}
+	writeJPEG(fname,encodeJPEG());
+	logInfo("Saved %s",fname);
+}
+
+//----------------------------------------------------
+//ERRORS
+
+//jpeg_std_error's error_exit calls exit(), this jumps back to whoever set jump so that they can clean up and throw
+typedef struct jpegErrorMgr{
+	jpeg_error_mgr mgr; //must be first so that the cinfo->err pointer can be cast back
+	jmp_buf jump;
+	char message[JMSG_LENGTH_MAX];
+}jpegErrorMgr;
+
+static void jpegErrorExit(j_common_ptr cinfo){
+	jpegErrorMgr *err = (jpegErrorMgr*) cinfo->err;
+	(*cinfo->err->format_message)(cinfo,err->message);
+	longjmp(err->jump,1);
+}
+
+//Warnings (e.g. a truncated file) go to the log rather than straight to stderr
+static void jpegOutputMessage(j_common_ptr cinfo){
+	char message[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message)(cinfo,message);
+	logWarn("libjpeg: %s",message);
+}
+
+static jpeg_error_mgr* jpegThrowingError(jpegErrorMgr& err){
+	jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpegErrorExit;
+	err.mgr.output_message = jpegOutputMessage;
+	err.message[0] = '\0';
+	return &err.mgr;
+}
+
+//----------------------------------------------------
+//ENCODING
+
+//libjpeg's destination manager, writing into a vector that grows as needed
+typedef struct vectorDest{
+	jpeg_destination_mgr mgr; //must be first so that the cinfo->dest pointer can be cast back
+	std::vector<uint8_t> *out;
+}vectorDest;
+
+static void initVectorDest(j_compress_ptr cinfo){
+	vectorDest *dest = (vectorDest*) cinfo->dest;
+	dest->mgr.next_output_byte = dest->out->data();
+	dest->mgr.free_in_buffer = dest->out->size();
+}
+
+static boolean growVectorDest(j_compress_ptr cinfo){
+	vectorDest *dest = (vectorDest*) cinfo->dest;
+	//Called when it's completely full
+	const size_t used = dest->out->size();
+	dest->out->resize(used*2);
+	dest->mgr.next_output_byte = dest->out->data()+used;
+	dest->mgr.free_in_buffer = dest->out->size()-used;
+	return true;
+}
+
+static void termVectorDest(j_compress_ptr cinfo){
+	vectorDest *dest = (vectorDest*) cinfo->dest;
+	dest->out->resize(dest->out->size()-dest->mgr.free_in_buffer);
+}
+
+std::vector<uint8_t> CameraImage::encodeJPEG(int quality) const{
+	std::vector<uint8_t> result;
+	//Photos are usually around a tenth of the raw size at 75, so it rarely has to grow
+	result.resize(std::max(4096,this->height*this->width*3/8));
+	//Made before the setjmp, longjmp skips destructors
+	std::unique_ptr<JSAMPROW[]> rows(new JSAMPROW[this->height]);
 	jpeg_compress_struct cinfo;
-	jpeg_error_mgr jerr;
-	cinfo.err = jpeg_std_error(&jerr);
+	jpegErrorMgr jerr;
+	cinfo.err = jpegThrowingError(jerr);
+	if(setjmp(jerr.jump)){
+		jpeg_destroy_compress(&cinfo);
+		throw std::runtime_error(std::string("Could not encode JPEG: ")+jerr.message);
+	}
 	jpeg_create_compress(&cinfo);
-	jpeg_stdio_dest(&cinfo,f);
+	vectorDest dest;
+	dest.out = &result;
+	dest.mgr.init_destination = initVectorDest;
+	dest.mgr.empty_output_buffer = growVectorDest;
+	dest.mgr.term_destination = termVectorDest;
+	cinfo.dest = &dest.mgr;
 
 	cinfo.image_width = this->width;
 	cinfo.image_height = this->height;
 	cinfo.input_components = 3; //RGB
 	cinfo.in_color_space = JCS_RGB;
-
-	const int quality = 75; //0 to 100
 	jpeg_set_defaults(&cinfo);
 	jpeg_set_quality(&cinfo,quality,true); //the true is to force entries between 0 and 255
+#ifndef LIBJPEG_TURBO_VERSION
+	//libjpeg-turbo's accurate DCT is SIMD and about as fast, plain libjpeg's isn't
+	cinfo.dct_method = JDCT_IFAST;
+#endif
 	jpeg_start_compress(&cinfo,true); // the true is to write the Huffman tables
 
-	JSAMPROW rowPtr[1];
-	int rowStride = this->width*3;
+	//All of the rows at once, rather than a call per scanline
+	const int rowStride = this->width*3;
+	for(int y=0;y<this->height;y++){
+		rows[y] = &this->data[y * rowStride];
+	}
 	while(cinfo.next_scanline < cinfo.image_height){
-		rowPtr[0] = &this->data[cinfo.next_scanline * rowStride];
-		jpeg_write_scanlines(&cinfo,rowPtr,1);
+		jpeg_write_scanlines(&cinfo,&rows[cinfo.next_scanline],cinfo.image_height-cinfo.next_scanline);
 	}
-	std::cout << "Saved " << fname << std::endl;
 	jpeg_finish_compress(&cinfo);
 	jpeg_destroy_compress(&cinfo);
+	return result;
+}
+
+void CameraImage::writeJPEG(const std::string& fname,const std::vector<uint8_t>& jpeg){
+	int fd = open(fname.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if(fd<0){
+		throw std::runtime_error("Could not open file "+fname);
+	}
+	//One write for the whole file, only looped in case it's interrupted
+	size_t written = 0;
+	while(written<jpeg.size()){
+		ssize_t n = write(fd,jpeg.data()+written,jpeg.size()-written);
+		if(n<0){
+			if(errno==EINTR) continue;
+			close(fd);
+			throw std::runtime_error("Could not write file "+fname);
+		}
+		written += n;
+	}
+	close(fd);
+}
+
+//----------------------------------------------------
+//DECODING
+
+CameraImage CameraImage::loadJPEG(std::string fname){
+	FILE *f = fopen(fname.c_str(),"rb");
+	if(!f){
+		throw std::runtime_error("Could not open file "+fname);
+	}
+	//Made before the setjmp, longjmp skips destructors
+	std::unique_ptr<uint8_t[]> output;
+	jpeg_decompress_struct cinfo;
+	jpegErrorMgr jerr;
+	cinfo.err = jpegThrowingError(jerr);
+	//A corrupt file throws rather than exiting, the training skips it
+	if(setjmp(jerr.jump)){
+		jpeg_destroy_decompress(&cinfo);
+		fclose(f);
+		throw std::runtime_error("Could not decode "+fname+": "+jerr.message);
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo,f);
+	jpeg_read_header(&cinfo,true);
+	cinfo.out_color_space = JCS_RGB; //converts greyscale too
+	jpeg_start_decompress(&cinfo);
+
+	int height = cinfo.output_height;
+	int width = cinfo.output_width;
+	int rowStride = width*3;
+	output = std::unique_ptr<uint8_t[]>(new uint8_t[height*rowStride]);
+	JSAMPROW rowPtr[1];
+	while(cinfo.output_scanline < cinfo.output_height){
+		rowPtr[0] = &output[cinfo.output_scanline * rowStride];
+		jpeg_read_scanlines(&cinfo,rowPtr,1);
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
 	fclose(f);
+	CameraImage result(output,height,width);
+	return result;
 }
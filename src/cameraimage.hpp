@@ -3,6 +3,10 @@
 
 #include <memory>
 #include <exception>
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
 
 class CameraImage{
 	public:
@@ -18,7 +22,25 @@ class CameraImage{
 			this->width = inputWidth;
 		}
 		void saveAsJPEG(std::string fname);
+		//Encoded in memory, see JpegEncoder to do it off the caller's thread
+		std::vector<uint8_t> encodeJPEG(int quality = 75) const;
+		//Already encoded bytes to a file in a single write
+		static void writeJPEG(const std::string& fname,const std::vector<uint8_t>& jpeg);
+		static CameraImage loadJPEG(std::string fname);
 		static CameraImage YUYVToRGB(uint8_t *data,int height,int width);
+		//One pixel, shared by everything that reads YUYV so that they all give the same colours
+		static inline void yuvToRGB(int Y,int U,int V,uint8_t *rgb){
+			//Used for calculations - no real world significance
+			const int C = Y;
+			const int D = U-128;
+			const int E = V-128;
+			auto clip = [](int val){
+				return (uint8_t) std::max(0,std::min(255,val));
+			};
+			rgb[0] = clip((298*C+409*E+128)>>8);
+			rgb[1] = clip((298*C-100*D-208*E+128)>>8);
+			rgb[2] = clip((298*C+516*D+128)>>8);
+		}
 };
 
 #endif
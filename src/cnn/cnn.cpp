@@ -1,5 +1,10 @@
 #include "cnn.hpp"
 #include <arm_neon.h>
+#include <thread>
+#include <barrier>
+#include <random>
+#include <algorithm>
+#include <numeric>
 
 //----------------------------------------------------
 //CONSTRUCTORS 
@@ -39,31 +44,36 @@ CNN::CNN(d2& pixelStatsInp){
     padding = true;
 
     this->pixelStats = pixelStatsInp;
-    this->kernels = loadKernels();
-    this->weights = loadWeights();
+    //Goes through the same path as a hot-swapped model
+    std::unique_ptr<modelSlot> model = loadModel(currDir+"/res");
+    checkModel(*model);
+    swapModel(*model);
     this->activations = std::vector<Tensor>(numNeurons.size());
     for(int l=0;l<numNeurons.size();l++){
         activations[l] = Tensor({numNeurons[l]});
     }
     this->maps = std::vector<Tensor>(mapDimens.size());
-    for(int l=0;l<mapDimens.size();l++){
-        maps[l] = Tensor({mapDimens[l].c,mapDimens[l].h,mapDimens[l].w});
+    //Pitched so that the kernels don't need scalar tails
+    maps[0] = Tensor({mapDimens[0].c,mapDimens[0].h,mapDimens[0].w},true);
+    for(int l=1;l<mapDimens.size();l++){
+        //Blocked layout
+        maps[l] = Tensor({numChannelBlocks(mapDimens[l].c),mapDimens[l].h,mapDimens[l].w,CHANNEL_BLOCK});
     }
-    if(padding){
-        this->paddedMaps = std::vector<Tensor>(mapDimens.size()-1); //last map is pooled not convolved - my favourite way of having a Martini
-        for(int l=0;l<mapDimens.size()-1;l++){
-            int kernelRadiusY = std::floor(this->kernelSizes[l].first/2);
-            int kernelRadiusX = std::floor(this->kernelSizes[l].second/2);
-            int paddedHeight = mapDimens[l].h+2*kernelRadiusY;
-            int paddedWidth = mapDimens[l].w+2*kernelRadiusX;
-            paddedMaps[l] = Tensor({mapDimens[l].c,paddedHeight,paddedWidth});
-        }
+    //Needed even without padding as this is where the input is converted into the blocked layout
+    this->paddedMaps = std::vector<Tensor>(mapDimens.size()-1); //last map is pooled not convolved - my favourite way of having a Martini
+    for(int l=0;l<mapDimens.size()-1;l++){
+        int kernelRadiusY = padding ? std::floor(this->kernelSizes[l].first/2) : 0;
+        int kernelRadiusX = padding ? std::floor(this->kernelSizes[l].second/2) : 0;
+        int paddedHeight = mapDimens[l].h+2*kernelRadiusY;
+        int paddedWidth = mapDimens[l].w+2*kernelRadiusX;
+        paddedMaps[l] = Tensor({numChannelBlocks(mapDimens[l].c),paddedHeight,paddedWidth,CHANNEL_BLOCK});
     }
     for(int l=0;l<kernelSizes.size();l++){
         if(kernelSizes[l].first==0 || kernelSizes[l].second==0){ //pooling
             int pooledDimenX = mapDimens[l].w/strides[l].second;
             int pooledDimenY = mapDimens[l].h/strides[l].first;
-            maxPoolIndices.push_back(std::unique_ptr<int[]>(new int[mapDimens[l].c*pooledDimenY*pooledDimenX]));
+            //Blocked like the pooled map
+            maxPoolIndices.push_back(std::unique_ptr<int[]>(new int[numChannelBlocks(mapDimens[l].c)*CHANNEL_BLOCK*pooledDimenY*pooledDimenX]));
         }
     }
     //final pooling
@@ -81,9 +91,13 @@ CNN::CNN(CNN *original,bool deepCopyWeights) {
     kernelSizes = original->kernelSizes;
     strides = original->strides;
     padding = original->padding;
+    inferenceMode = original->inferenceMode;
+    kernelSparsity = original->kernelSparsity;
+    weightSparsity = original->weightSparsity;
     pixelStats = original->pixelStats;
     if(deepCopyWeights){
         kernels = original->kernels; //copy by value
+        blockedKernels = original->blockedKernels;
         weights = original->weights;
     }
     else{ //i.e. shallow copy
@@ -91,6 +105,10 @@ CNN::CNN(CNN *original,bool deepCopyWeights) {
         for(int i=0;i<original->kernels.size();i++){
             this->kernels[i].shallowCopy(original->kernels[i]);
         }
+        this->blockedKernels = std::vector<Tensor>(original->blockedKernels.size());
+        for(int i=0;i<original->blockedKernels.size();i++){
+            this->blockedKernels[i].shallowCopy(original->blockedKernels[i]);
+        }
         this->weights = std::vector<Tensor>(original->weights.size());
         for(int i=0;i<original->weights.size();i++){
             this->weights[i].shallowCopy(original->weights[i]);
@@ -101,24 +119,27 @@ CNN::CNN(CNN *original,bool deepCopyWeights) {
         activations[l] = Tensor({numNeurons[l]});
     }
     this->maps = std::vector<Tensor>(mapDimens.size());
-    for(int l=0;l<mapDimens.size();l++){
-        maps[l] = Tensor({mapDimens[l].c,mapDimens[l].h,mapDimens[l].w});
+    //Pitched so that the kernels don't need scalar tails
+    maps[0] = Tensor({mapDimens[0].c,mapDimens[0].h,mapDimens[0].w},true);
+    for(int l=1;l<mapDimens.size();l++){
+        //Blocked layout
+        maps[l] = Tensor({numChannelBlocks(mapDimens[l].c),mapDimens[l].h,mapDimens[l].w,CHANNEL_BLOCK});
     }
-    if(padding){
-        this->paddedMaps = std::vector<Tensor>(mapDimens.size()-1); //last map is pooled not convolved - my favourite way of having a Martini
-        for(int l=0;l<mapDimens.size()-1;l++){
-            int kernelRadiusY = std::floor(this->kernelSizes[l].first/2);
-            int kernelRadiusX = std::floor(this->kernelSizes[l].second/2);
-            int paddedHeight = mapDimens[l].h+2*kernelRadiusY;
-            int paddedWidth = mapDimens[l].w+2*kernelRadiusX;
-            paddedMaps[l] = Tensor({mapDimens[l].c,paddedHeight,paddedWidth});
-        }
+    //Needed even without padding as this is where the input is converted into the blocked layout
+    this->paddedMaps = std::vector<Tensor>(mapDimens.size()-1); //last map is pooled not convolved - my favourite way of having a Martini
+    for(int l=0;l<mapDimens.size()-1;l++){
+        int kernelRadiusY = padding ? std::floor(this->kernelSizes[l].first/2) : 0;
+        int kernelRadiusX = padding ? std::floor(this->kernelSizes[l].second/2) : 0;
+        int paddedHeight = mapDimens[l].h+2*kernelRadiusY;
+        int paddedWidth = mapDimens[l].w+2*kernelRadiusX;
+        paddedMaps[l] = Tensor({numChannelBlocks(mapDimens[l].c),paddedHeight,paddedWidth,CHANNEL_BLOCK});
     }
     for(int l=0;l<kernelSizes.size();l++){
         if(kernelSizes[l].first==0 || kernelSizes[l].second==0){ //pooling
             int pooledDimenX = mapDimens[l].w/strides[l].second;
             int pooledDimenY = mapDimens[l].h/strides[l].first;
-            maxPoolIndices.push_back(std::unique_ptr<int[]>(new int[mapDimens[l].c*pooledDimenY*pooledDimenX]));
+            //Blocked like the pooled map
+            maxPoolIndices.push_back(std::unique_ptr<int[]>(new int[numChannelBlocks(mapDimens[l].c)*CHANNEL_BLOCK*pooledDimenY*pooledDimenX]));
         }
     }
     //final pooling
@@ -142,8 +163,11 @@ std::vector<float> CNN::forwards(Tensor& imageInt
     #if PROFILING
         Timer *forwardsTimer = parentTimer->addChildTimer("forwards");
     #endif
+    //Between frames is the only time the model can change
+    swapInStandbyModel();
     reset();
-    maps[0] = parseImg(imageInt
+    //Straight into the input map rather than via a temporary
+    parseImg(imageInt.view(),maps[0].view()
     #if PROFILING
         ,parentTimer?forwardsTimer:nullptr
     #endif
@@ -153,45 +177,76 @@ std::vector<float> CNN::forwards(Tensor& imageInt
         ,parentTimer?forwardsTimer:nullptr
     #endif
     );
+    return forwardsFromInput(
     #if PROFILING
+        parentTimer?forwardsTimer:nullptr
+    #endif
+    );
+}
+
+std::vector<float> CNN::forwards(const std::function<void(const TensorView& input,const d2& pixelStats)>& fillInput
+#if PROFILING
+    ,Timer *parentTimer
+#endif
+){
+    #if PROFILING
+        Timer *forwardsTimer = parentTimer ? parentTimer->addChildTimer("forwards") : nullptr;
+        Timer *fillInputTimer = nullptr;
+        if(parentTimer) fillInputTimer = forwardsTimer->addChildTimer("fillInput");
+    #endif
+    swapInStandbyModel();
+    reset();
+    fillInput(maps[0].view(),pixelStats);
+    #if PROFILING
+        if(parentTimer) fillInputTimer->stop();
+    #endif
+    return forwardsFromInput(
+    #if PROFILING
+        parentTimer?forwardsTimer:nullptr
+    #endif
+    );
+}
+
+std::vector<float> CNN::forwardsFromInput(
+#if PROFILING
+    Timer *forwardsTimer
+#endif
+){
+    #if PROFILING
+        Timer *parentTimer = forwardsTimer;
         Timer *convolutionalLayersTimer = nullptr;
         if(parentTimer) convolutionalLayersTimer = forwardsTimer->addChildTimer("convolutionalLayers");
     #endif
     //Convolutional and pooling layers
+    //The input is the only CHW map, it is converted into the blocked layout (and padded) here
+    blockImage(maps[0].view(),paddedMaps[0].view());
+    int poolingLayer = 0;
     for(int l=1;l<mapDimens.size();l++){
         #if PROFILING
             Timer *convolutionalLayerTimer = nullptr;
             if(parentTimer) convolutionalLayerTimer = convolutionalLayersTimer->addChildTimer("convolutionLayer"+std::to_string(l-1));
         #endif
-        for(int i=0;i<mapDimens[l].c;i++){
-            //Does copy-elision and so no ctor is called and memory is shared
-            Tensor currChannel = maps[l].slice({i}); 
-            if(kernelSizes[l-1].first==0 || kernelSizes[l-1].second==0){
-                //1:1 mapping for a max pool layer
-                Tensor prevChannel = maps[l-1].slice({i});
-                currChannel = maxPool(prevChannel,strides[l-1].second,strides[l-1].first); //maxPool requires 1:1 channels between layers
-            }
-            else{   
-                //Slice with biases
-                Tensor kernel = kernels[l-1].slice({i},{i});
-                if(i==0){
-                    //We need to set the paddedMap with the correct data and padding 
-                    currChannel = convolution(maps[l-1],paddedMaps[l-1],kernel,strides[l-1].second,strides[l-1].first
-                    #if PROFILING
-                        ,parentTimer?convolutionalLayerTimer:nullptr
-                    #endif
-                    );
-                }   
-                else{
-                    //We've already set the paddedMap with the correct data
-                    //Tell it not to pad
-                    currChannel = convolution(paddedMaps[l-1],kernel,strides[l-1].second,strides[l-1].first,false
-                    #if PROFILING
-                        ,parentTimer?convolutionalLayerTimer:nullptr
-                    #endif
-                    );
-                }
-            }
+        //Views are just pointers and sizes and so they're cheap to make every frame
+        TensorView currMaps = maps[l].view();
+        TensorView layerInput = paddedMaps[l-1].view();
+        bool pooling = kernelSizes[l-1].first==0 || kernelSizes[l-1].second==0;
+        if(l>1){
+            if(pooling) layerInput = maps[l-1].view(); //the padding isn't needed
+            //We only need to set the paddedMap with the correct data and padding once per layer
+            else padImageBlocked(maps[l-1].view(),layerInput);
+        }
+        if(pooling){
+            //1:1 mapping for a max pool layer
+            //The indices are only needed for training
+            int *layerMaxPoolIndices = inferenceMode ? nullptr : maxPoolIndices[poolingLayer].get();
+            maxPoolBlocked(layerInput,currMaps,strides[l-1].second,strides[l-1].first,layerMaxPoolIndices);
+            poolingLayer++;
+        }
+        else{
+            //Every output channel at once
+            //Pruned models skip their zero blocks
+            const blockSparsity *sparsity = kernelSparsity[l-1].rowStarts.empty() ? nullptr : &kernelSparsity[l-1];
+            convolutionBlocked(layerInput,blockedKernels[l-1].view(),currMaps,strides[l-1].second,strides[l-1].first,sparsity);
         }
         #if PROFILING
             if(parentTimer) convolutionalLayerTimer->stop();
@@ -205,30 +260,15 @@ std::vector<float> CNN::forwards(Tensor& imageInt
         }
     #endif
     //Final pooling 
+    //Pools straight into activations[0], converting back to CHW as it goes
     int poolingDimenX = mapDimens[mapDimens.size()-1].w/strides[strides.size()-1].second;
     int poolingDimenY = mapDimens[mapDimens.size()-1].h/strides[strides.size()-1].first;
-    int poolingArea = poolingDimenY*poolingDimenX;
-    Tensor pooled({mapDimens[mapDimens.size()-1].c,poolingDimenY,poolingDimenX});
-    float *pooledData = pooled.getData();
-    float *activations0Data = activations[0].getData();
-    std::vector<int> pooledChildSizes = pooled.getChildSizes();
-    for(int i=0;i<mapDimens[mapDimens.size()-1].c;i++){
-        Tensor pooledChannel = pooled.slice({i});
-        Tensor prevChannel = maps[mapDimens.size()-1].slice({i});
-        int *maxPoolIndicesMap = &(maxPoolIndices[maxPoolIndices.size()-1][i*poolingArea]);
-        pooledChannel = maxPool(prevChannel,strides[strides.size()-1].second,strides[strides.size()-1].first,maxPoolIndicesMap);
-        int activationsPoolingArea = i*poolingArea;
-        int poolingChannel = i*pooledChildSizes[0];
-        for(int y=0;y<poolingDimenY;y++){
-            int activationsPoolingRow = activationsPoolingArea + y*poolingDimenX;
-            int poolingRow = poolingChannel + y*pooledChildSizes[1];
-            std::memcpy(
-                activations0Data+activationsPoolingRow,
-                pooledData+poolingRow,
-                poolingDimenX*sizeof(float)
-            );
-        }
-    }
+    const int flattenedDimens[3] = {mapDimens[mapDimens.size()-1].c,poolingDimenY,poolingDimenX};
+    const int flattenedChildSizes[3] = {poolingDimenY*poolingDimenX,poolingDimenX,1};
+    TensorView flattened(activations[0].getData(),flattenedDimens,flattenedChildSizes,3);
+    //The indices are only needed for training
+    int *finalMaxPoolIndices = inferenceMode ? nullptr : maxPoolIndices[maxPoolIndices.size()-1].get();
+    maxPoolBlocked(maps[mapDimens.size()-1].view(),flattened,strides[strides.size()-1].second,strides[strides.size()-1].first,finalMaxPoolIndices);
     #if PROFILING
         Timer *mlpTimer = nullptr;
         if(parentTimer){
@@ -240,28 +280,9 @@ std::vector<float> CNN::forwards(Tensor& imageInt
 
 
     for(int l=0;l<weights.size();l++){
-        float *biasesData = weights[l].getBiases()->getData();
-        float* __restrict__ prevActivations = activations[l].getData();
-        float* __restrict__ currActivations = activations[l+1].getData();
-        float *currWeights = weights[l].getData();
-        for(int i=0;i<numNeurons[l+1];i++){
-            int weightsTo = i*numNeurons[l];
-            int j=0;
-            float *currWeightsTo = currWeights + weightsTo;
-            for(;j+3<numNeurons[l];j+=4){
-                float32x4_t prevActivations128 = vld1q_f32(&prevActivations[j]);
-                float32x4_t currWeights128 = vld1q_f32(&currWeightsTo[j]);
-                currActivations[i] += dotProduct4f(prevActivations128,currWeights128);
-            }
-            //scalar tail
-            for(;j<numNeurons[l];j++){
-                currActivations[i] += prevActivations[j] * currWeightsTo[j]; 
-            }
-            currActivations[i] += biasesData[i]; //add bias
-            if(l!=weights.size()-1){ //Don't ReLU the last layer
-                currActivations[i] = leakyRelu(currActivations[i]);
-            }
-        }
+        //Don't ReLU the last layer
+        fullyConnected(weights[l].view(),activations[l].getData(),activations[l+1].getData(),l!=weights.size()-1,
+            weightSparsity[l].rowStarts.empty() ? nullptr : &weightSparsity[l]);
     }
     #if PROFILING
         if(parentTimer) mlpTimer->stop();
@@ -293,3 +314,146 @@ std::vector<float> CNN::forwards(Tensor& imageInt
     
     return res;
 } 
+
+
+//----------------------------------------------------
+//TRAINING 
+
+float CNN::backwards(const std::vector<float>& target){
+    if(inferenceMode){
+        throw std::logic_error("backwards needs the maxPoolIndices, inference mode must be off for forwards");
+    }
+    if(activationGradients.empty()){
+        throw std::logic_error("allocateGradients must be called before backwards");
+    }
+    if(target.size()!=numNeurons[numNeurons.size()-1]){
+        throw std::invalid_argument("Target must be {weedX,weedY,hasWeed}");
+    }
+    const float *output = activations[activations.size()-1].getData();
+    float *outputGradients = activationGradients[activationGradients.size()-1].getData();
+    //Binary cross entropy on hasWeed, through the sigmoid its gradient is just p-t
+    const float hasWeed = target[2];
+    const float p = std::clamp(output[2],1e-7f,1.0f-1e-7f);
+    float loss = -(hasWeed*std::log(p) + (1-hasWeed)*std::log(1-p));
+    outputGradients[2] = output[2]-hasWeed;
+    //Squared error on the position, only if there's a weed to find
+    outputGradients[0] = 0;
+    outputGradients[1] = 0;
+    if(hasWeed>0.5f){
+        for(int i=0;i<2;i++){
+            float diff = output[i]-target[i];
+            loss += 0.5f*diff*diff;
+            outputGradients[i] = diff;
+        }
+    }
+    //MLP
+    for(int l=weights.size()-1;l>=0;l--){
+        fullyConnectedBackwards(weights[l].view(),activations[l].getData(),activationGradients[l+1].getData(),
+            weightGradients[l].view(),activationGradients[l].getData());
+        //activations[0] is the pooled maps, they weren't ReLU'd
+        if(l>0) leakyReluBackwards(activations[l].view(),activationGradients[l].view());
+    }
+    //Final pooling, back into the blocked layout
+    int poolingDimenX = mapDimens[mapDimens.size()-1].w/strides[strides.size()-1].second;
+    int poolingDimenY = mapDimens[mapDimens.size()-1].h/strides[strides.size()-1].first;
+    const int flattenedDimens[3] = {mapDimens[mapDimens.size()-1].c,poolingDimenY,poolingDimenX};
+    const int flattenedChildSizes[3] = {poolingDimenY*poolingDimenX,poolingDimenX,1};
+    TensorView flattenedGradients(activationGradients[0].getData(),flattenedDimens,flattenedChildSizes,3);
+    maxPoolBlockedBackwards(flattenedGradients,mapGradients[mapDimens.size()-1].view(),maxPoolIndices[maxPoolIndices.size()-1].get());
+    //Convolutional and pooling layers
+    int poolingLayer = maxPoolIndices.size()-2; //the last one is the final pooling
+    for(int l=mapDimens.size()-1;l>=1;l--){
+        bool pooling = kernelSizes[l-1].first==0 || kernelSizes[l-1].second==0;
+        if(pooling){
+            maxPoolBlockedBackwards(mapGradients[l].view(),mapGradients[l-1].view(),maxPoolIndices[poolingLayer].get());
+            poolingLayer--;
+            continue;
+        }
+        leakyReluBackwards(maps[l].view(),mapGradients[l].view());
+        //The image doesn't need a gradient
+        TensorView inputGradients = l>1 ? paddedMapGradients[l-1].view() : TensorView();
+        convolutionBlockedBackwards(paddedMaps[l-1].view(),blockedKernels[l-1].view(),mapGradients[l].view(),
+            blockedKernelGradients[l-1].view(),inputGradients,strides[l-1].second,strides[l-1].first);
+        if(l>1) unpadImageBlocked(paddedMapGradients[l-1].view(),mapGradients[l-1].view());
+    }
+    return loss;
+}
+
+void CNN::train(int numSamples,const std::function<Tensor(int)>& getImage,const d2& targets,const trainingOptions& options){
+    if(targets.size()!=numSamples){
+        throw std::invalid_argument("There must be a target for every sample");
+    }
+    if(options.batchSize<=0 || options.epochs<=0){
+        throw std::invalid_argument("The batch size and number of epochs must be positive");
+    }
+    int numThreads = options.numThreads>0 ? options.numThreads : std::max(1u,std::thread::hardware_concurrency());
+    //Any more and some would have nothing to do
+    numThreads = std::min(numThreads,options.batchSize);
+    //Pruned blocks won't stay zero and so train densely
+    kernelSparsity = std::vector<blockSparsity>(blockedKernels.size());
+    weightSparsity = std::vector<blockSparsity>(weights.size());
+    blockedKernelVelocities = zeroedCopies(blockedKernels);
+    weightVelocities = zeroedCopies(weights);
+    //Shallow copies, stepping the weights here steps them for every worker
+    std::vector<std::unique_ptr<CNN>> workerCnns;
+    std::vector<CNN*> workers;
+    for(int t=0;t<numThreads;t++){
+        workerCnns.push_back(std::make_unique<CNN>(this,false));
+        workerCnns[t]->setInferenceMode(false);
+        workerCnns[t]->allocateGradients();
+        workers.push_back(workerCnns[t].get());
+    }
+    std::vector<int> order(numSamples);
+    std::iota(order.begin(),order.end(),0);
+    std::mt19937 rng(std::random_device{}());
+    const int numBatches = (numSamples+options.batchSize-1)/options.batchSize;
+    std::cout << "Training on " << numSamples << " samples with " << numThreads << " threads" << std::endl;
+    for(int epoch=0;epoch<options.epochs;epoch++){
+        std::shuffle(order.begin(),order.end(),rng);
+        std::vector<double> losses(numThreads,0.0);
+        std::vector<int> numCorrect(numThreads,0);
+        std::vector<int> numDone(numThreads,0);
+        std::barrier sync(numThreads);
+        std::vector<std::thread> threads;
+        for(int t=0;t<numThreads;t++){
+            threads.emplace_back([&,t](){
+                CNN *worker = workers[t];
+                for(int b=0;b<numBatches;b++){
+                    const int batchStart = b*options.batchSize;
+                    const int batchEnd = std::min(batchStart+options.batchSize,numSamples);
+                    //Each worker gets every numThreads-th sample of the batch and accumulates its own gradients
+                    for(int s=batchStart+t;s<batchEnd;s+=numThreads){
+                        const int sample = order[s];
+                        try{
+                            Tensor image = getImage(sample);
+                            std::vector<float> result = worker->forwards(image);
+                            losses[t] += worker->backwards(targets[sample]);
+                            if((result[2]>0.5f)==(targets[sample][2]>0.5f)) numCorrect[t]++;
+                            numDone[t]++;
+                        }
+                        catch(const std::exception& e){
+                            //Skipped rather than thrown so that the other threads aren't left at the barrier
+                            std::cerr << "Skipping sample " << sample << ": " << e.what() << std::endl;
+                        }
+                    }
+                    sync.arrive_and_wait();
+                    //Every gradient is done, each thread now reduces its own part of the weights
+                    applyGradients(workers,t,numThreads,batchEnd-batchStart,options.learningRate,options.momentum);
+                    //Nobody can start the next batch until all the weights are updated
+                    sync.arrive_and_wait();
+                }
+            });
+        }
+        for(std::thread& thread : threads) thread.join();
+        const int totalDone = std::accumulate(numDone.begin(),numDone.end(),0);
+        const double totalLoss = std::accumulate(losses.begin(),losses.end(),0.0);
+        const int totalCorrect = std::accumulate(numCorrect.begin(),numCorrect.end(),0);
+        std::cout << "Epoch " << epoch+1 << "/" << options.epochs << " - loss: " << totalLoss/std::max(1,totalDone)
+        << ", hasWeed accuracy: " << 100.0*totalCorrect/std::max(1,totalDone) << "%" << std::endl;
+    }
+    //Back into the unblocked kernels so that they can be saved
+    unblockKernels(blockedKernels,kernels);
+    findSparsity();
+    blockedKernelVelocities.clear();
+    weightVelocities.clear();
+}
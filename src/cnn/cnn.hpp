@@ -3,12 +3,21 @@
 
 #include "globals.hpp"
 #include <vector>
+#include <functional>
 #include "tensor.hpp"
 #include "cnnutils.hpp"
 #if PROFILING
 	#include "timer.hpp"
 #endif
 
+typedef struct trainingOptions{
+    int epochs = 10;
+    int batchSize = 32;
+    float learningRate = 0.001f;
+    float momentum = 0.9f;
+    int numThreads = 0; //0 uses every core
+}trainingOptions;
+
 class CNN : public CnnUtils{
     public:
         //CONSTRUCTORS 
@@ -24,6 +33,40 @@ class CNN : public CnnUtils{
             ,Timer *parentTimer = nullptr
         #endif 
         );
+        //For frames that are already the input's size, fillInput writes the normalised CHW image straight into the input map
+        //This replaces parseImg and normaliseImg, pixelStats are getPixelStats()
+        std::vector<float> forwards(const std::function<void(const TensorView& input,const d2& pixelStats)>& fillInput
+        #if PROFILING
+            ,Timer *parentTimer = nullptr
+        #endif 
+        );
+
+        //TRAINING
+        //Backpropagates the last forwards, which must have been run with inference mode off
+        //target is {weedX,weedY,hasWeed}, weedX and weedY are ignored if there isn't a weed
+        //Returns the loss
+        float backwards(const std::vector<float>& target);
+        //Minibatch SGD with momentum, each thread has a worker CNN which shares these weights
+        //getImage is called from every thread and so it must be thread safe
+        void train(int numSamples,const std::function<Tensor(int)>& getImage,const d2& targets,const trainingOptions& options);
+        //Writes the model in the format that the constructor loads
+        void save(const std::string& modelDir) const{ saveModel(modelDir); }
+
+        //(GET|SET)TERS
+        //Inference mode skips recording maxPoolIndices, training needs it off
+        void setInferenceMode(bool mode){ inferenceMode = mode; }
+        bool getInferenceMode() const{ return inferenceMode; }
+        //c,h,w of what forwards' fillInput is given
+        dimens getInputDimens() const{ return mapDimens[0]; }
+        //{means,stdDevs} per channel, loaded once at startup, swapping in a new model keeps them
+        const d2& getPixelStats() const{ return pixelStats; }
+    private:
+        //Everything after the input map has been filled
+        std::vector<float> forwardsFromInput(
+        #if PROFILING
+            Timer *forwardsTimer
+        #endif
+        );
 };
 
 #endif
@@ -0,0 +1,285 @@
+#include "cnnreference.hpp"
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+//Readability over speed, every access goes through here
+static inline float& at(const TensorView& view,int i,int j,int k){
+    return view.getData()[(size_t)i*view.getChildSize(0) + (size_t)j*view.getChildSize(1) + (size_t)k*view.getChildSize(2)];
+}
+
+static inline float& at(const TensorView& view,int i,int j,int k,int l){
+    return view.getData()[(size_t)i*view.getChildSize(0) + (size_t)j*view.getChildSize(1)
+        + (size_t)k*view.getChildSize(2) + (size_t)l*view.getChildSize(3)];
+}
+
+static inline double leakyRelu(double num){
+    return num<=0 ? num*0.01 : num;
+}
+
+//----------------------------------------------------
+//IMAGE-RELATED
+
+void CnnReference::padImage(const TensorView& image,const TensorView& paddedImage){
+    const int yRadius = (paddedImage.getDimen(1)-image.getDimen(1))/2;
+    const int xRadius = (paddedImage.getDimen(2)-image.getDimen(2))/2;
+    for(int c=0;c<paddedImage.getDimen(0);c++){
+        for(int y=0;y<paddedImage.getDimen(1);y++){
+            for(int x=0;x<paddedImage.getDimen(2);x++){
+                const int imageY = y-yRadius;
+                const int imageX = x-xRadius;
+                const bool inside = imageY>=0 && imageY<image.getDimen(1) && imageX>=0 && imageX<image.getDimen(2);
+                at(paddedImage,c,y,x) = inside ? at(image,c,imageY,imageX) : 0.0f;
+            }
+        }
+    }
+}
+
+void CnnReference::convolution(const TensorView& paddedImage,const TensorView& kernel,const TensorView& result,int xStride,int yStride){
+    const double bias = kernel.getNumBiases()==1 ? *kernel.getBiases() : 0.0;
+    for(int newY=0;newY<result.getDimen(0);newY++){
+        for(int newX=0;newX<result.getDimen(1);newX++){
+            double sum = bias;
+            for(int c=0;c<kernel.getDimen(0);c++){
+                for(int j=0;j<kernel.getDimen(1);j++){
+                    for(int k=0;k<kernel.getDimen(2);k++){
+                        sum += (double) at(kernel,c,j,k) * at(paddedImage,c,newY*yStride+j,newX*xStride+k);
+                    }
+                }
+            }
+            result.getData()[newY*result.getChildSize(0) + newX] = (float) leakyRelu(sum);
+        }
+    }
+}
+
+void CnnReference::convolutionLayer(const TensorView& paddedImage,const TensorView& kernel,const TensorView& result,int xStride,int yStride,bool relu){
+    for(int o=0;o<kernel.getDimen(0);o++){
+        const double bias = kernel.getBiases()==nullptr ? 0.0 : kernel.getBiases()[o];
+        for(int newY=0;newY<result.getDimen(1);newY++){
+            for(int newX=0;newX<result.getDimen(2);newX++){
+                double sum = bias;
+                for(int i=0;i<kernel.getDimen(1);i++){
+                    for(int j=0;j<kernel.getDimen(2);j++){
+                        for(int k=0;k<kernel.getDimen(3);k++){
+                            sum += (double) at(kernel,o,i,j,k) * at(paddedImage,i,newY*yStride+j,newX*xStride+k);
+                        }
+                    }
+                }
+                at(result,o,newY,newX) = (float) (relu ? leakyRelu(sum) : sum);
+            }
+        }
+    }
+}
+
+void CnnReference::maxPool(const TensorView& image,const TensorView& result,int xStride,int yStride,int *maxPoolIndices){
+    const int imWidth = image.getDimen(2);
+    for(int c=0;c<result.getDimen(0);c++){
+        for(int newY=0;newY<result.getDimen(1);newY++){
+            for(int newX=0;newX<result.getDimen(2);newX++){
+                float max = -std::numeric_limits<float>::infinity();
+                int maxIndex = -1;
+                for(int j=0;j<yStride;j++){
+                    for(int i=0;i<xStride;i++){
+                        const int y = newY*yStride+j;
+                        const int x = newX*xStride+i;
+                        if(maxIndex==-1 || at(image,c,y,x)>max){
+                            max = at(image,c,y,x);
+                            maxIndex = y*imWidth+x;
+                        }
+                    }
+                }
+                at(result,c,newY,newX) = max;
+                if(maxPoolIndices!=nullptr){
+                    maxPoolIndices[(c*result.getDimen(1)+newY)*result.getDimen(2)+newX] = maxIndex;
+                }
+            }
+        }
+    }
+}
+
+//How much of input j goes into output i along one axis
+static double resizeWeight(int inSize,int outSize,int i,int j){
+    const double scale = (double) inSize/outSize;
+    if(scale>=1.0){
+        const double covered = std::min((i+1)*scale,(double)(j+1))-std::max(i*scale,(double)j);
+        return covered>0 ? covered/scale : 0.0;
+    }
+    const double centre = std::max(0.0,(i+0.5)*scale-0.5);
+    const int nearest = std::min((int)centre,inSize-1);
+    const double fraction = nearest+1<inSize ? centre-nearest : 0.0;
+    if(j==nearest) return 1.0-fraction;
+    if(j==nearest+1) return fraction;
+    return 0.0;
+}
+
+void CnnReference::resizeImg(const TensorView& img,const TensorView& result){
+    const int imHeight = img.getDimen(1);
+    const int imWidth = img.getDimen(2);
+    const int resHeight = result.getDimen(1);
+    const int resWidth = result.getDimen(2);
+    //Only the inputs near the output can have a weight, +-2 covers both the area and bilinear cases
+    const double yScale = (double) imHeight/resHeight;
+    const double xScale = (double) imWidth/resWidth;
+    for(int c=0;c<img.getDimen(0);c++){
+        for(int y=0;y<resHeight;y++){
+            const int yFirst = std::max(0,(int)std::floor(y*yScale)-2);
+            const int yLast = std::min(imHeight-1,(int)std::ceil((y+1)*yScale)+2);
+            for(int x=0;x<resWidth;x++){
+                const int xFirst = std::max(0,(int)std::floor(x*xScale)-2);
+                const int xLast = std::min(imWidth-1,(int)std::ceil((x+1)*xScale)+2);
+                double sum = 0.0;
+                for(int j=yFirst;j<=yLast;j++){
+                    const double yWeight = resizeWeight(imHeight,resHeight,y,j);
+                    if(yWeight==0.0) continue;
+                    for(int i=xFirst;i<=xLast;i++){
+                        sum += yWeight*resizeWeight(imWidth,resWidth,x,i)*at(img,c,j,i);
+                    }
+                }
+                at(result,c,y,x) = (float) sum;
+            }
+        }
+    }
+}
+
+//----------------------------------------------------
+//BLOCKED LAYOUT
+
+void CnnReference::blockImage(const TensorView& image,const TensorView& paddedBlockedImage){
+    const int yRadius = (paddedBlockedImage.getDimen(1)-image.getDimen(1))/2;
+    const int xRadius = (paddedBlockedImage.getDimen(2)-image.getDimen(2))/2;
+    for(int c=0;c<paddedBlockedImage.getDimen(0)*4;c++){
+        for(int y=0;y<paddedBlockedImage.getDimen(1);y++){
+            for(int x=0;x<paddedBlockedImage.getDimen(2);x++){
+                const int imageY = y-yRadius;
+                const int imageX = x-xRadius;
+                const bool inside = c<image.getDimen(0) && imageY>=0 && imageY<image.getDimen(1) && imageX>=0 && imageX<image.getDimen(2);
+                at(paddedBlockedImage,c/4,y,x,c%4) = inside ? at(image,c,imageY,imageX) : 0.0f;
+            }
+        }
+    }
+}
+
+void CnnReference::unblockImage(const TensorView& blockedImage,const TensorView& image){
+    for(int c=0;c<image.getDimen(0);c++){
+        for(int y=0;y<image.getDimen(1);y++){
+            for(int x=0;x<image.getDimen(2);x++){
+                at(image,c,y,x) = at(blockedImage,c/4,y,x,c%4);
+            }
+        }
+    }
+}
+
+//----------------------------------------------------
+//MLP
+
+void CnnReference::fullyConnected(const TensorView& layerWeights,const float *prev,float *curr,bool relu){
+    for(int i=0;i<layerWeights.getDimen(0);i++){
+        double sum = layerWeights.getBiases()[i];
+        for(int j=0;j<layerWeights.getDimen(1);j++){
+            sum += (double) layerWeights.getData()[(size_t)i*layerWeights.getChildSize(0)+j] * prev[j];
+        }
+        curr[i] = (float) (relu ? leakyRelu(sum) : sum);
+    }
+}
+
+//----------------------------------------------------
+//BACKPROPAGATION
+
+void CnnReference::convolutionLayerBackwards(const TensorView& paddedImage,const TensorView& kernel,const TensorView& resultGradients,
+    const TensorView& kernelGradients,float *biasGradients,const TensorView& paddedImageGradients,int xStride,int yStride){
+    const int numOut = kernel.getDimen(0);
+    const int numIn = kernel.getDimen(1);
+    const int kernelHeight = kernel.getDimen(2);
+    const int kernelWidth = kernel.getDimen(3);
+    const int resHeight = resultGradients.getDimen(1);
+    const int resWidth = resultGradients.getDimen(2);
+    for(int o=0;o<numOut;o++){
+        double biasSum = 0.0;
+        for(int newY=0;newY<resHeight;newY++){
+            for(int newX=0;newX<resWidth;newX++){
+                biasSum += at(resultGradients,o,newY,newX);
+            }
+        }
+        biasGradients[o] = (float) biasSum;
+        for(int i=0;i<numIn;i++){
+            for(int j=0;j<kernelHeight;j++){
+                for(int k=0;k<kernelWidth;k++){
+                    double sum = 0.0;
+                    for(int newY=0;newY<resHeight;newY++){
+                        for(int newX=0;newX<resWidth;newX++){
+                            sum += (double) at(resultGradients,o,newY,newX) * at(paddedImage,i,newY*yStride+j,newX*xStride+k);
+                        }
+                    }
+                    at(kernelGradients,o,i,j,k) = (float) sum;
+                }
+            }
+        }
+    }
+    if(paddedImageGradients.getData()==nullptr) return;
+    //Gathered per input pixel rather than scattered
+    for(int i=0;i<numIn;i++){
+        for(int y=0;y<paddedImage.getDimen(1);y++){
+            for(int x=0;x<paddedImage.getDimen(2);x++){
+                double sum = 0.0;
+                for(int j=0;j<kernelHeight;j++){
+                    for(int k=0;k<kernelWidth;k++){
+                        if((y-j)%yStride!=0 || (x-k)%xStride!=0) continue;
+                        const int newY = (y-j)/yStride;
+                        const int newX = (x-k)/xStride;
+                        if(y<j || x<k || newY>=resHeight || newX>=resWidth) continue;
+                        for(int o=0;o<numOut;o++){
+                            sum += (double) at(kernel,o,i,j,k) * at(resultGradients,o,newY,newX);
+                        }
+                    }
+                }
+                at(paddedImageGradients,i,y,x) = (float) sum;
+            }
+        }
+    }
+}
+
+void CnnReference::maxPoolBackwards(const TensorView& resultGradients,const TensorView& imageGradients,const int *maxPoolIndices){
+    const int imWidth = imageGradients.getDimen(2);
+    for(int c=0;c<imageGradients.getDimen(0);c++){
+        for(int y=0;y<imageGradients.getDimen(1);y++){
+            for(int x=0;x<imageGradients.getDimen(2);x++){
+                at(imageGradients,c,y,x) = 0.0f;
+            }
+        }
+    }
+    for(int c=0;c<resultGradients.getDimen(0);c++){
+        for(int newY=0;newY<resultGradients.getDimen(1);newY++){
+            for(int newX=0;newX<resultGradients.getDimen(2);newX++){
+                const int index = maxPoolIndices[(c*resultGradients.getDimen(1)+newY)*resultGradients.getDimen(2)+newX];
+                at(imageGradients,c,index/imWidth,index%imWidth) += at(resultGradients,c,newY,newX);
+            }
+        }
+    }
+}
+
+void CnnReference::fullyConnectedBackwards(const TensorView& layerWeights,const float *prev,const float *currGradients,
+    const TensorView& layerGradients,float *biasGradients,float *prevGradients){
+    const int numOut = layerWeights.getDimen(0);
+    const int numIn = layerWeights.getDimen(1);
+    for(int i=0;i<numOut;i++){
+        biasGradients[i] = currGradients[i];
+        for(int j=0;j<numIn;j++){
+            layerGradients.getData()[(size_t)i*layerGradients.getChildSize(0)+j] = currGradients[i]*prev[j];
+        }
+    }
+    if(prevGradients==nullptr) return;
+    for(int j=0;j<numIn;j++){
+        double sum = 0.0;
+        for(int i=0;i<numOut;i++){
+            sum += (double) layerWeights.getData()[(size_t)i*layerWeights.getChildSize(0)+j] * currGradients[i];
+        }
+        prevGradients[j] = (float) sum;
+    }
+}
+
+void CnnReference::leakyReluBackwards(const float *activations,float *gradients,size_t size){
+    for(size_t i=0;i<size;i++){
+        if(activations[i]<=0) gradients[i] *= 0.01f;
+    }
+}
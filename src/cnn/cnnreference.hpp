@@ -0,0 +1,43 @@
+#ifndef CNNREFERENCE_HPP
+#define CNNREFERENCE_HPP
+
+#include "tensorview.hpp"
+
+//Plain scalar versions of every layer, used by the conformance suite to check the optimised kernels in CnnUtils
+//Everything is accumulated in doubles and written as obviously as possible, speed doesn't matter here
+//Images are CHW, the blocked kernels are compared after converting back with unblockImage
+class CnnReference{
+    public:
+        //IMAGE-RELATED
+        static void padImage(const TensorView& image,const TensorView& paddedImage);
+        //One output channel from a [inChannel][y][x] kernel with at most one bias, leaky ReLU'd
+        //The window for output (x,y) starts at (x*xStride,y*yStride) in the padded image
+        static void convolution(const TensorView& paddedImage,const TensorView& kernel,const TensorView& result,int xStride,int yStride);
+        //Every output channel from a [outChannel][inChannel][y][x] kernel with a bias for each output channel, result is CHW
+        static void convolutionLayer(const TensorView& paddedImage,const TensorView& kernel,const TensorView& result,int xStride,int yStride,bool relu = true);
+        //The first max in the window (row by row) wins, maxPoolIndices are y*width+x in the image's channel
+        static void maxPool(const TensorView& image,const TensorView& result,int xStride,int yStride,int *maxPoolIndices = nullptr);
+        //Area average for shrinking and bilinear for enlarging, each output pixel is worked out directly in 2D
+        static void resizeImg(const TensorView& img,const TensorView& result);
+
+        //BLOCKED LAYOUT
+        //Pads (like padImage) and blocks a CHW image in one go, the channels past the end of the last block are 0
+        static void blockImage(const TensorView& image,const TensorView& paddedBlockedImage);
+        //[C/4][H][W][4] back into CHW, the extra channels in the last block are dropped
+        static void unblockImage(const TensorView& blockedImage,const TensorView& image);
+
+        //MLP
+        static void fullyConnected(const TensorView& layerWeights,const float *prev,float *curr,bool relu);
+
+        //BACKPROPAGATION
+        //Unlike CnnUtils, the gradients are all written over rather than added to
+        //resultGradients are w.r.t. the convolution before the leaky ReLU
+        static void convolutionLayerBackwards(const TensorView& paddedImage,const TensorView& kernel,const TensorView& resultGradients,
+            const TensorView& kernelGradients,float *biasGradients,const TensorView& paddedImageGradients,int xStride,int yStride);
+        static void maxPoolBackwards(const TensorView& resultGradients,const TensorView& imageGradients,const int *maxPoolIndices);
+        static void fullyConnectedBackwards(const TensorView& layerWeights,const float *prev,const float *currGradients,
+            const TensorView& layerGradients,float *biasGradients,float *prevGradients);
+        static void leakyReluBackwards(const float *activations,float *gradients,size_t size);
+};
+
+#endif
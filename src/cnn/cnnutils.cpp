@@ -1,6 +1,7 @@
 #include "cnnutils.hpp"
 #include "cnn.hpp" //Needs to be in the .cpp file to avoid a circular dependency but we still need member functions
 #include "json.hpp"
+#include "logger.hpp"
 #include <random>
 #include <algorithm>
 #include <fstream>
@@ -15,62 +16,173 @@
 //The pretty looking [{i,j,k}] is too slow for these inner loops
 //So the raw pointer is used
 
-Tensor CnnUtils::parseImg(const Tensor& img
+void CnnUtils::parseImg(const TensorView& img,const TensorView& result
 #if PROFILING
     ,Timer *parentTimer
 #endif
-) const{
+){
     #if PROFILING
         Timer *parseImgTimer = nullptr;
         if(parentTimer) parseImgTimer = parentTimer->addChildTimer("parseImg");
     #endif 
-    //The produced images may have a slight black border around them
-    //Keeping a constant stride doesn't stretch the image 
-    //but as it is an integer means that it will create a border
-    //e.g. a 258x258 image would be given a stride length of 2 and so would only have 128 pixels in the remaining image
-    std::vector<int> imgDimens = img.getDimens();
-    if(imgDimens.size()!=3){
+    if(img.getNumDimens()!=3 || result.getNumDimens()!=3){
         throw std::invalid_argument("Image must have 3 dimensions for parseImg");
     }
-    int channels = imgDimens[0];
-    int imHeight = imgDimens[1];
-    int imWidth = imgDimens[2];
-    if(channels!=mapDimens[0].c){
+    int channels = img.getDimen(0);
+    int imHeight = img.getDimen(1);
+    int imWidth = img.getDimen(2);
+    if(channels!=mapDimens[0].c || result.getDimen(0)!=mapDimens[0].c){
         throw std::runtime_error("parseImg requires the input to have the same number of channels as the input to the CNN");
     }
+    if(result.getDimen(1)!=mapDimens[0].h || result.getDimen(2)!=mapDimens[0].w){
+        throw std::invalid_argument("parseImg's result must be the size of the CNN's input");
+    }
     if(imHeight==mapDimens[0].h && imWidth==mapDimens[0].w){
-        //If it's already the same size, we don't have to do anything
-        return img;
+        //If it's already the same size, it's just a copy (a row at a time as result is pitched)
+        const float *imgData = img.getData();
+        float *resultData = result.getData();
+        for(int c=0;c<channels;c++){
+            for(int y=0;y<imHeight;y++){
+                std::memcpy(
+                    resultData + c*result.getChildSize(0) + y*result.getChildSize(1),
+                    imgData + c*img.getChildSize(0) + y*img.getChildSize(1),
+                    sizeof(float)*imWidth
+                );
+            }
+        }
     }
-    
-    //ceil so that we take too large steps and so we take <=mapDimens[0] steps
-    //If we floor it, we go out of the mapDimens[0] x mapDimens[0] bounds (as we aren't striding far enough)
-    int xStride = (int) std::ceil((float)imWidth/mapDimens[0].w); //Reducing size to mapDimens[0] x mapDimens[0] via a Gaussian blur
-    int yStride = (int) std::ceil((float)imHeight/mapDimens[0].h); 
-    Tensor gKernel = gaussianBlurKernel(xStride,yStride);
-    Tensor gKernel3d = Tensor({1,yStride,xStride});
-    gKernel3d.slice({0}) = gKernel;
-    Tensor result = Tensor({channels,mapDimens[0].h,mapDimens[0].w});
-    Tensor img4d = Tensor({channels,1,imHeight,imWidth}); //convolution requires a 3d array (image with multiple channels) 
-    //but we only want to process one channel at a time and so we have to store each channel in a separate 3d array
-    for(int l=0;l<channels;l++){
-        //Deep copy
-        img4d.slice({l,0}) = img.slice({l});
-        //Copy-elision
-        Tensor sliced = img4d.slice({l});
-        //Deep copy
-        result.slice({l}) = convolution(sliced,gKernel3d, xStride, yStride,mapDimens[0].w,mapDimens[0].h,false
-        #if PROFILING
-        ,parentTimer?parseImgTimer:nullptr
-        #endif 
-        );
+    else{
+        //Unlike a whole number stride, this stretches the image to fit and so doesn't leave a border
+        if(resizeX.inSize!=imWidth || resizeX.outSize!=mapDimens[0].w){
+            resizeX = resizeCoefficients(imWidth,mapDimens[0].w);
+        }
+        if(resizeY.inSize!=imHeight || resizeY.outSize!=mapDimens[0].h){
+            resizeY = resizeCoefficients(imHeight,mapDimens[0].h);
+        }
+        resizeImg(img,result,resizeX,resizeY);
     }
     #if PROFILING
         if(parentTimer) parseImgTimer->stop();
     #endif 
+}
+
+resizeAxis CnnUtils::resizeCoefficients(int inSize,int outSize){
+    if(inSize<=0 || outSize<=0){
+        throw std::invalid_argument("Resize sizes must be positive");
+    }
+    const float scale = (float) inSize/outSize;
+    //Each output's inputs and their weights before they're put into a fixed number of taps
+    std::vector<std::vector<std::pair<int,float>>> taps(outSize);
+    for(int i=0;i<outSize;i++){
+        if(scale>=1.0f){
+            //Shrinking, the average of the inputs that this output covers
+            //Partly covered inputs count for the fraction that's covered
+            const float left = i*scale;
+            const float right = (i+1)*scale;
+            for(int j=(int)left;j<inSize && j<right;j++){
+                const float covered = std::min(right,(float)(j+1))-std::max(left,(float)j);
+                if(covered>0) taps[i].push_back({j,covered/scale});
+            }
+        }
+        else{
+            //Enlarging, bilinear between the two nearest inputs (by their centres)
+            const float centre = std::max(0.0f,(i+0.5f)*scale-0.5f);
+            const int j = std::min((int)centre,inSize-1);
+            //Past the last centre it's just the last input
+            const float fraction = j+1<inSize ? centre-j : 0.0f;
+            taps[i].push_back({j,1.0f-fraction});
+            if(fraction>0) taps[i].push_back({j+1,fraction});
+        }
+    }
+    resizeAxis result;
+    result.inSize = inSize;
+    result.outSize = outSize;
+    for(int i=0;i<outSize;i++){
+        result.numTaps = std::max(result.numTaps,taps[i].back().first-taps[i].front().first+1);
+    }
+    result.starts = std::vector<int>(outSize);
+    result.weights = std::vector<float>(outSize*result.numTaps,0.0f);
+    for(int i=0;i<outSize;i++){
+        //Moved back at the end so that every tap is still in the input
+        const int start = std::min(taps[i].front().first,inSize-result.numTaps);
+        result.starts[i] = start;
+        for(const std::pair<int,float>& tap : taps[i]){
+            result.weights[i*result.numTaps + tap.first-start] = tap.second;
+        }
+    }
     return result;
 }
 
+void CnnUtils::resizeImg(const TensorView& img,const TensorView& result,const resizeAxis& xAxis,const resizeAxis& yAxis){
+    if(img.getNumDimens()!=3 || result.getNumDimens()!=3 || img.getDimen(0)!=result.getDimen(0)){
+        throw std::invalid_argument("resizeImg needs two CHW images with the same number of channels");
+    }
+    const int channels = img.getDimen(0);
+    const int imWidth = img.getDimen(2);
+    const int resHeight = result.getDimen(1);
+    const int resWidth = result.getDimen(2);
+    if(xAxis.inSize!=imWidth || yAxis.inSize!=img.getDimen(1) || xAxis.outSize!=resWidth || yAxis.outSize!=resHeight){
+        throw std::invalid_argument("Resize coefficients don't match the image sizes");
+    }
+    const float *imgData = img.getData();
+    float *resultData = result.getData();
+    const int imgChildSizes0 = img.getChildSize(0);
+    const int imgChildSizes1 = img.getChildSize(1);
+    const int resultChildSizes0 = result.getChildSize(0);
+    const int resultChildSizes1 = result.getChildSize(1);
+    const int xTaps = xAxis.numTaps;
+    const int yTaps = yAxis.numTaps;
+    //Halving is the common case (e.g. 1280x960) and each output is just a pair of inputs
+    const bool xHalving = imWidth==2*resWidth && xTaps==2;
+    //One input-width row, the y taps are done into this and then the x taps are done from it
+    std::vector<float> rowBuffer(imWidth);
+    float* __restrict__ row = rowBuffer.data();
+    for(int c=0;c<channels;c++){
+        const float *imgChannel = imgData + c*imgChildSizes0;
+        float *resultChannel = resultData + c*resultChildSizes0;
+        for(int y=0;y<resHeight;y++){
+            //Vertical, every column at once and so it's all contiguous loads
+            const float *imgRows = imgChannel + yAxis.starts[y]*imgChildSizes1;
+            const float *yWeights = yAxis.weights.data() + y*yTaps;
+            int x=0;
+            for(;x+3<imWidth;x+=4){
+                float32x4_t acc = vmulq_n_f32(vld1q_f32(imgRows+x),yWeights[0]);
+                for(int t=1;t<yTaps;t++){
+                    acc = vfmaq_n_f32(acc,vld1q_f32(imgRows + t*imgChildSizes1 + x),yWeights[t]);
+                }
+                vst1q_f32(row+x,acc);
+            }
+            //scalar tail
+            for(;x<imWidth;x++){
+                float sum = 0.0f;
+                for(int t=0;t<yTaps;t++){
+                    sum += imgRows[t*imgChildSizes1 + x]*yWeights[t];
+                }
+                row[x] = sum;
+            }
+            //Horizontal
+            float* __restrict__ resultRow = resultChannel + y*resultChildSizes1;
+            int newX=0;
+            if(xHalving){
+                for(;newX+3<resWidth;newX+=4){
+                    //Evens and odds
+                    const float32x4x2_t pairs = vld2q_f32(row + newX*2);
+                    vst1q_f32(resultRow+newX,vmulq_n_f32(vaddq_f32(pairs.val[0],pairs.val[1]),0.5f));
+                }
+            }
+            for(;newX<resWidth;newX++){
+                const float *taps = row + xAxis.starts[newX];
+                const float *xWeights = xAxis.weights.data() + newX*xTaps;
+                float sum = 0.0f;
+                for(int t=0;t<xTaps;t++){
+                    sum += taps[t]*xWeights[t];
+                }
+                resultRow[newX] = sum;
+            }
+        }
+    }
+}
+
 void CnnUtils::normaliseImg(Tensor& img
 #if PROFILING
     ,Timer *parentTimer
@@ -82,12 +194,12 @@ void CnnUtils::normaliseImg(Tensor& img
     #endif 
     d1 pixelMeans = this->pixelStats[0];
     d1 pixelStdDevs = this->pixelStats[1];
-    std::vector<int> imgDimens = img.getDimens();
+    const std::vector<int>& imgDimens = img.getDimens();
     if(imgDimens.size()!=3){
         throw std::invalid_argument("Image must have 3 dimensions for normaliseImg");
     }
     float*  __restrict__ imgData = img.getData();
-    std::vector<int> imgChildSizes = img.getChildSizes();
+    const std::vector<int>& imgChildSizes = img.getChildSizes();
     for(int c=0;c<imgDimens[0];c++){
         int imageChannel = c*imgChildSizes[0];
         for(int i=0;i<imgDimens[1];i++){
@@ -117,82 +229,189 @@ Tensor CnnUtils::gaussianBlurKernel(int width,int height){ //This will be odd si
     return kernel;
 }
 
-Tensor CnnUtils::maxPool(Tensor& image,int xStride,int yStride){ 
-    int xKernelRadius = (int) floor(xStride/2); //Not actually a radius, actually half the width of the kernel
-    int yKernelRadius = (int) floor(yStride/2); 
-    std::vector<int> imgDimens = image.getDimens();
-    if(imgDimens.size()!=2){
+//Keeps the first maximum (like a scalar > scan) along with where it was
+static inline void maxWithIndex(float32x4_t& max,int32x4_t& index,const float32x4_t candidate,const int32x4_t candidateIndex){
+    const uint32x4_t greater = vcgtq_f32(candidate,max);
+    max = vbslq_f32(greater,candidate,max);
+    index = vbslq_s32(greater,candidateIndex,index);
+}
+
+Tensor CnnUtils::maxPool(const TensorView& image,int xStride,int yStride){ 
+    if(image.getNumDimens()!=2){
         throw std::invalid_argument("Image must have 2 dimensions for maxPool");
     }
-    int imHeight = imgDimens[0];
-    int imWidth = imgDimens[1];
-    int resHeight = imHeight/yStride;
-    int resWidth = imWidth/xStride;
-    Tensor result({resHeight,resWidth});
-    int newY,newX = newY =0;
+    Tensor result({image.getDimen(0)/yStride,image.getDimen(1)/xStride});
+    maxPool(image,result.view(),xStride,yStride);
+    return result;
+}
 
-    float*  __restrict__ imageData = image.getData();
-    float*  __restrict__ resultData = result.getData();
-    for(int y=yKernelRadius;y<=imHeight-yKernelRadius;y+=yStride){
-        int resultRow = newY*resWidth;
-        for(int x=xKernelRadius;x<=imWidth-xKernelRadius;x+=xStride){
-            float max = -std::numeric_limits<float>::infinity();
-            for(int j=0;j<yStride;j++){
-                int imageRow = (y+j-yKernelRadius)*imWidth +x-xKernelRadius;
-                for(int i=0;i<xStride;i++){
-                    if((imageData[imageRow+i])>max){ //*image[{(y+j-yKernelRadius),(x+i-xKernelRadius)}]
-                        max = imageData[imageRow+i];
-                    }
-                }
-            }
-            resultData[resultRow+newX] = max;
-            newX++;
-        }
-        newX=0;
-        newY++;
+Tensor CnnUtils::maxPool(const TensorView& image,int xStride,int yStride,int *maxPoolIndices){
+    //maxPoolIndices should be just for this input map
+    if(image.getNumDimens()!=2){
+        throw std::invalid_argument("Image must have 2 dimensions for maxPool");
     }
+    Tensor result({image.getDimen(0)/yStride,image.getDimen(1)/xStride});
+    maxPool(image,result.view(),xStride,yStride,maxPoolIndices);
     return result;
 }
 
-Tensor CnnUtils::maxPool(Tensor& image,int xStride,int yStride,int *maxPoolIndices){
+void CnnUtils::maxPool(const TensorView& image,const TensorView& result,int xStride,int yStride,int *maxPoolIndices){
     //maxPoolIndices should be just for this input map
-    int xKernelRadius = (int) floor(xStride/2); //Not actually a radius, actually half the width of the kernel
-    int yKernelRadius = (int) floor(yStride/2); 
-    std::vector<int> imgDimens = image.getDimens();
-    if(imgDimens.size()!=2){
+    //They are unpitched indices into image and aren't recorded if it is nullptr
+    if(image.getNumDimens()!=2){
         throw std::invalid_argument("Image must have 2 dimensions for maxPool");
     }
-    int imHeight = imgDimens[0];
-    int imWidth = imgDimens[1];
-    int resHeight = imHeight/yStride;
-    int resWidth = imWidth/xStride;
-    Tensor result({resHeight,resWidth});
-    int newY,newX = newY =0;
-    float* __restrict__ imageData = image.getData();
+    const int imHeight = image.getDimen(0);
+    const int imWidth = image.getDimen(1);
+    const int imRowPitch = image.getChildSize(0); //may be more than imWidth
+    const int resHeight = imHeight/yStride;
+    const int resWidth = imWidth/xStride;
+    if(result.getNumDimens()!=2 || result.getDimen(0)!=resHeight || result.getDimen(1)!=resWidth){
+        throw std::invalid_argument("Result is the wrong size for maxPool");
+    }
+    const int resRowPitch = result.getChildSize(0);
+    const float* __restrict__ imageData = image.getData();
     float* __restrict__ resultData = result.getData();
-    for(int y=yKernelRadius;y<=imHeight-yKernelRadius;y+=yStride){
-        int resultRow = newY*resWidth;
-        for(int x=xKernelRadius;x<=imWidth-xKernelRadius;x+=xStride){
+    //Lane k is the output newX+k, these are the offsets of their windows
+    const int32x4_t laneOffsets = {0,xStride,2*xStride,3*xStride};
+    for(int newY=0;newY<resHeight;newY++){
+        const float *imageRow = imageData + newY*yStride*imRowPitch;
+        float *resultRow = resultData + newY*resRowPitch;
+        int *indicesRow = maxPoolIndices==nullptr ? nullptr : maxPoolIndices + newY*resWidth;
+        const int logicalImageRow = newY*yStride*imWidth;
+        int newX=0;
+        if(xStride==2 && yStride==2){
+            //2x2 - the most common pooling and so it gets its own path
+            const float *imageRow1 = imageRow + imRowPitch;
+            for(;newX+3<resWidth;newX+=4){
+                //Splits 8 pixels into the left and right of 4 windows
+                const float32x4x2_t top = vld2q_f32(imageRow+newX*2);
+                const float32x4x2_t bottom = vld2q_f32(imageRow1+newX*2);
+                if(indicesRow==nullptr){
+                    vst1q_f32(resultRow+newX,vmaxq_f32(vmaxq_f32(top.val[0],top.val[1]),vmaxq_f32(bottom.val[0],bottom.val[1])));
+                    continue;
+                }
+                const int32x4_t windowIndex = vaddq_s32(vdupq_n_s32(logicalImageRow+newX*2),laneOffsets);
+                float32x4_t max = top.val[0];
+                int32x4_t index = windowIndex;
+                maxWithIndex(max,index,top.val[1],vaddq_s32(windowIndex,vdupq_n_s32(1)));
+                maxWithIndex(max,index,bottom.val[0],vaddq_s32(windowIndex,vdupq_n_s32(imWidth)));
+                maxWithIndex(max,index,bottom.val[1],vaddq_s32(windowIndex,vdupq_n_s32(imWidth+1)));
+                vst1q_f32(resultRow+newX,max);
+                vst1q_s32(indicesRow+newX,index);
+            }
+        }
+        else{
+            const int xStride2 = xStride*2;
+            const int xStride3 = xStride*3;
+            for(;newX+3<resWidth;newX+=4){
+                const float *window = imageRow + newX*xStride;
+                const int32x4_t windowIndex = vaddq_s32(vdupq_n_s32(logicalImageRow+newX*xStride),laneOffsets);
+                float32x4_t max = vdupq_n_f32(-std::numeric_limits<float>::infinity());
+                int32x4_t index = windowIndex;
+                for(int j=0;j<yStride;j++){
+                    const float *windowRow = window + j*imRowPitch;
+                    for(int i=0;i<xStride;i++){
+                        //Gather the same window position for 4 outputs
+                        const float32x4_t R = {
+                            windowRow[i],
+                            windowRow[i+xStride],
+                            windowRow[i+xStride2],
+                            windowRow[i+xStride3]
+                        };
+                        if(indicesRow==nullptr) max = vmaxq_f32(max,R);
+                        else maxWithIndex(max,index,R,vaddq_s32(windowIndex,vdupq_n_s32(j*imWidth+i)));
+                    }
+                }
+                vst1q_f32(resultRow+newX,max);
+                if(indicesRow!=nullptr) vst1q_s32(indicesRow+newX,index);
+            }
+        }
+        //scalar tail
+        for(;newX<resWidth;newX++){
             float max = -std::numeric_limits<float>::infinity();
+            int maxIndex = logicalImageRow+newX*xStride;
             for(int j=0;j<yStride;j++){
-                int imageRow = (y+j-yKernelRadius)*imWidth +x-xKernelRadius;
+                const float *windowRow = imageRow + j*imRowPitch + newX*xStride;
                 for(int i=0;i<xStride;i++){
-                    if((imageData[imageRow+i])>max){ //*image[{(y+j-yKernelRadius),(x+i-xKernelRadius)}]
-                        max = imageData[imageRow+i];
-                        maxPoolIndices[newY*resWidth+newX] = imageRow+i;
+                    if(windowRow[i]>max){
+                        max = windowRow[i];
+                        maxIndex = logicalImageRow + j*imWidth + newX*xStride + i;
                     }
                 }
             }
-            resultData[resultRow+newX] = max;
-            newX++;
+            resultRow[newX] = max;
+            if(indicesRow!=nullptr) indicesRow[newX] = maxIndex;
         }
-        newX=0;
-        newY++;
     }
-    return result;
 }
-//variable size output
-Tensor CnnUtils::convolution(const Tensor& image,Tensor& kernel,const int xStride,const int yStride,bool padding
+
+//Copies image into the middle of paddedImage and zeroes the border
+//paddedImage doesn't need to contain anything, it just needs to be the correct size
+void CnnUtils::padImage(const TensorView& image,const TensorView& paddedImage){
+    if(image.getNumDimens()!=3){
+        throw std::invalid_argument("Image must have 3 dimensions for padding");
+    }
+    if(paddedImage.getNumDimens()!=3){
+        throw std::invalid_argument("Padded image must have 3 dimensions for padding");
+    }
+    if(paddedImage.getDimen(0)!=image.getDimen(0)){
+        throw std::invalid_argument("Padded image must have the same number of channels as the unpadded image");
+    }
+    const int yKernelRadius = (paddedImage.getDimen(1)-image.getDimen(1))/2;
+    const int xKernelRadius = (paddedImage.getDimen(2)-image.getDimen(2))/2;
+    if(yKernelRadius<0 || xKernelRadius<0){
+        throw std::invalid_argument("Padded image is smaller than the unpadded image");
+    }
+    float *pImageData = paddedImage.getData();
+    const float *imageData = image.getData();
+    //Set the padding and copy the data
+    //It is not quicker to first set data to 0 and then do this
+    const int imageChildSizes0 = image.getChildSize(0);
+    const int imageChildSizes1 = image.getChildSize(1);
+    const int pImageChildSizes0 = paddedImage.getChildSize(0);
+    const int pImageChildSizes1 = paddedImage.getChildSize(1);
+    const int pImageDimens0 = paddedImage.getDimen(0);
+    const int pImageDimens1 = paddedImage.getDimen(1);
+    const int imageDimens1 = image.getDimen(1);
+    const int imageDimens2 = image.getDimen(2);
+    const int imageRowBytes = imageDimens2*sizeof(float);
+    for(int l=0;l<pImageDimens0;l++){
+        const float *imageChannel = imageData+l*imageChildSizes0;
+        float *pImageChannel = pImageData+l*pImageChildSizes0;
+        //Top padding
+        //Large and so probably worth a memset
+        std::memset(pImageChannel,0,yKernelRadius*pImageChildSizes1*sizeof(float));
+        for(int y=0;y<imageDimens1;y++){
+            float *pImageRow = pImageChannel+(y+yKernelRadius)*pImageChildSizes1;
+            //Left padding
+            float *pImagePtr = pImageRow;
+            float *pImageRowBody = pImageRow+xKernelRadius;
+            //xKernelRadius is likely small and so not worth calling memset or vectorising
+            for(;pImagePtr<pImageRowBody;pImagePtr++){
+                *pImagePtr = 0;
+            }
+           
+            const float *imageRow = imageChannel+y*imageChildSizes1;
+            //Copying the actual data
+            std::memcpy(pImageRowBody,imageRow,imageRowBytes);
+
+            pImagePtr = pImageRowBody+imageDimens2;
+            float *pImageNextRow = pImageRow+pImageChildSizes1;
+            //Right padding
+            for(;pImagePtr<pImageNextRow;pImagePtr++){
+                *pImagePtr = 0;
+            }
+        }
+        //Bottom padding
+        float *pImageEndPadding = pImageChannel + (imageDimens1+yKernelRadius)*pImageChildSizes1;
+        std::memset(pImageEndPadding,0,(pImageDimens1-imageDimens1-yKernelRadius)*pImageChildSizes1*sizeof(float));
+    }
+}
+
+//Writes into result which must already be zeroed and be the correct size
+//The image must already be padded if padding is wanted
+void CnnUtils::convolution(const TensorView& paddedImage,const TensorView& kernel,const TensorView& result,const int xStride,const int yStride
 #if PROFILING
     ,Timer *parentTimer
 #endif
@@ -207,15 +426,22 @@ Tensor CnnUtils::convolution(const Tensor& image,Tensor& kernel,const int xStrid
             
         }
     #endif 
-    std::vector<int> imgDimens = image.getDimens();
-    std::vector<int> kernelDimens = kernel.getDimens();
-    if(imgDimens.size()!=3){
+    if(paddedImage.getNumDimens()!=3){
         throw std::invalid_argument("Image must have 3 dimensions for convolution");
     }
-    if(kernelDimens.size()!=3){
+    if(kernel.getNumDimens()!=3){
         throw std::invalid_argument("Kernel must have 3 dimensions for convolution");
     }
-    if(kernelDimens[0]!=imgDimens[0]){
+    if(result.getNumDimens()!=2){
+        throw std::invalid_argument("Result must have 2 dimensions for convolution");
+    }
+    //Plain arrays so that the hot loops can index them like the old vectors
+    const int kernelDimens[3] = {kernel.getDimen(0),kernel.getDimen(1),kernel.getDimen(2)};
+    const int kernelChildSizes[2] = {kernel.getChildSize(0),kernel.getChildSize(1)};
+    const int paddedImgDimens[3] = {paddedImage.getDimen(0),paddedImage.getDimen(1),paddedImage.getDimen(2)};
+    const int paddedImageChildSizes[2] = {paddedImage.getChildSize(0),paddedImage.getChildSize(1)};
+    const int resultChildSizes[1] = {result.getChildSize(0)};
+    if(kernelDimens[0]!=paddedImgDimens[0]){
         throw std::invalid_argument("The image and kernel must have the same number of channels for convolution");
     }
     if(kernelDimens[1]&1==0 || kernelDimens[2]&1==0){
@@ -223,102 +449,21 @@ Tensor CnnUtils::convolution(const Tensor& image,Tensor& kernel,const int xStrid
     }
     const int xKernelRadius = (int) floor(kernelDimens[2]/2); //Not actually a radius, actually half the width
     const int yKernelRadius = (int) floor(kernelDimens[1]/2);
-
-    std::vector<int> paddedImgDimens;
-    std::vector<int> paddedImageChildSizes;
-    Tensor paddedImage;
-
-    float*  __restrict__ imageData = image.getData();
-    std::vector<int> imageChildSizes = image.getChildSizes();
-    
-    if(padding){
-        int paddedHeight = imgDimens[1]+yKernelRadius*2;
-        int paddedWidth = imgDimens[2]+xKernelRadius*2;
-        paddedImgDimens = {imgDimens[0],paddedHeight,paddedWidth};
-        #if PROFILING
-            Timer *paddingAllocTimer = nullptr;
-            if(parentTimer){
-                paddingAllocTimer = preconvolutionTimer->addChildTimer("paddingAlloc");
-            }
-        #endif
-        paddedImage = Tensor(paddedImgDimens);
-        #if PROFILING
-            Timer *paddingLoopTimer = nullptr;
-            if(parentTimer){
-                paddingAllocTimer->stop();
-                paddingLoopTimer = preconvolutionTimer->addChildTimer("paddingLoop");
-            }
-        #endif
-
-        paddedImageChildSizes = paddedImage.getChildSizes();
-        const int imgDimens0 = imgDimens[0];
-        const int imgDimens1 = imgDimens[1];
-        const int imgDimens2 = imgDimens[2];
-        const int imageChildSizes0 = imageChildSizes[0];
-        const int imageChildSizes1 = imageChildSizes[1];
-        const int paddedImageChildSizes0 = paddedImageChildSizes[0];
-        const int paddedImageChildSizes1 = paddedImageChildSizes[1];
-        
-        float*  __restrict__ paddedImageData = paddedImage.getData();
-        for(int l=0;l<imgDimens0;l++){ //for each image channel
-            int imageChannel = l*imageChildSizes0;
-            int paddedImageChannel = l*paddedImageChildSizes0+xKernelRadius; //saving additions
-            int yLoopBound = imgDimens1+yKernelRadius;
-            for(int y=yKernelRadius;y<yLoopBound;y++){
-                int imageRow = imageChannel + (y-yKernelRadius)*imageChildSizes1;
-                int paddedImageRow = paddedImageChannel + y*paddedImageChildSizes1;
-                //paddedImage: xKernelRadius to paddedWidth-xKernelRadius
-                //image: 0 to width
-                float* __restrict__ paddedImagePtr = paddedImageData+paddedImageRow;
-                float* imagePtr = imageData+imageRow;
-                const float* endImageRow = imagePtr+imgDimens2;
-                for(;imagePtr+3<endImageRow;paddedImagePtr+=4,imagePtr+=4){
-                    float32x4_t imageSection = vld1q_f32(imagePtr);
-                    vst1q_f32(paddedImagePtr,imageSection);
-                }
-                for(;imagePtr<endImageRow;paddedImagePtr++,imagePtr++){
-                    *paddedImagePtr = *imagePtr;
-                }
-            }
-        }
-        #if PROFILING
-            if(parentTimer) paddingLoopTimer->stop();
-        #endif
-    }
-    else{
-        paddedImgDimens = imgDimens;
-        paddedImageChildSizes = image.getChildSizes();
-        //paddedImage is const - we never change the data and so it is safe to be shallow copied
-        paddedImage.shallowCopy(image); 
-    }
-    
     const int imHeight = paddedImgDimens[1]; //assumption that all channels have same dimensions
     const int imWidth = paddedImgDimens[2];
-    #if PROFILING
-        Timer *resultAllocTimer = nullptr;
-        if(parentTimer){
-            resultAllocTimer = preconvolutionTimer->addChildTimer("resultAlloc");
-        }
-    #endif
-    Tensor result({
-        (int)ceil((float)(imHeight-2*yKernelRadius)/yStride),
-        (int)ceil((float)(imWidth-2*xKernelRadius)/xStride)
-    }); //0 initialised
-    #if PROFILING
-        if(parentTimer) resultAllocTimer->stop();
-    #endif
+    if(result.getDimen(0)!=(int)ceil((float)(imHeight-2*yKernelRadius)/yStride)
+    || result.getDimen(1)!=(int)ceil((float)(imWidth-2*xKernelRadius)/xStride)){
+        throw std::invalid_argument("Result is the wrong size for convolution");
+    }
 
     const float *paddedImageData = paddedImage.getData();
     float *kernelData = kernel.getData();
     float*  __restrict__ resultData = result.getData();
-    Tensor *biases = kernel.getBiases();
     float bias = 0; //for a 3D kernel, there should only 1 bias
-    std::vector<int> kernelChildSizes = kernel.getChildSizes();
-    std::vector<int> resultChildSizes = result.getChildSizes();
-    if(biases!=nullptr && biases->getTotalSize()==1){
-        bias = *((*biases)[0]);
+    if(kernel.getNumBiases()==1){
+        bias = *kernel.getBiases();
     }
-    else if(biases!=nullptr && biases->getTotalSize()>1){
+    else if(kernel.getNumBiases()>1){
         throw std::invalid_argument("Too many biases for a 3D kernel");
     }
     //No biases is valid
@@ -337,23 +482,32 @@ Tensor CnnUtils::convolution(const Tensor& image,Tensor& kernel,const int xStrid
         const int paddedImageChildSizes0 = paddedImageChildSizes[0];
         const int paddedImageChildSizes1 = paddedImageChildSizes[1];
         const int resultChildSizes0 = resultChildSizes[0];
+        //If the rows are pitched, the last group of 4 can run into the pitch rather than needing a scalar tail
+        //The result needs room for the whole group and the input needs room for everything the group reads
+        const int numXGroups = (result.getDimen(1)+3)/4;
+        const bool overrunRows = resultChildSizes0>=numXGroups*4 
+                                && paddedImageChildSizes1>2+xStride*(numXGroups*4-1);
+        const int vectorXBound = overrunRows ? originalImgXBound : originalImgXBound-xStride*3;
         if(xStride==1){
             //Don't need to gather
             for(int l=0;l<paddedImgDimens0;l++){
                 int newY = 0;
                 int newX = 0;
-                const int kernelChannel = l*9; //3x3 = 9
+                //The kernel's rows can be pitched too
+                const float *kernelRow0 = kernelData + l*kernelChildSizes[0];
+                const float *kernelRow1 = kernelRow0 + kernelChildSizes[1];
+                const float *kernelRow2 = kernelRow1 + kernelChildSizes[1];
                 const int paddedImageChannel = l*paddedImageChildSizes0;
                 //Need these for scalar tail
-                const float k00 = kernelData[kernelChannel + 0];
-                const float k01 = kernelData[kernelChannel + 1];
-                const float k02 = kernelData[kernelChannel + 2];
-                const float k10 = kernelData[kernelChannel + 3];
-                const float k11 = kernelData[kernelChannel + 4];
-                const float k12 = kernelData[kernelChannel + 5];
-                const float k20 = kernelData[kernelChannel + 6];
-                const float k21 = kernelData[kernelChannel + 7];
-                const float k22 = kernelData[kernelChannel + 8];
+                const float k00 = kernelRow0[0];
+                const float k01 = kernelRow0[1];
+                const float k02 = kernelRow0[2];
+                const float k10 = kernelRow1[0];
+                const float k11 = kernelRow1[1];
+                const float k12 = kernelRow1[2];
+                const float k20 = kernelRow2[0];
+                const float k21 = kernelRow2[1];
+                const float k22 = kernelRow2[2];
 
                 const float32x4_t K00 = vdupq_n_f32(k00);
                 const float32x4_t K01 = vdupq_n_f32(k01);
@@ -374,28 +528,28 @@ Tensor CnnUtils::convolution(const Tensor& image,Tensor& kernel,const int xStrid
                     
                     int x=1;
                     //Process different inputs at once
-                    //Stop short and we can scalar the rest
+                    //Stop short and we can scalar the rest (unless we can overrun into the pitch)
                     //originalImgXBound is the last valid padded pixel and so as x is the centre,
                     //when we go to x+1, this will be the last valid padded pixel hence the <
-                    for(;x+3<originalImgXBound;x+=4){
+                    for(;x<vectorXBound;x+=4){
                         //x is the centre of the kernel and so we start at x-1
                         const int xSub1 = x-1; 
                         //indices where the pixels are located
                         
                         //Get all of the pixels that will be in the (0,0) position for the convolutions
-                        const float32x4_t R00 = vld1q_f32(paddedRow0Base);    
+                        const float32x4_t R00 = vld1q_f32(paddedRow0Base+xSub1);    
                         //And then the (0,1)
-                        const float32x4_t R01 = vld1q_f32(paddedRow0Base+1);
+                        const float32x4_t R01 = vld1q_f32(paddedRow0Base+xSub1+1);
                         //etc.
-                        const float32x4_t R02 = vld1q_f32(paddedRow0Base+2); 
+                        const float32x4_t R02 = vld1q_f32(paddedRow0Base+xSub1+2); 
                         //(1,0)
-                        const float32x4_t R10 = vld1q_f32(paddedRow1Base);
-                        const float32x4_t R11 = vld1q_f32(paddedRow1Base+1);
-                        const float32x4_t R12 = vld1q_f32(paddedRow1Base+2);
+                        const float32x4_t R10 = vld1q_f32(paddedRow1Base+xSub1);
+                        const float32x4_t R11 = vld1q_f32(paddedRow1Base+xSub1+1);
+                        const float32x4_t R12 = vld1q_f32(paddedRow1Base+xSub1+2);
 
-                        const float32x4_t R20 = vld1q_f32(paddedRow2Base);
-                        const float32x4_t R21 = vld1q_f32(paddedRow2Base+1);
-                        const float32x4_t R22 = vld1q_f32(paddedRow2Base+2);
+                        const float32x4_t R20 = vld1q_f32(paddedRow2Base+xSub1);
+                        const float32x4_t R21 = vld1q_f32(paddedRow2Base+xSub1+1);
+                        const float32x4_t R22 = vld1q_f32(paddedRow2Base+xSub1+2);
 
                         //Compute kernel*image for 4 convolutions at once for each kernel element
                         float32x4_t acc = vdupq_n_f32(0.0f); //set to zero
@@ -420,8 +574,8 @@ Tensor CnnUtils::convolution(const Tensor& image,Tensor& kernel,const int xStrid
                     }
                     //scalar tail - remaining outputs for this row
                     for (;x<originalImgXBound;x++) {
-                        //x-1 as x is the centre
-                        const int row0 = paddedImageChannel + x-1;
+                        //x-1 and y-1 as (x,y) is the centre
+                        const int row0 = paddedImageChannel + (y-1)*paddedImageChildSizes1 + x-1;
                         const int row1 = row0 + paddedImageChildSizes1;
                         const int row2 = row1 + paddedImageChildSizes1;
                         resultData[resultRow + newX] +=
@@ -441,18 +595,21 @@ Tensor CnnUtils::convolution(const Tensor& image,Tensor& kernel,const int xStrid
             for(int l=0;l<paddedImgDimens0;l++){
                 int newY = 0;
                 int newX = 0;
-                const int kernelChannel = l*9; //3x3 = 9
+                //The kernel's rows can be pitched too
+                const float *kernelRow0 = kernelData + l*kernelChildSizes[0];
+                const float *kernelRow1 = kernelRow0 + kernelChildSizes[1];
+                const float *kernelRow2 = kernelRow1 + kernelChildSizes[1];
                 const int paddedImageChannel = l*paddedImageChildSizes0;
                 //Need these for scalar tail
-                const float k00 = kernelData[kernelChannel + 0];
-                const float k01 = kernelData[kernelChannel + 1];
-                const float k02 = kernelData[kernelChannel + 2];
-                const float k10 = kernelData[kernelChannel + 3];
-                const float k11 = kernelData[kernelChannel + 4];
-                const float k12 = kernelData[kernelChannel + 5];
-                const float k20 = kernelData[kernelChannel + 6];
-                const float k21 = kernelData[kernelChannel + 7];
-                const float k22 = kernelData[kernelChannel + 8];
+                const float k00 = kernelRow0[0];
+                const float k01 = kernelRow0[1];
+                const float k02 = kernelRow0[2];
+                const float k10 = kernelRow1[0];
+                const float k11 = kernelRow1[1];
+                const float k12 = kernelRow1[2];
+                const float k20 = kernelRow2[0];
+                const float k21 = kernelRow2[1];
+                const float k22 = kernelRow2[2];
 
                 const float32x4_t K00 = vdupq_n_f32(k00);
                 const float32x4_t K01 = vdupq_n_f32(k01);
@@ -476,10 +633,10 @@ Tensor CnnUtils::convolution(const Tensor& image,Tensor& kernel,const int xStrid
                     
                     int x=1;
                     //Process different inputs at once
-                    //Stop short and we can scalar the rest
+                    //Stop short and we can scalar the rest (unless we can overrun into the pitch)
                     //originalImgXBound is the last valid padded pixel and so as x is the centre,
                     //when we go to x+1, this will be the last valid padded pixel hence the <
-                    for(;x+xStride*3<originalImgXBound;x+=xStride*4){
+                    for(;x<vectorXBound;x+=xStride*4){
                         //x is the centre of the kernel and so we start at x-1
                         const int xSub1 = x-1; 
                         const int xAdd1 = x+1;
@@ -567,8 +724,8 @@ Tensor CnnUtils::convolution(const Tensor& image,Tensor& kernel,const int xStrid
                     }
                     //scalar tail - remaining outputs for this row
                     for (;x<originalImgXBound;x+=xStride) {
-                        //x-1 as x is the centre
-                        const int row0 = paddedImageChannel + x-1;
+                        //x-1 and y-1 as (x,y) is the centre
+                        const int row0 = paddedImageChannel + (y-1)*paddedImageChildSizes1 + x-1;
                         const int row1 = row0 + paddedImageChildSizes1;
                         const int row2 = row1 + paddedImageChildSizes1;
                         resultData[resultRow + newX] +=
@@ -710,10 +867,11 @@ Tensor CnnUtils::convolution(const Tensor& image,Tensor& kernel,const int xStrid
     }
     
 
-    std::vector<int> resultDimens = result.getDimens();
-    for(int y=0;y<resultDimens[0];y++){
+    const int resultDimens0 = result.getDimen(0);
+    const int resultDimens1 = result.getDimen(1);
+    for(int y=0;y<resultDimens0;y++){
         int resultRow = y*resultChildSizes[0];
-        for(int x=0;x<resultDimens[1];x++){
+        for(int x=0;x<resultDimens1;x++){
             resultData[resultRow+x] = leakyRelu(resultData[resultRow+x]+bias); //has to be here as otherwise we would relu before we've done all the channels
         }
     }
@@ -723,107 +881,45 @@ Tensor CnnUtils::convolution(const Tensor& image,Tensor& kernel,const int xStrid
             convolutionTimer->stop();
         } 
     #endif
-    return result;
 }
 
-//Saving the padding allocation
-//prePaddingImage doesn't contain the image data, it just needs to be the correct size
-Tensor CnnUtils::convolution(const Tensor& image,Tensor& prePaddedImage,Tensor& kernel,const int xStride,const int yStride
+//variable size output
+Tensor CnnUtils::convolution(const TensorView& image,const TensorView& kernel,const int xStride,const int yStride,bool padding
 #if PROFILING
     ,Timer *parentTimer
 #endif
-){
-    #if PROFILING
-        Timer *prePaddedConvolutionTimer = nullptr;
-        Timer *paddingTimer = nullptr;
-        if(parentTimer){
-            prePaddedConvolutionTimer = parentTimer->addChildTimer("prePaddedConvolution");
-            paddingTimer = prePaddedConvolutionTimer->addChildTimer("padding");
-        }
-    #endif
-    std::vector<int> imageDimens = image.getDimens();
-    std::vector<int> pImageDimens = prePaddedImage.getDimens();
-    std::vector<int> kernelDimens = kernel.getDimens();
-    if(imageDimens.size()!=3){
+){ 
+    if(image.getNumDimens()!=3){
         throw std::invalid_argument("Image must have 3 dimensions for convolution");
     }
-    if(pImageDimens.size()!=3){
-        throw std::invalid_argument("Padded image must have 3 dimensions for convolution");
-    }
-    if(kernelDimens.size()!=3){
+    if(kernel.getNumDimens()!=3){
         throw std::invalid_argument("Kernel must have 3 dimensions for convolution");
     }
-    const int yKernelRadius = std::floor(kernelDimens[1]/2);
-    const int xKernelRadius = std::floor(kernelDimens[2]/2);
-    if(pImageDimens[0]!=imageDimens[0]){
-        throw std::invalid_argument("Padded image must have the same number of channels as the unpadded image");
-    }
-    const int correctPaddedHeight = imageDimens[1]+2*yKernelRadius;
-    const int correctPaddedWidth = imageDimens[2]+2*xKernelRadius;
-    if(correctPaddedHeight!=pImageDimens[1] || correctPaddedWidth!=pImageDimens[2]){
-        throw std::invalid_argument("Padded image had been padded incorrectly");
-    }
-    float *pImageData = prePaddedImage.getData();
-    const float *imageData = image.getData();
-    std::vector<int> pImageChildSizes = prePaddedImage.getChildSizes();
-    std::vector<int> imageChildSizes = image.getChildSizes();
-    //Set the padding and copy the data
-    //It is not quicker to first set data to 0 and then do this
-    const int imageChildSizes0 = imageChildSizes[0];
-    const int pImageChildSizes0 = pImageChildSizes[0];
-    const int pImageDimens0 = pImageDimens[0];
-    const int imageDimens1 = imageDimens[1];
-    const int imageDimens2 = imageDimens[2];
-    const int pImageDimens2 = pImageDimens[2];
-    const int imageRowBytes = imageDimens2*sizeof(float);
-    for(int l=0;l<pImageDimens0;l++){
-        const float *imageChannel = imageData+l*imageChildSizes0;
-        float *pImageChannel = pImageData+l*pImageChildSizes0;
-        //Top padding
-        //Large and so probably worth a memset
-        std::memset(pImageChannel,0,yKernelRadius*pImageDimens2*sizeof(float));
-        for(int y=0;y<imageDimens1;y++){
-            float *pImageRow = pImageChannel+(y+yKernelRadius)*pImageDimens2;
-            //Left padding
-            float *pImagePtr = pImageRow;
-            float *pImageRowBody = pImageRow+xKernelRadius;
-            //xKernelRadius is likely small and so not worth calling memset or vectorising
-            for(;pImagePtr<pImageRowBody;pImagePtr++){
-                *pImagePtr = 0;
-            }
-           
-            const float *imageRow = imageChannel+y*imageDimens2;
-            //Copying the actual data
-            std::memcpy(pImageRowBody,imageRow,imageRowBytes);
-
-            pImagePtr = pImageRowBody+imageDimens2;
-            float *pImageNextRow = pImageRow+pImageDimens2;
-            //Right padding
-            for(;pImagePtr<pImageNextRow;pImagePtr++){
-                *pImagePtr = 0;
-            }
-        }
-        //Bottom padding
-        float *pImageEndPadding = pImageChannel + (imageDimens1+yKernelRadius)*pImageDimens[2];
-        std::memset(pImageEndPadding,0,yKernelRadius*pImageDimens2*sizeof(float));
+    const int xKernelRadius = (int) floor(kernel.getDimen(2)/2); //Not actually a radius, actually half the width
+    const int yKernelRadius = (int) floor(kernel.getDimen(1)/2);
+    Tensor paddedImage;
+    TensorView paddedImageView = image;
+    if(padding){
+        paddedImage = Tensor({image.getDimen(0),image.getDimen(1)+yKernelRadius*2,image.getDimen(2)+xKernelRadius*2});
+        paddedImageView = paddedImage.view();
+        padImage(image,paddedImageView);
     }
+    const int imHeight = paddedImageView.getDimen(1);
+    const int imWidth = paddedImageView.getDimen(2);
+    Tensor result({
+        (int)ceil((float)(imHeight-2*yKernelRadius)/yStride),
+        (int)ceil((float)(imWidth-2*xKernelRadius)/xStride)
+    }); //0 initialised
+    convolution(paddedImageView,kernel,result.view(),xStride,yStride
     #if PROFILING
-        if(parentTimer) paddingTimer->stop();
-    #endif 
-    //Copy-elision
-    Tensor result = convolution(prePaddedImage,kernel,xStride,yStride,false
-    #if PROFILING
-        ,prePaddedConvolutionTimer
+        ,parentTimer
     #endif
     );
-    #if PROFILING
-        if(parentTimer) prePaddedConvolutionTimer->stop();
-    #endif 
     return result;
 }
 
 //fixed size output
-Tensor CnnUtils::convolution(Tensor& image,Tensor& kernel,int xStride,int yStride,int newWidth,int newHeight,bool padding
+Tensor CnnUtils::convolution(const TensorView& image,const TensorView& kernel,int xStride,int yStride,int newWidth,int newHeight,bool padding
 #if PROFILING
     ,Timer *parentTimer
 #endif
@@ -838,7 +934,7 @@ Tensor CnnUtils::convolution(Tensor& image,Tensor& kernel,int xStride,int yStrid
         ,parentTimer?fixedSizedConvolutionTimer:nullptr
     #endif
     );
-    std::vector<int> convResultDimens = convResult.getDimens();
+    const std::vector<int>& convResultDimens = convResult.getDimens();
     if(convResultDimens[0]==newHeight && convResultDimens[1]==newWidth){
         #if PROFILING
             fixedSizedConvolutionTimer->stop();
@@ -870,6 +966,784 @@ Tensor CnnUtils::convolution(Tensor& image,Tensor& kernel,int xStride,int yStrid
 }
 
 
+//----------------------------------------------------
+//BLOCKED LAYOUT
+
+//The conv layers keep their maps as [C/4][H][W][4] rather than CHW
+//An output pixel's sums over the input channels then read neighbouring memory rather than a plane apart
+//and one register holds 4 output channels at once
+//The CHW <-> blocked conversion only happens at the input (blockImage) and at the flatten (maxPoolBlocked)
+
+std::vector<Tensor> CnnUtils::blockKernels(const std::vector<Tensor>& layerKernels){
+    std::vector<Tensor> result(layerKernels.size());
+    for(int l=0;l<layerKernels.size();l++){
+        const std::vector<int>& kernelDimens = layerKernels[l].getDimens();
+        if(kernelDimens.size()!=4){
+            throw std::invalid_argument("Kernels must have 4 dimensions to be blocked");
+        }
+        const int numOutChans = kernelDimens[0];
+        const int numInChans = kernelDimens[1];
+        const int height = kernelDimens[2];
+        const int width = kernelDimens[3];
+        const int numOutBlocks = numChannelBlocks(numOutChans);
+        //0 initialised and so the channels which don't exist have 0 weights
+        result[l] = Tensor({numOutBlocks,numChannelBlocks(numInChans),height,width,CHANNEL_BLOCK*CHANNEL_BLOCK});
+        const float *kernelData = layerKernels[l].getData();
+        const std::vector<int>& kernelChildSizes = layerKernels[l].getChildSizes();
+        float *resultData = result[l].getData();
+        const std::vector<int>& resultChildSizes = result[l].getChildSizes();
+        for(int o=0;o<numOutChans;o++){
+            int resultOutBlock = (o/CHANNEL_BLOCK)*resultChildSizes[0] + o%CHANNEL_BLOCK;
+            for(int i=0;i<numInChans;i++){
+                int resultInBlock = resultOutBlock + (i/CHANNEL_BLOCK)*resultChildSizes[1] + (i%CHANNEL_BLOCK)*CHANNEL_BLOCK;
+                const float *kernelChannel = kernelData + o*kernelChildSizes[0] + i*kernelChildSizes[1];
+                for(int y=0;y<height;y++){
+                    for(int x=0;x<width;x++){
+                        resultData[resultInBlock + y*resultChildSizes[2] + x*resultChildSizes[3]] = kernelChannel[y*kernelChildSizes[2]+x];
+                    }
+                }
+            }
+        }
+        Tensor biases({numOutBlocks*CHANNEL_BLOCK});
+        Tensor *kernelBiases = layerKernels[l].getBiases();
+        if(kernelBiases!=nullptr){
+            std::memcpy(biases.getData(),kernelBiases->getData(),sizeof(float)*kernelBiases->getTotalSize());
+        }
+        result[l].setBiases(biases);
+    }
+    return result;
+}
+
+void CnnUtils::blockImage(const TensorView& image,const TensorView& paddedBlockedImage){
+    if(image.getNumDimens()!=3){
+        throw std::invalid_argument("Image must have 3 dimensions to be blocked");
+    }
+    if(paddedBlockedImage.getNumDimens()!=4 || paddedBlockedImage.getDimen(3)!=CHANNEL_BLOCK){
+        throw std::invalid_argument("Blocked image must be [C/"+std::to_string(CHANNEL_BLOCK)+"][H][W]["+std::to_string(CHANNEL_BLOCK)+"]");
+    }
+    const int channels = image.getDimen(0);
+    const int imHeight = image.getDimen(1);
+    const int imWidth = image.getDimen(2);
+    const int numBlocks = paddedBlockedImage.getDimen(0);
+    const int paddedHeight = paddedBlockedImage.getDimen(1);
+    const int paddedWidth = paddedBlockedImage.getDimen(2);
+    if(numBlocks!=numChannelBlocks(channels)){
+        throw std::invalid_argument("Blocked image has the wrong number of channel blocks");
+    }
+    const int yRadius = (paddedHeight-imHeight)/2;
+    const int xRadius = (paddedWidth-imWidth)/2;
+    if(yRadius<0 || xRadius<0){
+        throw std::invalid_argument("Blocked image is smaller than the image");
+    }
+    const float *imageData = image.getData();
+    const int imageChildSizes0 = image.getChildSize(0);
+    const int imageChildSizes1 = image.getChildSize(1);
+    float *blockedData = paddedBlockedImage.getData();
+    const int blockedChildSizes0 = paddedBlockedImage.getChildSize(0);
+    const int blockedChildSizes1 = paddedBlockedImage.getChildSize(1);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    for(int b=0;b<numBlocks;b++){
+        float *block = blockedData + b*blockedChildSizes0;
+        //Top and bottom padding
+        std::memset(block,0,yRadius*blockedChildSizes1*sizeof(float));
+        std::memset(block+(yRadius+imHeight)*blockedChildSizes1,0,(paddedHeight-imHeight-yRadius)*blockedChildSizes1*sizeof(float));
+        const int firstChannel = b*CHANNEL_BLOCK;
+        for(int y=0;y<imHeight;y++){
+            float *blockedRow = block + (y+yRadius)*blockedChildSizes1;
+            //Left and right padding
+            std::memset(blockedRow,0,xRadius*CHANNEL_BLOCK*sizeof(float));
+            std::memset(blockedRow+(xRadius+imWidth)*CHANNEL_BLOCK,0,(paddedWidth-imWidth-xRadius)*CHANNEL_BLOCK*sizeof(float));
+            float* __restrict__ blockedRowBody = blockedRow + xRadius*CHANNEL_BLOCK;
+            //nullptr for channels which only exist to fill the last block
+            const float *imageRows[CHANNEL_BLOCK];
+            for(int c=0;c<CHANNEL_BLOCK;c++){
+                imageRows[c] = (firstChannel+c<channels) ? imageData+(firstChannel+c)*imageChildSizes0+y*imageChildSizes1 : nullptr;
+            }
+            int x=0;
+            for(;x+3<imWidth;x+=4){
+                //Interleaves 4 pixels of 4 channels in one store
+                float32x4x4_t pixels;
+                pixels.val[0] = imageRows[0] ? vld1q_f32(imageRows[0]+x) : zero;
+                pixels.val[1] = imageRows[1] ? vld1q_f32(imageRows[1]+x) : zero;
+                pixels.val[2] = imageRows[2] ? vld1q_f32(imageRows[2]+x) : zero;
+                pixels.val[3] = imageRows[3] ? vld1q_f32(imageRows[3]+x) : zero;
+                vst4q_f32(blockedRowBody+x*CHANNEL_BLOCK,pixels);
+            }
+            //Scalar tail
+            for(;x<imWidth;x++){
+                for(int c=0;c<CHANNEL_BLOCK;c++){
+                    blockedRowBody[x*CHANNEL_BLOCK+c] = imageRows[c] ? imageRows[c][x] : 0.0f;
+                }
+            }
+        }
+    }
+}
+
+void CnnUtils::padImageBlocked(const TensorView& blockedImage,const TensorView& paddedBlockedImage){
+    if(blockedImage.getNumDimens()!=4 || paddedBlockedImage.getNumDimens()!=4){
+        throw std::invalid_argument("Blocked images must have 4 dimensions for padding");
+    }
+    if(blockedImage.getDimen(0)!=paddedBlockedImage.getDimen(0) || blockedImage.getDimen(3)!=paddedBlockedImage.getDimen(3)){
+        throw std::invalid_argument("Padded image must have the same channel blocks as the unpadded image");
+    }
+    const int numBlocks = blockedImage.getDimen(0);
+    const int imHeight = blockedImage.getDimen(1);
+    const int imWidth = blockedImage.getDimen(2);
+    const int paddedHeight = paddedBlockedImage.getDimen(1);
+    const int paddedWidth = paddedBlockedImage.getDimen(2);
+    const int yRadius = (paddedHeight-imHeight)/2;
+    const int xRadius = (paddedWidth-imWidth)/2;
+    if(yRadius<0 || xRadius<0){
+        throw std::invalid_argument("Padded image is smaller than the unpadded image");
+    }
+    const float *imageData = blockedImage.getData();
+    const int imageChildSizes0 = blockedImage.getChildSize(0);
+    const int imageChildSizes1 = blockedImage.getChildSize(1);
+    float *paddedData = paddedBlockedImage.getData();
+    const int paddedChildSizes0 = paddedBlockedImage.getChildSize(0);
+    const int paddedChildSizes1 = paddedBlockedImage.getChildSize(1);
+    //A whole blocked row is contiguous and so it's one memcpy
+    const int rowBytes = imWidth*CHANNEL_BLOCK*sizeof(float);
+    for(int b=0;b<numBlocks;b++){
+        const float *imageBlock = imageData + b*imageChildSizes0;
+        float *paddedBlock = paddedData + b*paddedChildSizes0;
+        std::memset(paddedBlock,0,yRadius*paddedChildSizes1*sizeof(float));
+        std::memset(paddedBlock+(yRadius+imHeight)*paddedChildSizes1,0,(paddedHeight-imHeight-yRadius)*paddedChildSizes1*sizeof(float));
+        for(int y=0;y<imHeight;y++){
+            float *paddedRow = paddedBlock + (y+yRadius)*paddedChildSizes1;
+            std::memset(paddedRow,0,xRadius*CHANNEL_BLOCK*sizeof(float));
+            std::memcpy(paddedRow+xRadius*CHANNEL_BLOCK,imageBlock+y*imageChildSizes1,rowBytes);
+            std::memset(paddedRow+(xRadius+imWidth)*CHANNEL_BLOCK,0,(paddedWidth-imWidth-xRadius)*CHANNEL_BLOCK*sizeof(float));
+        }
+    }
+}
+
+void CnnUtils::convolutionBlocked(const TensorView& paddedImage,const TensorView& kernel,const TensorView& result,const int xStride,const int yStride,const blockSparsity *sparsity){
+    if(paddedImage.getNumDimens()!=4 || result.getNumDimens()!=4){
+        throw std::invalid_argument("Image and result must be blocked for convolutionBlocked");
+    }
+    if(kernel.getNumDimens()!=5 || kernel.getDimen(4)!=CHANNEL_BLOCK*CHANNEL_BLOCK){
+        throw std::invalid_argument("Kernel must be blocked with blockKernels for convolutionBlocked");
+    }
+    const int numInBlocks = kernel.getDimen(1);
+    const int kernelHeight = kernel.getDimen(2);
+    const int kernelWidth = kernel.getDimen(3);
+    if(paddedImage.getDimen(0)!=numInBlocks){
+        throw std::invalid_argument("The image and kernel must have the same number of channels for convolution");
+    }
+    if(result.getDimen(0)!=kernel.getDimen(0)){
+        throw std::invalid_argument("The result and kernel must have the same number of output channels for convolution");
+    }
+    const int yKernelRadius = kernelHeight/2;
+    const int xKernelRadius = kernelWidth/2;
+    const int resHeight = result.getDimen(1);
+    const int resWidth = result.getDimen(2);
+    //Same sizes as the CHW convolution
+    if(resHeight!=(int)ceil((float)(paddedImage.getDimen(1)-2*yKernelRadius)/yStride)
+    || resWidth!=(int)ceil((float)(paddedImage.getDimen(2)-2*xKernelRadius)/xStride)){
+        throw std::invalid_argument("Result is the wrong size for convolution");
+    }
+    if(kernel.getNumBiases()<kernel.getDimen(0)*CHANNEL_BLOCK){
+        throw std::invalid_argument("Blocked kernels need a bias for every output channel");
+    }
+    const float *imageData = paddedImage.getData();
+    const float *kernelData = kernel.getData();
+    const float *biasesData = kernel.getBiases();
+    float* __restrict__ resultData = result.getData();
+    const int numOutBlocks = kernel.getDimen(0);
+    const int imageChildSizes0 = paddedImage.getChildSize(0);
+    const int imageChildSizes1 = paddedImage.getChildSize(1);
+    const int kernelChildSizes0 = kernel.getChildSize(0);
+    const int kernelChildSizes1 = kernel.getChildSize(1);
+    const int kernelChildSizes2 = kernel.getChildSize(2);
+    const int resultChildSizes0 = result.getChildSize(0);
+    const int resultChildSizes1 = result.getChildSize(1);
+    //Distance between neighbouring outputs' windows
+    const int xStep = xStride*CHANNEL_BLOCK;
+    if(sparsity!=nullptr && sparsity->rowStarts.size()!=numOutBlocks+1){
+        throw std::invalid_argument("Kernel sparsity does not match the kernel");
+    }
+    //For a pruned model, only the input blocks which aren't all zero for this output block are used
+    //If none are left, the output block is just the bias
+    const int *activeInBlocks = sparsity==nullptr ? nullptr : sparsity->cols.data();
+
+    for(int o=0;o<numOutBlocks;o++){
+        const int inStart = sparsity==nullptr ? 0 : sparsity->rowStarts[o];
+        const int inEnd = sparsity==nullptr ? numInBlocks : sparsity->rowStarts[o+1];
+        const float *outKernel = kernelData + o*kernelChildSizes0;
+        const float32x4_t B = vld1q_f32(biasesData + o*CHANNEL_BLOCK);
+        float *resultBlock = resultData + o*resultChildSizes0;
+        for(int newY=0;newY<resHeight;newY++){
+            float* __restrict__ resultRow = resultBlock + newY*resultChildSizes1;
+            //Top of the window
+            const float *imageRowBase = imageData + newY*yStride*imageChildSizes1;
+            int newX=0;
+            //4 outputs at once so that each kernel load is used 4 times
+            for(;newX+3<resWidth;newX+=4){
+                float32x4_t acc0 = B;
+                float32x4_t acc1 = B;
+                float32x4_t acc2 = B;
+                float32x4_t acc3 = B;
+                for(int n=inStart;n<inEnd;n++){
+                    const int i = activeInBlocks==nullptr ? n : activeInBlocks[n];
+                    const float *inKernel = outKernel + i*kernelChildSizes1;
+                    const float *imageBlock = imageRowBase + i*imageChildSizes0 + newX*xStep;
+                    for(int j=0;j<kernelHeight;j++){
+                        const float *kernelRow = inKernel + j*kernelChildSizes2;
+                        const float *imageRow = imageBlock + j*imageChildSizes1;
+                        for(int k=0;k<kernelWidth;k++){
+                            //The weights from each of the 4 input channels to the 4 output channels
+                            const float *kernelPtr = kernelRow + k*CHANNEL_BLOCK*CHANNEL_BLOCK;
+                            const float32x4_t K0 = vld1q_f32(kernelPtr);
+                            const float32x4_t K1 = vld1q_f32(kernelPtr+4);
+                            const float32x4_t K2 = vld1q_f32(kernelPtr+8);
+                            const float32x4_t K3 = vld1q_f32(kernelPtr+12);
+                            //The 4 input channels for each of the 4 outputs
+                            const float *imagePtr = imageRow + k*CHANNEL_BLOCK;
+                            const float32x4_t R0 = vld1q_f32(imagePtr);
+                            const float32x4_t R1 = vld1q_f32(imagePtr+xStep);
+                            const float32x4_t R2 = vld1q_f32(imagePtr+2*xStep);
+                            const float32x4_t R3 = vld1q_f32(imagePtr+3*xStep);
+                            acc0 = vfmaq_laneq_f32(acc0,K0,R0,0);
+                            acc1 = vfmaq_laneq_f32(acc1,K0,R1,0);
+                            acc2 = vfmaq_laneq_f32(acc2,K0,R2,0);
+                            acc3 = vfmaq_laneq_f32(acc3,K0,R3,0);
+                            acc0 = vfmaq_laneq_f32(acc0,K1,R0,1);
+                            acc1 = vfmaq_laneq_f32(acc1,K1,R1,1);
+                            acc2 = vfmaq_laneq_f32(acc2,K1,R2,1);
+                            acc3 = vfmaq_laneq_f32(acc3,K1,R3,1);
+                            acc0 = vfmaq_laneq_f32(acc0,K2,R0,2);
+                            acc1 = vfmaq_laneq_f32(acc1,K2,R1,2);
+                            acc2 = vfmaq_laneq_f32(acc2,K2,R2,2);
+                            acc3 = vfmaq_laneq_f32(acc3,K2,R3,2);
+                            acc0 = vfmaq_laneq_f32(acc0,K3,R0,3);
+                            acc1 = vfmaq_laneq_f32(acc1,K3,R1,3);
+                            acc2 = vfmaq_laneq_f32(acc2,K3,R2,3);
+                            acc3 = vfmaq_laneq_f32(acc3,K3,R3,3);
+                        }
+                    }
+                }
+                float *resultPtr = resultRow + newX*CHANNEL_BLOCK;
+                vst1q_f32(resultPtr,leakyRelu4f(acc0));
+                vst1q_f32(resultPtr+4,leakyRelu4f(acc1));
+                vst1q_f32(resultPtr+8,leakyRelu4f(acc2));
+                vst1q_f32(resultPtr+12,leakyRelu4f(acc3));
+            }
+            //Tail - one output at a time, still 4 output channels at once
+            for(;newX<resWidth;newX++){
+                float32x4_t acc = B;
+                for(int n=inStart;n<inEnd;n++){
+                    const int i = activeInBlocks==nullptr ? n : activeInBlocks[n];
+                    const float *inKernel = outKernel + i*kernelChildSizes1;
+                    const float *imageBlock = imageRowBase + i*imageChildSizes0 + newX*xStep;
+                    for(int j=0;j<kernelHeight;j++){
+                        const float *kernelRow = inKernel + j*kernelChildSizes2;
+                        const float *imageRow = imageBlock + j*imageChildSizes1;
+                        for(int k=0;k<kernelWidth;k++){
+                            const float *kernelPtr = kernelRow + k*CHANNEL_BLOCK*CHANNEL_BLOCK;
+                            const float32x4_t R = vld1q_f32(imageRow + k*CHANNEL_BLOCK);
+                            acc = vfmaq_laneq_f32(acc,vld1q_f32(kernelPtr),R,0);
+                            acc = vfmaq_laneq_f32(acc,vld1q_f32(kernelPtr+4),R,1);
+                            acc = vfmaq_laneq_f32(acc,vld1q_f32(kernelPtr+8),R,2);
+                            acc = vfmaq_laneq_f32(acc,vld1q_f32(kernelPtr+12),R,3);
+                        }
+                    }
+                }
+                vst1q_f32(resultRow + newX*CHANNEL_BLOCK,leakyRelu4f(acc));
+            }
+        }
+    }
+}
+
+void CnnUtils::maxPoolBlocked(const TensorView& image,const TensorView& result,int xStride,int yStride,int *maxPoolIndices){
+    if(image.getNumDimens()!=4 || image.getDimen(3)!=CHANNEL_BLOCK){
+        throw std::invalid_argument("Image must be blocked for maxPoolBlocked");
+    }
+    const bool blockedResult = result.getNumDimens()==4;
+    if(!blockedResult && result.getNumDimens()!=3){
+        throw std::invalid_argument("Result must either be blocked or CHW for maxPoolBlocked");
+    }
+    const int numBlocks = image.getDimen(0);
+    const int imWidth = image.getDimen(2);
+    const int resHeight = image.getDimen(1)/yStride;
+    const int resWidth = imWidth/xStride;
+    //Only the CHW result knows how many of the channels in the last block are real
+    const int channels = blockedResult ? numBlocks*CHANNEL_BLOCK : result.getDimen(0);
+    if(result.getDimen(1)!=resHeight || result.getDimen(2)!=resWidth
+    || (blockedResult && result.getDimen(0)!=numBlocks) || (!blockedResult && numChannelBlocks(channels)!=numBlocks)){
+        throw std::invalid_argument("Result is the wrong size for maxPoolBlocked");
+    }
+    const float *imageData = image.getData();
+    float* __restrict__ resultData = result.getData();
+    const int imageChildSizes0 = image.getChildSize(0);
+    const int imageChildSizes1 = image.getChildSize(1);
+    const int resultChildSizes0 = result.getChildSize(0);
+    const int resultChildSizes1 = result.getChildSize(1);
+    const int resArea = resHeight*resWidth;
+    for(int b=0;b<numBlocks;b++){
+        const float *imageBlock = imageData + b*imageChildSizes0;
+        for(int newY=0;newY<resHeight;newY++){
+            const int logicalImageRow = newY*yStride*imWidth;
+            for(int newX=0;newX<resWidth;newX++){
+                const float *window = imageBlock + newY*yStride*imageChildSizes1 + newX*xStride*CHANNEL_BLOCK;
+                const int windowIndex = logicalImageRow + newX*xStride;
+                //4 channels at once
+                float32x4_t max;
+                //Every lane has the same position but they can have different maxes
+                int32x4_t index = vdupq_n_s32(windowIndex);
+                if(xStride==2 && yStride==2){
+                    const float32x4_t P00 = vld1q_f32(window);
+                    const float32x4_t P01 = vld1q_f32(window+CHANNEL_BLOCK);
+                    const float32x4_t P10 = vld1q_f32(window+imageChildSizes1);
+                    const float32x4_t P11 = vld1q_f32(window+imageChildSizes1+CHANNEL_BLOCK);
+                    if(maxPoolIndices==nullptr){
+                        max = vmaxq_f32(vmaxq_f32(P00,P01),vmaxq_f32(P10,P11));
+                    }
+                    else{
+                        max = P00;
+                        maxWithIndex(max,index,P01,vdupq_n_s32(windowIndex+1));
+                        maxWithIndex(max,index,P10,vdupq_n_s32(windowIndex+imWidth));
+                        maxWithIndex(max,index,P11,vdupq_n_s32(windowIndex+imWidth+1));
+                    }
+                }
+                else{
+                    max = vdupq_n_f32(-std::numeric_limits<float>::infinity());
+                    for(int j=0;j<yStride;j++){
+                        const float *windowRow = window + j*imageChildSizes1;
+                        for(int i=0;i<xStride;i++){
+                            const float32x4_t P = vld1q_f32(windowRow + i*CHANNEL_BLOCK);
+                            if(maxPoolIndices==nullptr) max = vmaxq_f32(max,P);
+                            else maxWithIndex(max,index,P,vdupq_n_s32(windowIndex+j*imWidth+i));
+                        }
+                    }
+                }
+                if(blockedResult){
+                    const int resultIndex = b*resultChildSizes0 + newY*resultChildSizes1 + newX*CHANNEL_BLOCK;
+                    vst1q_f32(resultData + resultIndex,max);
+                    if(maxPoolIndices!=nullptr) vst1q_s32(maxPoolIndices + resultIndex,index);
+                    continue;
+                }
+                //Flatten back to CHW
+                float maxVals[CHANNEL_BLOCK];
+                int maxIndices[CHANNEL_BLOCK];
+                vst1q_f32(maxVals,max);
+                vst1q_s32(maxIndices,index);
+                for(int c=0;c<CHANNEL_BLOCK && b*CHANNEL_BLOCK+c<channels;c++){
+                    const int channel = b*CHANNEL_BLOCK+c;
+                    resultData[channel*resultChildSizes0 + newY*resultChildSizes1 + newX] = maxVals[c];
+                    if(maxPoolIndices!=nullptr){
+                        maxPoolIndices[channel*resArea + newY*resWidth + newX] = maxIndices[c];
+                    }
+                }
+            }
+        }
+    }
+}
+
+//----------------------------------------------------
+//MLP
+
+void CnnUtils::fullyConnected(const TensorView& layerWeights,const float *prev,float *curr,bool relu,const blockSparsity *sparsity){
+    if(layerWeights.getNumDimens()!=2){
+        throw std::invalid_argument("Weights must have 2 dimensions for fullyConnected");
+    }
+    const int numOut = layerWeights.getDimen(0);
+    const int numIn = layerWeights.getDimen(1);
+    if(layerWeights.getNumBiases()!=numOut){
+        throw std::invalid_argument("fullyConnected needs a bias for every output");
+    }
+    if(sparsity!=nullptr && sparsity->rowStarts.size()!=numOut+1){
+        throw std::invalid_argument("Weight sparsity does not match the weights");
+    }
+    const float *biasesData = layerWeights.getBiases();
+    const float* __restrict__ prevActivations = prev;
+    float* __restrict__ currActivations = curr;
+    const float *currWeights = layerWeights.getData();
+    const int weightsChildSizes0 = layerWeights.getChildSize(0);
+    for(int i=0;i<numOut;i++){
+        const float *currWeightsTo = currWeights + i*weightsChildSizes0;
+        float sum = 0;
+        if(sparsity==nullptr){
+            int j=0;
+            for(;j+3<numIn;j+=4){
+                float32x4_t prevActivations128 = vld1q_f32(&prevActivations[j]);
+                float32x4_t currWeights128 = vld1q_f32(&currWeightsTo[j]);
+                sum += dotProduct4f(prevActivations128,currWeights128);
+            }
+            //scalar tail
+            for(;j<numIn;j++){
+                sum += prevActivations[j] * currWeightsTo[j]; 
+            }
+        }
+        else{
+            //Only the blocks of inputs which have a non-zero weight to this neuron
+            for(int n=sparsity->rowStarts[i];n<sparsity->rowStarts[i+1];n++){
+                int j = sparsity->cols[n]*MLP_SPARSE_BLOCK;
+                const int blockEnd = std::min(j+MLP_SPARSE_BLOCK,numIn);
+                for(;j+3<blockEnd;j+=4){
+                    float32x4_t prevActivations128 = vld1q_f32(&prevActivations[j]);
+                    float32x4_t currWeights128 = vld1q_f32(&currWeightsTo[j]);
+                    sum += dotProduct4f(prevActivations128,currWeights128);
+                }
+                //scalar tail, only the last block can have one
+                for(;j<blockEnd;j++){
+                    sum += prevActivations[j] * currWeightsTo[j];
+                }
+            }
+        }
+        sum += biasesData[i]; //add bias
+        currActivations[i] = relu ? leakyRelu(sum) : sum;
+    }
+}
+
+//----------------------------------------------------
+//BACKPROPAGATION
+
+//The backwards kernels work on the same blocked layout as forwards and so the maps never need converting
+//Training updates blockedKernels directly, see unblockKernels
+
+void CnnUtils::leakyReluBackwards(const TensorView& activations,const TensorView& gradients){
+    if(activations.getTotalSize()!=gradients.getTotalSize()){
+        throw std::invalid_argument("Activations and gradients must be the same size for leakyReluBackwards");
+    }
+    const float *activationsData = activations.getData();
+    float* __restrict__ gradientsData = gradients.getData();
+    const size_t size = gradients.getTotalSize();
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    size_t i=0;
+    for(;i+3<size;i+=4){
+        const float32x4_t G = vld1q_f32(gradientsData+i);
+        const uint32x4_t positive = vcgtq_f32(vld1q_f32(activationsData+i),zero);
+        vst1q_f32(gradientsData+i,vbslq_f32(positive,G,vmulq_n_f32(G,0.01f)));
+    }
+    //scalar tail
+    for(;i<size;i++){
+        if(activationsData[i]<=0) gradientsData[i] *= 0.01f;
+    }
+}
+
+void CnnUtils::convolutionBlockedBackwards(const TensorView& paddedImage,const TensorView& kernel,const TensorView& resultGradients,
+    const TensorView& kernelGradients,const TensorView& paddedImageGradients,const int xStride,const int yStride){
+    if(paddedImage.getNumDimens()!=4 || resultGradients.getNumDimens()!=4){
+        throw std::invalid_argument("Image and result gradients must be blocked for convolutionBlockedBackwards");
+    }
+    if(kernel.getNumDimens()!=5 || kernel.getDimen(4)!=CHANNEL_BLOCK*CHANNEL_BLOCK){
+        throw std::invalid_argument("Kernel must be blocked with blockKernels for convolutionBlockedBackwards");
+    }
+    if(kernelGradients.getTotalSize()!=kernel.getTotalSize() || kernelGradients.getNumBiases()!=kernel.getNumBiases()){
+        throw std::invalid_argument("Kernel gradients must be the same shape as the kernel");
+    }
+    const bool imageGradients = paddedImageGradients.getData()!=nullptr;
+    if(imageGradients && paddedImageGradients.getTotalSize()!=paddedImage.getTotalSize()){
+        throw std::invalid_argument("Image gradients must be the same shape as the padded image");
+    }
+    const int numOutBlocks = kernel.getDimen(0);
+    const int numInBlocks = kernel.getDimen(1);
+    const int kernelHeight = kernel.getDimen(2);
+    const int kernelWidth = kernel.getDimen(3);
+    const int resHeight = resultGradients.getDimen(1);
+    const int resWidth = resultGradients.getDimen(2);
+    if(paddedImage.getDimen(0)!=numInBlocks || resultGradients.getDimen(0)!=numOutBlocks){
+        throw std::invalid_argument("The image, kernel and result gradients have mismatched channels");
+    }
+    const float *imageData = paddedImage.getData();
+    const float *kernelData = kernel.getData();
+    const float *gradientsData = resultGradients.getData();
+    float *kernelGradientsData = kernelGradients.getData();
+    float *biasGradientsData = kernelGradients.getBiases();
+    float *imageGradientsData = paddedImageGradients.getData();
+    const int imageChildSizes0 = paddedImage.getChildSize(0);
+    const int imageChildSizes1 = paddedImage.getChildSize(1);
+    const int kernelChildSizes0 = kernel.getChildSize(0);
+    const int kernelChildSizes1 = kernel.getChildSize(1);
+    const int kernelChildSizes2 = kernel.getChildSize(2);
+    const int gradientsChildSizes0 = resultGradients.getChildSize(0);
+    const int gradientsChildSizes1 = resultGradients.getChildSize(1);
+    const int xStep = xStride*CHANNEL_BLOCK;
+    if(imageGradients){
+        std::memset(imageGradientsData,0,sizeof(float)*paddedImageGradients.getTotalSize());
+    }
+
+    for(int o=0;o<numOutBlocks;o++){
+        const float *gradientsBlock = gradientsData + o*gradientsChildSizes0;
+        //Biases
+        float32x4_t biasSum = vdupq_n_f32(0.0f);
+        for(int newY=0;newY<resHeight;newY++){
+            for(int newX=0;newX<resWidth;newX++){
+                biasSum = vaddq_f32(biasSum,vld1q_f32(gradientsBlock + newY*gradientsChildSizes1 + newX*CHANNEL_BLOCK));
+            }
+        }
+        vst1q_f32(biasGradientsData + o*CHANNEL_BLOCK,vaddq_f32(vld1q_f32(biasGradientsData + o*CHANNEL_BLOCK),biasSum));
+        for(int i=0;i<numInBlocks;i++){
+            for(int j=0;j<kernelHeight;j++){
+                for(int k=0;k<kernelWidth;k++){
+                    const int kernelOffset = o*kernelChildSizes0 + i*kernelChildSizes1 + j*kernelChildSizes2 + k*CHANNEL_BLOCK*CHANNEL_BLOCK;
+                    //One vector of output channels per input channel, the same as K0-K3 in convolutionBlocked
+                    //Kept in registers for every output rather than read-modify-writing memory
+                    float32x4_t G0 = vdupq_n_f32(0.0f);
+                    float32x4_t G1 = vdupq_n_f32(0.0f);
+                    float32x4_t G2 = vdupq_n_f32(0.0f);
+                    float32x4_t G3 = vdupq_n_f32(0.0f);
+                    //Transposed, one vector of input channels per output channel
+                    const float32x4x4_t KT = vld4q_f32(kernelData + kernelOffset);
+                    for(int newY=0;newY<resHeight;newY++){
+                        const float *gradientsRow = gradientsBlock + newY*gradientsChildSizes1;
+                        const int imageRowOffset = i*imageChildSizes0 + (newY*yStride+j)*imageChildSizes1 + k*CHANNEL_BLOCK;
+                        const float *imageRow = imageData + imageRowOffset;
+                        float *imageGradientsRow = imageGradientsData + imageRowOffset;
+                        for(int newX=0;newX<resWidth;newX++){
+                            const float32x4_t D = vld1q_f32(gradientsRow + newX*CHANNEL_BLOCK);
+                            const float32x4_t R = vld1q_f32(imageRow + newX*xStep);
+                            G0 = vfmaq_laneq_f32(G0,D,R,0);
+                            G1 = vfmaq_laneq_f32(G1,D,R,1);
+                            G2 = vfmaq_laneq_f32(G2,D,R,2);
+                            G3 = vfmaq_laneq_f32(G3,D,R,3);
+                            if(imageGradients){
+                                float32x4_t IG = vld1q_f32(imageGradientsRow + newX*xStep);
+                                IG = vfmaq_laneq_f32(IG,KT.val[0],D,0);
+                                IG = vfmaq_laneq_f32(IG,KT.val[1],D,1);
+                                IG = vfmaq_laneq_f32(IG,KT.val[2],D,2);
+                                IG = vfmaq_laneq_f32(IG,KT.val[3],D,3);
+                                vst1q_f32(imageGradientsRow + newX*xStep,IG);
+                            }
+                        }
+                    }
+                    float *kernelGradientsPtr = kernelGradientsData + kernelOffset;
+                    vst1q_f32(kernelGradientsPtr,vaddq_f32(vld1q_f32(kernelGradientsPtr),G0));
+                    vst1q_f32(kernelGradientsPtr+4,vaddq_f32(vld1q_f32(kernelGradientsPtr+4),G1));
+                    vst1q_f32(kernelGradientsPtr+8,vaddq_f32(vld1q_f32(kernelGradientsPtr+8),G2));
+                    vst1q_f32(kernelGradientsPtr+12,vaddq_f32(vld1q_f32(kernelGradientsPtr+12),G3));
+                }
+            }
+        }
+    }
+}
+
+void CnnUtils::unpadImageBlocked(const TensorView& paddedBlockedImage,const TensorView& blockedImage){
+    if(blockedImage.getNumDimens()!=4 || paddedBlockedImage.getNumDimens()!=4){
+        throw std::invalid_argument("Blocked images must have 4 dimensions for unpadding");
+    }
+    if(blockedImage.getDimen(0)!=paddedBlockedImage.getDimen(0) || blockedImage.getDimen(3)!=paddedBlockedImage.getDimen(3)){
+        throw std::invalid_argument("Padded image must have the same channel blocks as the unpadded image");
+    }
+    const int numBlocks = blockedImage.getDimen(0);
+    const int imHeight = blockedImage.getDimen(1);
+    const int imWidth = blockedImage.getDimen(2);
+    const int yRadius = (paddedBlockedImage.getDimen(1)-imHeight)/2;
+    const int xRadius = (paddedBlockedImage.getDimen(2)-imWidth)/2;
+    if(yRadius<0 || xRadius<0){
+        throw std::invalid_argument("Padded image is smaller than the unpadded image");
+    }
+    const float *paddedData = paddedBlockedImage.getData();
+    const int paddedChildSizes0 = paddedBlockedImage.getChildSize(0);
+    const int paddedChildSizes1 = paddedBlockedImage.getChildSize(1);
+    float *imageData = blockedImage.getData();
+    const int imageChildSizes0 = blockedImage.getChildSize(0);
+    const int imageChildSizes1 = blockedImage.getChildSize(1);
+    const int rowBytes = imWidth*CHANNEL_BLOCK*sizeof(float);
+    for(int b=0;b<numBlocks;b++){
+        for(int y=0;y<imHeight;y++){
+            std::memcpy(
+                imageData + b*imageChildSizes0 + y*imageChildSizes1,
+                paddedData + b*paddedChildSizes0 + (y+yRadius)*paddedChildSizes1 + xRadius*CHANNEL_BLOCK,
+                rowBytes
+            );
+        }
+    }
+}
+
+void CnnUtils::maxPoolBlockedBackwards(const TensorView& resultGradients,const TensorView& imageGradients,const int *maxPoolIndices){
+    if(imageGradients.getNumDimens()!=4 || imageGradients.getDimen(3)!=CHANNEL_BLOCK){
+        throw std::invalid_argument("Image gradients must be blocked for maxPoolBlockedBackwards");
+    }
+    const bool blockedResult = resultGradients.getNumDimens()==4;
+    if(!blockedResult && resultGradients.getNumDimens()!=3){
+        throw std::invalid_argument("Result gradients must either be blocked or CHW for maxPoolBlockedBackwards");
+    }
+    if(maxPoolIndices==nullptr){
+        throw std::invalid_argument("maxPoolIndices are needed for maxPoolBlockedBackwards, they aren't recorded in inference mode");
+    }
+    const int imWidth = imageGradients.getDimen(2);
+    const int imageChildSizes0 = imageGradients.getChildSize(0);
+    const int imageChildSizes1 = imageGradients.getChildSize(1);
+    float *imageGradientsData = imageGradients.getData();
+    const float *gradientsData = resultGradients.getData();
+    const int resHeight = resultGradients.getDimen(1);
+    const int resWidth = resultGradients.getDimen(2);
+    const int resultChildSizes0 = resultGradients.getChildSize(0);
+    const int resultChildSizes1 = resultGradients.getChildSize(1);
+    std::memset(imageGradientsData,0,sizeof(float)*imageGradients.getTotalSize());
+    //Everything that wasn't the max has no effect on the output and so it keeps a 0 gradient
+    auto addGradient = [&](int channel,int index,float gradient){
+        imageGradientsData[(channel/CHANNEL_BLOCK)*imageChildSizes0 + (index/imWidth)*imageChildSizes1
+            + (index%imWidth)*CHANNEL_BLOCK + channel%CHANNEL_BLOCK] += gradient;
+    };
+    if(blockedResult){
+        for(int b=0;b<resultGradients.getDimen(0);b++){
+            for(int newY=0;newY<resHeight;newY++){
+                for(int newX=0;newX<resWidth;newX++){
+                    const int resultIndex = b*resultChildSizes0 + newY*resultChildSizes1 + newX*CHANNEL_BLOCK;
+                    for(int c=0;c<CHANNEL_BLOCK;c++){
+                        addGradient(b*CHANNEL_BLOCK+c,maxPoolIndices[resultIndex+c],gradientsData[resultIndex+c]);
+                    }
+                }
+            }
+        }
+        return;
+    }
+    const int resArea = resHeight*resWidth;
+    for(int channel=0;channel<resultGradients.getDimen(0);channel++){
+        for(int newY=0;newY<resHeight;newY++){
+            for(int newX=0;newX<resWidth;newX++){
+                addGradient(channel,maxPoolIndices[channel*resArea + newY*resWidth + newX],
+                    gradientsData[channel*resultChildSizes0 + newY*resultChildSizes1 + newX]);
+            }
+        }
+    }
+}
+
+void CnnUtils::fullyConnectedBackwards(const TensorView& layerWeights,const float *prev,const float *currGradients,const TensorView& layerGradients,float *prevGradients){
+    if(layerWeights.getNumDimens()!=2 || layerGradients.getNumDimens()!=2){
+        throw std::invalid_argument("Weights and their gradients must have 2 dimensions for fullyConnectedBackwards");
+    }
+    const int numOut = layerWeights.getDimen(0);
+    const int numIn = layerWeights.getDimen(1);
+    if(layerGradients.getDimen(0)!=numOut || layerGradients.getDimen(1)!=numIn || layerGradients.getNumBiases()!=numOut){
+        throw std::invalid_argument("Weight gradients must be the same shape as the weights");
+    }
+    const float *weightsData = layerWeights.getData();
+    float *gradientsData = layerGradients.getData();
+    float *biasGradientsData = layerGradients.getBiases();
+    const int weightsChildSizes0 = layerWeights.getChildSize(0);
+    const int gradientsChildSizes0 = layerGradients.getChildSize(0);
+    if(prevGradients!=nullptr) std::memset(prevGradients,0,sizeof(float)*numIn);
+    //A row at a time so that both the weights and their gradients are read in order
+    for(int i=0;i<numOut;i++){
+        const float gradient = currGradients[i];
+        if(gradient==0.0f) continue; //nothing to add
+        biasGradientsData[i] += gradient;
+        const float* __restrict__ weightsRow = weightsData + i*weightsChildSizes0;
+        float* __restrict__ gradientsRow = gradientsData + i*gradientsChildSizes0;
+        int j=0;
+        for(;j+3<numIn;j+=4){
+            vst1q_f32(gradientsRow+j,vfmaq_n_f32(vld1q_f32(gradientsRow+j),vld1q_f32(prev+j),gradient));
+            if(prevGradients!=nullptr){
+                vst1q_f32(prevGradients+j,vfmaq_n_f32(vld1q_f32(prevGradients+j),vld1q_f32(weightsRow+j),gradient));
+            }
+        }
+        //scalar tail
+        for(;j<numIn;j++){
+            gradientsRow[j] += prev[j]*gradient;
+            if(prevGradients!=nullptr) prevGradients[j] += weightsRow[j]*gradient;
+        }
+    }
+}
+
+//----------------------------------------------------
+//TRAINING
+
+void CnnUtils::allocateGradients(){
+    blockedKernelGradients = zeroedCopies(blockedKernels);
+    weightGradients = zeroedCopies(weights);
+    activationGradients = zeroedCopies(activations);
+    mapGradients = std::vector<Tensor>(maps.size());
+    for(int l=1;l<maps.size();l++){
+        mapGradients[l] = Tensor(maps[l].getDimens());
+    }
+    paddedMapGradients = std::vector<Tensor>(paddedMaps.size());
+    for(int l=1;l<paddedMaps.size();l++){
+        paddedMapGradients[l] = Tensor(paddedMaps[l].getDimens());
+    }
+}
+
+//Sums one part of every worker's gradients into the velocity, steps the weights and zeroes the gradients
+static void applyGradientsPart(float *params,float *velocities,const std::vector<float*>& workerGradients,size_t size,
+    int part,int numParts,float scale,float learningRate,float momentum){
+    //Parts are whole vectors so that two threads never store to the same vector
+    const size_t partSize = ((size+numParts-1)/numParts+3) & ~(size_t)3;
+    const size_t start = std::min(size,part*partSize);
+    const size_t end = std::min(size,start+partSize);
+    size_t i=start;
+    for(;i+3<end;i+=4){
+        float32x4_t sum = vdupq_n_f32(0.0f);
+        for(float *gradients : workerGradients){
+            sum = vaddq_f32(sum,vld1q_f32(gradients+i));
+            vst1q_f32(gradients+i,vdupq_n_f32(0.0f));
+        }
+        //v = momentum*v + mean gradient, w -= learningRate*v
+        const float32x4_t V = vfmaq_n_f32(vmulq_n_f32(sum,scale),vld1q_f32(velocities+i),momentum);
+        vst1q_f32(velocities+i,V);
+        vst1q_f32(params+i,vfmaq_n_f32(vld1q_f32(params+i),V,-learningRate));
+    }
+    //scalar tail, only the last part can have one
+    for(;i<end;i++){
+        float sum = 0.0f;
+        for(float *gradients : workerGradients){
+            sum += gradients[i];
+            gradients[i] = 0.0f;
+        }
+        velocities[i] = momentum*velocities[i] + sum*scale;
+        params[i] -= learningRate*velocities[i];
+    }
+}
+
+void CnnUtils::applyGradients(const std::vector<CNN*>& workers,int part,int numParts,int batchSize,float learningRate,float momentum){
+    const float scale = 1.0f/batchSize;
+    std::vector<float*> workerGradients(workers.size());
+    //The weights are shared with the workers and so stepping them here updates every worker
+    for(int l=0;l<blockedKernels.size();l++){
+        for(int w=0;w<workers.size();w++) workerGradients[w] = workers[w]->blockedKernelGradients[l].getData();
+        applyGradientsPart(blockedKernels[l].getData(),blockedKernelVelocities[l].getData(),workerGradients,
+            blockedKernels[l].getTotalSize(),part,numParts,scale,learningRate,momentum);
+        for(int w=0;w<workers.size();w++) workerGradients[w] = workers[w]->blockedKernelGradients[l].getBiases()->getData();
+        applyGradientsPart(blockedKernels[l].getBiases()->getData(),blockedKernelVelocities[l].getBiases()->getData(),workerGradients,
+            blockedKernels[l].getBiases()->getTotalSize(),part,numParts,scale,learningRate,momentum);
+    }
+    for(int l=0;l<weights.size();l++){
+        for(int w=0;w<workers.size();w++) workerGradients[w] = workers[w]->weightGradients[l].getData();
+        applyGradientsPart(weights[l].getData(),weightVelocities[l].getData(),workerGradients,
+            weights[l].getTotalSize(),part,numParts,scale,learningRate,momentum);
+        for(int w=0;w<workers.size();w++) workerGradients[w] = workers[w]->weightGradients[l].getBiases()->getData();
+        applyGradientsPart(weights[l].getBiases()->getData(),weightVelocities[l].getBiases()->getData(),workerGradients,
+            weights[l].getBiases()->getTotalSize(),part,numParts,scale,learningRate,momentum);
+    }
+}
+
+void CnnUtils::unblockKernels(const std::vector<Tensor>& blockedLayerKernels,std::vector<Tensor>& layerKernels){
+    if(blockedLayerKernels.size()!=layerKernels.size()){
+        throw std::invalid_argument("Blocked kernels and kernels must have the same number of layers");
+    }
+    for(int l=0;l<layerKernels.size();l++){
+        const std::vector<int>& kernelDimens = layerKernels[l].getDimens();
+        const int numOutChans = kernelDimens[0];
+        const int numInChans = kernelDimens[1];
+        const int height = kernelDimens[2];
+        const int width = kernelDimens[3];
+        const float *blockedData = blockedLayerKernels[l].getData();
+        const std::vector<int>& blockedChildSizes = blockedLayerKernels[l].getChildSizes();
+        float *kernelData = layerKernels[l].getData();
+        const std::vector<int>& kernelChildSizes = layerKernels[l].getChildSizes();
+        //Same indexing as blockKernels
+        for(int o=0;o<numOutChans;o++){
+            int blockedOutBlock = (o/CHANNEL_BLOCK)*blockedChildSizes[0] + o%CHANNEL_BLOCK;
+            for(int i=0;i<numInChans;i++){
+                int blockedInBlock = blockedOutBlock + (i/CHANNEL_BLOCK)*blockedChildSizes[1] + (i%CHANNEL_BLOCK)*CHANNEL_BLOCK;
+                float *kernelChannel = kernelData + o*kernelChildSizes[0] + i*kernelChildSizes[1];
+                for(int y=0;y<height;y++){
+                    for(int x=0;x<width;x++){
+                        kernelChannel[y*kernelChildSizes[2]+x] = blockedData[blockedInBlock + y*blockedChildSizes[2] + x*blockedChildSizes[3]];
+                    }
+                }
+            }
+        }
+        Tensor *kernelBiases = layerKernels[l].getBiases();
+        if(kernelBiases!=nullptr){
+            //The blocked biases are padded at the end
+            std::memcpy(kernelBiases->getData(),blockedLayerKernels[l].getBiases()->getData(),sizeof(float)*kernelBiases->getTotalSize());
+        }
+    }
+}
+
 //----------------------------------------------------
 //MATHS UTILS
 
@@ -912,16 +1786,16 @@ void CnnUtils::reset(){
     }
 }
 
-std::vector<Tensor> CnnUtils::loadKernels(
+std::vector<Tensor> CnnUtils::loadKernels(const std::string& modelDir
 #if PROFILING
-    Timer *parentTimer
+    ,Timer *parentTimer
 #endif 
 ){
    	 #if PROFILING
         	Timer *loadKernelsTimer = nullptr;
         	if(parentTimer) loadKernelsTimer = parentTimer->addChildTimer("loadKernels");
    	#endif
-        std::ifstream kernelsFile(currDir+"/res/kernelWeights.json");
+        std::ifstream kernelsFile(modelDir+"/kernelWeights.json");
         nlohmann::json jsonKernels;
         kernelsFile >> jsonKernels;
         kernelsFile.close();
@@ -935,7 +1809,7 @@ std::vector<Tensor> CnnUtils::loadKernels(
             int width = kernelsVec[i][0][0][0].size();
             result[i] = Tensor({numOutChans,numInChans,height,width});
             float* __restrict__ resultIPtr = result[i].getData();
-            std::vector<int> childSizes = result[i].getChildSizes();
+            const std::vector<int>& childSizes = result[i].getChildSizes();
             for(int j=0;j<numOutChans;j++){
                 float* __restrict__ resultJPtr = resultIPtr+j*childSizes[0];
                 for(int k=0;k<numInChans;k++){
@@ -949,7 +1823,7 @@ std::vector<Tensor> CnnUtils::loadKernels(
                 }
             }
         }
-        std::ifstream kernelBiasesFile(currDir+"/res/kernelBiases.json");
+        std::ifstream kernelBiasesFile(modelDir+"/kernelBiases.json");
         nlohmann::json jsonBiases;
         kernelBiasesFile >> jsonBiases;
         kernelBiasesFile.close();
@@ -966,7 +1840,7 @@ std::vector<Tensor> CnnUtils::loadKernels(
             result[i].setBiases(biases);
         }
         #if DEBUG
-            std::cout << "Loaded kernels" << std::endl;
+            logDebug("Loaded kernels");
         #endif
         #if PROFILING
             if(parentTimer) loadKernelsTimer->stop("(loadOld)");
@@ -974,9 +1848,9 @@ std::vector<Tensor> CnnUtils::loadKernels(
         return result;
 }
 
-std::vector<Tensor> CnnUtils::loadWeights(
+std::vector<Tensor> CnnUtils::loadWeights(const std::string& modelDir
 #if PROFILING
-    Timer *parentTimer
+    ,Timer *parentTimer
 #endif 
 ){
     	//Each layer of weights is a tensor
@@ -984,7 +1858,7 @@ std::vector<Tensor> CnnUtils::loadWeights(
   		Timer *loadWeightsTimer = nullptr;
         	if(parentTimer) loadWeightsTimer = parentTimer->addChildTimer("loadWeights");
     	#endif
-        std::ifstream weightsFile(currDir+"/res/mlpWeights.json");
+        std::ifstream weightsFile(modelDir+"/mlpWeights.json");
         nlohmann::json jsonWeights;
         weightsFile >> jsonWeights;
         weightsFile.close();
@@ -994,7 +1868,7 @@ std::vector<Tensor> CnnUtils::loadWeights(
         for(int i=0;i<weightsVec.size();i++){
             result[i] = Tensor({(int)weightsVec[i].size(),(int)weightsVec[i][0].size()});
             float* __restrict__ resultIPtr = result[i].getData();
-            std::vector<int> childSizes = result[i].getChildSizes();
+            const std::vector<int>& childSizes = result[i].getChildSizes();
             const int childSizes0 = childSizes[0];
             for(int j=0;j<weightsVec[i].size();j++){
                 float* __restrict resultJPtr = resultIPtr + j*childSizes0;
@@ -1003,7 +1877,7 @@ std::vector<Tensor> CnnUtils::loadWeights(
                 }
             }
         }
-        std::ifstream mlpBiasesFile(currDir+"/res/mlpBiases.json");
+        std::ifstream mlpBiasesFile(modelDir+"/mlpBiases.json");
         nlohmann::json jsonBiases;
         mlpBiasesFile >> jsonBiases;
         mlpBiasesFile.close();
@@ -1022,8 +1896,228 @@ std::vector<Tensor> CnnUtils::loadWeights(
             if(parentTimer) loadWeightsTimer->stop("(loadOld)");
         #endif
         #if DEBUG
-            std::cout << "Loaded weights" << std::endl;
+            logDebug("Loaded weights");
         #endif
         return result;
 }
 
+std::unique_ptr<modelSlot> CnnUtils::loadModel(const std::string& modelDir){
+    std::unique_ptr<modelSlot> model = std::make_unique<modelSlot>();
+    model->kernels = loadKernels(modelDir);
+    model->blockedKernels = blockKernels(model->kernels);
+    model->weights = loadWeights(modelDir);
+    for(int l=0;l<model->blockedKernels.size();l++){
+        model->kernelSparsity.push_back(findKernelSparsity(model->blockedKernels[l]));
+    }
+    for(int l=0;l<model->weights.size();l++){
+        model->weightSparsity.push_back(findWeightSparsity(model->weights[l]));
+    }
+    return model;
+}
+
+void CnnUtils::checkModel(const modelSlot& model) const{
+    //Indexed by layer, the same as forwards
+    if(model.kernels.size()!=kernelSizes.size()){
+        throw std::invalid_argument("Model has the wrong number of kernel layers");
+    }
+    for(int l=0;l<kernelSizes.size();l++){
+        if(kernelSizes[l].first==0 || kernelSizes[l].second==0) continue; //pooling
+        const std::vector<int>& kernelDimens = model.kernels[l].getDimens();
+        if(kernelDimens.size()!=4 || kernelDimens[0]!=mapDimens[l+1].c || kernelDimens[1]!=mapDimens[l].c
+        || kernelDimens[2]!=kernelSizes[l].first || kernelDimens[3]!=kernelSizes[l].second){
+            throw std::invalid_argument("Kernel layer "+std::to_string(l)+" does not match the architecture");
+        }
+        const Tensor *kernelBiases = model.kernels[l].getBiases();
+        if(kernelBiases==nullptr || kernelBiases->getTotalSize()!=kernelDimens[0]){
+            throw std::invalid_argument("Kernel layer "+std::to_string(l)+" has the wrong number of biases");
+        }
+    }
+    if(model.weights.size()!=numNeurons.size()-1){
+        throw std::invalid_argument("Model has the wrong number of MLP layers");
+    }
+    for(int l=0;l<model.weights.size();l++){
+        const std::vector<int>& weightDimens = model.weights[l].getDimens();
+        const Tensor *weightBiases = model.weights[l].getBiases();
+        if(weightDimens.size()!=2 || weightDimens[0]!=numNeurons[l+1] || weightDimens[1]!=numNeurons[l]
+        || weightBiases==nullptr || weightBiases->getTotalSize()!=numNeurons[l+1]){
+            throw std::invalid_argument("MLP layer "+std::to_string(l)+" does not match the architecture");
+        }
+    }
+}
+
+void CnnUtils::swapModel(modelSlot& model){
+    std::swap(kernels,model.kernels);
+    std::swap(blockedKernels,model.blockedKernels);
+    std::swap(weights,model.weights);
+    std::swap(kernelSparsity,model.kernelSparsity);
+    std::swap(weightSparsity,model.weightSparsity);
+}
+
+void CnnUtils::swapInStandbyModel(){
+    //Cheap check first, this is every frame
+    if(!standbyReady.load(std::memory_order_acquire)) return;
+    std::unique_lock<std::mutex> lock(standbyMutex,std::try_to_lock);
+    if(!lock.owns_lock() || !standbyReady) return; //try again next frame
+    swapModel(*standbyModel);
+    standbyReady = false;
+    //The old model is now in standbyModel, it is freed by the next load rather than here
+    //This is on the inference thread, so it mustn't wait for stdout
+    logInfo("Swapped in the new model");
+}
+
+bool CnnUtils::loadModelAsync(const std::string& modelDir){
+    if(modelLoading.exchange(true)) return false;
+    //The previous loader has finished (modelLoading was false) and so this doesn't wait
+    if(modelLoader.joinable()) modelLoader.join();
+    modelLoader = std::thread([this,modelDir](){
+        try{
+            std::unique_ptr<modelSlot> model = loadModel(modelDir);
+            checkModel(*model);
+            std::unique_ptr<modelSlot> oldModel;
+            {
+                std::lock_guard<std::mutex> lock(standbyMutex);
+                oldModel = std::move(standbyModel);
+                standbyModel = std::move(model);
+                standbyReady.store(true,std::memory_order_release);
+            }
+            //oldModel is freed here, on this thread, once the lock is released
+            logInfo("Loaded new model from %s",modelDir);
+        }
+        catch(const std::exception& e){
+            logError("Failed to load the model from %s, keeping the current one: %s",modelDir,e.what());
+        }
+        modelLoading = false;
+    });
+    return true;
+}
+
+CnnUtils::~CnnUtils(){
+    if(modelLoader.joinable()) modelLoader.join();
+}
+
+//Writes a temporary file and renames it so that a reload never sees half a file
+static void saveJson(const std::string& fname,const nlohmann::json& json){
+    const std::string tempFname = fname+".tmp";
+    std::ofstream file(tempFname);
+    if(!file){
+        throw std::runtime_error("Could not open file "+tempFname);
+    }
+    file << json;
+    file.close();
+    if(std::rename(tempFname.c_str(),fname.c_str())!=0){
+        throw std::runtime_error("Could not replace "+fname);
+    }
+}
+
+void CnnUtils::saveModel(const std::string& modelDir) const{
+    //The same formats as loadKernels and loadWeights
+    d5 kernelsVec;
+    d2 kernelBiasesVec;
+    for(int l=0;l<kernels.size();l++){
+        kernelsVec.push_back(kernels[l].toVector<d4>());
+        kernelBiasesVec.push_back(kernels[l].getBiases()->toVector<d1>());
+    }
+    d3 weightsVec;
+    d2 mlpBiasesVec;
+    for(int l=0;l<weights.size();l++){
+        weightsVec.push_back(weights[l].toVector<d2>());
+        mlpBiasesVec.push_back(weights[l].getBiases()->toVector<d1>());
+    }
+    saveJson(modelDir+"/kernelWeights.json",kernelsVec);
+    saveJson(modelDir+"/kernelBiases.json",kernelBiasesVec);
+    saveJson(modelDir+"/mlpWeights.json",weightsVec);
+    saveJson(modelDir+"/mlpBiases.json",mlpBiasesVec);
+    std::cout << "Saved the model to " << modelDir << std::endl;
+}
+
+std::vector<Tensor> CnnUtils::zeroedCopies(const std::vector<Tensor>& tensors){
+    std::vector<Tensor> result(tensors.size());
+    for(int i=0;i<tensors.size();i++){
+        result[i] = Tensor(tensors[i].getDimens());
+        Tensor *biases = tensors[i].getBiases();
+        if(biases!=nullptr){
+            Tensor zeroedBiases(biases->getDimens());
+            result[i].setBiases(zeroedBiases);
+        }
+    }
+    return result;
+}
+
+void CnnUtils::findSparsity(){
+    kernelSparsity = std::vector<blockSparsity>(blockedKernels.size());
+    for(int l=0;l<blockedKernels.size();l++){
+        kernelSparsity[l] = findKernelSparsity(blockedKernels[l]);
+    }
+    weightSparsity = std::vector<blockSparsity>(weights.size());
+    for(int l=0;l<weights.size();l++){
+        weightSparsity[l] = findWeightSparsity(weights[l]);
+    }
+    #if DEBUG
+        for(int l=0;l<kernelSparsity.size();l++){
+            std::cout << "Kernels " << l << ": " << kernelSparsity[l].density*100 << "% of blocks kept" << std::endl;
+        }
+        for(int l=0;l<weightSparsity.size();l++){
+            std::cout << "Weights " << l << ": " << weightSparsity[l].density*100 << "% of blocks kept" << std::endl;
+        }
+    #endif
+}
+
+blockSparsity CnnUtils::findKernelSparsity(const Tensor& blockedKernel){
+    //A block is every weight from 4 input channels to 4 output channels
+    //so a pruned input or output channel shows up as a run of zero blocks
+    const std::vector<int>& kernelDimens = blockedKernel.getDimens();
+    const std::vector<int>& kernelChildSizes = blockedKernel.getChildSizes();
+    const int numOutBlocks = kernelDimens[0];
+    const int numInBlocks = kernelDimens[1];
+    const float *kernelData = blockedKernel.getData();
+    blockSparsity result;
+    result.rowStarts.push_back(0);
+    for(int o=0;o<numOutBlocks;o++){
+        for(int i=0;i<numInBlocks;i++){
+            const float *block = kernelData + o*kernelChildSizes[0] + i*kernelChildSizes[1];
+            for(int k=0;k<kernelChildSizes[1];k++){
+                if(block[k]!=0.0f){
+                    result.cols.push_back(i);
+                    break;
+                }
+            }
+        }
+        result.rowStarts.push_back(result.cols.size());
+    }
+    result.density = (float) result.cols.size()/(numOutBlocks*numInBlocks);
+    if(result.density>SPARSE_DENSITY_THRESHOLD){
+        result.rowStarts.clear();
+        result.cols.clear();
+    }
+    return result;
+}
+
+blockSparsity CnnUtils::findWeightSparsity(const Tensor& layerWeights){
+    const std::vector<int>& weightsDimens = layerWeights.getDimens();
+    const int numOut = weightsDimens[0];
+    const int numIn = weightsDimens[1];
+    const int rowPitch = layerWeights.getChildSizes()[0];
+    const int numBlocks = (numIn+MLP_SPARSE_BLOCK-1)/MLP_SPARSE_BLOCK;
+    const float *weightsData = layerWeights.getData();
+    blockSparsity result;
+    result.rowStarts.push_back(0);
+    for(int i=0;i<numOut;i++){
+        const float *row = weightsData + i*rowPitch;
+        for(int b=0;b<numBlocks;b++){
+            const int blockEnd = std::min((b+1)*MLP_SPARSE_BLOCK,numIn);
+            for(int j=b*MLP_SPARSE_BLOCK;j<blockEnd;j++){
+                if(row[j]!=0.0f){
+                    result.cols.push_back(b);
+                    break;
+                }
+            }
+        }
+        result.rowStarts.push_back(result.cols.size());
+    }
+    result.density = (float) result.cols.size()/(numOut*numBlocks);
+    if(result.density>SPARSE_DENSITY_THRESHOLD){
+        result.rowStarts.clear();
+        result.cols.clear();
+    }
+    return result;
+}
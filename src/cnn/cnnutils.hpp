@@ -7,14 +7,56 @@
 #include <cstdlib>
 #include <limits>
 #include <numbers>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
 #include "globals.hpp"
 #include "tensor.hpp"
+#include "tensorview.hpp"
 #include <arm_neon.h>
 
 #if PROFILING
     #include "timer.hpp"
 #endif
 
+//Channels per block in the blocked (NCHWc) layout, one NEON register
+#define CHANNEL_BLOCK 4
+
+//Weights are skipped a block at a time, 16 inputs is 4 NEON registers
+#define MLP_SPARSE_BLOCK 16
+//Layers with more of their blocks than this are run densely as the indirection isn't worth it
+#define SPARSE_DENSITY_THRESHOLD 0.9f
+
+//Which blocks of a layer's weights are not all zero, like a compressed sparse row matrix
+//Row r's blocks are cols[rowStarts[r]] to cols[rowStarts[r+1]-1]
+//A row is an output block for kernels and an output neuron for MLP weights
+typedef struct blockSparsity{
+    std::vector<int> rowStarts; //empty means the layer is run densely
+    std::vector<int> cols;
+    float density = 1.0f; //fraction of blocks that are kept
+}blockSparsity;
+
+//Everything that changes when a new model is swapped in
+//The architecture (mapDimens, kernelSizes etc.) stays the same and so the maps can be reused
+typedef struct modelSlot{
+    std::vector<Tensor> kernels;
+    std::vector<Tensor> blockedKernels;
+    std::vector<Tensor> weights;
+    std::vector<blockSparsity> kernelSparsity;
+    std::vector<blockSparsity> weightSparsity;
+}modelSlot;
+
+//Precomputed taps for resizing along one axis
+//Every output has the same number of taps, the ones it doesn't need have a 0 weight
+typedef struct resizeAxis{
+    int inSize = 0;
+    int outSize = 0;
+    int numTaps = 0;
+    std::vector<int> starts; //first input used by each output
+    std::vector<float> weights; //[outSize][numTaps]
+}resizeAxis;
+
 typedef struct dimens{
     int c;
     int h;
@@ -27,66 +69,169 @@ class CnnUtils {
     protected:
         //Things with mutliple layers are stored as vectors as each layer can have different sized tensors
         std::vector<Tensor> kernels; //the kernels are stored [layer][currLayerChannel][prevLayerChannel][y][x] 
+        std::vector<Tensor> blockedKernels; //the same kernels repacked for the blocked layout, see blockKernels
         std::vector<Tensor> activations;
         std::vector<Tensor> weights;
-        std::vector<Tensor> maps; //Note: the input image is included in "maps" for simplicity
-        std::vector<Tensor> paddedMaps; //Reusing padding is better than allocating for every convolutions
+        std::vector<Tensor> maps; //Note: the input image is included in "maps" for simplicity, it is the only one in CHW, the rest are blocked
+        std::vector<Tensor> paddedMaps; //Reusing padding is better than allocating for every convolutions, blocked layout
         d2 pixelStats;
         std::vector<int> numNeurons;
         std::vector<dimens> mapDimens; //c,h,w - includes the result of pooling (except final pooling)
         std::vector<std::pair<int,int>> kernelSizes; //0 represents a pooling layer, the last one is excluded
         std::vector<std::pair<int,int>> strides; //pooling strides are included
         std::vector<std::unique_ptr<int[]>> maxPoolIndices;
+        std::vector<blockSparsity> kernelSparsity; //per layer, over blockedKernels' [outBlock][inBlock]
+        std::vector<blockSparsity> weightSparsity; //per layer, over MLP_SPARSE_BLOCK inputs of each output neuron
+        //Worked out for the first frame of each input size rather than every frame
+        resizeAxis resizeX;
+        resizeAxis resizeY;
+        bool inferenceMode = true; //only training needs maxPoolIndices and so they aren't recorded in inference mode
         bool padding;
+        //The members above are the active model, this is the other slot
+        //A new model is loaded into it in the background and then swapped in between frames
+        std::unique_ptr<modelSlot> standbyModel;
+        std::mutex standbyMutex; //only held for the move in and the swap, forwards never waits on it
+        std::atomic<bool> standbyReady{false};
+        std::atomic<bool> modelLoading{false};
+        std::thread modelLoader;
+        //TRAINING - only allocated by allocateGradients, inference never touches these
+        //Same shapes (and biases) as what they are the gradients of
+        std::vector<Tensor> blockedKernelGradients;
+        std::vector<Tensor> weightGradients;
+        std::vector<Tensor> mapGradients; //[0] isn't used as the image doesn't need a gradient
+        std::vector<Tensor> paddedMapGradients; //[0] isn't used either
+        std::vector<Tensor> activationGradients;
+        //Momentum, only the CNN that owns the weights has these, not its workers
+        std::vector<Tensor> blockedKernelVelocities;
+        std::vector<Tensor> weightVelocities;
 
         //UTILS
         void reset();
-        std::vector<Tensor> loadKernels(
+        static std::vector<Tensor> loadKernels(const std::string& modelDir = currDir+"/res"
         #if PROFILING
-            Timer *parentTimer = nullptr
+            ,Timer *parentTimer = nullptr
         #endif 
         );
-        std::vector<Tensor> loadWeights(
+        static std::vector<Tensor> loadWeights(const std::string& modelDir = currDir+"/res"
         #if PROFILING
-            Timer *parentTimer = nullptr
+            ,Timer *parentTimer = nullptr
         #endif 
         );
+        //Loads, blocks and finds the sparsity of a model, everything the active model needs before a frame can use it
+        static std::unique_ptr<modelSlot> loadModel(const std::string& modelDir);
+        //Throws if the model doesn't fit this CNN's architecture
+        void checkModel(const modelSlot& model) const;
+        //Swaps the active model with model, O(1) as only the vectors' pointers move
+        void swapModel(modelSlot& model);
+        //Called between frames, swaps in the standby model if one is ready
+        //Never blocks, if the loader has the lock it'll be picked up next frame
+        void swapInStandbyModel();
+        void saveModel(const std::string& modelDir) const;
+        //Same shapes and biases but zeroed
+        static std::vector<Tensor> zeroedCopies(const std::vector<Tensor>& tensors);
+
+        //TRAINING
+        void allocateGradients();
+        //Sums every worker's gradients for one part of the weights, steps the (shared) weights and zeroes the gradients
+        //Each thread does a different part and so no locks are needed
+        void applyGradients(const std::vector<CNN*>& workers,int part,int numParts,int batchSize,float learningRate,float momentum);
+        //Finds the zero blocks in blockedKernels and weights so that pruned models skip them
+        //Has to be redone if the weights change
+        void findSparsity();
 
     public:
+        ~CnnUtils();
+        //Loads the model in modelDir on a background thread, it is swapped in at the start of the next forwards once it's ready
+        //Returns false (and does nothing) if a load is already in progress
+        //A model that fails to load or doesn't fit is logged and the current model is kept
+        bool loadModelAsync(const std::string& modelDir);
+        bool isModelLoading() const{ return modelLoading; }
+
         //IMAGE-RELATED
-        Tensor parseImg(const Tensor& img
+        //Resizes (if needed) straight into result, which is the model's input map
+        void parseImg(const TensorView& img,const TensorView& result
         #if PROFILING
             ,Timer *parentTimer = nullptr
         #endif
-        ) const;
+        );
+        //Area weights for shrinking (every input pixel counts), bilinear for enlarging
+        static resizeAxis resizeCoefficients(int inSize,int outSize);
+        //Separable, each output row is the y taps of the input rows and then the x taps of that
+        static void resizeImg(const TensorView& img,const TensorView& result,const resizeAxis& xAxis,const resizeAxis& yAxis);
         void normaliseImg(Tensor& img
         #if PROFILING
             ,Timer *parentTimer = nullptr
         #endif 
         );
         static Tensor gaussianBlurKernel(int width,int height);
-        static Tensor maxPool(Tensor& image,int xStride,int yStride);
-        Tensor maxPool(Tensor& image,int xStride,int yStride,int *maxPoolIndices);
-        //variable size output
-        static Tensor convolution(const Tensor& image,Tensor& kernel,int xStride,int yStride,bool padding
+        static Tensor maxPool(const TensorView& image,int xStride,int yStride);
+        static Tensor maxPool(const TensorView& image,int xStride,int yStride,int *maxPoolIndices);
+        //Writes into result, maxPoolIndices are only recorded if it isn't nullptr
+        static void maxPool(const TensorView& image,const TensorView& result,int xStride,int yStride,int *maxPoolIndices = nullptr);
+        //paddedImage doesn't need to contain the image data, it just needs to be the correct size
+        static void padImage(const TensorView& image,const TensorView& paddedImage);
+        //Writes into result which must be zeroed and the correct size
+        //Reusing the output and padding is better than allocating for every convolution
+        static void convolution(const TensorView& paddedImage,const TensorView& kernel,const TensorView& result,const int xStride,const int yStride
         #if PROFILING
             ,Timer *parentTimer = nullptr
         #endif
         );
-        //Saving the padding allocation
-        //prePaddingImage doesn't contain the image data, it just needs to be the correct size
-        Tensor convolution(const Tensor& image,Tensor& prePaddedImage,Tensor& kernel,const int xStride,const int yStride
+        //variable size output
+        static Tensor convolution(const TensorView& image,const TensorView& kernel,int xStride,int yStride,bool padding
         #if PROFILING
-            ,Timer *parentTimer
+            ,Timer *parentTimer = nullptr
         #endif
         );
         //fixed size output
-        static Tensor convolution(Tensor& image,Tensor& kernel,int xStride,int yStride,int newWidth,int newHeight,bool padding
+        static Tensor convolution(const TensorView& image,const TensorView& kernel,int xStride,int yStride,int newWidth,int newHeight,bool padding
         #if PROFILING
             ,Timer *parentTimer = nullptr
         #endif
         );
 
+        //BLOCKED LAYOUT
+        //[C/CHANNEL_BLOCK][H][W][CHANNEL_BLOCK] so that one NEON load gets 4 channels of a pixel
+        static inline int numChannelBlocks(int channels){ return (channels+CHANNEL_BLOCK-1)/CHANNEL_BLOCK; }
+        //[outBlock][inBlock][y][x][inChannel*CHANNEL_BLOCK+outChannel], the biases are padded to whole blocks
+        static std::vector<Tensor> blockKernels(const std::vector<Tensor>& layerKernels);
+        //The inverse of blockKernels, training updates blockedKernels and so this is needed before saving
+        static void unblockKernels(const std::vector<Tensor>& blockedLayerKernels,std::vector<Tensor>& layerKernels);
+        //CHW image into a blocked image with a zeroed border if paddedBlockedImage is bigger
+        static void blockImage(const TensorView& image,const TensorView& paddedBlockedImage);
+        static void padImageBlocked(const TensorView& blockedImage,const TensorView& paddedBlockedImage);
+        //Does every output channel at once, result must be the correct size but doesn't need to be zeroed
+        //Only the input blocks in sparsity are used if it isn't nullptr
+        static void convolutionBlocked(const TensorView& paddedImage,const TensorView& kernel,const TensorView& result,const int xStride,const int yStride,const blockSparsity *sparsity = nullptr);
+        //rowStarts is left empty if the kernel is dense enough to not be worth skipping blocks
+        static blockSparsity findKernelSparsity(const Tensor& blockedKernel);
+        //result can either be blocked or CHW, CHW is used for the flatten into activations[0]
+        //maxPoolIndices have the same layout as result, each is y*width+x in the image's channel, they are not recorded if it is nullptr
+        static void maxPoolBlocked(const TensorView& image,const TensorView& result,int xStride,int yStride,int *maxPoolIndices = nullptr);
+
+        //MLP
+        //curr = weights*prev + biases (then leaky ReLU'd if relu)
+        //Only the blocks in sparsity are used if it isn't nullptr
+        static void fullyConnected(const TensorView& layerWeights,const float *prev,float *curr,bool relu,const blockSparsity *sparsity = nullptr);
+        static blockSparsity findWeightSparsity(const Tensor& layerWeights);
+
+        //BACKPROPAGATION
+        //Gradients of weights are added to so that a worker can accumulate a whole minibatch
+        //Gradients of images and activations are written over
+        //gradients *= leakyRelu'(x), the outputs have the same sign as x and so they can be used instead
+        //Both must be contiguous, i.e. not pitched
+        static void leakyReluBackwards(const TensorView& activations,const TensorView& gradients);
+        //paddedImageGradients is skipped if it has no data (the first layer doesn't need it)
+        static void convolutionBlockedBackwards(const TensorView& paddedImage,const TensorView& kernel,const TensorView& resultGradients,
+            const TensorView& kernelGradients,const TensorView& paddedImageGradients,const int xStride,const int yStride);
+        //The inverse of padImageBlocked, the padding's gradients are dropped
+        static void unpadImageBlocked(const TensorView& paddedBlockedImage,const TensorView& blockedImage);
+        //Sends each gradient back to where its max came from
+        //resultGradients and maxPoolIndices are either blocked or CHW as in maxPoolBlocked, imageGradients is blocked
+        static void maxPoolBlockedBackwards(const TensorView& resultGradients,const TensorView& imageGradients,const int *maxPoolIndices);
+        //prevGradients is skipped if it's nullptr
+        static void fullyConnectedBackwards(const TensorView& layerWeights,const float *prev,const float *currGradients,const TensorView& layerGradients,float *prevGradients);
+
         //MATH UTILS
         static std::vector<float> softmax(std::vector<float> inp);
         static inline float sigmoid(float num){
@@ -106,6 +251,10 @@ class CnnUtils {
             return (x+epsilon>=y && x-epsilon<=y);
         }
        
+        static inline float32x4_t leakyRelu4f(float32x4_t a){
+            //Same as leakyRelu as 0.01x>x for x<=0
+            return vmaxq_f32(a,vmulq_n_f32(a,0.01f));
+        }
         static inline float dotProduct4f(float *X,float *Y);
         static inline float dotProduct4f(float32x4_t a,float32x4_t b);
         static inline float horizontalSum(float32x4_t a);
@@ -0,0 +1,805 @@
+#include "conformance.hpp"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <random>
+#include <map>
+#include <string>
+#include <vector>
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+#include "tensor.hpp"
+#include "tensorview.hpp"
+#include "cnnutils.hpp"
+#include "cnnreference.hpp"
+
+//The shapes are picked so that the vector bodies, the scalar tails and the special cased paths (3x3, 2x2 etc.) all get hit
+//Views are randomly pitched or start a few floats into their buffer so that nothing relies on the layout it's usually given
+//Sums are allowed to differ by rounding, scaled by the same sum of absolute values
+//Everything else (copies, padding, pooling) has to match exactly
+
+#define LAYOUT_CONTIGUOUS 0
+#define LAYOUT_PITCHED 1
+#define LAYOUT_MISALIGNED 2
+
+typedef struct kernelResult{
+    int cases = 0;
+    int failures = 0;
+    std::string firstFailure;
+}kernelResult;
+
+typedef std::map<std::string,kernelResult> resultMap;
+
+//A view along with the buffers that it points into
+typedef struct testTensor{
+    Tensor storage;
+    Tensor biases;
+    TensorView view;
+    int layout = LAYOUT_CONTIGUOUS;
+}testTensor;
+
+static std::mt19937 rng;
+
+//----------------------------------------------------
+//UTILS
+
+static int randInt(int min,int max){
+    return std::uniform_int_distribution<int>(min,max)(rng);
+}
+
+static bool coinFlip(){
+    return randInt(0,1)==1;
+}
+
+static void randomise(float *data,size_t size){
+    std::uniform_real_distribution<float> dist(-1.0f,1.0f);
+    for(size_t i=0;i<size;i++) data[i] = dist(rng);
+}
+
+//Few distinct values so that pooling windows have ties
+static void quantise(float *data,size_t size){
+    for(size_t i=0;i<size;i++) data[i] = randInt(-4,4)*0.25f;
+}
+
+static void randomise(Tensor& t){
+    randomise(t.getData(),t.getTotalSize());
+    if(t.getBiases()!=nullptr) randomise(t.getBiases()->getData(),t.getBiases()->getTotalSize());
+}
+
+//Every value is random, including any pitch, and so a kernel which reads past a row gets garbage
+static testTensor makeTensor(const std::vector<int>& dimens,int numBiases,int layout = -1){
+    if(layout==-1) layout = randInt(LAYOUT_CONTIGUOUS,LAYOUT_MISALIGNED);
+    const int numDimens = dimens.size();
+    int childSizes[TENSOR_VIEW_MAX_DIMENS];
+    int size = 1;
+    for(int i=numDimens-1;i>=0;i--){
+        childSizes[i] = size;
+        int dimen = dimens[i];
+        if(i==numDimens-1 && numDimens>1 && layout==LAYOUT_PITCHED){
+            dimen = (dimen+TENSOR_SIMD_WIDTH-1)/TENSOR_SIMD_WIDTH*TENSOR_SIMD_WIDTH;
+        }
+        size *= dimen;
+    }
+    const int offset = layout==LAYOUT_MISALIGNED ? randInt(1,3) : 0;
+    testTensor result;
+    result.layout = layout;
+    result.storage = Tensor({size+offset});
+    result.biases = Tensor({std::max(numBiases,1)});
+    randomise(result.storage);
+    randomise(result.biases);
+    result.view = TensorView(result.storage.getData()+offset,dimens.data(),childSizes,numDimens,
+        numBiases>0 ? result.biases.getData() : nullptr,numBiases);
+    return result;
+}
+
+//Same layout but with the absolute values, the reference run on these gives the magnitude of each sum
+static testTensor absCopy(const testTensor& t){
+    testTensor result;
+    result.layout = t.layout;
+    result.storage = Tensor({(int)t.storage.getTotalSize()});
+    result.biases = Tensor({(int)t.biases.getTotalSize()});
+    for(size_t i=0;i<t.storage.getTotalSize();i++) result.storage.getData()[i] = std::fabs(t.storage.getData()[i]);
+    for(size_t i=0;i<t.biases.getTotalSize();i++) result.biases.getData()[i] = std::fabs(t.biases.getData()[i]);
+    int dimens[TENSOR_VIEW_MAX_DIMENS];
+    int childSizes[TENSOR_VIEW_MAX_DIMENS];
+    for(int i=0;i<t.view.getNumDimens();i++){
+        dimens[i] = t.view.getDimen(i);
+        childSizes[i] = t.view.getChildSize(i);
+    }
+    result.view = TensorView(result.storage.getData()+(t.view.getData()-t.storage.getData()),dimens,childSizes,t.view.getNumDimens(),
+        t.view.getBiases()==nullptr ? nullptr : result.biases.getData(),t.view.getNumBiases());
+    return result;
+}
+
+static Tensor absTensor(const Tensor& t){
+    Tensor result(t);
+    for(size_t i=0;i<result.getTotalSize();i++) result.getData()[i] = std::fabs(result.getData()[i]);
+    Tensor *biases = result.getBiases();
+    if(biases!=nullptr){
+        for(size_t i=0;i<biases->getTotalSize();i++) biases->getData()[i] = std::fabs(biases->getData()[i]);
+    }
+    return result;
+}
+
+static TensorView flatView(float *data,int size){
+    const int childSize = 1;
+    return TensorView(data,&size,&childSize,1);
+}
+
+//Treats [H][W] as [1][H][W]
+static TensorView channelView(const TensorView& image){
+    const int dimens[3] = {1,image.getDimen(0),image.getDimen(1)};
+    const int childSizes[3] = {image.getDimen(0)*image.getChildSize(0),image.getChildSize(0),1};
+    return TensorView(image.getData(),dimens,childSizes,3);
+}
+
+//Treats [C/4][H][W][4] as [C/4][H][W*4], a pixel's block is then just 4 wider
+static TensorView rowsView(const TensorView& blockedImage){
+    const int dimens[3] = {blockedImage.getDimen(0),blockedImage.getDimen(1),blockedImage.getDimen(2)*CHANNEL_BLOCK};
+    const int childSizes[3] = {blockedImage.getChildSize(0),blockedImage.getChildSize(1),1};
+    return TensorView(blockedImage.getData(),dimens,childSizes,3);
+}
+
+static size_t numElements(const TensorView& view){
+    size_t result = 1;
+    for(int i=0;i<view.getNumDimens();i++) result *= view.getDimen(i);
+    return result;
+}
+
+//Where the index-th element in row major order is, skipping any pitch
+static size_t offsetOf(const TensorView& view,size_t index){
+    size_t offset = 0;
+    for(int i=view.getNumDimens()-1;i>=0;i--){
+        offset += (index%view.getDimen(i))*view.getChildSize(i);
+        index /= view.getDimen(i);
+    }
+    return offset;
+}
+
+static std::string describe(const TensorView& view,int layout = LAYOUT_CONTIGUOUS){
+    std::string result;
+    for(int i=0;i<view.getNumDimens();i++){
+        result += (i==0 ? "" : "x") + std::to_string(view.getDimen(i));
+    }
+    if(layout==LAYOUT_PITCHED) result += " (pitched)";
+    if(layout==LAYOUT_MISALIGNED) result += " (misaligned)";
+    return result;
+}
+
+static std::string describe(const testTensor& t){
+    return describe(t.view,t.layout);
+}
+
+static void fail(kernelResult& result,const std::string& description){
+    result.failures++;
+    if(result.firstFailure.empty()) result.firstFailure = description;
+}
+
+//got and want are compared in row major order and so they only need the same number of elements, not the same shape
+//A tolerance of 0 has to match exactly, otherwise it's relative to magnitude
+static void check(kernelResult& result,const std::string& description,const TensorView& got,const TensorView& want,const TensorView& magnitude,float tolerance){
+    result.cases++;
+    const size_t size = numElements(want);
+    if(numElements(got)!=size){
+        fail(result,description+": "+std::to_string(numElements(got))+" elements, expected "+std::to_string(size));
+        return;
+    }
+    for(size_t i=0;i<size;i++){
+        const float gotVal = got.getData()[offsetOf(got,i)];
+        const float wantVal = want.getData()[offsetOf(want,i)];
+        if(gotVal==wantVal) continue;
+        if(tolerance>0 && std::fabs(gotVal-wantVal)<=tolerance*magnitude.getData()[offsetOf(magnitude,i)]+FLT_MIN) continue;
+        std::ostringstream message;
+        message << std::setprecision(9) << description << ": element " << i << " is " << gotVal << ", expected " << wantVal;
+        fail(result,message.str());
+        return;
+    }
+}
+
+static void checkIndices(kernelResult& result,const std::string& description,const std::vector<int>& got,const std::vector<int>& want){
+    result.cases++;
+    for(size_t i=0;i<want.size();i++){
+        if(got[i]==want[i]) continue;
+        fail(result,description+": index "+std::to_string(i)+" is "+std::to_string(got[i])+", expected "+std::to_string(want[i]));
+        return;
+    }
+}
+
+//Rounding in a sum of n terms is at most about n*epsilon of the sum of their absolute values
+static float sumTolerance(int numTerms){
+    return 2*FLT_EPSILON*(numTerms+8);
+}
+
+//One of the shapes that CnnUtils::convolution has its own path for
+static void chwKernelShape(int& height,int& width,int& xStride,int& yStride){
+    xStride = randInt(1,3);
+    yStride = randInt(1,3);
+    switch(randInt(0,3)){
+        case 0: //unrolled 3x3
+            height = 3;
+            width = 3;
+            break;
+        case 1: //NEON along the kernel's rows
+            height = randInt(1,7);
+            width = randInt(4,9);
+            break;
+        case 2: //generic
+            do{
+                height = randInt(1,5);
+                width = randInt(1,3);
+            }while(height==3 && width==3);
+            break;
+        default: //the first layer
+            height = 6;
+            width = 8;
+            if(coinFlip()){
+                xStride = 8;
+                yStride = 6;
+            }
+    }
+}
+
+static void poolStrides(int& xStride,int& yStride){
+    if(coinFlip()){
+        xStride = 2;
+        yStride = 2;
+        return;
+    }
+    xStride = randInt(1,4);
+    yStride = randInt(1,4);
+}
+
+//Zeroes whole [outBlock][inBlock] blocks like a pruned model has
+static void pruneKernel(Tensor& kernel){
+    const std::vector<int>& dimens = kernel.getDimens();
+    const std::vector<int>& childSizes = kernel.getChildSizes();
+    for(int outBlock=0;outBlock<CnnUtils::numChannelBlocks(dimens[0]);outBlock++){
+        for(int inBlock=0;inBlock<CnnUtils::numChannelBlocks(dimens[1]);inBlock++){
+            if(randInt(0,2)!=0) continue;
+            for(int o=outBlock*CHANNEL_BLOCK;o<std::min((outBlock+1)*CHANNEL_BLOCK,dimens[0]);o++){
+                for(int i=inBlock*CHANNEL_BLOCK;i<std::min((inBlock+1)*CHANNEL_BLOCK,dimens[1]);i++){
+                    std::fill_n(kernel.getData()+o*childSizes[0]+i*childSizes[1],childSizes[1],0.0f);
+                }
+            }
+        }
+    }
+}
+
+static Tensor makeKernel(int outChannels,int inChannels,int height,int width){
+    Tensor kernel({outChannels,inChannels,height,width});
+    Tensor biases({outChannels});
+    kernel.setBiases(biases);
+    randomise(kernel);
+    return kernel;
+}
+
+//blockedResult picks [C/4][H][W][4] or CHW, maxPoolBlocked writes either
+static std::vector<int> poolResultDimens(bool blockedResult,int channels,int resHeight,int resWidth){
+    if(blockedResult) return {CnnUtils::numChannelBlocks(channels),resHeight,resWidth,CHANNEL_BLOCK};
+    return {channels,resHeight,resWidth};
+}
+
+//Blocked maxPoolIndices into the CHW order that CnnReference uses
+static std::vector<int> unblockIndices(const std::vector<int>& indices,const TensorView& blockedResult){
+    const int channels = blockedResult.getDimen(0)*CHANNEL_BLOCK;
+    const int resHeight = blockedResult.getDimen(1);
+    const int resWidth = blockedResult.getDimen(2);
+    std::vector<int> result(channels*resHeight*resWidth);
+    for(int c=0;c<channels;c++){
+        for(int y=0;y<resHeight;y++){
+            for(int x=0;x<resWidth;x++){
+                result[(c*resHeight+y)*resWidth+x] = indices[(c/CHANNEL_BLOCK)*blockedResult.getChildSize(0)
+                    + y*blockedResult.getChildSize(1) + x*CHANNEL_BLOCK + c%CHANNEL_BLOCK];
+            }
+        }
+    }
+    return result;
+}
+
+//----------------------------------------------------
+//IMAGE-RELATED
+
+static void testPadImage(resultMap& results){
+    const int yRadius = randInt(0,3);
+    const int xRadius = randInt(0,3);
+    testTensor image = makeTensor({randInt(1,9),randInt(1,40),randInt(1,40)},0);
+    const std::vector<int> paddedDimens = {image.view.getDimen(0),image.view.getDimen(1)+2*yRadius,image.view.getDimen(2)+2*xRadius};
+    testTensor got = makeTensor(paddedDimens,0);
+    testTensor want = makeTensor(paddedDimens,0,LAYOUT_CONTIGUOUS);
+    CnnUtils::padImage(image.view,got.view);
+    CnnReference::padImage(image.view,want.view);
+    check(results["padImage"],describe(image)+" into "+describe(got),got.view,want.view,want.view,0);
+}
+
+static void testConvolution(resultMap& results){
+    int kernelHeight,kernelWidth,xStride,yStride;
+    chwKernelShape(kernelHeight,kernelWidth,xStride,yStride);
+    const int yRadius = kernelHeight/2;
+    const int xRadius = kernelWidth/2;
+    const int channels = randInt(1,6);
+    testTensor paddedImage = makeTensor({channels,2*yRadius+randInt(1,30),2*xRadius+randInt(1,30)},0);
+    testTensor kernel = makeTensor({channels,kernelHeight,kernelWidth},randInt(0,1));
+    const int resHeight = (paddedImage.view.getDimen(1)-2*yRadius+yStride-1)/yStride;
+    const int resWidth = (paddedImage.view.getDimen(2)-2*xRadius+xStride-1)/xStride;
+    testTensor got = makeTensor({resHeight,resWidth},0);
+    std::fill_n(got.storage.getData(),got.storage.getTotalSize(),0.0f); //has to be zeroed
+    testTensor want = makeTensor({resHeight,resWidth},0,LAYOUT_CONTIGUOUS);
+    testTensor magnitude = makeTensor({resHeight,resWidth},0,LAYOUT_CONTIGUOUS);
+    CnnUtils::convolution(paddedImage.view,kernel.view,got.view,xStride,yStride);
+    CnnReference::convolution(paddedImage.view,kernel.view,want.view,xStride,yStride);
+    CnnReference::convolution(absCopy(paddedImage).view,absCopy(kernel).view,magnitude.view,xStride,yStride);
+    const std::string description = describe(paddedImage)+" * "+describe(kernel)+", stride "+std::to_string(xStride)+"x"+std::to_string(yStride);
+    check(results["convolution"],description,got.view,want.view,magnitude.view,sumTolerance(channels*kernelHeight*kernelWidth));
+}
+
+//The variable and fixed size convolutions which pad and allocate for you
+static void testConvolutionWrappers(resultMap& results){
+    int kernelHeight,kernelWidth,xStride,yStride;
+    chwKernelShape(kernelHeight,kernelWidth,xStride,yStride);
+    const int yRadius = kernelHeight/2;
+    const int xRadius = kernelWidth/2;
+    const bool padding = coinFlip();
+    const int channels = randInt(1,4);
+    testTensor image = makeTensor({channels,(padding ? 0 : 2*yRadius)+randInt(1,30),(padding ? 0 : 2*xRadius)+randInt(1,30)},0);
+    testTensor kernel = makeTensor({channels,kernelHeight,kernelWidth},1);
+    testTensor paddedImage = makeTensor({channels,image.view.getDimen(1)+(padding ? 2*yRadius : 0),image.view.getDimen(2)+(padding ? 2*xRadius : 0)},0,LAYOUT_CONTIGUOUS);
+    CnnReference::padImage(image.view,paddedImage.view);
+    const int resHeight = (paddedImage.view.getDimen(1)-2*yRadius+yStride-1)/yStride;
+    const int resWidth = (paddedImage.view.getDimen(2)-2*xRadius+xStride-1)/xStride;
+    const std::string description = describe(image)+" * "+describe(kernel)+", stride "+std::to_string(xStride)+"x"+std::to_string(yStride)
+        +(padding ? ", padded" : "");
+    const float tolerance = sumTolerance(channels*kernelHeight*kernelWidth);
+    //Fixed size is the same with zeros on the bottom and right
+    const int newHeight = resHeight+randInt(0,2);
+    const int newWidth = resWidth+randInt(0,2);
+    testTensor want = makeTensor({newHeight,newWidth},0,LAYOUT_CONTIGUOUS);
+    testTensor magnitude = makeTensor({newHeight,newWidth},0,LAYOUT_CONTIGUOUS);
+    std::fill_n(want.storage.getData(),want.storage.getTotalSize(),0.0f);
+    std::fill_n(magnitude.storage.getData(),magnitude.storage.getTotalSize(),0.0f);
+    const int resDimens[2] = {resHeight,resWidth};
+    const int resChildSizes[2] = {newWidth,1};
+    const TensorView wantResult(want.view.getData(),resDimens,resChildSizes,2);
+    const TensorView magnitudeResult(magnitude.view.getData(),resDimens,resChildSizes,2);
+    CnnReference::convolution(paddedImage.view,kernel.view,wantResult,xStride,yStride);
+    CnnReference::convolution(absCopy(paddedImage).view,absCopy(kernel).view,magnitudeResult,xStride,yStride);
+
+    Tensor variableSize = CnnUtils::convolution(image.view,kernel.view,xStride,yStride,padding);
+    check(results["convolution (variable size)"],description,variableSize.view(),wantResult,magnitudeResult,tolerance);
+    Tensor fixedSize = CnnUtils::convolution(image.view,kernel.view,xStride,yStride,newWidth,newHeight,padding);
+    check(results["convolution (fixed size)"],description+" into "+describe(want),fixedSize.view(),want.view,magnitude.view,tolerance);
+}
+
+static void testMaxPool(resultMap& results){
+    int xStride,yStride;
+    poolStrides(xStride,yStride);
+    testTensor image = makeTensor({yStride*randInt(1,12)+randInt(0,yStride-1),xStride*randInt(1,20)+randInt(0,xStride-1)},0);
+    if(coinFlip()) quantise(image.storage.getData(),image.storage.getTotalSize());
+    const int resHeight = image.view.getDimen(0)/yStride;
+    const int resWidth = image.view.getDimen(1)/xStride;
+    testTensor got = makeTensor({resHeight,resWidth},0);
+    testTensor want = makeTensor({1,resHeight,resWidth},0,LAYOUT_CONTIGUOUS);
+    std::vector<int> gotIndices(resHeight*resWidth);
+    std::vector<int> wantIndices(resHeight*resWidth);
+    CnnReference::maxPool(channelView(image.view),want.view,xStride,yStride,wantIndices.data());
+    const std::string description = describe(image)+", stride "+std::to_string(xStride)+"x"+std::to_string(yStride);
+    //Without the indices is a different path
+    CnnUtils::maxPool(image.view,got.view,xStride,yStride);
+    check(results["maxPool"],description,got.view,want.view,want.view,0);
+    CnnUtils::maxPool(image.view,got.view,xStride,yStride,gotIndices.data());
+    kernelResult& withIndices = results["maxPool (indices)"];
+    check(withIndices,description,got.view,want.view,want.view,0);
+    checkIndices(withIndices,description,gotIndices,wantIndices);
+}
+
+static void testResizeImg(resultMap& results){
+    const int channels = randInt(1,3);
+    const int resHeight = randInt(1,40);
+    const int resWidth = randInt(1,40);
+    //Exact halving has its own path
+    const int imHeight = randInt(0,2)==0 ? 2*resHeight : randInt(1,60);
+    const int imWidth = randInt(0,2)==0 ? 2*resWidth : randInt(1,60);
+    testTensor image = makeTensor({channels,imHeight,imWidth},0);
+    testTensor got = makeTensor({channels,resHeight,resWidth},0);
+    testTensor want = makeTensor({channels,resHeight,resWidth},0,LAYOUT_CONTIGUOUS);
+    testTensor magnitude = makeTensor({channels,resHeight,resWidth},0,LAYOUT_CONTIGUOUS);
+    const resizeAxis xAxis = CnnUtils::resizeCoefficients(imWidth,resWidth);
+    const resizeAxis yAxis = CnnUtils::resizeCoefficients(imHeight,resHeight);
+    CnnUtils::resizeImg(image.view,got.view,xAxis,yAxis);
+    CnnReference::resizeImg(image.view,want.view);
+    testTensor absImage = absCopy(image);
+    CnnReference::resizeImg(absImage.view,magnitude.view);
+    //The weights are worked out in floats from i*scale and so each can be out by about inSize*epsilon
+    //That isn't relative to the weighted sum and so the biggest input is added to every magnitude
+    const float maxInput = *std::max_element(absImage.storage.getData(),absImage.storage.getData()+absImage.storage.getTotalSize());
+    for(size_t i=0;i<magnitude.storage.getTotalSize();i++) magnitude.storage.getData()[i] += maxInput;
+    check(results["resizeImg"],describe(image)+" to "+describe(got),got.view,want.view,magnitude.view,
+        sumTolerance(2*std::max(imHeight,imWidth)));
+}
+
+//----------------------------------------------------
+//BLOCKED LAYOUT
+
+static void testBlockKernels(resultMap& results){
+    Tensor kernel = makeKernel(randInt(1,9),randInt(1,9),randInt(1,6),randInt(1,6));
+    const std::vector<int>& dimens = kernel.getDimens();
+    const std::vector<Tensor> blocked = CnnUtils::blockKernels({kernel});
+    std::vector<Tensor> unblocked = {makeKernel(dimens[0],dimens[1],dimens[2],dimens[3])};
+    CnnUtils::unblockKernels(blocked,unblocked);
+    //Round trip
+    kernelResult& result = results["blockKernels"];
+    const std::string description = describe(kernel.view());
+    check(result,description,unblocked[0].view(),kernel.view(),kernel.view(),0);
+    check(result,description+" biases",unblocked[0].getBiases()->view(),kernel.getBiases()->view(),kernel.getBiases()->view(),0);
+}
+
+static void testBlockImage(resultMap& results){
+    const int yRadius = randInt(0,3);
+    const int xRadius = randInt(0,3);
+    testTensor image = makeTensor({randInt(1,9),randInt(1,30),randInt(1,30)},0);
+    const std::vector<int> blockedDimens = {
+        CnnUtils::numChannelBlocks(image.view.getDimen(0)),image.view.getDimen(1)+2*yRadius,image.view.getDimen(2)+2*xRadius,CHANNEL_BLOCK
+    };
+    testTensor got = makeTensor(blockedDimens,0);
+    testTensor want = makeTensor(blockedDimens,0,LAYOUT_CONTIGUOUS);
+    CnnUtils::blockImage(image.view,got.view);
+    CnnReference::blockImage(image.view,want.view);
+    check(results["blockImage"],describe(image)+" into "+describe(got),got.view,want.view,want.view,0);
+}
+
+static void testPadImageBlocked(resultMap& results){
+    const int yRadius = randInt(0,3);
+    const int xRadius = randInt(0,3);
+    testTensor image = makeTensor({randInt(1,3),randInt(1,30),randInt(1,30),CHANNEL_BLOCK},0);
+    const int numBlocks = image.view.getDimen(0);
+    const int paddedHeight = image.view.getDimen(1)+2*yRadius;
+    const int paddedWidth = image.view.getDimen(2)+2*xRadius;
+    testTensor got = makeTensor({numBlocks,paddedHeight,paddedWidth,CHANNEL_BLOCK},0);
+    testTensor want = makeTensor({numBlocks,paddedHeight,paddedWidth*CHANNEL_BLOCK},0,LAYOUT_CONTIGUOUS);
+    CnnUtils::padImageBlocked(image.view,got.view);
+    CnnReference::padImage(rowsView(image.view),want.view);
+    const std::string description = describe(image)+" into "+describe(got);
+    check(results["padImageBlocked"],description,got.view,want.view,want.view,0);
+    //Unpadding gets the original back
+    testTensor unpadded = makeTensor(poolResultDimens(true,numBlocks*CHANNEL_BLOCK,image.view.getDimen(1),image.view.getDimen(2)),0);
+    CnnUtils::unpadImageBlocked(got.view,unpadded.view);
+    check(results["unpadImageBlocked"],description,unpadded.view,image.view,image.view,0);
+}
+
+static void testConvolutionBlocked(resultMap& results){
+    const int inChannels = randInt(1,9);
+    const int outChannels = randInt(1,9);
+    int kernelHeight = randInt(1,6);
+    int kernelWidth = randInt(1,6);
+    int xStride = randInt(1,3);
+    int yStride = randInt(1,3);
+    if(randInt(0,4)==0){
+        //the first layer
+        kernelHeight = 6;
+        kernelWidth = 8;
+        xStride = 8;
+        yStride = 6;
+    }
+    const int yRadius = kernelHeight/2;
+    const int xRadius = kernelWidth/2;
+    Tensor kernel = makeKernel(outChannels,inChannels,kernelHeight,kernelWidth);
+    const bool pruned = coinFlip();
+    if(pruned) pruneKernel(kernel);
+    const std::vector<Tensor> blocked = CnnUtils::blockKernels({kernel});
+    const blockSparsity sparsity = CnnUtils::findKernelSparsity(blocked[0]);
+    const int paddedHeight = 2*yRadius+randInt(1,25);
+    const int paddedWidth = 2*xRadius+randInt(1,25);
+    const int resHeight = (paddedHeight-2*yRadius+yStride-1)/yStride;
+    const int resWidth = (paddedWidth-2*xRadius+xStride-1)/xStride;
+    testTensor paddedImage = makeTensor({CnnUtils::numChannelBlocks(inChannels),paddedHeight,paddedWidth,CHANNEL_BLOCK},0);
+    testTensor got = makeTensor(poolResultDimens(true,outChannels,resHeight,resWidth),0);
+    CnnUtils::convolutionBlocked(paddedImage.view,blocked[0].view(),got.view,xStride,yStride,pruned && !sparsity.rowStarts.empty() ? &sparsity : nullptr);
+
+    testTensor paddedImageCHW = makeTensor({inChannels,paddedHeight,paddedWidth},0,LAYOUT_CONTIGUOUS);
+    CnnReference::unblockImage(paddedImage.view,paddedImageCHW.view);
+    testTensor gotCHW = makeTensor({outChannels,resHeight,resWidth},0,LAYOUT_CONTIGUOUS);
+    testTensor want = makeTensor({outChannels,resHeight,resWidth},0,LAYOUT_CONTIGUOUS);
+    testTensor magnitude = makeTensor({outChannels,resHeight,resWidth},0,LAYOUT_CONTIGUOUS);
+    CnnReference::unblockImage(got.view,gotCHW.view);
+    CnnReference::convolutionLayer(paddedImageCHW.view,kernel.view(),want.view,xStride,yStride);
+    CnnReference::convolutionLayer(absCopy(paddedImageCHW).view,absTensor(kernel).view(),magnitude.view,xStride,yStride);
+    const std::string description = describe(paddedImage)+" * "+describe(kernel.view())+", stride "+std::to_string(xStride)+"x"+std::to_string(yStride);
+    check(results[pruned ? "convolutionBlocked (pruned)" : "convolutionBlocked"],description,gotCHW.view,want.view,magnitude.view,
+        sumTolerance(inChannels*kernelHeight*kernelWidth));
+}
+
+static void testMaxPoolBlocked(resultMap& results){
+    int xStride,yStride;
+    poolStrides(xStride,yStride);
+    const int channels = randInt(1,9);
+    const bool blockedResult = coinFlip();
+    const bool recordIndices = coinFlip();
+    testTensor image = makeTensor({
+        CnnUtils::numChannelBlocks(channels),yStride*randInt(1,10)+randInt(0,yStride-1),xStride*randInt(1,10)+randInt(0,xStride-1),CHANNEL_BLOCK
+    },0);
+    if(coinFlip()) quantise(image.storage.getData(),image.storage.getTotalSize());
+    const int resHeight = image.view.getDimen(1)/yStride;
+    const int resWidth = image.view.getDimen(2)/xStride;
+    testTensor got = makeTensor(poolResultDimens(blockedResult,channels,resHeight,resWidth),0);
+    std::vector<int> gotIndices(recordIndices ? got.view.getTotalSize() : 0);
+    CnnUtils::maxPoolBlocked(image.view,got.view,xStride,yStride,recordIndices ? gotIndices.data() : nullptr);
+
+    //A blocked result has every channel in the last block, real or not
+    const int refChannels = blockedResult ? image.view.getDimen(0)*CHANNEL_BLOCK : channels;
+    testTensor imageCHW = makeTensor({refChannels,image.view.getDimen(1),image.view.getDimen(2)},0,LAYOUT_CONTIGUOUS);
+    CnnReference::unblockImage(image.view,imageCHW.view);
+    testTensor want = makeTensor({refChannels,resHeight,resWidth},0,LAYOUT_CONTIGUOUS);
+    std::vector<int> wantIndices(refChannels*resHeight*resWidth);
+    CnnReference::maxPool(imageCHW.view,want.view,xStride,yStride,wantIndices.data());
+    testTensor unblockedResult = makeTensor({refChannels,resHeight,resWidth},0,LAYOUT_CONTIGUOUS);
+    if(blockedResult) CnnReference::unblockImage(got.view,unblockedResult.view);
+    const TensorView gotCHW = blockedResult ? unblockedResult.view : got.view;
+    const std::string name = std::string("maxPoolBlocked (")+(blockedResult ? "blocked" : "CHW")+(recordIndices ? ", indices)" : ")");
+    const std::string description = describe(image)+" into "+describe(got)+", stride "+std::to_string(xStride)+"x"+std::to_string(yStride);
+    check(results[name],description,gotCHW,want.view,want.view,0);
+    if(recordIndices){
+        checkIndices(results[name],description,blockedResult ? unblockIndices(gotIndices,got.view) : gotIndices,wantIndices);
+    }
+}
+
+//----------------------------------------------------
+//MLP
+
+static void testFullyConnected(resultMap& results){
+    const int numOut = randInt(1,40);
+    const int numIn = randInt(1,100);
+    const bool relu = coinFlip();
+    const bool pruned = coinFlip();
+    Tensor weights({numOut,numIn},coinFlip());
+    Tensor biases({numOut});
+    weights.setBiases(biases);
+    randomise(weights);
+    if(pruned){
+        const int rowPitch = weights.getChildSizes()[0];
+        for(int i=0;i<numOut;i++){
+            for(int j=0;j<numIn;j+=MLP_SPARSE_BLOCK){
+                if(coinFlip()) std::fill_n(weights.getData()+i*rowPitch+j,std::min(MLP_SPARSE_BLOCK,numIn-j),0.0f);
+            }
+        }
+    }
+    const blockSparsity sparsity = CnnUtils::findWeightSparsity(weights);
+    //prev doesn't have to be aligned either
+    std::vector<float> prevBuffer(numIn+3);
+    randomise(prevBuffer.data(),prevBuffer.size());
+    float *prev = prevBuffer.data()+randInt(0,3);
+    std::vector<float> absPrev(prev,prev+numIn);
+    for(float& val : absPrev) val = std::fabs(val);
+    std::vector<float> got(numOut);
+    std::vector<float> want(numOut);
+    std::vector<float> magnitude(numOut);
+    CnnUtils::fullyConnected(weights.view(),prev,got.data(),relu,pruned && !sparsity.rowStarts.empty() ? &sparsity : nullptr);
+    CnnReference::fullyConnected(weights.view(),prev,want.data(),relu);
+    CnnReference::fullyConnected(absTensor(weights).view(),absPrev.data(),magnitude.data(),relu);
+    const std::string description = describe(weights.view())+(relu ? ", relu" : "");
+    check(results[pruned ? "fullyConnected (pruned)" : "fullyConnected"],description,flatView(got.data(),numOut),
+        flatView(want.data(),numOut),flatView(magnitude.data(),numOut),sumTolerance(numIn));
+}
+
+//----------------------------------------------------
+//BACKPROPAGATION
+
+static void testLeakyReluBackwards(resultMap& results){
+    const int size = randInt(1,100);
+    std::vector<float> activations(size);
+    quantise(activations.data(),size); //so that some are exactly 0
+    std::vector<float> got(size);
+    randomise(got.data(),size);
+    std::vector<float> want = got;
+    CnnUtils::leakyReluBackwards(flatView(activations.data(),size),flatView(got.data(),size));
+    CnnReference::leakyReluBackwards(activations.data(),want.data(),size);
+    check(results["leakyReluBackwards"],std::to_string(size),flatView(got.data(),size),flatView(want.data(),size),flatView(want.data(),size),0);
+}
+
+static void testConvolutionBlockedBackwards(resultMap& results){
+    const int inChannels = randInt(1,9);
+    const int outChannels = randInt(1,9);
+    const int kernelHeight = randInt(1,5);
+    const int kernelWidth = randInt(1,5);
+    const int xStride = randInt(1,3);
+    const int yStride = randInt(1,3);
+    const bool imageGradients = coinFlip();
+    const int yRadius = kernelHeight/2;
+    const int xRadius = kernelWidth/2;
+    const int paddedHeight = 2*yRadius+randInt(1,20);
+    const int paddedWidth = 2*xRadius+randInt(1,20);
+    const int resHeight = (paddedHeight-2*yRadius+yStride-1)/yStride;
+    const int resWidth = (paddedWidth-2*xRadius+xStride-1)/xStride;
+    Tensor kernel = makeKernel(outChannels,inChannels,kernelHeight,kernelWidth);
+    const std::vector<Tensor> blocked = CnnUtils::blockKernels({kernel});
+    //Weight gradients are added to and so they start with something in them
+    Tensor kernelGradients(blocked[0]);
+    randomise(kernelGradients);
+    const Tensor initialGradients(kernelGradients);
+    testTensor paddedImage = makeTensor({CnnUtils::numChannelBlocks(inChannels),paddedHeight,paddedWidth,CHANNEL_BLOCK},0);
+    testTensor resultGradients = makeTensor(poolResultDimens(true,outChannels,resHeight,resWidth),0);
+    testTensor gotImageGradients = makeTensor({paddedImage.view.getDimen(0),paddedHeight,paddedWidth,CHANNEL_BLOCK},0);
+    CnnUtils::convolutionBlockedBackwards(paddedImage.view,blocked[0].view(),resultGradients.view,kernelGradients.view(),
+        imageGradients ? gotImageGradients.view : TensorView(),xStride,yStride);
+
+    //The reference works in CHW
+    testTensor paddedImageCHW = makeTensor({inChannels,paddedHeight,paddedWidth},0,LAYOUT_CONTIGUOUS);
+    testTensor resultGradientsCHW = makeTensor({outChannels,resHeight,resWidth},0,LAYOUT_CONTIGUOUS);
+    CnnReference::unblockImage(paddedImage.view,paddedImageCHW.view);
+    CnnReference::unblockImage(resultGradients.view,resultGradientsCHW.view);
+    Tensor refKernelGradients = makeKernel(outChannels,inChannels,kernelHeight,kernelWidth);
+    Tensor magnitudeKernelGradients = makeKernel(outChannels,inChannels,kernelHeight,kernelWidth);
+    testTensor wantImageGradients = makeTensor({inChannels,paddedHeight,paddedWidth},0,LAYOUT_CONTIGUOUS);
+    testTensor magnitudeImageGradients = makeTensor({inChannels,paddedHeight,paddedWidth},0,LAYOUT_CONTIGUOUS);
+    CnnReference::convolutionLayerBackwards(paddedImageCHW.view,kernel.view(),resultGradientsCHW.view,refKernelGradients.view(),
+        refKernelGradients.getBiases()->getData(),wantImageGradients.view,xStride,yStride);
+    CnnReference::convolutionLayerBackwards(absCopy(paddedImageCHW).view,absTensor(kernel).view(),absCopy(resultGradientsCHW).view,
+        magnitudeKernelGradients.view(),magnitudeKernelGradients.getBiases()->getData(),magnitudeImageGradients.view,xStride,yStride);
+
+    //Back into [out][in][y][x] and then want = what was there + the reference
+    std::vector<Tensor> gotKernelGradients = {makeKernel(outChannels,inChannels,kernelHeight,kernelWidth)};
+    std::vector<Tensor> wantKernelGradients = {makeKernel(outChannels,inChannels,kernelHeight,kernelWidth)};
+    CnnUtils::unblockKernels({kernelGradients},gotKernelGradients);
+    CnnUtils::unblockKernels({initialGradients},wantKernelGradients);
+    Tensor& want = wantKernelGradients[0];
+    Tensor magnitude = absTensor(want);
+    for(size_t i=0;i<want.getTotalSize();i++){
+        want.getData()[i] += refKernelGradients.getData()[i];
+        magnitude.getData()[i] += magnitudeKernelGradients.getData()[i];
+    }
+    for(int o=0;o<outChannels;o++){
+        want.getBiases()->getData()[o] += refKernelGradients.getBiases()->getData()[o];
+        magnitude.getBiases()->getData()[o] += magnitudeKernelGradients.getBiases()->getData()[o];
+    }
+    kernelResult& result = results["convolutionBlockedBackwards"];
+    const std::string description = describe(paddedImage)+" * "+describe(kernel.view())+", stride "+std::to_string(xStride)+"x"+std::to_string(yStride);
+    const float tolerance = sumTolerance(std::max(resHeight*resWidth,outChannels*kernelHeight*kernelWidth));
+    check(result,description+" kernel",gotKernelGradients[0].view(),want.view(),magnitude.view(),tolerance);
+    check(result,description+" biases",flatView(gotKernelGradients[0].getBiases()->getData(),outChannels),
+        flatView(want.getBiases()->getData(),outChannels),flatView(magnitude.getBiases()->getData(),outChannels),tolerance);
+    if(imageGradients){
+        testTensor gotImageGradientsCHW = makeTensor({inChannels,paddedHeight,paddedWidth},0,LAYOUT_CONTIGUOUS);
+        CnnReference::unblockImage(gotImageGradients.view,gotImageGradientsCHW.view);
+        check(result,description+" image",gotImageGradientsCHW.view,wantImageGradients.view,magnitudeImageGradients.view,tolerance);
+    }
+}
+
+static void testMaxPoolBlockedBackwards(resultMap& results){
+    int xStride,yStride;
+    poolStrides(xStride,yStride);
+    const int channels = randInt(1,9);
+    const bool blockedResult = coinFlip();
+    testTensor image = makeTensor({
+        CnnUtils::numChannelBlocks(channels),yStride*randInt(1,10)+randInt(0,yStride-1),xStride*randInt(1,10)+randInt(0,xStride-1),CHANNEL_BLOCK
+    },0);
+    quantise(image.storage.getData(),image.storage.getTotalSize());
+    const int imHeight = image.view.getDimen(1);
+    const int imWidth = image.view.getDimen(2);
+    const int resHeight = imHeight/yStride;
+    const int resWidth = imWidth/xStride;
+    const std::vector<int> resultDimens = poolResultDimens(blockedResult,channels,resHeight,resWidth);
+    testTensor pooled = makeTensor(resultDimens,0);
+    std::vector<int> indices(pooled.view.getTotalSize());
+    CnnUtils::maxPoolBlocked(image.view,pooled.view,xStride,yStride,indices.data());
+    testTensor resultGradients = makeTensor(resultDimens,0);
+    testTensor got = makeTensor({image.view.getDimen(0),imHeight,imWidth,CHANNEL_BLOCK},0);
+    CnnUtils::maxPoolBlockedBackwards(resultGradients.view,got.view,indices.data());
+
+    const int refChannels = blockedResult ? image.view.getDimen(0)*CHANNEL_BLOCK : channels;
+    testTensor unblockedGradients = makeTensor({refChannels,resHeight,resWidth},0,LAYOUT_CONTIGUOUS);
+    if(blockedResult) CnnReference::unblockImage(resultGradients.view,unblockedGradients.view);
+    const TensorView resultGradientsCHW = blockedResult ? unblockedGradients.view : resultGradients.view;
+    testTensor want = makeTensor({refChannels,imHeight,imWidth},0,LAYOUT_CONTIGUOUS);
+    CnnReference::maxPoolBackwards(resultGradientsCHW,want.view,blockedResult ? unblockIndices(indices,pooled.view).data() : indices.data());
+    testTensor gotCHW = makeTensor({refChannels,imHeight,imWidth},0,LAYOUT_CONTIGUOUS);
+    CnnReference::unblockImage(got.view,gotCHW.view);
+    //The windows don't overlap and so each gradient is only ever added to 0
+    check(results[blockedResult ? "maxPoolBlockedBackwards (blocked)" : "maxPoolBlockedBackwards (CHW)"],
+        describe(image)+", stride "+std::to_string(xStride)+"x"+std::to_string(yStride),gotCHW.view,want.view,want.view,0);
+}
+
+static void testFullyConnectedBackwards(resultMap& results){
+    const int numOut = randInt(1,40);
+    const int numIn = randInt(1,100);
+    const bool prevGradients = coinFlip();
+    Tensor weights({numOut,numIn},coinFlip());
+    Tensor biases({numOut});
+    weights.setBiases(biases);
+    randomise(weights);
+    //Gradients are added to
+    Tensor gotGradients(weights);
+    randomise(gotGradients);
+    const Tensor initialGradients(gotGradients);
+    std::vector<float> prev(numIn);
+    randomise(prev.data(),numIn);
+    std::vector<float> currGradients(numOut);
+    randomise(currGradients.data(),numOut);
+    //0 gradients are skipped
+    for(float& val : currGradients) if(randInt(0,3)==0) val = 0.0f;
+    std::vector<float> gotPrevGradients(numIn);
+    CnnUtils::fullyConnectedBackwards(weights.view(),prev.data(),currGradients.data(),gotGradients.view(),prevGradients ? gotPrevGradients.data() : nullptr);
+
+    testTensor want = makeTensor({numOut,numIn},numOut,LAYOUT_CONTIGUOUS);
+    std::vector<float> wantPrevGradients(numIn);
+    CnnReference::fullyConnectedBackwards(weights.view(),prev.data(),currGradients.data(),want.view,want.view.getBiases(),wantPrevGradients.data());
+    testTensor magnitude = absCopy(want);
+    for(int i=0;i<numOut;i++){
+        for(int j=0;j<numIn;j++){
+            const float initial = initialGradients.getData()[i*initialGradients.getChildSizes()[0]+j];
+            want.view.getData()[i*numIn+j] += initial;
+            magnitude.view.getData()[i*numIn+j] += std::fabs(initial);
+        }
+        const float initialBias = initialGradients.getBiases()->getData()[i];
+        want.view.getBiases()[i] += initialBias;
+        magnitude.view.getBiases()[i] += std::fabs(initialBias);
+    }
+    kernelResult& result = results["fullyConnectedBackwards"];
+    const std::string description = describe(weights.view());
+    //Just a multiply and add each
+    check(result,description+" weights",gotGradients.view(),want.view,magnitude.view,sumTolerance(1));
+    check(result,description+" biases",flatView(gotGradients.getBiases()->getData(),numOut),flatView(want.view.getBiases(),numOut),
+        flatView(magnitude.view.getBiases(),numOut),sumTolerance(1));
+    if(prevGradients){
+        std::vector<float> absCurrGradients = currGradients;
+        for(float& val : absCurrGradients) val = std::fabs(val);
+        std::vector<float> magnitudePrevGradients(numIn);
+        testTensor discard = makeTensor({numOut,numIn},numOut,LAYOUT_CONTIGUOUS);
+        CnnReference::fullyConnectedBackwards(absTensor(weights).view(),prev.data(),absCurrGradients.data(),discard.view,discard.view.getBiases(),
+            magnitudePrevGradients.data());
+        check(result,description+" prev",flatView(gotPrevGradients.data(),numIn),flatView(wantPrevGradients.data(),numIn),
+            flatView(magnitudePrevGradients.data(),numIn),sumTolerance(numOut));
+    }
+}
+
+//----------------------------------------------------
+//RUNNING
+
+typedef void (*conformanceTest)(resultMap& results);
+
+int runConformance(int iterations,unsigned int seed){
+    const std::vector<std::pair<std::string,conformanceTest>> tests = {
+        {"padImage",testPadImage},
+        {"convolution",testConvolution},
+        {"convolution wrappers",testConvolutionWrappers},
+        {"maxPool",testMaxPool},
+        {"resizeImg",testResizeImg},
+        {"blockKernels",testBlockKernels},
+        {"blockImage",testBlockImage},
+        {"padImageBlocked",testPadImageBlocked},
+        {"convolutionBlocked",testConvolutionBlocked},
+        {"maxPoolBlocked",testMaxPoolBlocked},
+        {"fullyConnected",testFullyConnected},
+        {"leakyReluBackwards",testLeakyReluBackwards},
+        {"convolutionBlockedBackwards",testConvolutionBlockedBackwards},
+        {"maxPoolBlockedBackwards",testMaxPoolBlockedBackwards},
+        {"fullyConnectedBackwards",testFullyConnectedBackwards}
+    };
+    std::cout << "Conformance: " << iterations << " iterations, seed " << seed << std::endl;
+    rng.seed(seed);
+    resultMap results;
+    for(int i=0;i<iterations;i++){
+        for(const std::pair<std::string,conformanceTest>& test : tests){
+            try{
+                test.second(results);
+            }
+            catch(const std::exception& e){
+                //A kernel rejecting a valid shape is a failure too
+                kernelResult& result = results[test.first];
+                result.cases++;
+                fail(result,std::string("threw \"")+e.what()+"\"");
+            }
+        }
+    }
+    int numFailed = 0;
+    for(const std::pair<const std::string,kernelResult>& kernel : results){
+        const kernelResult& result = kernel.second;
+        std::cout << (result.failures==0 ? "PASS " : "FAIL ") << kernel.first << ": "
+            << result.cases-result.failures << "/" << result.cases << " cases" << std::endl;
+        if(result.failures>0){
+            std::cout << "    first failure: " << result.firstFailure << std::endl;
+            numFailed++;
+        }
+    }
+    if(numFailed==0) std::cout << "Every kernel matches the reference" << std::endl;
+    else std::cout << numFailed << " kernels don't match the reference, rerun with seed " << seed << std::endl;
+    return numFailed;
+}
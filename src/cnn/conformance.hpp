@@ -0,0 +1,9 @@
+#ifndef CONFORMANCE_HPP
+#define CONFORMANCE_HPP
+
+//Runs every optimised kernel in CnnUtils on random shapes and compares it against CnnReference
+//The same seed gives the same shapes and values so that a failure can be rerun
+//Returns the number of kernels which failed
+int runConformance(int iterations,unsigned int seed);
+
+#endif
@@ -1,40 +1,85 @@
 #include "tensor.hpp"
 
-Tensor::Tensor(const std::vector<int>& inputDimens){
+Tensor::Tensor(const std::vector<int>& inputDimens) : Tensor(inputDimens,false){}
+
+Tensor::Tensor(const std::vector<int>& inputDimens,bool pitchedRows){
     dimens = inputDimens;
     int numElems = 1;
     childSizes.resize(dimens.size());
     for(int i=dimens.size()-1;i>=0;i--){
         childSizes[i] = numElems;
-        numElems *= dimens[i];
+        //Round the row length up so that every row is a whole number of vectors
+        if(pitchedRows && i==dimens.size()-1 && dimens.size()>1){
+            numElems *= (dimens[i]+TENSOR_SIMD_WIDTH-1)/TENSOR_SIMD_WIDTH*TENSOR_SIMD_WIDTH;
+        }
+        else numElems *= dimens[i];
     }
     totalSize = (size_t) childSizes[0]*dimens[0];
     //Pointer must be shared as it may be used by sub-tensors
-    //initialise values to 0 with float[] constructor
-    data = std::shared_ptr<float[]>(new float[totalSize]());
+    data = allocate(totalSize);
     offset = 0;
 }
 
-Tensor::Tensor(const std::vector<int>& inputDimens,const std::shared_ptr<float[]> ptr,int pOffset){
+Tensor::Tensor(const std::vector<int>& inputDimens,const std::vector<int>& inputChildSizes,const std::shared_ptr<float[]> ptr,int pOffset){
     dimens = inputDimens;
-    int numElems = 1;
-    childSizes.resize(dimens.size());
-    for(int i=dimens.size()-1;i>=0;i--){
-        childSizes[i] = numElems;
-        numElems *= dimens[i];
-    }
+    childSizes = inputChildSizes;
     totalSize = (size_t) childSizes[0]*dimens[0];
     data = ptr;
     offset = pOffset;
 }
 
+std::shared_ptr<float[]> Tensor::allocate(size_t size){
+    //aligned_alloc needs the size to be a multiple of the alignment
+    size_t bytes = (sizeof(float)*size+TENSOR_ALIGNMENT-1)/TENSOR_ALIGNMENT*TENSOR_ALIGNMENT;
+    if(bytes==0) bytes = TENSOR_ALIGNMENT;
+    float *ptr = static_cast<float*>(std::aligned_alloc(TENSOR_ALIGNMENT,bytes));
+    if(ptr==nullptr){
+        throw std::bad_alloc();
+    }
+    //initialise values to 0 like the float[] constructor did
+    std::memset(ptr,0,bytes);
+    return std::shared_ptr<float[]>(ptr,std::free);
+}
+
+void Tensor::copyValues(const Tensor& t){
+    if(this->childSizes==t.childSizes){
+        //More efficient than a loop
+        std::memcpy(
+            this->getData(),
+            t.getData(),
+            sizeof(float)*totalSize
+        );
+        return;
+    }
+    //Different pitches and so copy a row at a time
+    int numDimens = dimens.size();
+    int rowLength = dimens[numDimens-1];
+    size_t numRows = 1;
+    for(int i=0;i<numDimens-1;i++) numRows *= dimens[i];
+    float *thisData = this->getData();
+    const float *tData = t.getData();
+    for(size_t r=0;r<numRows;r++){
+        //Work out the offsets of this row in both tensors
+        size_t remaining = r;
+        size_t thisRow = 0;
+        size_t tRow = 0;
+        for(int i=numDimens-2;i>=0;i--){
+            size_t index = remaining % dimens[i];
+            remaining /= dimens[i];
+            thisRow += index*this->childSizes[i];
+            tRow += index*t.childSizes[i];
+        }
+        std::memcpy(thisData+thisRow,tData+tRow,sizeof(float)*rowLength);
+    }
+}
+
 Tensor::Tensor(const Tensor& t){
     this->offset = 0;
     this->dimens = t.dimens;
     this->childSizes = t.childSizes;
     this->totalSize = t.totalSize;
     //Independent memory to that of the copyee
-    this->data = std::shared_ptr<float[]>(new float[totalSize]());
+    this->data = allocate(totalSize);
     Tensor *tBiases = t.getBiases();
     if(tBiases!=nullptr){
         //deep copy
@@ -50,7 +95,7 @@ Tensor::Tensor(const Tensor& t){
 Tensor& Tensor::operator=(const Tensor &t){ 
     if(this==&t) return *this; //Self-assignment prevention
     if(this->data==nullptr && this->offset==0){ //If we haven't been initialised i.e. through default constructor
-        this->data = std::shared_ptr<float[]>(new float[t.totalSize]());
+        this->data = allocate(t.totalSize);
         this->offset = 0;
         this->dimens = t.dimens;
         this->childSizes = t.childSizes;
@@ -73,12 +118,7 @@ Tensor& Tensor::operator=(const Tensor &t){
         this->biases = std::make_shared<Tensor>(*tBiases);
     }
     else this->biases.reset();
-    //More efficient than a loop
-    std::memcpy(
-        this->getData(),
-        t.getData(),
-        sizeof(float)*totalSize
-    );
+    copyValues(t);
     return *this;
 }
 
@@ -96,7 +136,7 @@ Tensor::Tensor(Tensor&& t) noexcept{
 Tensor& Tensor::operator=(Tensor&& t){
     if(this == &t) return *this; //Self-assignment prevention
     if(this->data==nullptr && this->offset==0){ //If we haven't been initialised i.e. through default constructor
-        this->data = std::shared_ptr<float[]>(new float[t.totalSize]());
+        this->data = allocate(t.totalSize);
         this->offset = 0;
         this->dimens = t.dimens;
         this->childSizes = t.childSizes;
@@ -114,12 +154,7 @@ Tensor& Tensor::operator=(Tensor&& t){
         }
     }
     this->biases = std::move(t.biases);
-    //More efficient than a loop
-    std::memcpy(
-        this->getData(),
-        t.getData(),
-        sizeof(float)*totalSize
-    );
+    copyValues(t);
     t.offset = 0;
     t.totalSize = 0;
     return *this;
@@ -154,7 +189,8 @@ Tensor Tensor::slice(const std::vector<int>& indices) const{
     for(int i=0;i<indices.size();i++){
         subOffset += indices[i]*childSizes[i];
     }
-    Tensor subTensor = Tensor(subDimens,data,subOffset);
+    std::vector<int> subChildSizes(childSizes.begin() + indices.size(),childSizes.end());
+    Tensor subTensor = Tensor(subDimens,subChildSizes,data,subOffset);
     return subTensor;
 }
 
@@ -168,7 +204,8 @@ Tensor Tensor::slice(const std::vector<int>& indices,const std::vector<int>& bia
     for(int i=0;i<indices.size();i++){
         subOffset += indices[i]*childSizes[i];
     }
-    Tensor subTensor = Tensor(subDimens,data,subOffset);
+    std::vector<int> subChildSizes(childSizes.begin() + indices.size(),childSizes.end());
+    Tensor subTensor = Tensor(subDimens,subChildSizes,data,subOffset);
     if(this->getBiases()==nullptr){
         throw std::invalid_argument("Cannot slice biases as biases are null");
     }
@@ -178,11 +215,26 @@ Tensor Tensor::slice(const std::vector<int>& indices,const std::vector<int>& bia
 }
 
 Tensor& Tensor::operator=(const std::vector<float>& vals){
-    if(vals.size()!=totalSize){
+    size_t numValues = 1;
+    for(int i=0;i<dimens.size();i++) numValues *= dimens[i];
+    if(vals.size()!=numValues){
         throw std::invalid_argument("Length of \"vals\" mismatches size of tensor");
     }
-    for(int i=0;i<totalSize;i++){
-        data[i+offset] = vals[i];
+    if(numValues==totalSize){
+        for(int i=0;i<totalSize;i++){
+            data[i+offset] = vals[i];
+        }
+        return *this;
     }
+    //Pitched rows and so skip over the end of each row
+    Tensor unpitched(dimens);
+    unpitched = vals;
+    copyValues(unpitched);
     return *this;
+}
+
+TensorView Tensor::view() const{
+    float *biasesData = biases==nullptr ? nullptr : biases->getData();
+    int numBiases = biases==nullptr ? 0 : (int) biases->getTotalSize();
+    return TensorView(getData(),dimens.data(),childSizes.data(),(int)dimens.size(),biasesData,numBiases);
 }
\ No newline at end of file
@@ -7,6 +7,12 @@
 #include <memory>
 #include <cstring>
 #include "globals.hpp"
+#include "tensorview.hpp"
+
+//Buffers start on a cache line
+#define TENSOR_ALIGNMENT 64
+//Floats in a NEON register, pitched rows are rounded up to this
+#define TENSOR_SIMD_WIDTH 4
 
 
 class Tensor{
@@ -16,7 +22,7 @@ class Tensor{
     std::shared_ptr<Tensor> biases = nullptr;
     int offset = 0; //how far this tensor's data is into the shared_ptr
     std::vector<int> dimens; //e.g. 5x4x6 {5,4,6}
-    std::vector<int> childSizes; //e.g. {24,6,1}
+    std::vector<int> childSizes; //e.g. {24,6,1} or {32,8,1} if the rows are pitched
     size_t totalSize = 0;
     public:
         //Default constructor, needed for initialising an empty vector with size
@@ -24,6 +30,10 @@ class Tensor{
         Tensor(){};
         //Fresh Tensor constructor
         Tensor(const std::vector<int>& inputDimens);
+        //pitchedRows rounds the row length up to TENSOR_SIMD_WIDTH
+        //The kernels can then run a full vector over the end of a row rather than doing a scalar tail
+        //The padding is only ever written by kernels and is never part of the values
+        Tensor(const std::vector<int>& inputDimens,bool pitchedRows);
 
         //not a Rule of 5 as we don't have any raw ptrs and hence don't need a destructor
         //Copy constructor - needed for deep copy (for biases)
@@ -63,10 +73,11 @@ class Tensor{
         template <typename dn>
         dn toVector() const;
 
-        std::vector<int> getDimens() const { return dimens; }
+        //By reference so that the hot loops don't copy the vector
+        const std::vector<int>& getDimens() const { return dimens; }
         size_t getTotalSize() const { return totalSize; }
         Tensor *getBiases() const { return biases==nullptr ? nullptr : biases.get(); }
-        std::vector<int> getChildSizes() const { return childSizes; }
+        const std::vector<int>& getChildSizes() const { return childSizes; }
         int getOffset() const { return offset; }
         void setBiases(Tensor& pBiases) { 
             //Deep copy ctor
@@ -74,10 +85,17 @@ class Tensor{
             biases = std::make_shared<Tensor>(pBiases);
         }
         float *getData() const { return data.get()+offset; }
+        //Non-owning view for the kernels, includes the biases if there are any
+        TensorView view() const;
 
     private:
         //Sub-Tensor constructor
-        Tensor(const std::vector<int>& inputDimens,const std::shared_ptr<float[]> ptr,int pOffset);
+        //The child sizes are the parent's so that pitched rows stay pitched
+        Tensor(const std::vector<int>& inputDimens,const std::vector<int>& inputChildSizes,const std::shared_ptr<float[]> ptr,int pOffset);
+        //Zero initialised and aligned to TENSOR_ALIGNMENT
+        static std::shared_ptr<float[]> allocate(size_t size);
+        //Copies the values across, a row at a time if the pitches differ
+        void copyValues(const Tensor& t);
         inline size_t flattenIndex(const std::vector<int>& indices) const{
             if (indices.size() != dimens.size()) {
                 throw std::invalid_argument("Tensor indices provided do not match tensor dimensions");
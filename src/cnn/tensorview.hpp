@@ -0,0 +1,72 @@
+#ifndef TENSORVIEW_HPP
+#define TENSORVIEW_HPP
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+//Kernels are the deepest at 4 dimensions, toVector goes up to d5
+#define TENSOR_VIEW_MAX_DIMENS 5
+
+//A non-owning window onto a Tensor's data
+//The shape is stored inline and nothing is refcounted and so slicing is just a few integer ops
+//The Tensor it came from must outlive it
+class TensorView{
+    float *data = nullptr;
+    //Not owned either, points into the parent Tensor's biases
+    float *biases = nullptr;
+    int numBiases = 0;
+    int numDimens = 0;
+    int dimens[TENSOR_VIEW_MAX_DIMENS] = {0};
+    int childSizes[TENSOR_VIEW_MAX_DIMENS] = {0};
+    size_t totalSize = 0;
+    public:
+        TensorView(){};
+        TensorView(float *pData,const int *pDimens,const int *pChildSizes,int pNumDimens,float *pBiases = nullptr,int pNumBiases = 0){
+            if(pNumDimens>TENSOR_VIEW_MAX_DIMENS){
+                throw std::invalid_argument("TensorView supports at most "+std::to_string(TENSOR_VIEW_MAX_DIMENS)+" dimensions");
+            }
+            data = pData;
+            biases = pBiases;
+            numBiases = pNumBiases;
+            numDimens = pNumDimens;
+            for(int i=0;i<numDimens;i++){
+                dimens[i] = pDimens[i];
+                childSizes[i] = pChildSizes[i];
+            }
+            totalSize = numDimens==0 ? 0 : (size_t) childSizes[0]*dimens[0];
+        }
+
+        //Drops the first dimension, does not include the biases
+        inline TensorView slice(int index) const{
+            TensorView sub;
+            sub.data = data + (size_t)index*childSizes[0];
+            sub.numDimens = numDimens-1;
+            for(int i=0;i<sub.numDimens;i++){
+                sub.dimens[i] = dimens[i+1];
+                sub.childSizes[i] = childSizes[i+1];
+            }
+            sub.totalSize = (size_t) childSizes[0];
+            return sub;
+        }
+        //Same as above but keeps the single bias for this slice
+        //Used for the kernel of an output channel
+        inline TensorView slice(int index,int biasIndex) const{
+            TensorView sub = slice(index);
+            if(biases!=nullptr){
+                sub.biases = biases+biasIndex;
+                sub.numBiases = 1;
+            }
+            return sub;
+        }
+
+        float *getData() const { return data; }
+        int getNumDimens() const { return numDimens; }
+        int getDimen(int i) const { return dimens[i]; }
+        int getChildSize(int i) const { return childSizes[i]; }
+        size_t getTotalSize() const { return totalSize; }
+        float *getBiases() const { return biases; }
+        int getNumBiases() const { return numBiases; }
+};
+
+#endif
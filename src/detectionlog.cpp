@@ -0,0 +1,142 @@
+#include "detectionlog.hpp"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#define DETECTION_LOG_MAGIC "WSDL"
+#define DETECTION_LOG_VERSION 1
+
+static_assert(sizeof(detectionRecord)==40,"Records are read back from old files, their layout can't change without a new version");
+
+DetectionLog::DetectionLog(const std::string& dir,uint32_t recordsPerSegment,int syncIntervalMs){
+	if(recordsPerSegment==0){
+		throw std::invalid_argument("A detection log segment must hold at least one record");
+	}
+	this->dir = dir;
+	this->recordsPerSegment = recordsPerSegment;
+	this->syncIntervalMs = syncIntervalMs;
+	std::filesystem::create_directories(dir);
+	openSegment();
+	syncThread = std::thread(&DetectionLog::syncLoop,this);
+}
+
+DetectionLog::~DetectionLog(){
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	stopped.notify_one();
+	syncThread.join();
+	closeSegment();
+}
+
+void DetectionLog::append(const detectionRecord& record){
+	std::lock_guard<std::mutex> lock(mutex);
+	if(header()->numRecords>=header()->capacity){
+		closeSegment();
+		openSegment();
+	}
+	detectionLogHeader *segment = header();
+	memcpy(mapping+sizeof(detectionLogHeader)+segment->numRecords*sizeof(detectionRecord),&record,sizeof(record));
+	//After the record so that a crash never counts one that isn't there
+	segment->numRecords++;
+}
+
+void DetectionLog::openSegment(){
+	timespec now;
+	clock_gettime(CLOCK_REALTIME,&now);
+	std::string fname = dir+"/detections_"+std::to_string(now.tv_sec)+".bin";
+	//Two in the same second would only happen with tiny segments
+	for(int i=1;std::filesystem::exists(fname);i++){
+		fname = dir+"/detections_"+std::to_string(now.tv_sec)+"_"+std::to_string(i)+".bin";
+	}
+	int fd = open(fname.c_str(),O_RDWR|O_CREAT|O_EXCL,0644);
+	if(fd<0){
+		throw std::runtime_error("Could not create detection log "+fname);
+	}
+	mappingSize = sizeof(detectionLogHeader)+(size_t)recordsPerSegment*sizeof(detectionRecord);
+	//Allocated up front so that appending never grows the file (and its metadata) a block at a time
+	if(posix_fallocate(fd,0,mappingSize)!=0){
+		close(fd);
+		throw std::runtime_error("Could not allocate detection log "+fname);
+	}
+	void *addr = mmap(nullptr,mappingSize,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	//The mapping keeps the file open
+	close(fd);
+	if(addr==MAP_FAILED){
+		throw std::runtime_error("Could not map detection log "+fname);
+	}
+	mapping = (uint8_t*) addr;
+	detectionLogHeader *segment = header();
+	memcpy(segment->magic,DETECTION_LOG_MAGIC,4);
+	segment->version = DETECTION_LOG_VERSION;
+	segment->recordSize = sizeof(detectionRecord);
+	segment->capacity = recordsPerSegment;
+	segment->numRecords = 0;
+}
+
+void DetectionLog::closeSegment(){
+	if(!mapping) return;
+	//Left to the kernel's writeback rather than waiting for it here
+	msync(mapping,mappingSize,MS_ASYNC);
+	munmap(mapping,mappingSize);
+	mapping = nullptr;
+}
+
+void DetectionLog::syncLoop(){
+	std::unique_lock<std::mutex> lock(mutex);
+	while(!stopping){
+		stopped.wait_for(lock,std::chrono::milliseconds(syncIntervalMs));
+		if(!mapping) continue;
+		uint8_t *start = mapping;
+		const size_t used = sizeof(detectionLogHeader)+header()->numRecords*sizeof(detectionRecord);
+		const size_t pageSize = sysconf(_SC_PAGESIZE);
+		const size_t length = (used+pageSize-1)/pageSize*pageSize;
+		//The clean pages are skipped, so it's only what's been appended since last time
+		//If a new segment is opened meanwhile this fails harmlessly as the old one has been unmapped
+		lock.unlock();
+		msync(start,length,MS_SYNC);
+		lock.lock();
+	}
+}
+
+void DetectionLog::exportCsv(const std::vector<std::string>& fnames,std::ostream& out){
+	out << "wallTime,captureTime,sequence,x,y,hasWeed,decision,weedX,weedY,latencyMs\n";
+	for(const std::string& fname: fnames){
+		exportSegment(fname,out);
+	}
+}
+
+void DetectionLog::exportSegment(const std::string& fname,std::ostream& out){
+	std::ifstream file(fname,std::ios::binary);
+	if(!file){
+		throw std::runtime_error("Could not open file "+fname);
+	}
+	detectionLogHeader segment;
+	if(!file.read((char*) &segment,sizeof(segment)) || memcmp(segment.magic,DETECTION_LOG_MAGIC,4)!=0 || segment.version!=DETECTION_LOG_VERSION){
+		throw std::runtime_error(fname+" is not a detection log");
+	}
+	if(segment.recordSize!=sizeof(detectionRecord) || segment.numRecords>segment.capacity){
+		throw std::runtime_error("Detection log "+fname+" is corrupt");
+	}
+	std::vector<detectionRecord> records(segment.numRecords);
+	if(!file.read((char*) records.data(),records.size()*sizeof(detectionRecord))){
+		throw std::runtime_error("Detection log "+fname+" is truncated");
+	}
+	static const char *decisions[] = {"no weed","weed","stale"};
+	char line[256];
+	for(const detectionRecord& record: records){
+		snprintf(line,sizeof(line),"%llu.%03llu,%llu,%u,%f,%f,%f,%s,%d,%d,%.3f\n",
+			(unsigned long long) (record.wallTime/1000000000),(unsigned long long) (record.wallTime/1000000%1000),
+			(unsigned long long) record.captureTime,record.sequence,record.result[0],record.result[1],record.result[2],
+			record.decision<=DECISION_STALE ? decisions[record.decision] : "unknown",record.weedX,record.weedY,record.latencyUs/1000.0);
+		out << line;
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef DETECTIONLOG_HPP
+#define DETECTIONLOG_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef enum detectionDecision{
+	DECISION_NO_WEED,
+	DECISION_WEED,
+	DECISION_STALE //too old to act on, nothing was published
+} detectionDecision;
+
+//One per frame that made it through the CNN, fixed size so the file can be indexed
+typedef struct detectionRecord{
+	uint64_t captureTime; //ns, monotonic (see videoFrame)
+	uint64_t wallTime; //ns since the epoch when it was logged, for matching up with the field
+	uint32_t sequence; //frame id
+	float result[3]; //x, y, has weed, straight from CNN::forwards
+	uint32_t latencyUs; //capture -> published
+	uint8_t decision; //detectionDecision
+	int8_t weedX; //as given to the Pico, 0-100
+	int8_t weedY;
+	uint8_t padding;
+}detectionRecord;
+
+//At the start of every segment
+typedef struct detectionLogHeader{
+	char magic[4];
+	uint32_t version;
+	uint32_t recordSize;
+	uint32_t capacity;
+	uint64_t numRecords; //the rest of the file is preallocated zeros
+}detectionLogHeader;
+
+//Appends to preallocated, mmapped segment files in dir (detections_<unix s>.bin) and starts a new one when it's full
+//Appending is a memcpy, the pages are flushed to the SD card by a background thread every syncIntervalMs
+//so nothing is written a record at a time and the writer never waits for the disk
+class DetectionLog{
+	public:
+		DetectionLog(const std::string& dir,uint32_t recordsPerSegment = 65536,int syncIntervalMs = 5000);
+		~DetectionLog();
+		//Only one thread can append
+		void append(const detectionRecord& record);
+		//Every record in the segment files as CSV, in the order they're given
+		static void exportCsv(const std::vector<std::string>& fnames,std::ostream& out);
+	private:
+		std::string dir;
+		uint32_t recordsPerSegment;
+		int syncIntervalMs;
+		//Guards the mapping against the sync thread, neither holds it whilst waiting for the disk
+		std::mutex mutex;
+		uint8_t *mapping = nullptr;
+		size_t mappingSize = 0;
+		bool stopping = false;
+		std::condition_variable stopped;
+		std::thread syncThread;
+
+		detectionLogHeader* header(){ return (detectionLogHeader*) mapping; }
+		void openSegment();
+		void closeSegment();
+		void syncLoop();
+		static void exportSegment(const std::string& fname,std::ostream& out);
+};
+
+#endif
@@ -0,0 +1,256 @@
+#include "detectionpipeline.hpp"
+#include "logger.hpp"
+#include "videoframe.hpp"
+#include "picoi2c.hpp"
+#include "latency.hpp"
+#include "snapshotring.hpp"
+#include "flightrecorder.hpp"
+#include <unistd.h>
+#include <ctime>
+#include <cstring>
+
+DetectionPipeline::DetectionPipeline(FrameSource& source,CNN& cnn,DetectionSlot *slot,bool lossless,volatile sig_atomic_t& reloadFlag,const std::string& modelDir,
+	FrameScheduler *scheduler,uint32_t maxAgeMs,DetectionLog *log) : source(source),cnn(cnn),reloadFlag(reloadFlag){
+	this->slot = slot;
+	this->scheduler = scheduler;
+	this->maxAgeMs = maxAgeMs;
+	this->log = log;
+	this->lossless = lossless;
+	this->modelDir = modelDir;
+}
+
+long DetectionPipeline::run(){
+	std::thread preprocessThread(&DetectionPipeline::preprocessLoop,this);
+	std::thread publishThread(&DetectionPipeline::publishLoop,this);
+	inferLoop();
+	preprocessThread.join();
+	publishThread.join();
+	if(preprocessError) std::rethrow_exception(preprocessError);
+	if(inferError) std::rethrow_exception(inferError);
+	if(publishError) std::rethrow_exception(publishError);
+	return numPublished;
+}
+
+void DetectionPipeline::stop(){
+	stopping = true;
+	frames.close();
+	results.close();
+}
+
+//Returns false if the next stage has stopped
+template<typename T>
+bool DetectionPipeline::handOver(LatestQueue<T>& queue){
+	//Lossless waits for the last one to be taken, otherwise it's replaced
+	while(lossless && !queue.waitUntilTaken(1000)){
+		if(queue.isClosed()) return false;
+	}
+	queue.publish();
+	return true;
+}
+
+//----------------------------------------------------
+//PREPROCESS
+
+//At most 10 a second go to the snapshot ring
+static const uint64_t snapshotIntervalNs = 100000000;
+
+void DetectionPipeline::preprocessLoop(){
+	try{
+		while(!stopping && !source.isFinished()){
+			if(scheduler) scheduler->waitForNextFrame();
+			//Filled in place, the slot's tensor is only allocated the first time
+			preparedFrame& prepared = frames.writeSlot();
+			bool gotFrame = source.processNextFrame([&](const videoFrame& frame){
+				const uint64_t start = monotonicNow();
+				prepare(frame,prepared);
+				prepared.preparedTime = monotonicNow();
+				if(scheduler) scheduler->recordStage(STAGE_PREPROCESS,(prepared.preparedTime-start)/1e9);
+				if(LatencyStats *stats = LatencyStats::get()){
+					stats->record(LATENCY_ACQUIRE,frame.captureTime,start);
+					stats->record(LATENCY_PREPROCESS,start,prepared.preparedTime);
+				}
+				//The frame is only valid in here, so this copy does hold up detection, photos don't need every frame
+				SnapshotRing *ring = SnapshotRing::get();
+				if(ring && prepared.preparedTime-lastSnapshotTime>=snapshotIntervalNs){
+					ring->push(frame);
+					lastSnapshotTime = prepared.preparedTime;
+				}
+			});
+			if(!gotFrame){
+				if(!source.isFinished() && !stopping) logWarn("No frame");
+				continue;
+			}
+			if(!handOver(frames)) break;
+			//The slot stays as it is until our next writeSlot, the infer stage only reads it
+			if(FlightRecorder *recorder = FlightRecorder::get()) recorder->recordFrame(prepared.input,cnn.getPixelStats(),prepared.sequence,prepared.captureTime);
+		}
+	}
+	catch(...){
+		preprocessError = std::current_exception();
+		stop();
+	}
+	//Nothing else is coming
+	frames.close();
+}
+
+void DetectionPipeline::prepare(const videoFrame& frame,preparedFrame& prepared){
+	const dimens inputDimens = cnn.getInputDimens();
+	if(prepared.input.getTotalSize()==0){
+		prepared.input = Tensor({inputDimens.c,inputDimens.h,inputDimens.w});
+	}
+	//The stats never change, so the infer stage only has to copy it in
+	const d2& pixelStats = cnn.getPixelStats();
+	if(frame.height==inputDimens.h && frame.width==inputDimens.w){
+		videoFrameToInput(frame,prepared.input.view(),pixelStats);
+	}
+	else{
+		//Normalising is per pixel and the resize weights add up to 1, so it can be done as the frame's converted
+		const std::vector<int>& fullDimens = fullSizeFrame.getDimens();
+		if(fullDimens.size()!=3 || fullDimens[1]!=frame.height || fullDimens[2]!=frame.width){
+			fullSizeFrame = Tensor({inputDimens.c,frame.height,frame.width});
+		}
+		videoFrameToInput(frame,fullSizeFrame.view(),pixelStats);
+		//Only recalculated if the frame size changes
+		if(resizeX.inSize!=frame.width || resizeX.outSize!=inputDimens.w){
+			resizeX = CnnUtils::resizeCoefficients(frame.width,inputDimens.w);
+		}
+		if(resizeY.inSize!=frame.height || resizeY.outSize!=inputDimens.h){
+			resizeY = CnnUtils::resizeCoefficients(frame.height,inputDimens.h);
+		}
+		CnnUtils::resizeImg(fullSizeFrame.view(),prepared.input.view(),resizeX,resizeY);
+	}
+	prepared.sequence = frame.sequence;
+	prepared.timestamp = frame.timestamp;
+	prepared.captureTime = frame.captureTime;
+}
+
+//----------------------------------------------------
+//INFER
+
+void DetectionPipeline::inferLoop(){
+	try{
+		while(!stopping){
+			checkModelReload();
+			preparedFrame *prepared = frames.pop(1000);
+			if(!prepared){
+				if(frames.isClosed()) break;
+				continue;
+			}
+			const uint64_t start = monotonicNow();
+			detection& out = results.writeSlot();
+			out.result = cnn.forwards([prepared](const TensorView& input,const d2& pixelStats){
+				//Already normalised, the input map's rows are pitched and ours aren't so it's a copy per row
+				const float *imageData = prepared->input.getData();
+				const int height = input.getDimen(1);
+				const int width = input.getDimen(2);
+				for(int c=0;c<input.getDimen(0);c++){
+					for(int y=0;y<height;y++){
+						memcpy(input.getData() + (size_t)c*input.getChildSize(0) + (size_t)y*input.getChildSize(1),
+							imageData + (size_t)(c*height+y)*width,width*sizeof(float));
+					}
+				}
+			});
+			out.sequence = prepared->sequence;
+			out.timestamp = prepared->timestamp;
+			out.captureTime = prepared->captureTime;
+			out.inferredTime = monotonicNow();
+			if(scheduler) scheduler->recordStage(STAGE_INFER,(out.inferredTime-start)/1e9);
+			//From when it was ready, so waiting for the CNN is included
+			if(LatencyStats *stats = LatencyStats::get()) stats->record(LATENCY_INFER,prepared->preparedTime,out.inferredTime);
+			if(!handOver(results)) break;
+		}
+	}
+	catch(...){
+		inferError = std::current_exception();
+		stop();
+	}
+	results.close();
+}
+
+void DetectionPipeline::checkModelReload(){
+	if(reloadFlag){
+		reloadFlag = 0;
+		//Swapped in by forwards once it's loaded, no frames are missed
+		if(!cnn.loadModelAsync(modelDir)){
+			logWarn("Already loading a model, ignoring the reload");
+		}
+	}
+}
+
+//----------------------------------------------------
+//PUBLISH
+
+void DetectionPipeline::publishLoop(){
+	try{
+		while(true){
+			detection *latest = results.pop(1000);
+			if(!latest){
+				if(results.isClosed()) break;
+				continue;
+			}
+			reportWeeds(*latest);
+			numPublished++;
+		}
+	}
+	catch(...){
+		publishError = std::current_exception();
+		stop();
+	}
+}
+
+void DetectionPipeline::reportWeeds(const detection& latest){
+	const std::vector<float>& result = latest.result;
+	const uint64_t ageMs = (monotonicNow()-latest.captureTime)/1000000;
+	const bool stale = maxAgeMs>0 && ageMs>maxAgeMs;
+	FlightRecorder *recorder = FlightRecorder::get();
+	if(recorder){
+		recorder->recordDetection({latest.sequence,latest.captureTime,latest.inferredTime,{result[0],result[1],result[2]},stale});
+	}
+	//The nozzle would miss, better to say nothing than the wrong place
+	if(stale){
+		logWarn("Dropping frame %u, it's %llums old",latest.sequence,(unsigned long long) ageMs);
+		numStale++;
+		logDetection(latest,DECISION_STALE,0,0,monotonicNow());
+		return;
+	}
+	const float hasWeedThreshold = 0.5f;
+	weedReport report = {0,0,0,latest.sequence,latest.captureTime,0};
+	if(result[2] > hasWeedThreshold){
+		logInfo("Weed spotted at: (%f,%f) %llums after capture",result[0],result[1],(unsigned long long) ageMs);
+		report.weed = 1;
+		report.weedX = (char) (result[0]*100);
+		report.weedY = (char) (result[1]*100);
+	}
+	else{
+		logInfo("No weeds present");
+	}
+	//Give the weed info to i2C, there isn't one when replaying
+	report.publishTime = monotonicNow();
+	if(slot){
+		slot->publish(report);
+		logDebug("Published: %d %d %d",report.weed,report.weedX,report.weedY);
+	}
+	if(recorder) recorder->recordReport(report);
+	logDetection(latest,report.weed ? DECISION_WEED : DECISION_NO_WEED,report.weedX,report.weedY,report.publishTime);
+	if(LatencyStats *stats = LatencyStats::get()){
+		const uint64_t now = monotonicNow();
+		stats->record(LATENCY_PUBLISH,latest.inferredTime,now);
+		stats->record(LATENCY_CAPTURE_TO_PUBLISH,latest.captureTime,now);
+	}
+}
+
+void DetectionPipeline::logDetection(const detection& latest,detectionDecision decision,char weedX,char weedY,uint64_t decidedTime){
+	if(!log) return;
+	timespec now;
+	clock_gettime(CLOCK_REALTIME,&now);
+	detectionRecord record = {};
+	record.captureTime = latest.captureTime;
+	record.wallTime = (uint64_t) now.tv_sec*1000000000ull+now.tv_nsec;
+	record.sequence = latest.sequence;
+	for(int i=0;i<3;i++) record.result[i] = latest.result[i];
+	record.latencyUs = decidedTime>latest.captureTime ? (decidedTime-latest.captureTime)/1000 : 0;
+	record.decision = decision;
+	record.weedX = weedX;
+	record.weedY = weedY;
+	log->append(record);
+}
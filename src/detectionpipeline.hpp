@@ -0,0 +1,90 @@
+#ifndef DETECTIONPIPELINE_HPP
+#define DETECTIONPIPELINE_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <csignal>
+#include "framesource.hpp"
+#include "latestqueue.hpp"
+#include "framescheduler.hpp"
+#include "detectionlog.hpp"
+#include "detectionslot.hpp"
+#include "cnn.hpp"
+
+//A frame converted (and resized) to the CNN's input size and normalised with its pixel stats
+typedef struct preparedFrame{
+	Tensor input;
+	uint32_t sequence;
+	uint64_t timestamp;
+	uint64_t captureTime;
+	uint64_t preparedTime;
+}preparedFrame;
+
+typedef struct detection{
+	std::vector<float> result; //see CNN::forwards
+	uint32_t sequence;
+	uint64_t timestamp;
+	uint64_t captureTime; //of the frame it came from
+	uint64_t inferredTime;
+}detection;
+
+//Capture and preprocess -> infer -> publish, each on its own thread
+//The stages only ever hand over their latest output, so it runs at the speed of the slowest stage and the rest is dropped
+//Preprocessing frame N+1 happens whilst frame N is in the CNN
+class DetectionPipeline{
+	public:
+		//slot is where the weed info goes (the I2C process), nullptr for nowhere
+		//lossless waits for each stage rather than dropping, only for sources that wait for us (e.g. replaying with --fast)
+		//When reloadFlag is set the model in modelDir is loaded and swapped in between frames
+		//scheduler paces the frames, nullptr takes every one the source gives
+		//Detections more than maxAgeMs after their frame was captured are dropped rather than published, 0 never drops them
+		//Every detection is appended to log if there is one, including the dropped ones
+		DetectionPipeline(FrameSource& source,CNN& cnn,DetectionSlot *slot,bool lossless,volatile sig_atomic_t& reloadFlag,const std::string& modelDir,
+			FrameScheduler *scheduler=nullptr,uint32_t maxAgeMs=0,DetectionLog *log=nullptr);
+		//Blocks until the source finishes, inference runs on the calling thread
+		//Returns the number of frames that made it through, including stale ones
+		long run();
+		long getNumStale() const{ return numStale; }
+	private:
+		FrameSource& source;
+		CNN& cnn;
+		DetectionSlot *slot;
+		bool lossless;
+		volatile sig_atomic_t& reloadFlag;
+		std::string modelDir;
+		FrameScheduler *scheduler;
+		uint32_t maxAgeMs;
+		DetectionLog *log;
+		LatestQueue<preparedFrame> frames;
+		LatestQueue<detection> results;
+		std::atomic<bool> stopping{false};
+		long numPublished = 0;
+		long numStale = 0;
+		uint64_t lastSnapshotTime = 0;
+		//Each stage's first error, rethrown by run
+		std::exception_ptr preprocessError;
+		std::exception_ptr inferError;
+		std::exception_ptr publishError;
+		//Cached for frames that aren't the input's size, normalised at the frame's size and then resized
+		Tensor fullSizeFrame;
+		resizeAxis resizeX;
+		resizeAxis resizeY;
+
+		void preprocessLoop();
+		void inferLoop();
+		void publishLoop();
+		void prepare(const videoFrame& frame,preparedFrame& prepared);
+		void checkModelReload();
+		void reportWeeds(const detection& latest);
+		//decidedTime is when it was published or dropped
+		void logDetection(const detection& latest,detectionDecision decision,char weedX,char weedY,uint64_t decidedTime);
+		//Stops every stage when one fails
+		void stop();
+		template<typename T>
+		bool handOver(LatestQueue<T>& queue);
+};
+
+#endif
@@ -0,0 +1,40 @@
+#include "detectionslot.hpp"
+#include <sys/mman.h>
+#include <cstring>
+#include <stdexcept>
+#include <new>
+
+DetectionSlot *DetectionSlot::shared = nullptr;
+
+void DetectionSlot::init(){
+	if(shared) return;
+	//Anonymous and shared, so it's inherited by every fork
+	void *addr = mmap(nullptr,sizeof(DetectionSlot),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if(addr==MAP_FAILED){
+		throw std::runtime_error("Could not map the detection slot");
+	}
+	//mmap gives zeroed memory, so the version starts at 0 (never written)
+	shared = new(addr) DetectionSlot();
+}
+
+void DetectionSlot::publish(const weedReport& newReport){
+	const uint32_t before = version.load(std::memory_order_relaxed);
+	version.store(before+1,std::memory_order_relaxed);
+	//Nothing below can be seen before the odd version
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy((void*) &report,&newReport,sizeof(weedReport));
+	version.store(before+2,std::memory_order_release);
+}
+
+bool DetectionSlot::latest(weedReport& out) const{
+	while(true){
+		const uint32_t before = version.load(std::memory_order_acquire);
+		if(before==0) return false;
+		//Mid write, it's only a few bytes so it won't be for long
+		if(before%2!=0) continue;
+		memcpy((void*) &out,(const void*) &report,sizeof(weedReport));
+		//The copy has to be finished before the version is checked again
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(version.load(std::memory_order_relaxed)==before) return true;
+	}
+}
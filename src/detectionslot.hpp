@@ -0,0 +1,28 @@
+#ifndef DETECTIONSLOT_HPP
+#define DETECTIONSLOT_HPP
+
+#include <atomic>
+#include <cstdint>
+#include "picoi2c.hpp"
+
+//The newest report from inference, shared with the I2C process
+//A seqlock rather than a queue, so the reader only ever sees the latest and never anything that's piled up behind it
+//One writer (inference) and any number of readers, reading is a copy and a couple of atomic loads, no syscalls
+class DetectionSlot{
+	public:
+		//Must be called before forking, like LatencyStats::init
+		static void init();
+		//nullptr if init hasn't been called
+		static DetectionSlot* get(){ return shared; }
+		//Replaces whatever is there, only one thread can publish
+		void publish(const weedReport& report);
+		//Copies the newest report into out, false if nothing's been published yet
+		bool latest(weedReport& out) const;
+	private:
+		static DetectionSlot *shared;
+		//Odd whilst it's being written, 0 until the first report
+		std::atomic<uint32_t> version;
+		weedReport report;
+};
+
+#endif
@@ -0,0 +1,290 @@
+#include "flightrecorder.hpp"
+#include "cameraimage.hpp"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <csignal>
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <new>
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,"The rings are shared between processes and so can't have locks");
+
+FlightRecorder *FlightRecorder::shared = nullptr;
+
+#define DUMP_MAGIC "WSFR"
+#define DUMP_VERSION 2
+
+typedef enum dumpSectionType{
+	SECTION_FRAMES,
+	SECTION_DETECTIONS,
+	SECTION_REPORTS,
+	SECTION_COMMANDS
+} dumpSectionType;
+
+typedef struct dumpHeader{
+	char magic[4];
+	uint32_t version;
+	uint64_t realtimeNs; //so the monotonic times can be turned into dates
+	uint64_t monotonicNs;
+	char reason[16];
+	uint32_t thumbHeight;
+	uint32_t thumbWidth;
+}dumpHeader;
+
+//Followed by count entries of entrySize bytes, oldest first
+typedef struct dumpSection{
+	uint32_t type;
+	uint32_t entrySize;
+	uint64_t count;
+}dumpSection;
+
+void FlightRecorder::init(const std::string& dir){
+	if(shared) return;
+	if(dir.size()>=sizeof(FlightRecorder::dir)){
+		throw std::invalid_argument("Flight recorder directory "+dir+" is too long");
+	}
+	std::filesystem::create_directories(dir);
+	//Anonymous and shared, so it's inherited by every fork
+	void *addr = mmap(nullptr,sizeof(FlightRecorder),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if(addr==MAP_FAILED){
+		throw std::runtime_error("Could not map the flight recorder");
+	}
+	//mmap gives zeroed memory, so every ring starts empty
+	shared = new(addr) FlightRecorder();
+	strcpy(shared->dir,dir.c_str());
+}
+
+void FlightRecorder::recordFrame(const Tensor& image,const d2& pixelStats,uint32_t sequence,uint64_t captureTime){
+	const std::vector<int>& dimens = image.getDimens();
+	const std::vector<int>& childSizes = image.getChildSizes();
+	if(dimens.size()!=3 || dimens[0]!=3 || pixelStats.size()<2 || pixelStats[0].size()<3 || pixelStats[1].size()<3) return;
+	recordedFrame frame;
+	frame.sequence = sequence;
+	frame.captureTime = captureTime;
+	//Nearest neighbour is plenty for seeing what happened
+	const float *data = image.getData();
+	for(int y=0;y<RECORDER_THUMB_HEIGHT;y++){
+		const int imageY = y*dimens[1]/RECORDER_THUMB_HEIGHT;
+		for(int x=0;x<RECORDER_THUMB_WIDTH;x++){
+			const int imageX = x*dimens[2]/RECORDER_THUMB_WIDTH;
+			for(int c=0;c<3;c++){
+				//Back to 0-255
+				const float val = data[c*childSizes[0]+imageY*childSizes[1]+imageX]*pixelStats[1][c]+pixelStats[0][c];
+				frame.rgb[(y*RECORDER_THUMB_WIDTH+x)*3+c] = (uint8_t) std::max(0.0f,std::min(255.0f,val+0.5f));
+			}
+		}
+	}
+	frames.push(frame);
+}
+
+//----------------------------------------------------
+//DUMPING
+
+//Buffered so that the small entries aren't a syscall each, everything here is async-signal-safe
+typedef struct dumpWriter{
+	int fd;
+	bool ok;
+	size_t used;
+	char buffer[8192];
+}dumpWriter;
+
+static void writeAll(dumpWriter& writer,const void *data,size_t size){
+	const char *bytes = (const char*) data;
+	while(writer.ok && size>0){
+		ssize_t n = write(writer.fd,bytes,size);
+		if(n<0){
+			if(errno==EINTR) continue;
+			writer.ok = false;
+			return;
+		}
+		bytes += n;
+		size -= n;
+	}
+}
+
+static void flush(dumpWriter& writer){
+	writeAll(writer,writer.buffer,writer.used);
+	writer.used = 0;
+}
+
+static void append(dumpWriter& writer,const void *data,size_t size){
+	if(writer.used+size>sizeof(writer.buffer)){
+		flush(writer);
+		if(size>sizeof(writer.buffer)){
+			writeAll(writer,data,size);
+			return;
+		}
+	}
+	memcpy(writer.buffer+writer.used,data,size);
+	writer.used += size;
+}
+
+//Everything that's still in the ring and wasn't being overwritten as we read it
+template<typename T,int N>
+static void dumpRing(dumpWriter& writer,dumpSectionType type,const RecorderRing<T,N>& ring){
+	flush(writer);
+	const off_t sectionStart = lseek(writer.fd,0,SEEK_CUR);
+	dumpSection section = {(uint32_t) type,(uint32_t) sizeof(T),0};
+	writeAll(writer,&section,sizeof(section));
+	const uint64_t end = ring.getNumPushed();
+	const uint64_t start = end>(uint64_t) N ? end-N : 0;
+	T entry;
+	for(uint64_t i=start;i<end;i++){
+		if(!ring.read(i,entry)) continue;
+		append(writer,&entry,sizeof(T));
+		section.count++;
+	}
+	flush(writer);
+	//The count isn't known until the end
+	lseek(writer.fd,sectionStart,SEEK_SET);
+	writeAll(writer,&section,sizeof(section));
+	lseek(writer.fd,0,SEEK_END);
+}
+
+static void appendString(char *dest,size_t destSize,const char *src){
+	size_t length = strlen(dest);
+	while(*src && length+1<destSize) dest[length++] = *src++;
+	dest[length] = '\0';
+}
+
+static void appendNumber(char *dest,size_t destSize,uint64_t number){
+	char digits[21];
+	int i = sizeof(digits)-1;
+	digits[i] = '\0';
+	do{
+		digits[--i] = '0'+number%10;
+		number /= 10;
+	} while(number>0);
+	appendString(dest,destSize,digits+i);
+}
+
+bool FlightRecorder::dump(const char *reason){
+	timespec realtime;
+	timespec monotonic;
+	clock_gettime(CLOCK_REALTIME,&realtime);
+	clock_gettime(CLOCK_MONOTONIC,&monotonic);
+	const uint64_t realtimeNs = (uint64_t) realtime.tv_sec*1000000000ull+realtime.tv_nsec;
+	//No std::string, it allocates
+	char fname[sizeof(dir)+64] = {0};
+	appendString(fname,sizeof(fname),dir);
+	appendString(fname,sizeof(fname),"/flight_");
+	appendNumber(fname,sizeof(fname),realtimeNs/1000000);
+	appendString(fname,sizeof(fname),"_");
+	appendString(fname,sizeof(fname),reason);
+	appendString(fname,sizeof(fname),".bin");
+	dumpWriter writer;
+	writer.fd = open(fname,O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if(writer.fd<0) return false;
+	writer.ok = true;
+	writer.used = 0;
+	dumpHeader header = {};
+	memcpy(header.magic,DUMP_MAGIC,4);
+	header.version = DUMP_VERSION;
+	header.realtimeNs = realtimeNs;
+	header.monotonicNs = (uint64_t) monotonic.tv_sec*1000000000ull+monotonic.tv_nsec;
+	appendString(header.reason,sizeof(header.reason),reason);
+	header.thumbHeight = RECORDER_THUMB_HEIGHT;
+	header.thumbWidth = RECORDER_THUMB_WIDTH;
+	append(writer,&header,sizeof(header));
+	dumpRing(writer,SECTION_FRAMES,frames);
+	dumpRing(writer,SECTION_DETECTIONS,detections);
+	dumpRing(writer,SECTION_REPORTS,reports);
+	dumpRing(writer,SECTION_COMMANDS,commands);
+	close(writer.fd);
+	return writer.ok;
+}
+
+static void onCrashSignal(int signal){
+	if(FlightRecorder *recorder = FlightRecorder::get()) recorder->dump("crash");
+	//SA_RESETHAND has put the default back, so this kills us like it would have
+	raise(signal);
+}
+
+void FlightRecorder::dumpOnCrash(){
+	struct sigaction action;
+	memset(&action,0,sizeof(action));
+	action.sa_handler = onCrashSignal;
+	action.sa_flags = SA_RESETHAND|SA_NODEFER;
+	sigemptyset(&action.sa_mask);
+	for(int signal: {SIGSEGV,SIGBUS,SIGFPE,SIGILL,SIGABRT}){
+		sigaction(signal,&action,nullptr);
+	}
+}
+
+//----------------------------------------------------
+//EXPORTING
+
+template<typename T>
+static std::vector<T> readSection(std::ifstream& file,dumpSectionType type){
+	dumpSection section;
+	if(!file.read((char*) &section,sizeof(section)) || section.type!=(uint32_t) type || section.entrySize!=sizeof(T)){
+		throw std::runtime_error("Flight recording is corrupt or from a different version");
+	}
+	std::vector<T> entries(section.count);
+	if(!file.read((char*) entries.data(),section.count*sizeof(T))){
+		throw std::runtime_error("Flight recording is truncated");
+	}
+	return entries;
+}
+
+void FlightRecorder::exportDump(const std::string& fname,const std::string& outDir){
+	std::ifstream file(fname,std::ios::binary);
+	if(!file){
+		throw std::runtime_error("Could not open file "+fname);
+	}
+	dumpHeader header;
+	if(!file.read((char*) &header,sizeof(header)) || memcmp(header.magic,DUMP_MAGIC,4)!=0 || header.version!=DUMP_VERSION){
+		throw std::runtime_error(fname+" is not a flight recording");
+	}
+	if(header.thumbHeight!=RECORDER_THUMB_HEIGHT || header.thumbWidth!=RECORDER_THUMB_WIDTH){
+		throw std::runtime_error("Flight recording has "+std::to_string(header.thumbWidth)+"x"+std::to_string(header.thumbHeight)+" frames, expected "+
+			std::to_string(RECORDER_THUMB_WIDTH)+"x"+std::to_string(RECORDER_THUMB_HEIGHT));
+	}
+	std::vector<recordedFrame> frames = readSection<recordedFrame>(file,SECTION_FRAMES);
+	std::vector<recordedDetection> detections = readSection<recordedDetection>(file,SECTION_DETECTIONS);
+	std::vector<weedReport> reports = readSection<weedReport>(file,SECTION_REPORTS);
+	std::vector<recordedCommand> commands = readSection<recordedCommand>(file,SECTION_COMMANDS);
+	std::filesystem::create_directories(outDir);
+	//Times are ms before the dump, which is easier to read than the monotonic clock
+	auto msBefore = [&](uint64_t ns){
+		return ns==0 ? std::string("") : std::to_string(((int64_t) header.monotonicNs-(int64_t) ns)/1000000);
+	};
+	std::ofstream framesCsv(outDir+"/frames.csv");
+	framesCsv << "sequence,capturedMsBefore,file\n";
+	for(const recordedFrame& frame: frames){
+		const std::string jpegName = "frame_"+std::to_string(frame.sequence)+".jpg";
+		std::unique_ptr<uint8_t[]> rgb(new uint8_t[sizeof(frame.rgb)]);
+		memcpy(rgb.get(),frame.rgb,sizeof(frame.rgb));
+		CameraImage(rgb,RECORDER_THUMB_HEIGHT,RECORDER_THUMB_WIDTH).saveAsJPEG(outDir+"/"+jpegName);
+		framesCsv << frame.sequence << "," << msBefore(frame.captureTime) << "," << jpegName << "\n";
+	}
+	std::ofstream detectionsCsv(outDir+"/detections.csv");
+	detectionsCsv << "sequence,capturedMsBefore,inferredMsBefore,x,y,hasWeed,stale\n";
+	for(const recordedDetection& detection: detections){
+		detectionsCsv << detection.sequence << "," << msBefore(detection.captureTime) << "," << msBefore(detection.inferredTime) << ","
+			<< detection.result[0] << "," << detection.result[1] << "," << detection.result[2] << "," << (detection.stale?1:0) << "\n";
+	}
+	std::ofstream reportsCsv(outDir+"/reports.csv");
+	reportsCsv << "sequence,weed,weedX,weedY,capturedMsBefore,publishedMsBefore\n";
+	for(const weedReport& report: reports){
+		reportsCsv << report.sequence << "," << (int) report.weed << "," << (int) report.weedX << "," << (int) report.weedY << ","
+			<< msBefore(report.captureTime) << "," << msBefore(report.publishTime) << "\n";
+	}
+	std::ofstream commandsCsv(outDir+"/commands.csv");
+	commandsCsv << "msBefore,command,reply\n";
+	for(const recordedCommand& command: commands){
+		commandsCsv << msBefore(command.time) << ",0x" << std::hex << (int) command.command << std::dec << ",";
+		for(int i=0;i<command.replySize && i<(int) sizeof(command.reply);i++) commandsCsv << (i>0?" ":"") << (int) command.reply[i];
+		commandsCsv << "\n";
+	}
+	std::cout << "Exported " << frames.size() << " frames, " << detections.size() << " detections, " << reports.size() << " reports and "
+		<< commands.size() << " commands to " << outDir << " (dumped because of \"" << header.reason << "\")" << std::endl;
+}
@@ -0,0 +1,101 @@
+#ifndef FLIGHTRECORDER_HPP
+#define FLIGHTRECORDER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "picoi2c.hpp"
+#include "tensor.hpp"
+
+//What the CNN saw, shrunk so that a few seconds of them fit in memory
+#define RECORDER_THUMB_HEIGHT 60
+#define RECORDER_THUMB_WIDTH 80
+//About 8s at 30fps, longer when the detection rate is lower
+#define RECORDER_NUM_FRAMES 256
+#define RECORDER_NUM_EVENTS 1024
+
+typedef struct recordedFrame{
+	uint32_t sequence;
+	uint64_t captureTime;
+	uint8_t rgb[RECORDER_THUMB_HEIGHT*RECORDER_THUMB_WIDTH*3]; //HxWxC
+}recordedFrame;
+
+typedef struct recordedDetection{
+	uint32_t sequence;
+	uint64_t captureTime;
+	uint64_t inferredTime;
+	float result[3]; //x, y, has weed
+	bool stale; //dropped for being older than maxAgeMs
+}recordedDetection;
+
+typedef struct recordedCommand{
+	uint64_t time;
+	uint8_t command; //ZERO_CMDS
+	uint8_t replySize;
+	uint8_t reply[5];
+}recordedCommand;
+
+//Overwrites the oldest and never waits, one writer and any number of readers
+//Each entry is stamped with its index+1 after it's written, so a reader can tell if it changed underneath them
+template<typename T,int N>
+class RecorderRing{
+	public:
+		void push(const T& entry){
+			const uint64_t index = numPushed.load(std::memory_order_relaxed);
+			std::atomic<uint64_t>& stamp = stamps[index%N];
+			stamp.store(0,std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			memcpy((void*) &entries[index%N],&entry,sizeof(T));
+			stamp.store(index+1,std::memory_order_release);
+			numPushed.store(index+1,std::memory_order_release);
+		}
+		//false if index has been overwritten or is being written
+		bool read(uint64_t index,T& out) const{
+			const std::atomic<uint64_t>& stamp = stamps[index%N];
+			if(stamp.load(std::memory_order_acquire)!=index+1) return false;
+			memcpy((void*) &out,(const void*) &entries[index%N],sizeof(T));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return stamp.load(std::memory_order_relaxed)==index+1;
+		}
+		uint64_t getNumPushed() const{ return numPushed.load(std::memory_order_acquire); }
+		static constexpr int capacity = N;
+	private:
+		std::atomic<uint64_t> numPushed;
+		std::atomic<uint64_t> stamps[N];
+		T entries[N];
+};
+
+//The last few seconds of frames, CNN outputs, reports to the I2C process and commands from the Pico
+//Kept in memory shared by every process and only written to disk when something goes wrong
+//The dump is a single binary file, "Weed-Spotter flight <dump> <outDir>" turns it into CSVs and JPEGs
+class FlightRecorder{
+	public:
+		//Must be called before forking, like LatencyStats::init, dumps go in dir
+		static void init(const std::string& dir);
+		//nullptr if init hasn't been called, nothing is recorded then
+		static FlightRecorder* get(){ return shared; }
+		//Each of these has only one writer: preprocessing, publishing (detections and reports) and the I2C process
+		//image is the CNN's normalised CHW input, pixelStats ({means,stdDevs}) undo it
+		void recordFrame(const Tensor& image,const d2& pixelStats,uint32_t sequence,uint64_t captureTime);
+		void recordDetection(const recordedDetection& detection){ detections.push(detection); }
+		void recordReport(const weedReport& report){ reports.push(report); }
+		void recordCommand(const recordedCommand& command){ commands.push(command); }
+		//Writes everything still in the rings to <dir>/flight_<unix ms>_<reason>.bin
+		//Only uses async-signal-safe calls so it can be called from a crash handler, false if the file couldn't be written
+		bool dump(const char *reason);
+		//Dumps on SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT then lets the signal kill us as usual
+		//Handlers are inherited by forks
+		static void dumpOnCrash();
+		//Reads a dump into CSVs and a JPEG per frame
+		static void exportDump(const std::string& fname,const std::string& outDir);
+	private:
+		static FlightRecorder *shared;
+		char dir[256];
+		RecorderRing<recordedFrame,RECORDER_NUM_FRAMES> frames;
+		RecorderRing<recordedDetection,RECORDER_NUM_EVENTS> detections;
+		RecorderRing<weedReport,RECORDER_NUM_EVENTS> reports;
+		RecorderRing<recordedCommand,RECORDER_NUM_EVENTS> commands;
+};
+
+#endif
@@ -0,0 +1,111 @@
+#include "framescheduler.hpp"
+#include "logger.hpp"
+#include <fstream>
+#include <algorithm>
+#include <thread>
+#include <stdexcept>
+
+FrameScheduler::FrameScheduler(const scheduleOptions& options){
+	if(options.targetRate<0 || options.speed<0 || options.footprint<0){
+		throw std::invalid_argument("Detection rate, speed and footprint can't be negative");
+	}
+	if(options.overlap<0 || options.overlap>=1){
+		throw std::invalid_argument("Frame overlap must be from 0 up to 1");
+	}
+	if(options.maxBackoff<1 || options.hardTempLimit<=options.softTempLimit){
+		throw std::invalid_argument("maxBackoff must be at least 1 and the hard temperature limit must be above the soft one");
+	}
+	this->options = options;
+	double rate = options.targetRate;
+	if(options.speed>0 && options.footprint>0){
+		//Each frame can only move on by the part that doesn't overlap
+		rate = std::max(rate,(double) options.speed/(options.footprint*(1-options.overlap)));
+	}
+	targetInterval = rate>0 ? 1/rate : 0;
+}
+
+bool FrameScheduler::parseOption(const std::string& arg,scheduleOptions& options){
+	if(arg.rfind("--rate=",0)==0) options.targetRate = std::stof(arg.substr(7));
+	else if(arg.rfind("--speed=",0)==0) options.speed = std::stof(arg.substr(8));
+	else if(arg.rfind("--footprint=",0)==0) options.footprint = std::stof(arg.substr(12));
+	else if(arg.rfind("--overlap=",0)==0) options.overlap = std::stof(arg.substr(10));
+	else return false;
+	return true;
+}
+
+void FrameScheduler::waitForNextFrame(){
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if(now-lastPressureCheck>=std::chrono::seconds(1)){
+		lastPressureCheck = now;
+		updateBackoff();
+	}
+	if(started){
+		std::chrono::steady_clock::time_point due = lastStart+std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(getInterval()));
+		if(due>now){
+			std::this_thread::sleep_until(due);
+			now = due;
+		}
+	}
+	//If we're late the schedule starts again from now, so there's no burst to catch up
+	lastStart = now;
+	started = true;
+}
+
+void FrameScheduler::recordStage(pipelineStage stage,double seconds){
+	std::atomic<double>& cost = stage==STAGE_PREPROCESS ? preprocessCost : inferCost;
+	double old = cost.load();
+	//Weighted towards recent frames so it follows the CPU clock and model reloads
+	cost.store(old==0 ? seconds : old*0.9+seconds*0.1);
+}
+
+double FrameScheduler::getInterval(){
+	//The stages overlap, so the slowest one is the most the pipeline can do
+	double costInterval = std::max(preprocessCost.load(),inferCost.load());
+	return std::max(targetInterval,costInterval)*backoff;
+}
+
+void FrameScheduler::updateBackoff(){
+	double target = 1;
+	float temperature = readTemperature();
+	if(temperature>options.softTempLimit){
+		double fraction = std::min(1.0,(double) (temperature-options.softTempLimit)/(options.hardTempLimit-options.softTempLimit));
+		target = std::max(target,1+fraction*(options.maxBackoff-1));
+	}
+	float pressure = readCpuPressure();
+	if(pressure>options.cpuPressureLimit){
+		double fraction = std::min(1.0,(double) (pressure-options.cpuPressureLimit)/(1-options.cpuPressureLimit));
+		target = std::max(target,1+fraction*(options.maxBackoff-1));
+	}
+	//Backs off straight away but only speeds up again gradually so that it doesn't oscillate
+	if(target>=backoff) backoff = target;
+	else backoff = std::max(target,backoff*0.9);
+	if(backoff>1.01 && !backingOff){
+		logWarn("Backing off, frames are %.2fx further apart (%.1fC, %.0f%% CPU pressure)",backoff,temperature,pressure*100);
+		backingOff = true;
+	}
+	else if(backoff<=1.01 && backingOff){
+		logInfo("No longer backing off");
+		backingOff = false;
+	}
+}
+
+//----------------------------------------------------
+//PRESSURE
+
+float FrameScheduler::readTemperature(){
+	//In millidegrees, the SoC on a Pi
+	std::ifstream file("/sys/class/thermal/thermal_zone0/temp");
+	int milliDegrees;
+	if(!(file >> milliDegrees)) return -1;
+	return milliDegrees/1000.0f;
+}
+
+float FrameScheduler::readCpuPressure(){
+	//"some avg10=1.23 avg60=..." as a percentage, only if the kernel has PSI
+	std::ifstream file("/proc/pressure/cpu");
+	std::string some;
+	std::string avg10;
+	if(!(file >> some >> avg10) || some!="some" || avg10.rfind("avg10=",0)!=0) return 0;
+	return std::stof(avg10.substr(6))/100;
+}
@@ -0,0 +1,59 @@
+#ifndef FRAMESCHEDULER_HPP
+#define FRAMESCHEDULER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+//0 for any of the rates means as fast as the pipeline can go
+typedef struct scheduleOptions{
+	float targetRate = 0; //detections per second
+	//Ground coverage, the rate needed so that consecutive frames overlap by this much at this speed
+	float speed = 0; //m/s
+	float footprint = 0; //m of ground covered by a frame in the direction of travel
+	float overlap = 0.25f; //fraction of a frame shared with the next
+	//Backs off linearly between these, up to maxBackoff times the interval
+	float softTempLimit = 70.0f; //degrees C
+	float hardTempLimit = 80.0f;
+	float cpuPressureLimit = 0.5f; //fraction of time runnable tasks are waiting for a CPU (/proc/pressure/cpu)
+	float maxBackoff = 4.0f;
+}scheduleOptions;
+
+typedef enum pipelineStage{
+	STAGE_PREPROCESS,
+	STAGE_INFER
+} pipelineStage;
+
+//Decides when the next frame should be started
+//The interval is the larger of the target rate's and what the slowest stage costs, stretched under thermal or CPU pressure
+//Starting no sooner than that means no frame is prepared only to be dropped and the one that's used is as fresh as possible
+class FrameScheduler{
+	public:
+		FrameScheduler(const scheduleOptions& options);
+		//Sleeps until the next frame is due, never to catch up on missed ones
+		void waitForNextFrame();
+		//Called by each stage with how long its work took (not including waiting for a frame)
+		void recordStage(pipelineStage stage,double seconds);
+		//Seconds between frames that's currently being aimed for
+		double getInterval();
+		//"--rate=", "--speed=", "--footprint=", "--overlap=", returns false if arg isn't one of them
+		static bool parseOption(const std::string& arg,scheduleOptions& options);
+	private:
+		scheduleOptions options;
+		double targetInterval = 0;
+		//Moving averages of each stage's cost in seconds, written by both stages
+		std::atomic<double> preprocessCost{0};
+		std::atomic<double> inferCost{0};
+		std::chrono::steady_clock::time_point lastStart;
+		bool started = false;
+		//Pressure is only read once a second
+		std::chrono::steady_clock::time_point lastPressureCheck;
+		double backoff = 1;
+		bool backingOff = false;
+
+		void updateBackoff();
+		static float readTemperature();
+		static float readCpuPressure();
+};
+
+#endif
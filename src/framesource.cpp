@@ -0,0 +1,372 @@
+#include "framesource.hpp"
+#include "logger.hpp"
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
+#include <filesystem>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+//----------------------------------------------------
+//LIVE
+
+GstSource::GstSource(const std::string& pipelineDesc,bool loop,bool lossless){
+	this->loop = loop;
+	this->lossless = lossless;
+	gst_init(NULL,NULL);
+	GError *error = nullptr;
+	pipeline = gst_parse_launch(pipelineDesc.c_str(),&error);
+	if(!pipeline){
+		std::string message = error->message;
+		g_error_free(error);
+		throw std::runtime_error("Pipeline error: "+message);
+	}
+	appsink = gst_bin_get_by_name(GST_BIN(pipeline),"sink");
+	//The appsink gives us each sample as it arrives rather than us polling it
+	GstAppSinkCallbacks callbacks = {};
+	callbacks.new_sample = GstSource::onNewSample;
+	callbacks.eos = GstSource::onEos;
+	gst_app_sink_set_callbacks(GST_APP_SINK(appsink),&callbacks,this,NULL);
+	GstElement *decoder = gst_bin_get_by_name(GST_BIN(pipeline),"decoder");
+	if(decoder){
+		GstPad *decoderSink = gst_element_get_static_pad(decoder,"sink");
+		if(decoderSink){
+			gst_pad_add_probe(decoderSink,GST_PAD_PROBE_TYPE_BUFFER,GstSource::onDecoderInput,this,NULL);
+			gst_object_unref(decoderSink);
+		}
+		gst_object_unref(decoder);
+	}
+}
+
+GstSource::~GstSource(){
+	//Lets a lossless onNewSample stop waiting
+	samples.close();
+	gst_element_set_state(pipeline,GST_STATE_NULL);
+	gst_object_unref(appsink);
+	gst_object_unref(pipeline);
+}
+
+bool GstSource::processNextFrame(const std::function<void(const videoFrame&)>& process,int timeoutMs){
+	if(finished) return false;
+	std::shared_ptr<GstSample> *item = samples.pop(timeoutMs);
+	if(!item){
+		//Nothing came, e.g. a corrupt file or the streamer has gone
+		if(!samples.isClosed()) checkForError();
+		//Closed by onEos
+		if(samples.isClosed()){
+			if(loop){
+				//Back to the start, the flush clears the EOS
+				samples.reopen();
+				gst_element_seek_simple(pipeline,GST_FORMAT_TIME,(GstSeekFlags)(GST_SEEK_FLAG_FLUSH|GST_SEEK_FLAG_KEY_UNIT),0);
+			}
+			else finished = true;
+		}
+		return false;
+	}
+	//Given back to GStreamer as soon as we're done rather than when the slot is next used
+	GstSample *sample = item->get();
+	GstVideoInfo info;
+	if(!gst_video_info_from_caps(&info,gst_sample_get_caps(sample))){
+		item->reset();
+		throw std::runtime_error("GStreamer frame has no video caps");
+	}
+	GstBuffer *gstBuffer = gst_sample_get_buffer(sample);
+	//Decoders can pad their planes, this gives us the real offsets and strides
+	GstVideoFrame mapped;
+	if(!gst_video_frame_map(&mapped,&info,gstBuffer,GST_MAP_READ)){
+		item->reset();
+		return false;
+	}
+	videoFrame frame;
+	frame.height = GST_VIDEO_INFO_HEIGHT(&info);
+	frame.width = GST_VIDEO_INFO_WIDTH(&info);
+	frame.data = (const uint8_t*) GST_VIDEO_FRAME_PLANE_DATA(&mapped,0);
+	frame.stride = GST_VIDEO_FRAME_PLANE_STRIDE(&mapped,0);
+	frame.sequence = sequence++;
+	frame.timestamp = GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(gstBuffer)) ? GST_BUFFER_PTS(gstBuffer) : 0;
+	frame.captureTime = captureTime(sample,gstBuffer);
+	switch(GST_VIDEO_INFO_FORMAT(&info)){
+		case GST_VIDEO_FORMAT_RGB:
+			frame.format = FRAME_RGB;
+			break;
+		case GST_VIDEO_FORMAT_I420:
+			frame.format = FRAME_I420;
+			frame.uData = (const uint8_t*) GST_VIDEO_FRAME_PLANE_DATA(&mapped,1);
+			frame.vData = (const uint8_t*) GST_VIDEO_FRAME_PLANE_DATA(&mapped,2);
+			frame.chromaStride = GST_VIDEO_FRAME_PLANE_STRIDE(&mapped,1);
+			break;
+		case GST_VIDEO_FORMAT_NV12:
+			frame.format = FRAME_NV12;
+			frame.uData = (const uint8_t*) GST_VIDEO_FRAME_PLANE_DATA(&mapped,1);
+			frame.vData = frame.uData+1;
+			frame.chromaStride = GST_VIDEO_FRAME_PLANE_STRIDE(&mapped,1);
+			break;
+		default:
+			gst_video_frame_unmap(&mapped);
+			item->reset();
+			throw std::runtime_error(std::string("Unexpected GStreamer format ")+GST_VIDEO_INFO_NAME(&info));
+	}
+	try{
+		process(frame);
+	}
+	catch(...){
+		gst_video_frame_unmap(&mapped);
+		item->reset();
+		throw;
+	}
+	gst_video_frame_unmap(&mapped);
+	item->reset();
+	return true;
+}
+
+void GstSource::checkForError(){
+	GstBus *bus = gst_element_get_bus(pipeline);
+	GstMessage *message = gst_bus_pop_filtered(bus,GST_MESSAGE_ERROR);
+	gst_object_unref(bus);
+	if(!message) return;
+	GError *error = nullptr;
+	gchar *debug = nullptr;
+	gst_message_parse_error(message,&error,&debug);
+	std::string text = error ? error->message : "unknown error";
+	if(error) g_error_free(error);
+	g_free(debug);
+	gst_message_unref(message);
+	//It won't recover, every later call returns false
+	samples.close();
+	finished = true;
+	throw std::runtime_error("Pipeline error: "+text);
+}
+
+uint64_t GstSource::captureTime(GstSample *sample,GstBuffer *gstBuffer){
+	if(liveTimestamps && GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(gstBuffer))){
+		//Running time plus when the pipeline started is a time on the pipeline's clock, the monotonic system clock
+		guint64 runningTime = gst_segment_to_running_time(gst_sample_get_segment(sample),GST_FORMAT_TIME,GST_BUFFER_PTS(gstBuffer));
+		if(GST_CLOCK_TIME_IS_VALID(runningTime)) return gst_element_get_base_time(pipeline)+runningTime;
+	}
+	//The best we can do is when we got it
+	return monotonicNow();
+}
+
+GstFlowReturn GstSource::onNewSample(GstAppSink *sink,gpointer data){
+	GstSource *source = (GstSource*) data;
+	GstSample *sample = gst_app_sink_pull_sample(sink);
+	if(!sample) return GST_FLOW_OK;
+	LatencyStats *stats = LatencyStats::get();
+	GstBuffer *gstBuffer = gst_sample_get_buffer(sample);
+	if(stats && GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(gstBuffer))){
+		//Decoders keep the PTS of what they were given
+		const uint64_t decoderStart = source->decoderInputs.take(GST_BUFFER_PTS(gstBuffer));
+		stats->record(LATENCY_DECODE,decoderStart,monotonicNow());
+		if(source->liveTimestamps) stats->record(LATENCY_RECEIVE,source->captureTime(sample,gstBuffer),decoderStart);
+	}
+	//Holding up the streaming thread is what stops the decoder getting ahead
+	while(source->lossless && !source->samples.waitUntilTaken(1000)){
+		if(source->samples.isClosed()){
+			gst_sample_unref(sample);
+			return GST_FLOW_EOS;
+		}
+	}
+	//Anything still in the slot was dropped, replacing it unrefs it
+	source->samples.writeSlot() = std::shared_ptr<GstSample>(sample,gst_sample_unref);
+	source->samples.publish();
+	return GST_FLOW_OK;
+}
+
+GstPadProbeReturn GstSource::onDecoderInput(GstPad *pad,GstPadProbeInfo *info,gpointer data){
+	GstBuffer *gstBuffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	if(LatencyStats::get() && gstBuffer && GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(gstBuffer))){
+		((GstSource*) data)->decoderInputs.start(GST_BUFFER_PTS(gstBuffer),monotonicNow());
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+void GstSource::onEos(GstAppSink *sink,gpointer data){
+	((GstSource*) data)->samples.close();
+}
+
+std::string GstSource::outputCaps(bool nativeYuv){
+	//Without videoconvert we get whatever the decoder makes, we can convert both of these ourselves
+	if(nativeYuv) return "video/x-raw,format=(string){I420,NV12}";
+	return "videoconvert ! video/x-raw,format=RGB";
+}
+
+ShmSource::ShmSource(const std::string& socketPath,int height,int width,bool nativeYuv) : GstSource(
+	//shmsink sends each access unit as it is, the buffers point straight into the shared memory
+	"shmsrc socket-path="+socketPath+" is-live=true do-timestamp=true "+
+	" ! video/x-h264,stream-format=byte-stream,alignment=au ! h264parse ! decodebin name=decoder ! "+
+	outputCaps(nativeYuv)+",width="+std::to_string(width)+
+	",height="+std::to_string(height)+" ! appsink name=sink",false,false){
+	//Stamped with when each frame arrived, so this doesn't include exposure or rpicam-vid's encoding (see CAPTURE_AT_ARRIVAL)
+	liveTimestamps = true;
+	//No clock sync, a frame is ready as soon as it's decoded
+	g_object_set(G_OBJECT(appsink),"emit-signals",FALSE,"max-buffers",1,"drop",TRUE,"sync",FALSE,NULL);
+	//shmsrc fails straight away if the streamer hasn't made the socket yet
+	const auto deadline = std::chrono::steady_clock::now()+std::chrono::seconds(30);
+	while(!std::filesystem::exists(socketPath)){
+		if(std::chrono::steady_clock::now()>deadline){
+			throw std::runtime_error("The streamer never shared its frames at "+socketPath);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	gst_element_set_state(pipeline,GST_STATE_PLAYING);
+}
+
+CameraSource::CameraSource(int height,int width,std::function<void(const videoFrame&)> listener) : camera(StreamRole::VideoRecording,width,height){
+	camera.setFrameListener(std::move(listener));
+	camera.startStreaming();
+}
+
+CameraSource::~CameraSource(){
+	camera.stopStreaming();
+}
+
+bool CameraSource::processNextFrame(const std::function<void(const videoFrame&)>& process,int timeoutMs){
+	return camera.processLatestFrame(process,timeoutMs);
+}
+
+//----------------------------------------------------
+//REPLAY
+
+long ReplaySource::nextFrameIndex(long numFrames){
+	if(finished || numFrames<=0){
+		finished = true;
+		return -1;
+	}
+	long index = lastIndex+1;
+	if(options.realTime){
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if(lastIndex<0) startTime = now;
+		const double framePeriod = 1.0/options.fps;
+		long due = (long) (std::chrono::duration<double>(now-startTime).count()/framePeriod);
+		if(due>index){
+			index = due; //We were too slow for the ones in between
+		}
+		else{
+			std::this_thread::sleep_until(startTime+std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double>(index*framePeriod)));
+		}
+	}
+	lastIndex = index;
+	if(index>=numFrames){
+		if(!options.loop){
+			finished = true;
+			return -1;
+		}
+		index %= numFrames;
+	}
+	return index;
+}
+
+uint64_t ReplaySource::frameTimestamp() const{
+	//lastIndex keeps counting when looping so that the timestamps keep going up
+	return (uint64_t) (lastIndex*1e9/options.fps);
+}
+
+VideoFileSource::VideoFileSource(const std::string& fname,const replayOptions& options,bool nativeYuv) : GstSource(
+	"filesrc location=\""+fname+"\" ! decodebin name=decoder ! "+outputCaps(nativeYuv)+" ! appsink name=sink",options.loop,!options.realTime){
+	if(!std::filesystem::is_regular_file(fname)){
+		throw std::invalid_argument("Could not open video "+fname);
+	}
+	//Real time drops frames like RTSP, otherwise the decoder waits for us (see onNewSample)
+	g_object_set(G_OBJECT(appsink),"emit-signals",FALSE,"max-buffers",1,
+		"drop",options.realTime?TRUE:FALSE,"sync",options.realTime?TRUE:FALSE,NULL);
+	gst_element_set_state(pipeline,GST_STATE_PLAYING);
+}
+
+JpegDirSource::JpegDirSource(const std::string& dir,const replayOptions& options) : ReplaySource(options){
+	if(options.fps<=0){
+		throw std::invalid_argument("Replay fps must be positive");
+	}
+	for(const auto& entry: std::filesystem::directory_iterator(dir)){
+		std::string extension = entry.path().extension().string();
+		if(entry.is_regular_file() && (extension==".jpg" || extension==".jpeg")){
+			fnames.push_back(entry.path().string());
+		}
+	}
+	if(fnames.empty()){
+		throw std::invalid_argument("No JPEGs in "+dir);
+	}
+	//Shorter first puts photo_2 before photo_10
+	std::sort(fnames.begin(),fnames.end(),[](const std::string& a,const std::string& b){
+		return a.size()!=b.size() ? a.size()<b.size() : a<b;
+	});
+	logInfo("Replaying %zu JPEGs from %s",fnames.size(),dir);
+}
+
+bool JpegDirSource::processNextFrame(const std::function<void(const videoFrame&)>& process,int timeoutMs){
+	long index = nextFrameIndex(fnames.size());
+	if(index<0) return false;
+	//As if it was captured when it was due rather than after it's been decoded
+	uint64_t captureTime = monotonicNow();
+	CameraImage image = CameraImage::loadJPEG(fnames[index]);
+	videoFrame frame;
+	frame.data = image.data.get();
+	frame.height = image.height;
+	frame.width = image.width;
+	frame.stride = image.width*3;
+	frame.format = FRAME_RGB;
+	frame.sequence = index;
+	frame.timestamp = frameTimestamp();
+	frame.captureTime = captureTime;
+	process(frame);
+	return true;
+}
+
+RawDumpSource::RawDumpSource(const std::string& fname,int height,int width,frameFormat format,const replayOptions& options) : ReplaySource(options){
+	if(height<=0 || width<=0){
+		throw std::invalid_argument("Raw frame dimensions must be positive");
+	}
+	if(options.fps<=0){
+		throw std::invalid_argument("Replay fps must be positive");
+	}
+	this->height = height;
+	this->width = width;
+	this->format = format;
+	this->frameBytes = frameSize(format,height,width);
+	int fd = open(fname.c_str(),O_RDONLY);
+	if(fd<0){
+		throw std::runtime_error("Could not open file "+fname);
+	}
+	struct stat fileStat;
+	fstat(fd,&fileStat);
+	fileSize = fileStat.st_size;
+	numFrames = fileSize/frameBytes;
+	if(numFrames==0){
+		close(fd);
+		throw std::invalid_argument(fname+" doesn't have a whole frame in it");
+	}
+	if(fileSize%frameBytes!=0){
+		logWarn("%s has %zu bytes left over, check the frame size and format",fname,fileSize%frameBytes);
+	}
+	//Skipped frames are never read
+	void *addr = mmap(nullptr,fileSize,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(addr==MAP_FAILED){
+		throw std::runtime_error("Could not mmap "+fname);
+	}
+	fileData = reinterpret_cast<const uint8_t*>(addr);
+	logInfo("Replaying %ld raw frames from %s",numFrames,fname);
+}
+
+RawDumpSource::~RawDumpSource(){
+	munmap((void*)fileData,fileSize);
+}
+
+bool RawDumpSource::processNextFrame(const std::function<void(const videoFrame&)>& process,int timeoutMs){
+	long index = nextFrameIndex(numFrames);
+	if(index<0) return false;
+	videoFrame frame;
+	frame.height = height;
+	frame.width = width;
+	frame.format = format;
+	setUnpaddedPlanes(frame,fileData+index*frameBytes);
+	frame.sequence = index;
+	frame.timestamp = frameTimestamp();
+	frame.captureTime = monotonicNow();
+	process(frame);
+	return true;
+}
@@ -0,0 +1,143 @@
+#ifndef FRAMESOURCE_HPP
+#define FRAMESOURCE_HPP
+
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "videoframe.hpp"
+#include "cameraaccess.hpp"
+#include "latestqueue.hpp"
+#include "latency.hpp"
+
+//Where the inference loop gets its frames from
+class FrameSource{
+	public:
+		virtual ~FrameSource(){}
+		//Calls process with the next frame on this thread, frame.data is only valid inside process
+		//Returns false if there wasn't a frame within timeoutMs or the source has finished
+		virtual bool processNextFrame(const std::function<void(const videoFrame&)>& process,int timeoutMs = 1000) = 0;
+		//Live sources never finish
+		virtual bool isFinished() const{ return false; }
+};
+
+typedef struct replayOptions{
+	//Real time gives frames at fps and skips the ones we were too slow for, like a camera would
+	//Otherwise every frame is given as soon as it's asked for
+	bool realTime = true;
+	float fps = 30.0f;
+	bool loop = false;
+}replayOptions;
+
+//----------------------------------------------------
+//LIVE
+
+//Decodes with GStreamer, used for the RTSP stream and video files
+//nativeYuv skips videoconvert and gives the decoder's I420 or NV12 planes, which we convert ourselves (see videoFrameToInput)
+class GstSource : public FrameSource{
+	public:
+		~GstSource();
+		bool processNextFrame(const std::function<void(const videoFrame&)>& process,int timeoutMs = 1000) override;
+		bool isFinished() const override{ return finished; }
+	protected:
+		//pipelineDesc must end in an appsink called sink which gives RGB, I420 or NV12
+		//If it has an element called decoder, the time spent decoding is recorded (see LatencyStats)
+		//lossless holds up GStreamer until each frame has been taken, otherwise only the latest is kept
+		GstSource(const std::string& pipelineDesc,bool loop,bool lossless);
+		//The caps to put between the decoder and the appsink
+		static std::string outputCaps(bool nativeYuv);
+		GstElement *pipeline = nullptr;
+		GstElement *appsink = nullptr;
+		bool loop = false;
+		bool lossless = false;
+		//The buffers' PTS are from the pipeline's clock (live sources), otherwise they're only a position in the video
+		bool liveTimestamps = false;
+		bool finished = false;
+		uint32_t sequence = 0;
+	private:
+		//Filled on GStreamer's streaming thread
+		LatestQueue<std::shared_ptr<GstSample>> samples;
+		//When each frame went into the decoder, by PTS
+		PendingStamps decoderInputs;
+		uint64_t captureTime(GstSample *sample,GstBuffer *gstBuffer);
+		//A failed pipeline posts an error rather than sending EOS, throws it if there is one
+		void checkForError();
+		static GstFlowReturn onNewSample(GstAppSink *sink,gpointer data);
+		static GstPadProbeReturn onDecoderInput(GstPad *pad,GstPadProbeInfo *info,gpointer data);
+		static void onEos(GstAppSink *sink,gpointer data);
+};
+
+//The streamer's H.264, shared with us through shmsink rather than over RTSP, only the latest frame is kept
+class ShmSource : public GstSource{
+	public:
+		ShmSource(const std::string& socketPath,int height,int width,bool nativeYuv = false);
+};
+
+//Owns the camera, see CameraAccess::startStreaming
+class CameraSource : public FrameSource{
+	public:
+		//listener sees every frame on the camera's thread (e.g. to give them to the streamer)
+		CameraSource(int height,int width,std::function<void(const videoFrame&)> listener = nullptr);
+		~CameraSource();
+		bool processNextFrame(const std::function<void(const videoFrame&)>& process,int timeoutMs = 1000) override;
+	private:
+		CameraAccess camera;
+};
+
+//----------------------------------------------------
+//REPLAY
+
+//Anything that can be replayed from a file, lets the detection loop run without a camera
+class ReplaySource : public FrameSource{
+	public:
+		bool isFinished() const override{ return finished; }
+	protected:
+		ReplaySource(const replayOptions& options) : options(options){}
+		replayOptions options;
+		bool finished = false;
+		//Returns the index of the frame to give next or -1 if we've run out
+		//In real time this waits for the next frame to be due and skips any that were missed
+		long nextFrameIndex(long numFrames);
+		//Of the frame nextFrameIndex just gave, at fps from the start
+		uint64_t frameTimestamp() const;
+	private:
+		std::chrono::steady_clock::time_point startTime;
+		long lastIndex = -1;
+};
+
+//Video files go through GStreamer, real time is done with the appsink's clock sync
+class VideoFileSource : public GstSource{
+	public:
+		VideoFileSource(const std::string& fname,const replayOptions& options,bool nativeYuv = false);
+};
+
+//Every .jpg in a directory in natural order (photo_2 before photo_10), decoded as they're needed
+class JpegDirSource : public ReplaySource{
+	public:
+		JpegDirSource(const std::string& dir,const replayOptions& options);
+		bool processNextFrame(const std::function<void(const videoFrame&)>& process,int timeoutMs = 1000) override;
+	private:
+		std::vector<std::string> fnames;
+};
+
+//Frames one after another with no header or padding
+//e.g. from "ffmpeg -i video.mp4 -f rawvideo -pix_fmt rgb24 dump.raw"
+class RawDumpSource : public ReplaySource{
+	public:
+		RawDumpSource(const std::string& fname,int height,int width,frameFormat format,const replayOptions& options);
+		~RawDumpSource();
+		bool processNextFrame(const std::function<void(const videoFrame&)>& process,int timeoutMs = 1000) override;
+	private:
+		const uint8_t *fileData = nullptr; //mmapped
+		size_t fileSize = 0;
+		size_t frameBytes = 0;
+		long numFrames = 0;
+		int height;
+		int width;
+		frameFormat format;
+};
+
+#endif
@@ -5,6 +5,8 @@
 #include <string>
 
 extern const std::string currDir;
+//Where the streamer shares its H.264 with the inference process (see ShmSource)
+#define H264_SHM_SOCKET "/tmp/weed-spotter-h264"
 
 typedef std::vector<float> d1;
 typedef std::vector<d1> d2; 
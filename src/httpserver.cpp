@@ -1,68 +1,136 @@
 #include "httpserver.hpp"
+#include "logger.hpp"
+#include "latency.hpp"
+#include "videoframe.hpp"
+#include "snapshotring.hpp"
+#include "jpegencoder.hpp"
+#include "flightrecorder.hpp"
 
-#include <signal.h>
 #include <unistd.h>
-#include <iostream>
 #include <sys/types.h>
 #include <cstring>
 #include <string>
 #include <regex>
 #include <filesystem>
 #include <climits>
+#include <mutex>
+#include <chrono>
 
-static pid_t rpicamPid;
+static const std::string photosDir = "/home/alistair/pictures";
+//Handlers can run at the same time, held whilst a photo is queued so that a rejected one doesn't use up an id
+static std::mutex photoIdMutex;
 static int photoId = -1;
+//Created by startHttpServer, the handlers run on CivetWeb's threads
+static JpegEncoder *encoder = nullptr;
 
 int takePhotoHandler(struct mg_connection *conn,void *){
-	mg_printf(conn,
-		"HTTP/1.1 200 OK\r\n"
-		"Content-Type: text/plain\r\n"
-		"Connection: close\r\n\r\n"
-	);
-	if(rpicamPid>0){
-		photoId++;
-		pid_t pid = fork();
-		if(pid==0){
-			std::string locationStr = "location=/home/alistair/pictures/photo_"+std::to_string(photoId)+".jpg";
-			execlp("timeout","timeout",
-				"5", //Max wait of 5 seconds, the stream is more important than the photo
-				"gst-launch-1.0",
-				"-e",
-				"rtspsrc","location=rtsp://127.0.0.1:8554/stream","latency=50", //wait 50ms for all rtsp packets
-				"!","rtph264depay",
-				"!","avdec_h264",
-				"!","videoconvert",
-				"!","jpegenc",
-				"!","multifilesink",locationStr.c_str(),"max-files=1",
-				(char*) NULL
-			);
-			throw std::runtime_error("Could not take photo");
+	const uint64_t start = monotonicNow();
+	SnapshotRing *ring = SnapshotRing::get();
+	try{
+		if(!ring){
+			throw std::runtime_error("Frames aren't being shared with the server");
 		}
-		std::cout << "Photo is being taken" << std::endl;
+		uint32_t sequence;
+		CameraImage photo = ring->latest(&sequence);
+		//The file is written by the encoder's thread, we don't wait for it
+		int id;
+		{
+			std::lock_guard<std::mutex> lock(photoIdMutex);
+			id = photoId+1;
+			std::shared_future<jpegBytes> jpeg = encoder->encode(std::move(photo),photosDir+"/photo_"+std::to_string(id)+".jpg");
+			//Only ready straight away if it was turned down, get() throws why
+			if(jpeg.wait_for(std::chrono::seconds(0))==std::future_status::ready) jpeg.get();
+			photoId = id;
+		}
+		logInfo("Taking photo %d from frame %u",id,sequence);
 		mg_printf(conn,
 			"HTTP/1.1 200 OK\r\n"
 			"Content-Type: text/plain\r\n"
 			"Connection: close\r\n\r\n"
-			"Take photo triggered\n"
+			"Took photo_%d.jpg\n",id
+		);
+		if(LatencyStats *stats = LatencyStats::get()) stats->record(LATENCY_HTTP_REQUEST,start,monotonicNow());
+		return 200;
+	}
+	catch(const std::exception& e){
+		logError("Could not take photo: %s",e.what());
+		mg_printf(conn,
+			"HTTP/1.1 503 Service Unavailable\r\n"
+			"Content-Type: text/plain\r\n"
+			"Connection: close\r\n\r\n"
+			"Could not take photo: %s\n",e.what()
+		);
+		if(LatencyStats *stats = LatencyStats::get()) stats->record(LATENCY_HTTP_REQUEST,start,monotonicNow());
+		return 503;
+	}
+}
+
+int snapshotHandler(struct mg_connection *conn,void *){
+	SnapshotRing *ring = SnapshotRing::get();
+	try{
+		if(!ring){
+			throw std::runtime_error("Frames aren't being shared with the server");
+		}
+		//Not saved, only waits for the encoding
+		jpegBytes jpeg = encoder->encode(ring->latest()).get();
+		mg_printf(conn,
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: image/jpeg\r\n"
+			"Content-Length: %zu\r\n"
+			"Cache-Control: no-store\r\n"
+			"Connection: close\r\n\r\n",jpeg->size()
 		);
+		mg_write(conn,jpeg->data(),jpeg->size());
 		return 200;
 	}
-	else{
-		std::cerr << "rpicam-vid PID is invalid or not set" << std::endl;
+	catch(const std::exception& e){
+		mg_printf(conn,
+			"HTTP/1.1 503 Service Unavailable\r\n"
+			"Content-Type: text/plain\r\n"
+			"Connection: close\r\n\r\n"
+			"Could not take snapshot: %s\n",e.what()
+		);
+		return 503;
+	}
+}
+
+int latencyHandler(struct mg_connection *conn,void *){
+	LatencyStats *stats = LatencyStats::get();
+	std::string body = stats ? stats->dump() : "Latency isn't being recorded\n";
+	const char *query = mg_get_request_info(conn)->query_string;
+	if(stats && query && std::string(query)=="reset") stats->reset();
+	mg_printf(conn,
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/plain\r\n"
+		"Connection: close\r\n\r\n"
+		"%s",body.c_str()
+	);
+	return 200;
+}
+
+int flightRecorderHandler(struct mg_connection *conn,void *){
+	FlightRecorder *recorder = FlightRecorder::get();
+	if(!recorder || !recorder->dump("http")){
 		mg_printf(conn,
 			"HTTP/1.1 500 Internal Server Error\r\n"
 			"Content-Type: text/plain\r\n"
 			"Connection: close\r\n\r\n"
-			"Server error: PID not set");
+			"Could not dump the flight recorder\n"
+		);
 		return 500;
 	}
+	mg_printf(conn,
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/plain\r\n"
+		"Connection: close\r\n\r\n"
+		"Flight recorder dumped\n"
+	);
+	return 200;
 }
 
-void startHttpServer(int pipefd[2]){
-	close(pipefd[1]);
-	read(pipefd[0],&rpicamPid,sizeof(pid_t));
-	close(pipefd[0]);
+void startHttpServer(){
 	photoId = findHighestPhotoId();
+	encoder = new JpegEncoder();
 
 	const char *options[] = {
 		"listening_ports","8080",
@@ -75,14 +143,17 @@ void startHttpServer(int pipefd[2]){
 		throw std::runtime_error("Failed to start CivetWeb HTTP server");
 	}
 	mg_set_request_handler(ctx,"/take_photo",takePhotoHandler,nullptr);
-	std::cout << "HTTP server listening on port 8080" << std::endl;
+	mg_set_request_handler(ctx,"/snapshot.jpg",snapshotHandler,nullptr);
+	mg_set_request_handler(ctx,"/latency",latencyHandler,nullptr);
+	mg_set_request_handler(ctx,"/flight_recorder",flightRecorderHandler,nullptr);
+	logInfo("HTTP server listening on port 8080");
 
 	while(true) sleep(1);
 	mg_stop(ctx);
 }
 
 int findHighestPhotoId(void){
-	const std::string folderPath = "/home/alistair/pictures";
+	const std::string folderPath = photosDir;
 	std::regex photoFnamePattern(R"(photo_(\d+)\.jpg)");
 	//If we don't find any photos return -1 which will give the first photo as "photo_0.jpg"
 	int maxIndex = -1;
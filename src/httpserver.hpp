@@ -4,7 +4,14 @@
 #include <civetweb.h>
 
 int findHighestPhotoId(void);
+//Saves the newest frame from the SnapshotRing as photo_<n>.jpg, replies as soon as it's been copied
 int takePhotoHandler(struct mg_connection *conn, void *);
-void startHttpServer(int pipefd[2]);
+//The newest frame as a JPEG, nothing is saved
+int snapshotHandler(struct mg_connection *conn, void *);
+//The latency histograms as text, "/latency?reset" clears them afterwards
+int latencyHandler(struct mg_connection *conn, void *);
+//Writes the FlightRecorder to disk
+int flightRecorderHandler(struct mg_connection *conn, void *);
+void startHttpServer();
 
 #endif
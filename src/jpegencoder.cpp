@@ -0,0 +1,58 @@
+#include "jpegencoder.hpp"
+#include "logger.hpp"
+#include <stdexcept>
+
+JpegEncoder::JpegEncoder(int quality,int maxPending){
+	this->quality = quality;
+	this->maxPending = maxPending;
+	worker = std::thread(&JpegEncoder::workerLoop,this);
+}
+
+JpegEncoder::~JpegEncoder(){
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	jobReady.notify_one();
+	//Anything already queued is still finished
+	worker.join();
+}
+
+std::shared_future<jpegBytes> JpegEncoder::encode(CameraImage&& image,const std::string& fname){
+	std::promise<jpegBytes> promise;
+	std::shared_future<jpegBytes> future = promise.get_future().share();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(jobs.size()>=maxPending){
+			promise.set_exception(std::make_exception_ptr(std::runtime_error("Too many photos waiting to be encoded")));
+			return future;
+		}
+		jobs.push_back({std::move(image),fname,std::move(promise)});
+	}
+	jobReady.notify_one();
+	return future;
+}
+
+void JpegEncoder::workerLoop(){
+	while(true){
+		std::unique_lock<std::mutex> lock(mutex);
+		jobReady.wait(lock,[this]{ return stopping || !jobs.empty(); });
+		if(jobs.empty()) return; //must be stopping
+		encodeJob job = std::move(jobs.front());
+		jobs.pop_front();
+		lock.unlock();
+		try{
+			jpegBytes bytes = std::make_shared<const std::vector<uint8_t>>(job.image.encodeJPEG(quality));
+			//Only the encoding was needed, the raw pixels can go now
+			job.image.data.reset();
+			if(!job.fname.empty()){
+				CameraImage::writeJPEG(job.fname,*bytes);
+				logInfo("Saved %s",job.fname);
+			}
+			job.promise.set_value(bytes);
+		}
+		catch(...){
+			job.promise.set_exception(std::current_exception());
+		}
+	}
+}
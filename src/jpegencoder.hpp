@@ -0,0 +1,44 @@
+#ifndef JPEGENCODER_HPP
+#define JPEGENCODER_HPP
+
+#include "cameraimage.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//Shared so that the same bytes can be given to a file and any number of HTTP responses
+typedef std::shared_ptr<const std::vector<uint8_t>> jpegBytes;
+
+//Encodes photos on its own thread so that whoever took them can carry on straight away
+class JpegEncoder{
+	public:
+		//maxPending is how many can be waiting before more are turned away
+		JpegEncoder(int quality = 75,int maxPending = 4);
+		~JpegEncoder();
+		//Takes the image's buffer rather than copying it, fname is where to save it or empty to keep it in memory only
+		//Never blocks, if too many are pending the future holds an exception instead
+		std::shared_future<jpegBytes> encode(CameraImage&& image,const std::string& fname = "");
+	private:
+		typedef struct encodeJob{
+			CameraImage image;
+			std::string fname;
+			std::promise<jpegBytes> promise;
+		}encodeJob;
+		int quality;
+		size_t maxPending;
+		std::deque<encodeJob> jobs;
+		std::mutex mutex;
+		std::condition_variable jobReady;
+		bool stopping = false;
+		std::thread worker;
+
+		void workerLoop();
+};
+
+#endif
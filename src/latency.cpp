@@ -0,0 +1,167 @@
+#include "latency.hpp"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <csignal>
+#include <cmath>
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+#include <iostream>
+#include <stdexcept>
+#include <new>
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,"The histograms are shared between processes and so can't have locks");
+
+LatencyStats *LatencyStats::shared = nullptr;
+
+static const char *stageNames[NUM_LATENCY_STAGES] = {
+	"encode",
+	"receive",
+	"decode",
+	"acquire",
+	"preprocess",
+	"infer",
+	"publish",
+	"i2cReply",
+	"shoot",
+	"httpRequest",
+	"captureToPublish",
+	"captureToReply",
+	"captureToShoot"
+};
+
+//In place of captureTo* when the capture time is only when the frame arrived
+static const char *arrivalNames[NUM_LATENCY_STAGES-LATENCY_CAPTURE_TO_PUBLISH] = {
+	"arrivalToPublish",
+	"arrivalToReply",
+	"arrivalToShoot"
+};
+
+void LatencyStats::init(captureClock clock){
+	if(shared) return;
+	//Anonymous and shared, so it's inherited by every fork
+	void *addr = mmap(nullptr,sizeof(LatencyStats),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if(addr==MAP_FAILED){
+		throw std::runtime_error("Could not map the latency histograms");
+	}
+	shared = new(addr) LatencyStats();
+	shared->clock = clock;
+}
+
+void LatencyStats::record(latencyStage stage,uint64_t startNs,uint64_t endNs){
+	if(startNs==0 || endNs==0 || endNs<startNs) return;
+	const uint64_t ns = endNs-startNs;
+	latencyHistogram& histogram = histograms[stage];
+	histogram.buckets[bucketIndex(ns)].fetch_add(1,std::memory_order_relaxed);
+	histogram.count.fetch_add(1,std::memory_order_relaxed);
+	histogram.totalNs.fetch_add(ns,std::memory_order_relaxed);
+	uint64_t max = histogram.maxNs.load(std::memory_order_relaxed);
+	while(ns>max && !histogram.maxNs.compare_exchange_weak(max,ns,std::memory_order_relaxed));
+}
+
+void LatencyStats::reset(){
+	for(latencyHistogram& histogram: histograms){
+		for(std::atomic<uint64_t>& bucket: histogram.buckets) bucket = 0;
+		histogram.count = 0;
+		histogram.totalNs = 0;
+		histogram.maxNs = 0;
+	}
+}
+
+std::string LatencyStats::dump() const{
+	std::string result;
+	char line[160];
+	snprintf(line,sizeof(line),"%-18s %8s %9s %9s %9s %9s %9s\n","stage (ms)","count","mean","p50","p90","p99","max");
+	result += line;
+	for(int s=0;s<NUM_LATENCY_STAGES;s++){
+		const latencyHistogram& histogram = histograms[s];
+		const uint64_t count = histogram.count.load();
+		if(count==0) continue;
+		const char *name = clock==CAPTURE_AT_ARRIVAL && s>=LATENCY_CAPTURE_TO_PUBLISH ? arrivalNames[s-LATENCY_CAPTURE_TO_PUBLISH] : stageNames[s];
+		snprintf(line,sizeof(line),"%-18s %8llu %9.2f %9.2f %9.2f %9.2f %9.2f\n",name,(unsigned long long) count,
+			histogram.totalNs.load()/1e6/count,percentile(histogram,0.5)/1e6,percentile(histogram,0.9)/1e6,
+			percentile(histogram,0.99)/1e6,histogram.maxNs.load()/1e6);
+		result += line;
+	}
+	//So that they aren't read as glass to nozzle
+	if(clock==CAPTURE_AT_ARRIVAL){
+		result += "acquire and arrivalTo* start when the frame reached inference rather than at the sensor,\n"
+			"so exposure and everything before inference (e.g. rpicam-vid's encoding and the hop from the streamer) aren't included\n";
+	}
+	return result;
+}
+
+static volatile sig_atomic_t dumpRequested = 0;
+
+static void onDumpSignal(int signal){
+	dumpRequested = 1;
+}
+
+void LatencyStats::dumpOnSignal(int signal){
+	if(!shared) return;
+	std::signal(signal,onDumpSignal);
+	//Printing isn't safe in a signal handler
+	std::thread([]{
+		while(true){
+			if(dumpRequested){
+				dumpRequested = 0;
+				std::cerr << shared->dump() << std::flush;
+			}
+			usleep(250000);
+		}
+	}).detach();
+}
+
+//----------------------------------------------------
+//BUCKETS
+
+int LatencyStats::bucketIndex(uint64_t ns){
+	const uint64_t us = ns/1000;
+	if(us==0) return 0;
+	const int msb = 63-__builtin_clzll(us);
+	//The 2 bits after the top one pick the quarter of the doubling
+	const int quarter = msb>=2 ? (us>>(msb-2))&3 : (us<<(2-msb))&3;
+	return std::min(NUM_LATENCY_BUCKETS-1,1+msb*4+quarter);
+}
+
+double LatencyStats::bucketStart(int index){
+	if(index==0) return 0;
+	const int msb = (index-1)/4;
+	const int quarter = (index-1)%4;
+	return std::ldexp(4+quarter,msb-2)*1000;
+}
+
+double LatencyStats::percentile(const latencyHistogram& histogram,double fraction){
+	const uint64_t count = histogram.count.load();
+	const uint64_t target = (uint64_t) std::ceil(count*fraction);
+	uint64_t seen = 0;
+	for(int i=0;i<NUM_LATENCY_BUCKETS;i++){
+		seen += histogram.buckets[i].load();
+		//The top of the bucket so that it's never an underestimate
+		if(seen>=target) return std::min(bucketStart(i+1),(double) histogram.maxNs.load());
+	}
+	return histogram.maxNs.load();
+}
+
+//----------------------------------------------------
+//PENDING
+
+void PendingStamps::start(uint64_t key,uint64_t ns){
+	std::lock_guard<std::mutex> lock(mutex);
+	//Overwrites the oldest, which must have been dropped if it's still here
+	keys[next] = key;
+	starts[next] = ns;
+	next = (next+1)%SIZE;
+}
+
+uint64_t PendingStamps::take(uint64_t key){
+	std::lock_guard<std::mutex> lock(mutex);
+	for(int i=0;i<SIZE;i++){
+		if(starts[i]!=0 && keys[i]==key){
+			const uint64_t start = starts[i];
+			starts[i] = 0;
+			return start;
+		}
+	}
+	return 0;
+}
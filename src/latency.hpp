@@ -0,0 +1,86 @@
+#ifndef LATENCY_HPP
+#define LATENCY_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <mutex>
+
+//Every stage a frame goes through from the sensor to the nozzle, and which process times it
+//Times are all monotonicNow() (see videoframe.hpp) so they can be compared between processes
+typedef enum latencyStage{
+	LATENCY_ENCODE, //streamer, raw frame into the H.264 encoder -> out of it (direct capture only, rpicam-vid does its own)
+	LATENCY_RECEIVE, //inference, arrived from the streamer -> into the decoder (shared memory only)
+	LATENCY_DECODE, //inference, into the decoder -> out of the appsink
+	LATENCY_ACQUIRE, //inference, capture -> given to preprocessing
+	LATENCY_PREPROCESS, //inference, conversion and resizing
+	LATENCY_INFER, //inference, preprocessed -> CNN done, including waiting for the CNN
+	LATENCY_PUBLISH, //inference, CNN done -> written to the I2C process
+	LATENCY_I2C_REPLY, //I2C, written -> given to the Pico by HAS_WEED
+	LATENCY_SHOOT, //I2C, HAS_WEED reply -> SHOOT turning the pump on
+	LATENCY_HTTP_REQUEST, //HTTP, handling a request
+	//From the frame's captureTime, which is only the sensor's with direct capture (see captureClock)
+	LATENCY_CAPTURE_TO_PUBLISH,
+	LATENCY_CAPTURE_TO_REPLY,
+	LATENCY_CAPTURE_TO_SHOOT, //glass to nozzle with direct capture
+	NUM_LATENCY_STAGES
+} latencyStage;
+
+//What a frame's captureTime is
+typedef enum captureClock{
+	CAPTURE_AT_SENSOR, //libcamera's sensor timestamp (direct capture)
+	CAPTURE_AT_ARRIVAL //when it reached inference, rpicam-vid's H.264 has no timestamps and replays have no sensor
+} captureClock;
+
+//Log spaced, 4 per doubling from 1us, the last one has everything over ~18 minutes
+#define NUM_LATENCY_BUCKETS 128
+
+//Counters only, so that any process can add to them without a lock
+typedef struct latencyHistogram{
+	std::atomic<uint64_t> buckets[NUM_LATENCY_BUCKETS];
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> totalNs;
+	std::atomic<uint64_t> maxNs;
+}latencyHistogram;
+
+class LatencyStats{
+	public:
+		//Must be called before forking so that every process adds to the same histograms
+		//clock only changes how the capture stages are labelled in dump()
+		static void init(captureClock clock);
+		//nullptr if init hasn't been called, nothing is timed then
+		static LatencyStats* get(){ return shared; }
+		//Skipped if either time is unknown (0) or they're the wrong way round
+		void record(latencyStage stage,uint64_t startNs,uint64_t endNs);
+		//A table of every stage that's been timed, in ms
+		std::string dump() const;
+		void reset();
+		//Starts a thread in this process that prints dump() to stderr whenever it gets signal (e.g. SIGUSR1)
+		static void dumpOnSignal(int signal);
+	private:
+		latencyHistogram histograms[NUM_LATENCY_STAGES];
+		captureClock clock;
+		static LatencyStats *shared;
+
+		static int bucketIndex(uint64_t ns);
+		//Lower edge of a bucket in ns
+		static double bucketStart(int index);
+		static double percentile(const latencyHistogram& histogram,double fraction);
+};
+
+//When things that are in flight started, looked up by a key such as a GstBuffer's PTS
+//For stages where the start and end are seen in different places (e.g. either side of an encoder)
+class PendingStamps{
+	public:
+		void start(uint64_t key,uint64_t ns);
+		//Returns when key started and forgets it, 0 if it's not known (e.g. the encoder dropped it)
+		uint64_t take(uint64_t key);
+	private:
+		static constexpr int SIZE = 32;
+		uint64_t keys[SIZE] = {0};
+		uint64_t starts[SIZE] = {0};
+		int next = 0;
+		std::mutex mutex;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef LATESTQUEUE_HPP
+#define LATESTQUEUE_HPP
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+//Single producer, single consumer, where the consumer only ever wants the newest item (a triple buffer)
+//The producer never waits, an item that hasn't been taken yet is replaced (dropped) by the next one
+//Passing items is lock-free, the mutex is only for a stage with nothing to do to sleep on
+//The slots are reused rather than reallocated, so T's buffers are only allocated the first time
+template<typename T>
+class LatestQueue{
+	public:
+		//PRODUCER
+		//The slot to fill, it still has whatever was in it last
+		T& writeSlot(){ return slots[back]; }
+		//Makes the filled slot the latest
+		//Returns false if it replaced one that hadn't been taken
+		bool publish(){
+			int old = middle.load();
+			while(!middle.compare_exchange_weak(old,back | FRESH | (old & CLOSED)));
+			back = old & INDEX;
+			ring();
+			return !(old & FRESH);
+		}
+		//For producers that mustn't drop anything, waits until the consumer has taken the last item
+		//Returns false if it timed out or the queue was closed
+		bool waitUntilTaken(int timeoutMs){
+			return sleepUntil(timeoutMs,[this]{ return (middle.load() & (FRESH|CLOSED)) != FRESH; }) && !isClosed();
+		}
+		//Nothing else is coming, wakes both sides
+		void close(){
+			middle.fetch_or(CLOSED);
+			ring();
+		}
+		//e.g. a video file looping back to the start
+		void reopen(){
+			middle.fetch_and(~CLOSED);
+		}
+		bool isClosed() const{ return middle.load() & CLOSED; }
+
+		//CONSUMER
+		//Waits up to timeoutMs for an item newer than the last one
+		//Returns nullptr if there isn't one, check isClosed to see if there won't ever be
+		//The item belongs to the consumer until the next pop
+		T* pop(int timeoutMs){
+			if(!sleepUntil(timeoutMs,[this]{ return (middle.load() & (FRESH|CLOSED)) != 0; })) return nullptr;
+			int old = middle.load();
+			if(!(old & FRESH)) return nullptr; //closed
+			while(!middle.compare_exchange_weak(old,front | (old & CLOSED)));
+			front = old & INDEX;
+			ring();
+			return &slots[front];
+		}
+	private:
+		static constexpr int INDEX = 3;
+		static constexpr int FRESH = 4; //middle hasn't been taken
+		static constexpr int CLOSED = 8;
+		T slots[3];
+		int back = 0; //only touched by the producer
+		int front = 1; //only touched by the consumer
+		std::atomic<int> middle{2}; //index | FRESH | CLOSED
+		std::mutex sleepMutex;
+		std::condition_variable wake;
+		std::atomic<int> sleepers{0};
+
+		//A sleeper is counted before it checks the condition and a ringer changes middle before it checks for sleepers
+		//So either the sleeper sees the change or the ringer sees the sleeper
+		void ring(){
+			if(sleepers.load()>0){
+				std::lock_guard<std::mutex> lock(sleepMutex);
+				wake.notify_all();
+			}
+		}
+		template<typename Condition>
+		bool sleepUntil(int timeoutMs,Condition condition){
+			if(condition()) return true;
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			sleepers++;
+			bool met = wake.wait_for(lock,std::chrono::milliseconds(timeoutMs),condition);
+			sleepers--;
+			return met;
+		}
+};
+
+#endif
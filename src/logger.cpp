@@ -0,0 +1,180 @@
+#include "logger.hpp"
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//Single producer (the thread it belongs to), single consumer (the drain thread)
+typedef struct logRing{
+	std::atomic<uint64_t> head{0}; //next to be written
+	std::atomic<uint64_t> tail{0}; //next to be printed
+	std::atomic<uint64_t> numDropped{0};
+	logEntry entries[LOG_RING_SIZE];
+}logRing;
+
+//Rings are never freed, a thread that's finished can still have messages waiting
+//Neither is anything the drain thread uses, it's still running when the static destructors are
+static std::mutex& ringsMutex(){
+	static std::mutex *mutex = new std::mutex();
+	return *mutex;
+}
+static std::vector<logRing*>& rings(){
+	static std::vector<logRing*> *registered = new std::vector<logRing*>();
+	return *registered;
+}
+static std::mutex& drainMutex(){
+	static std::mutex *mutex = new std::mutex();
+	return *mutex;
+}
+static thread_local logRing *threadRing = nullptr;
+static std::atomic<bool> drainRunning{false};
+
+static const char *levelNames[] = {"DEBUG","INFO","WARN","ERROR"};
+
+static uint64_t logNow(){
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return (uint64_t) now.tv_sec*1000000000ull+now.tv_nsec;
+}
+
+static logLevel levelFromEnvironment(){
+	const char *level = getenv("WEED_SPOTTER_LOG");
+	if(!level) return LOG_LEVEL_INFO;
+	for(int i=LOG_LEVEL_DEBUG;i<=LOG_LEVEL_ERROR;i++){
+		if(strcasecmp(level,levelNames[i])==0) return (logLevel) i;
+	}
+	return LOG_LEVEL_INFO;
+}
+
+std::atomic<int>& Logger::minLevel(){
+	static std::atomic<int> level{levelFromEnvironment()};
+	return level;
+}
+
+//----------------------------------------------------
+//DRAINING
+
+//Takes everything that's waiting in every ring and prints it in time order
+static void drain(){
+	//Only one drain at a time, flush can be called whilst the thread is draining
+	std::lock_guard<std::mutex> drainLock(drainMutex());
+	std::vector<logRing*> current;
+	{
+		std::lock_guard<std::mutex> lock(ringsMutex());
+		current = rings();
+	}
+	std::vector<const logEntry*> entries;
+	std::vector<std::pair<logRing*,uint64_t>> taken;
+	uint64_t numDropped = 0;
+	for(logRing *ring: current){
+		const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+		const uint64_t head = ring->head.load(std::memory_order_acquire);
+		for(uint64_t i=tail;i<head;i++) entries.push_back(&ring->entries[i%LOG_RING_SIZE]);
+		taken.push_back({ring,head});
+		numDropped += ring->numDropped.exchange(0,std::memory_order_relaxed);
+	}
+	//Stable so that each thread's own messages stay in order
+	std::stable_sort(entries.begin(),entries.end(),[](const logEntry *a,const logEntry *b){ return a->time<b->time; });
+	char line[LOG_ENTRY_SIZE*2];
+	bool wroteOut = false;
+	bool wroteErr = false;
+	for(const logEntry *entry: entries){
+		const int prefix = snprintf(line,sizeof(line),"%llu.%03llu %s ",(unsigned long long) (entry->time/1000000000),
+			(unsigned long long) (entry->time/1000000%1000),levelNames[entry->level]);
+		int length = entry->formatter(line+prefix,sizeof(line)-prefix-1,entry->fmt,entry->args);
+		length = std::max(0,std::min(length,(int) sizeof(line)-prefix-2));
+		line[prefix+length] = '\n';
+		FILE *stream = entry->level>=LOG_LEVEL_WARN ? stderr : stdout;
+		fwrite(line,1,prefix+length+1,stream);
+		if(stream==stdout) wroteOut = true;
+		else wroteErr = true;
+	}
+	//Given back only once they've been printed
+	for(const std::pair<logRing*,uint64_t>& ring: taken){
+		ring.first->tail.store(ring.second,std::memory_order_release);
+	}
+	if(numDropped>0){
+		fprintf(stderr,"%llu log messages were dropped, the output couldn't keep up\n",(unsigned long long) numDropped);
+		wroteErr = true;
+	}
+	//Once per batch rather than per line
+	if(wroteOut) fflush(stdout);
+	if(wroteErr) fflush(stderr);
+}
+
+static void drainLoop(){
+	while(true){
+		drain();
+		usleep(20000);
+	}
+}
+
+//Forks only keep the thread that called fork, so the child needs its own drain thread
+//Anything that was waiting belongs to the parent, which prints it
+static void onForkPrepare(){
+	//Same order as drain
+	drainMutex().lock();
+	ringsMutex().lock();
+}
+
+static void onForkParent(){
+	ringsMutex().unlock();
+	drainMutex().unlock();
+}
+
+static void onForkChild(){
+	//The other threads' rings will never be written to again in here
+	rings().clear();
+	if(threadRing){
+		threadRing->tail.store(threadRing->head.load());
+		rings().push_back(threadRing);
+	}
+	drainRunning = false;
+	ringsMutex().unlock();
+	drainMutex().unlock();
+}
+
+static void startDrainThread(){
+	static std::once_flag registered;
+	std::call_once(registered,[]{
+		pthread_atfork(onForkPrepare,onForkParent,onForkChild);
+		//Whatever's left when main returns or exit is called
+		atexit(Logger::flush);
+	});
+	std::thread(drainLoop).detach();
+}
+
+//----------------------------------------------------
+//LOGGING
+
+logEntry* Logger::claim(){
+	if(!threadRing){
+		threadRing = new logRing();
+		std::lock_guard<std::mutex> lock(ringsMutex());
+		rings().push_back(threadRing);
+	}
+	//Only the first message in each process gets here
+	if(!drainRunning.load(std::memory_order_relaxed) && !drainRunning.exchange(true)){
+		startDrainThread();
+	}
+	const uint64_t head = threadRing->head.load(std::memory_order_relaxed);
+	if(head-threadRing->tail.load(std::memory_order_acquire)>=LOG_RING_SIZE){
+		threadRing->numDropped.fetch_add(1,std::memory_order_relaxed);
+		return nullptr;
+	}
+	logEntry *entry = &threadRing->entries[head%LOG_RING_SIZE];
+	entry->time = logNow();
+	return entry;
+}
+
+void Logger::publish(){
+	threadRing->head.store(threadRing->head.load(std::memory_order_relaxed)+1,std::memory_order_release);
+}
+
+void Logger::flush(){
+	drain();
+}
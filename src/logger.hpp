@@ -0,0 +1,140 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+typedef enum logLevel{
+	LOG_LEVEL_DEBUG,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_WARN,
+	LOG_LEVEL_ERROR
+} logLevel;
+
+//Each entry is a fixed size so the rings can be preallocated, longer messages are cut short
+#define LOG_ENTRY_SIZE 256
+#define LOG_ARGS_SIZE (LOG_ENTRY_SIZE-32)
+//Per thread, if the drain thread falls this far behind new messages are dropped rather than waiting
+#define LOG_RING_SIZE 512
+//A string that there was no room left for at all
+#define LOG_STRING_DROPPED 0xFFFF
+
+//Strings are copied in as they may not outlive the call, they go in the entry's args after the numbers
+typedef struct logString{
+	uint16_t offset; //into args
+}logString;
+
+//Unpacks the arguments and formats them, runs on the drain thread
+typedef int (*logFormatter)(char *out,size_t outSize,const char *fmt,const uint8_t *args);
+
+typedef struct logEntry{
+	uint64_t time; //ns, CLOCK_MONOTONIC
+	const char *fmt; //must be a string literal, only the pointer is kept
+	logFormatter formatter;
+	logLevel level;
+	alignas(8) uint8_t args[LOG_ARGS_SIZE];
+}logEntry;
+
+//Where the next string goes in an entry's args
+typedef struct logPacker{
+	uint8_t *args;
+	size_t used;
+}logPacker;
+
+//Each string gets whatever space is left, one that doesn't fit ends in "..." so it's obvious it was cut
+static inline logString packLogString(logPacker& packer,const char *str){
+	const size_t space = LOG_ARGS_SIZE-packer.used;
+	if(space<4) return {LOG_STRING_DROPPED};
+	logString result = {(uint16_t) packer.used};
+	char *out = (char*) packer.args+packer.used;
+	const size_t length = strnlen(str,space);
+	if(length<space){
+		memcpy(out,str,length+1);
+		packer.used += length+1;
+	}
+	else{
+		memcpy(out,str,space-4);
+		memcpy(out+space-4,"...",4);
+		packer.used = LOG_ARGS_SIZE;
+	}
+	return result;
+}
+
+//Numbers are kept as they are and strings are copied, formatting is left to the drain thread
+template<typename T>
+static inline T toLogArg(logPacker&,T arg){
+	static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value,"Only numbers and strings can be logged");
+	return arg;
+}
+
+static inline logString toLogArg(logPacker& packer,const char *arg){ return packLogString(packer,arg ? arg : "(null)"); }
+static inline logString toLogArg(logPacker& packer,char *arg){ return toLogArg(packer,(const char*) arg); }
+static inline logString toLogArg(logPacker& packer,const std::string& arg){ return toLogArg(packer,arg.c_str()); }
+
+template<typename T>
+static inline T fromLogArg(const T& arg,const uint8_t *){ return arg; }
+static inline const char* fromLogArg(const logString& arg,const uint8_t *args){
+	return arg.offset==LOG_STRING_DROPPED ? "..." : (const char*) args+arg.offset;
+}
+
+template<typename Tuple>
+static int formatLogEntry(char *out,size_t outSize,const char *fmt,const uint8_t *args){
+	const Tuple& values = *(const Tuple*) args;
+	return std::apply([&](const auto&... value){
+		#pragma GCC diagnostic push
+		#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+		#pragma GCC diagnostic ignored "-Wformat-security"
+		return snprintf(out,outSize,fmt,fromLogArg(value,args)...);
+		#pragma GCC diagnostic pop
+	},values);
+}
+
+//printf style logging that never blocks the caller
+//Each thread writes to its own lock-free ring and a background thread in each process formats and prints them
+//so a slow stdout (journald, a serial console) only ever holds up the drain thread
+//DEBUG and INFO go to stdout, WARN and ERROR to stderr, WEED_SPOTTER_LOG=debug|info|warn|error sets the lowest level printed
+class Logger{
+	public:
+		static bool isEnabled(logLevel level){ return level>=minLevel().load(std::memory_order_relaxed); }
+		static void setLevel(logLevel level){ minLevel().store(level,std::memory_order_relaxed); }
+		template<typename... Args>
+		static void log(logLevel level,const char *fmt,const Args&... args){
+			if(!isEnabled(level)) return;
+			typedef std::tuple<decltype(toLogArg(std::declval<logPacker&>(),args))...> argTuple;
+			static_assert(sizeof(argTuple)<=sizeof(logEntry::args),"Too much to log in one go");
+			logEntry *entry = claim();
+			//Full, it's been counted and will be reported
+			if(!entry) return;
+			entry->level = level;
+			entry->fmt = fmt;
+			entry->formatter = formatLogEntry<argTuple>;
+			logPacker packer = {entry->args,sizeof(argTuple)};
+			new(entry->args) argTuple(toLogArg(packer,args)...);
+			publish();
+		}
+		//Prints everything that's waiting and returns once it's done, e.g. before exiting
+		static void flush();
+	private:
+		static std::atomic<int>& minLevel();
+		//The next free entry in this thread's ring, nullptr if it's full
+		static logEntry* claim();
+		static void publish();
+};
+
+template<typename... Args>
+static inline void logDebug(const char *fmt,const Args&... args){ Logger::log(LOG_LEVEL_DEBUG,fmt,args...); }
+template<typename... Args>
+static inline void logInfo(const char *fmt,const Args&... args){ Logger::log(LOG_LEVEL_INFO,fmt,args...); }
+template<typename... Args>
+static inline void logWarn(const char *fmt,const Args&... args){ Logger::log(LOG_LEVEL_WARN,fmt,args...); }
+template<typename... Args>
+static inline void logError(const char *fmt,const Args&... args){ Logger::log(LOG_LEVEL_ERROR,fmt,args...); }
+
+#endif
@@ -1,6 +1,15 @@
 #include "cameraimage.hpp"
 #include "cameraaccess.hpp"
 #include "streamer.hpp"
+#include "viewfeed.hpp"
+#include "framesource.hpp"
+#include "detectionpipeline.hpp"
+#include "framescheduler.hpp"
+#include "latency.hpp"
+#include "snapshotring.hpp"
+#include "flightrecorder.hpp"
+#include "detectionslot.hpp"
+#include "logger.hpp"
 #include "httpserver.hpp"
 #include "sys/types.h"
 #include <unistd.h>
@@ -9,8 +18,14 @@
 #include <gst/app/gstappsink.h>
 #include <iostream>
 #include "cnn.hpp"
+#include "conformance.hpp"
 #include "json.hpp"
 #include <fstream>
+#include <csignal>
+#include <random>
+#include <chrono>
+#include <filesystem>
+#include <algorithm>
 
 //DONE
 //Moved includes to .cpp if applicable for faster compilation
@@ -25,112 +40,246 @@ const std::string currDir = "/home/alistair/Weed-Spotter";
 
 Tensor uint8ToTensor(uint8_t *data,size_t dataSize,const std::vector<int>& dimens);
 d2 loadPixelStats();
-void locateWeedsBlocking(int pipefd[2]);
+void replayBlocking(int argc,char **argv);
+void exportDetectionLog(int argc,char **argv);
+void onReloadModelSignal(int signal);
+void trainBlocking(int argc,char **argv);
+d2 loadLabels(const std::string& fname);
+
+//Set by SIGHUP, the new model is loaded in the background whilst the current one keeps running
+//e.g. copy the new .json files into res/ and then "kill -HUP <pid>"
+volatile sig_atomic_t reloadModel = 0;
 
 int main(int argc,char **argv){
-	//Pipe to give the rpicam-vid PID to the server so it can take photos
-	int pipefd[2];
-	pipe(pipefd);
+	//"Weed-Spotter train [epochs] [batchSize] [learningRate]" retrains on dataset/ and exits
+	if(argc>1 && std::string(argv[1])=="train"){
+		trainBlocking(argc,argv);
+		return 0;
+	}
+	//"Weed-Spotter conformance [iterations] [seed]" checks the optimised kernels against the scalar reference and exits
+	if(argc>1 && std::string(argv[1])=="conformance"){
+		int iterations = argc>2 ? std::stoi(argv[2]) : 100;
+		unsigned int seed = argc>3 ? std::stoul(argv[3]) : std::random_device{}();
+		return runConformance(iterations,seed)==0 ? 0 : 1;
+	}
+	//"Weed-Spotter flight <dump> <outDir>" exports a flight recorder dump to CSVs and JPEGs and exits
+	if(argc>1 && std::string(argv[1])=="flight"){
+		if(argc<4){
+			throw std::invalid_argument("Usage: flight <dump> <outDir>");
+		}
+		FlightRecorder::exportDump(argv[2],argv[3]);
+		return 0;
+	}
+	//"Weed-Spotter detections <segment.bin|logDir> [out.csv]" exports the detection log as CSV and exits
+	if(argc>1 && std::string(argv[1])=="detections"){
+		exportDetectionLog(argc,argv);
+		return 0;
+	}
+	//"Weed-Spotter replay <jpeg|raw|video> <path> [options]" runs the detection loop on recorded frames and exits
+	//No camera, RTSP server or I2C is needed so it can be profiled on a dev box
+	if(argc>1 && std::string(argv[1])=="replay"){
+		replayBlocking(argc,argv);
+		return 0;
+	}
+	//"--capture=libcamera" has inference read the camera itself rather than decoding the RTSP stream
+	//The streamer is then given our frames to encode as only one process can have the camera
+	bool directCapture = false;
+	//"--native-yuv" has the RTSP decoder give us its I420/NV12 rather than converting to RGB with videoconvert
+	bool nativeYuv = false;
+	//"--rate=<fps>" or "--speed=<m/s> --footprint=<m> [--overlap=0.25]" for the detection rate, otherwise as fast as it can go
+	scheduleOptions schedule;
+	//"--max-age=<ms>" is how long after capture a detection is still worth acting on, 0 for forever
+	uint32_t maxAgeMs = 500;
+	for(int i=1;i<argc;i++){
+		if(std::string(argv[i])=="--capture=libcamera") directCapture = true;
+		if(std::string(argv[i])=="--native-yuv") nativeYuv = true;
+		if(std::string(argv[i]).rfind("--max-age=",0)==0) maxAgeMs = std::stoul(argv[i]+10);
+		FrameScheduler::parseOption(argv[i],schedule);
+	}
+	//Shared by every process, "curl <pi-ip>:8080/latency" or "kill -USR1 <pid>" to see them
+	//rpicam-vid's H.264 doesn't carry the sensor's timestamps, only libcamera does
+	LatencyStats::init(directCapture ? CAPTURE_AT_SENSOR : CAPTURE_AT_ARRIVAL);
+	//The server takes photos from the frames we've decoded rather than opening the stream itself
+	SnapshotRing::init(480,640);
+	//The last few seconds of everything, written to recordings/ on a crash, "curl <pi-ip>:8080/flight_recorder" or a missed spray from the Pico
+	FlightRecorder::init(currDir+"/recordings");
+	FlightRecorder::dumpOnCrash();
+	//Inference -> I2C, only ever the newest detection
+	DetectionSlot::init();
+	int rawFramePipefd[2] = {-1,-1};
+	if(directCapture){
+		//Without it the streamer would start rpicam-vid and take the camera from us
+		if(pipe(rawFramePipefd) == -1){
+			throw std::runtime_error("Could not pipe");
+		}
+	}
+	//A crashed run leaves its socket behind, shmsink can't bind to it and we'd connect to nothing
+	else unlink(H264_SHM_SOCKET);
 
 	pid_t streamerPid = fork();
 	if(streamerPid==0){ //child
-		Streamer streamer(&argc,&argv,pipefd);
+		if(directCapture) close(rawFramePipefd[1]);
+		Streamer streamer(&argc,&argv,rawFramePipefd[0]);
 	}
+	if(directCapture) close(rawFramePipefd[0]);
 	pid_t httpServerPid = fork();
 	if(httpServerPid==0){
-		startHttpServer(pipefd);
+		startHttpServer();
 	}
-	int weedPipefd[2];
-	pipe(weedPipefd);
 	pid_t picoI2cPid = fork();
 	if(picoI2cPid==0){
-		picoI2cListenBlocking(weedPipefd);
+		picoI2cListenBlocking(maxAgeMs);
+	}
+	d2 pixelStats = loadPixelStats();
+	CNN cnn(pixelStats);
+	//Only this process reloads, the children were forked before this
+	std::signal(SIGHUP,onReloadModelSignal);
+	LatencyStats::dumpOnSignal(SIGUSR1);
+	std::unique_ptr<ViewFeed> viewFeed;
+	std::unique_ptr<FrameSource> source;
+	if(directCapture){
+		//If the streamer dies we'd rather carry on without the view feed than be killed
+		std::signal(SIGPIPE,SIG_IGN);
+		//Every frame goes to the stream, only the latest goes to the CNN
+		viewFeed = std::make_unique<ViewFeed>(rawFramePipefd[1],480,640);
+		ViewFeed *feed = viewFeed.get();
+		source = std::make_unique<CameraSource>(480,640,[feed](const videoFrame& frame){ feed->push(frame); });
+	}
+	else{
+		source = std::make_unique<ShmSource>(H264_SHM_SOCKET,480,640,nativeYuv);
 	}
-	locateWeedsBlocking(weedPipefd);
+	//Latest frame wins all the way through
+	FrameScheduler scheduler(schedule);
+	//Every detection, kept for the agronomy reports
+	DetectionLog detectionLog(currDir+"/logs");
+	DetectionPipeline pipeline(*source,cnn,DetectionSlot::get(),false,reloadModel,currDir+"/res",&scheduler,maxAgeMs,&detectionLog);
+	pipeline.run();
 	return 0;
 }
 
-void locateWeedsBlocking(int pipefd[2]){
-	//TODO - just for testing
-	const uint64_t usDelay = 1e6;
-	
-	bool weed = false;
-	char weedX = 0;
-	char weedY = 0;
-	char pipeBuffer[3] = {0};
-	//We never read anything
-	close(pipefd[0]);
+void replayBlocking(int argc,char **argv){
+	if(argc<4){
+		throw std::invalid_argument("Usage: replay <jpeg|raw|video> <path> [--fast] [--loop] [--native-yuv] [--fps=30] [--size=640x480] [--format=rgb|bgr|yuyv|i420|nv12] [--rate=] [--speed= --footprint= --overlap=] [--max-age=ms]");
+	}
+	const std::string type = argv[2];
+	const std::string path = argv[3];
+	replayOptions options;
+	//Only needed for raw dumps
+	int height = 480;
+	int width = 640;
+	frameFormat format = FRAME_RGB;
+	bool nativeYuv = false; //Only for videos
+	scheduleOptions schedule; //Only in real time
+	uint32_t maxAgeMs = 0;
+	for(int i=4;i<argc;i++){
+		const std::string arg = argv[i];
+		if(arg=="--fast") options.realTime = false;
+		else if(arg=="--loop") options.loop = true;
+		else if(arg=="--native-yuv") nativeYuv = true;
+		else if(arg.rfind("--fps=",0)==0) options.fps = std::stof(arg.substr(6));
+		else if(arg.rfind("--format=",0)==0) format = parseFrameFormat(arg.substr(9));
+		else if(arg.rfind("--size=",0)==0){
+			if(sscanf(arg.c_str()+7,"%dx%d",&width,&height)!=2){
+				throw std::invalid_argument("Replay size must be in the format <width>x<height>");
+			}
+		}
+		else if(arg.rfind("--max-age=",0)==0) maxAgeMs = std::stoul(arg.substr(10));
+		else if(!FrameScheduler::parseOption(arg,schedule)) throw std::invalid_argument("Unknown replay option "+arg);
+	}
+	std::unique_ptr<FrameSource> source;
+	if(type=="jpeg") source = std::make_unique<JpegDirSource>(path,options);
+	else if(type=="raw") source = std::make_unique<RawDumpSource>(path,height,width,format,options);
+	else if(type=="video") source = std::make_unique<VideoFileSource>(path,options,nativeYuv);
+	else throw std::invalid_argument("Unknown replay source "+type+", expected jpeg, raw or video");
+
 	d2 pixelStats = loadPixelStats();
 	CNN cnn(pixelStats);
+	std::signal(SIGHUP,onReloadModelSignal);
+	//Frames are stamped when they're read
+	LatencyStats::init(CAPTURE_AT_ARRIVAL);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	//--fast has every frame go through the CNN, real time is scheduled and drops them like a live source
+	std::unique_ptr<FrameScheduler> scheduler;
+	if(options.realTime) scheduler = std::make_unique<FrameScheduler>(schedule);
+	DetectionPipeline pipeline(*source,cnn,nullptr,!options.realTime,reloadModel,currDir+"/res",scheduler.get(),maxAgeMs);
+	long numFrames = pipeline.run();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+	//So the summary comes after every frame's messages
+	Logger::flush();
+	std::cout << "Processed " << numFrames << " frames in " << seconds << "s (" << numFrames/seconds << " fps)" << std::endl;
+	if(maxAgeMs>0) std::cout << pipeline.getNumStale() << " were older than " << maxAgeMs << "ms and dropped" << std::endl;
+	std::cout << LatencyStats::get()->dump();
+}
 
-   	gst_init(NULL, NULL);
+void exportDetectionLog(int argc,char **argv){
+	if(argc<3){
+		throw std::invalid_argument("Usage: detections <segment.bin|logDir> [out.csv]");
+	}
+	std::vector<std::string> fnames;
+	if(std::filesystem::is_directory(argv[2])){
+		for(const auto& entry: std::filesystem::directory_iterator(argv[2])){
+			const std::string fname = entry.path().filename().string();
+			if(fname.rfind("detections_",0)==0 && entry.path().extension()==".bin") fnames.push_back(entry.path().string());
+		}
+		//Named by when they were started
+		std::sort(fnames.begin(),fnames.end());
+	}
+	else fnames.push_back(argv[2]);
+	if(argc>3){
+		std::ofstream out(argv[3]);
+		if(!out){
+			throw std::runtime_error("Could not open file "+std::string(argv[3]));
+		}
+		DetectionLog::exportCsv(fnames,out);
+	}
+	else DetectionLog::exportCsv(fnames,std::cout);
+}
 
-	const std::vector<int> imageDimens = {3,480,640};
-    	std::string pipelineDesc =
-        "rtspsrc location=rtsp://127.0.0.1:8554/stream latency=200 ! decodebin ! "
-        "videoconvert ! video/x-raw,format=RGB,width="+std::to_string(imageDimens[2])+
-		",height="+std::to_string(imageDimens[1])+" ! appsink name=sink";
+void trainBlocking(int argc,char **argv){
+	trainingOptions options;
+	if(argc>2) options.epochs = std::stoi(argv[2]);
+	if(argc>3) options.batchSize = std::stoi(argv[3]);
+	if(argc>4) options.learningRate = std::stof(argv[4]);
+	//Carries on from the current model
+	d2 pixelStats = loadPixelStats();
+	CNN cnn(pixelStats);
+	//Line i of labels.csv is for photo_i.jpg
+	d2 targets = loadLabels(currDir+"/dataset/labels.csv");
+	const std::string photosDir = currDir+"/dataset/photos";
+	//Decoded as they're needed rather than keeping every photo in memory
+	auto getImage = [&](int i){
+		CameraImage photo = CameraImage::loadJPEG(photosDir+"/photo_"+std::to_string(i)+".jpg");
+		return uint8ToTensor(photo.data.get(),(size_t)photo.height*photo.width*3,{3,photo.height,photo.width});
+	};
+	cnn.train(targets.size(),getImage,targets,options);
+	//The running inference loop can pick this up with a SIGHUP
+	cnn.save(currDir+"/res");
+}
 
-    	GError *error = nullptr;
-   	 GstElement *pipeline = gst_parse_launch(pipelineDesc.c_str(), &error);
-    	if (!pipeline) {
-        	std::cerr << "Pipeline error: " << error->message << std::endl;
-        	g_error_free(error);
-        	return;
-    	}
+d2 loadLabels(const std::string& fname){
+	std::ifstream labelsFile(fname);
+	if(!labelsFile){
+		throw std::runtime_error("Could not open file "+fname);
+	}
+	d2 targets;
+	std::string line;
+	while(std::getline(labelsFile,line)){
+		if(line.empty()) continue;
+		size_t comma = line.find(',');
+		if(comma==std::string::npos){
+			throw std::invalid_argument("Label \""+line+"\" is not in the format x,y");
+		}
+		float x = std::stof(line.substr(0,comma));
+		float y = std::stof(line.substr(comma+1));
+		//-1,-1 means there's no weed
+		if(x<0 || y<0) targets.push_back({0.0f,0.0f,0.0f});
+		else targets.push_back({x,y,1.0f});
+	}
+	return targets;
+}
 
-    	GstElement *appsink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
-	g_object_set(G_OBJECT(appsink),"emit-signals",FALSE,"max-buffers",1,"drop",TRUE,NULL);
-    	gst_element_set_state(pipeline, GST_STATE_PLAYING);
-
-	while(1){
-        	//Pull one sample (blocking)
-        	GstSample *sample = gst_app_sink_try_pull_sample(GST_APP_SINK(appsink),1000000); //1ms
-	        if (!sample) {
-	        	std::cerr << "No sample" << std::endl;
-			continue;
-	        }
-
-	        GstBuffer *gstBuffer = gst_sample_get_buffer(sample);
-	        GstMapInfo map;
-	        if (gst_buffer_map(gstBuffer, &map, GST_MAP_READ)) {
-	            //map.data is a pointer to the raw pixels
-	            //RGB height x width x channels
-	         	const uint8_t *pixels = map.data;
-	        	size_t size = map.size;
-			Tensor inputImage = uint8ToTensor(map.data,map.size,imageDimens);
-
-			const float hasWeedThreshold = 0.5f;
-			std::vector result = cnn.forwards(inputImage);
-			if(result[2] > hasWeedThreshold){
-				std::cout << "Weed spotted at: ("+std::to_string(result[0])+","+
-				std::to_string(result[1])+")" << std::endl;
-				weed = true;
-				weedX = (char) (result[0]*100);
-				weedY = (char) (result[1]*100);
-			}
-			else{
-				std::cout << "No weeds present" << std::endl;
-				weed = false;
-				weedX = 0;
-				weedY = 0;
-			}
-			pipeBuffer[0] = weed?1:0;
-			pipeBuffer[1] = weedX;
-			pipeBuffer[2] = weedY;
-			//Give the weed info to i2C
-			write(pipefd[1],pipeBuffer,sizeof(pipeBuffer));
-			printf("Written to pipe: %d %d %d\n",pipeBuffer[0],pipeBuffer[1],pipeBuffer[2]);
-  			gst_buffer_unmap(gstBuffer, &map);
-	        }
-	        gst_sample_unref(sample);
-
-		usleep(usDelay);
-	}
-	close(pipefd[1]);
-
-    	gst_element_set_state(pipeline, GST_STATE_NULL);
-   	gst_object_unref(pipeline);
+void onReloadModelSignal(int signal){
+	reloadModel = 1;
 }
 
 d2 loadPixelStats(){
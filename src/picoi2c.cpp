@@ -1,22 +1,43 @@
 #include "picoi2c.hpp"
-#include <iostream>
+#include "logger.hpp"
 #include <pigpio.h>
 #include <unistd.h>
 #include <cstring>
+#include <algorithm>
 #include "globals.hpp"
 #include "pump.hpp"
-#include <fcntl.h>
+#include "videoframe.hpp"
+#include "latency.hpp"
+#include "flightrecorder.hpp"
+#include "detectionslot.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
+//Dumping writes megabytes to the SD card, so it's done on its own thread rather than holding up the Pico
+static std::mutex dumpMutex;
+static std::condition_variable dumpWanted;
+static bool dumpRequested = false;
 
-void picoI2cListenBlocking(int pipefd[2]){
-	bool weed = false;
-	char weedX = 0;
-	char weedY = 0;
-	char buffer[3] = {0};
-	//We don't write
-	close(pipefd[1]);
-	//Make read end of pipe non-blocking
-	fcntl(pipefd[0],F_SETFL,O_NONBLOCK);
+static void dumpLoop(FlightRecorder *recorder){
+	while(true){
+		{
+			std::unique_lock<std::mutex> lock(dumpMutex);
+			dumpWanted.wait(lock,[]{ return dumpRequested; });
+			dumpRequested = false;
+		}
+		if(!recorder->dump("missed_spray")) logError("Could not dump the flight recorder");
+	}
+}
+
+void picoI2cListenBlocking(uint32_t maxAgeMs){
+	DetectionSlot *slot = DetectionSlot::get();
+	if(!slot){
+		throw std::runtime_error("The detection slot hasn't been set up");
+	}
+	//Of the last HAS_WEED reply, for timing SHOOT
+	uint64_t repliedCaptureTime = 0;
+	uint64_t replyTime = 0;
 
 	if(gpioInitialise() < 0){
 		throw std::runtime_error("Could not initialise GPIO pins");
@@ -35,7 +56,8 @@ void picoI2cListenBlocking(int pipefd[2]){
 		gpioTerminate();
 		throw std::runtime_error("Could not set up i2c as a slave");
 	}
-	std::cout << "I2C slave running at address " << ZERO_I2C_ADDR << std::endl;
+	logInfo("I2C slave running at address %d",ZERO_I2C_ADDR);
+	if(FlightRecorder *recorder = FlightRecorder::get()) std::thread(dumpLoop,recorder).detach();
 	//we then check the buffer periodically
 	//The user presses disconnect, the pico sends us poweroff and then we poweroff
 	//The user can't press disconnect and then flip the off switch within 0.1s
@@ -43,54 +65,93 @@ void picoI2cListenBlocking(int pipefd[2]){
 	const int shootDutyCycle = 100;
 	const float shootDuration = 0.5f;
 	while(true){
-		int retVal = read(pipefd[0],buffer,sizeof(buffer));
-		//std::cout << retVal << std::endl;
-		if(retVal==sizeof(buffer)){
-			std::cout << "Read pipe" << std::endl;
-			weed = buffer[0] == 1;
-			weedX = buffer[1];
-			weedY = buffer[2];
-		}
 		int status = bscXfer(&xfer);
 		//We got something
 		if(status >= 0 && xfer.rxCnt > 0){
-			std::cout << "Received "<< xfer.rxCnt << " bytes on I2C" << std::endl;
+			logDebug("Received %d bytes on I2C",xfer.rxCnt);
 			if(xfer.rxCnt<2) continue;
 			for(int i=0;i<(xfer.rxCnt-1);i++){
-				printf("rxBuf[i]: %x rxBuf[i+1]: %x\n",xfer.rxBuf[i],xfer.rxBuf[i+1]);
+				logDebug("rxBuf[i]: %x rxBuf[i+1]: %x",xfer.rxBuf[i],xfer.rxBuf[i+1]);
 				if(xfer.rxBuf[i] == ZERO_CHECK_BYTE){
 					if(xfer.rxBuf[i+1] == POWEROFF){
-						std::cout << "Powering off" << std::endl;
+						logInfo("Powering off");
+						//We won't get another chance
+						Logger::flush();
 						//Stop I2C
 						xfer.control = 0;
 						xfer.txCnt = 0;
 						bscXfer(&xfer);
 						gpioTerminate();
 						system("poweroff");
-						std::cerr << "Could not power off" << std::endl;
+						logError("Could not power off");
 					}
-					if(xfer.rxBuf[i+1] == HAS_WEED){
-						printf("weed: %d weedY: %f weedY: %f\n",weed?1:0,weedX,weedY);
-						char reply[] = {(char) (weed?1:0),weedX,weedY};
-						memcpy(xfer.txBuf,reply,sizeof(reply));
-						xfer.txCnt = sizeof(reply);
-						printf("Sent: {%d,%d,%d}\n",reply[0],reply[1],reply[2]);
+					if(xfer.rxBuf[i+1] == HAS_WEED || xfer.rxBuf[i+1] == HAS_WEED_AGE){
+						//Read as the Pico asks so it's the newest there is, captureTime is 0 until the first report
+						weedReport report = {};
+						slot->latest(report);
+						const bool weed = report.weed == 1;
+						uint64_t ageMs = report.captureTime==0 ? UINT16_MAX : (monotonicNow()-report.captureTime)/1000000;
+						uint16_t age = (uint16_t) std::min<uint64_t>(ageMs,UINT16_MAX);
+						logDebug("Frame %u weed: %d weedX: %d weedY: %d age: %dms",report.sequence,weed?1:0,report.weedX,report.weedY,age);
+						char reply[] = {(char) (weed?1:0),report.weedX,report.weedY,(char) (age&0xFF),(char) (age>>8)};
+						size_t replySize = sizeof(reply);
+						if(xfer.rxBuf[i+1] == HAS_WEED){
+							//Too late to aim at, the weed has moved on
+							if(maxAgeMs>0 && ageMs>maxAgeMs){
+								logWarn("Report is stale, sending no weed");
+								reply[0] = 0;
+								reply[1] = 0;
+								reply[2] = 0;
+							}
+							replySize = 3;
+						}
+						memcpy(xfer.txBuf,reply,replySize);
+						xfer.txCnt = replySize;
+						logDebug("Sent: {%d,%d,%d}",reply[0],reply[1],reply[2]);
 						bscXfer(&xfer);
+						replyTime = monotonicNow();
+						if(FlightRecorder *recorder = FlightRecorder::get()){
+							recordedCommand command = {replyTime,(uint8_t) xfer.rxBuf[i+1],(uint8_t) replySize};
+							memcpy(command.reply,reply,replySize);
+							recorder->recordCommand(command);
+						}
+						repliedCaptureTime = report.captureTime;
+						if(LatencyStats *stats = LatencyStats::get()){
+							stats->record(LATENCY_I2C_REPLY,report.publishTime,replyTime);
+							stats->record(LATENCY_CAPTURE_TO_REPLY,report.captureTime,replyTime);
+						}
 					}
 					if(xfer.rxBuf[i+1]==SHOOT){
-						std::cout << "Shooting" << std::endl;
+						logInfo("Shooting");
 						//Reply
 						xfer.control = 0;
 						xfer.txCnt = 0;
 						bscXfer(&xfer);
+						//The pump goes on as soon as shootWeedKiller starts
+						const uint64_t now = monotonicNow();
+						if(LatencyStats *stats = LatencyStats::get()){
+							stats->record(LATENCY_SHOOT,replyTime,now);
+							stats->record(LATENCY_CAPTURE_TO_SHOOT,repliedCaptureTime,now);
+						}
+						if(FlightRecorder *recorder = FlightRecorder::get()) recorder->recordCommand({now,SHOOT,0});
 						shootWeedKiller(shootDutyCycle,shootDuration);
 					}
+					if(xfer.rxBuf[i+1]==MISSED_SPRAY){
+						//No reply, the BSC peripheral is left on
+						logWarn("Missed spray reported, dumping the flight recorder");
+						if(FlightRecorder *recorder = FlightRecorder::get()){
+							recorder->recordCommand({monotonicNow(),MISSED_SPRAY,0});
+							//Several reports whilst it's dumping only need one more dump
+							std::lock_guard<std::mutex> lock(dumpMutex);
+							dumpRequested = true;
+							dumpWanted.notify_one();
+						}
+					}
 				}
 			}
 		}
 		usleep(polling_period_micro);
 	}
-	close(pipefd[0]);
 	//Stop I2C
 	xfer.control = 0;
 	bscXfer(&xfer);
@@ -1,6 +1,8 @@
 #ifndef PICOI2C_HPP
 #define PICOI2C_HPP
 
+#include <cstdint>
+
 //Names match the code on the Pico
 //7 bit address
 #define ZERO_I2C_ADDR 0x2A
@@ -9,9 +11,24 @@
 typedef enum ZERO_CMDS{
 	POWEROFF = 0x10,
 	HAS_WEED = 0x20,
-	SHOOT = 0x30
+	HAS_WEED_AGE = 0x21, //HAS_WEED followed by how old it is
+	SHOOT = 0x30,
+	MISSED_SPRAY = 0x40 //the operator saw a weed get missed, dumps the flight recorder
 } ZERO_CMDS;
 
-void picoI2cListenBlocking(int pipefd[2]);
+//What inference publishes for every frame (see DetectionSlot)
+typedef struct weedReport{
+	char weed;
+	char weedX;
+	char weedY;
+	uint32_t sequence; //of the frame it came from
+	uint64_t captureTime; //see videoFrame
+	uint64_t publishTime; //when it was published
+}weedReport;
+
+//Reports older than maxAgeMs are given to HAS_WEED as no weed, 0 never drops them
+//HAS_WEED_AGE always gives the age (ms, little endian uint16, saturates) and leaves it to the Pico
+//Reports are read from DetectionSlot, which must have been initialised
+void picoI2cListenBlocking(uint32_t maxAgeMs);
 
 #endif
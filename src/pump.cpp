@@ -1,6 +1,6 @@
 #include "pump.hpp"
+#include "logger.hpp"
 
-#include <iostream>
 #include <exception>
 #include <unistd.h>
 #include <pigpio.h>
@@ -13,10 +13,10 @@ void shootWeedKiller(int dutyCyclePercentage,float durationSeconds){
 	//0-1,000,000
 	int dutyCycle = dutyCyclePercentage * 1e4;
 	gpioHardwarePWM(PUMP_GPIO,frequency,dutyCycle);
-	std::cout << "PWM on" << std::endl;
+	logDebug("PWM on");
 
 	gpioDelay(durationUs);
 	gpioHardwarePWM(PUMP_GPIO,0,0);
 
-	std::cout << "PWM off" << std::endl;
+	logDebug("PWM off");
 }
@@ -0,0 +1,80 @@
+#include "snapshotring.hpp"
+#include <sys/mman.h>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <new>
+
+SnapshotRing *SnapshotRing::shared = nullptr;
+
+void SnapshotRing::init(int height,int width){
+	if(shared) return;
+	//RGB is the biggest format
+	const size_t slotBytes = frameSize(FRAME_RGB,height,width);
+	const size_t totalBytes = sizeof(SnapshotRing)+NUM_SNAPSHOT_SLOTS*slotBytes;
+	//Anonymous and shared, so it's inherited by every fork
+	void *addr = mmap(nullptr,totalBytes,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if(addr==MAP_FAILED){
+		throw std::runtime_error("Could not map the snapshot ring");
+	}
+	//mmap gives zeroed memory, so every version starts at 0 (never written)
+	shared = new(addr) SnapshotRing();
+	shared->slotBytes = slotBytes;
+}
+
+uint8_t* SnapshotRing::slotData(int index){
+	return (uint8_t*)(this+1) + index*slotBytes;
+}
+
+void SnapshotRing::push(const videoFrame& frame){
+	if(frameSize(frame.format,frame.height,frame.width)>slotBytes) return;
+	const uint64_t index = numPushed.load(std::memory_order_relaxed)%NUM_SNAPSHOT_SLOTS;
+	snapshotSlot& slot = slots[index];
+	const uint32_t version = slot.version.load(std::memory_order_relaxed);
+	slot.version.store(version+1,std::memory_order_relaxed);
+	//Nothing below can be seen before the odd version
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.format = frame.format;
+	slot.height = frame.height;
+	slot.width = frame.width;
+	slot.sequence = frame.sequence;
+	slot.captureTime = frame.captureTime;
+	copyUnpadded(frame,slotData(index));
+	slot.version.store(version+2,std::memory_order_release);
+	numPushed.fetch_add(1,std::memory_order_release);
+}
+
+CameraImage SnapshotRing::latest(uint32_t *sequence,uint64_t *captureTime){
+	std::unique_ptr<uint8_t[]> copy(new uint8_t[slotBytes]);
+	//Only fails if the writer laps us whilst we're copying, which needs it to be a whole ring ahead
+	for(int attempt=0;attempt<NUM_SNAPSHOT_SLOTS*2;attempt++){
+		const uint64_t pushed = numPushed.load(std::memory_order_acquire);
+		if(pushed==0){
+			throw std::runtime_error("No frames have been decoded yet");
+		}
+		const uint64_t index = (pushed-1)%NUM_SNAPSHOT_SLOTS;
+		snapshotSlot& slot = slots[index];
+		const uint32_t before = slot.version.load(std::memory_order_acquire);
+		if(before%2!=0) continue;
+		videoFrame frame = {};
+		frame.format = slot.format;
+		frame.height = slot.height;
+		frame.width = slot.width;
+		frame.sequence = slot.sequence;
+		frame.captureTime = slot.captureTime;
+		//Could be half written, checked before it's used to copy
+		if(frame.format>FRAME_NV12 || frame.height<=0 || frame.width<=0) continue;
+		const size_t bytes = frameSize(frame.format,frame.height,frame.width);
+		if(bytes>slotBytes) continue;
+		memcpy(copy.get(),slotData(index),bytes);
+		//The copy has to be finished before the version is checked again
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(slot.version.load(std::memory_order_relaxed)!=before) continue;
+		setUnpaddedPlanes(frame,copy.get());
+		if(sequence) *sequence = frame.sequence;
+		if(captureTime) *captureTime = frame.captureTime;
+		//Converted here so the inference process never pays for it
+		return videoFrameToImage(frame);
+	}
+	throw std::runtime_error("The snapshot ring kept changing whilst it was being read");
+}
@@ -0,0 +1,46 @@
+#ifndef SNAPSHOTRING_HPP
+#define SNAPSHOTRING_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include "videoframe.hpp"
+#include "cameraimage.hpp"
+
+#define NUM_SNAPSHOT_SLOTS 4
+
+//Each slot is a seqlock, odd whilst it's being written
+typedef struct snapshotSlot{
+	std::atomic<uint32_t> version;
+	frameFormat format;
+	int height;
+	int width;
+	uint32_t sequence;
+	uint64_t captureTime;
+}snapshotSlot;
+
+//The last few frames the inference process decoded, shared with the HTTP server so it can take photos
+//without opening its own stream and decoder
+//One writer (inference) and any number of readers, neither ever waits for the other
+class SnapshotRing{
+	public:
+		//Must be called before forking, like LatencyStats::init
+		//Frames bigger than height x width are skipped
+		static void init(int height,int width);
+		//nullptr if init hasn't been called
+		static SnapshotRing* get(){ return shared; }
+		//Copies the frame in without padding, overwriting the oldest
+		void push(const videoFrame& frame);
+		//An RGB copy of the newest frame, throws if nothing's been pushed yet
+		CameraImage latest(uint32_t *sequence = nullptr,uint64_t *captureTime = nullptr);
+	private:
+		static SnapshotRing *shared;
+		std::atomic<uint64_t> numPushed;
+		size_t slotBytes;
+		snapshotSlot slots[NUM_SNAPSHOT_SLOTS];
+		//Followed by the pixels of each slot, slotBytes apart
+
+		uint8_t* slotData(int index);
+};
+
+#endif
@@ -1,12 +1,106 @@
 #include "streamer.hpp"
-#include <iostream>
+#include "logger.hpp"
+#include "latency.hpp"
+#include "videoframe.hpp"
+#include "globals.hpp"
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
-Streamer::Streamer(int *argcPtr,char ***argvPtr,int parentPipefd[2]){
-	close(parentPipefd[0]);
+//By PTS
+static PendingStamps encoderInputs;
+
+Streamer::Streamer(int *argcPtr,char ***argvPtr,int rawFrameFd){
 	gst_init(argcPtr,argvPtr);
+	std::string pipeline;
+	if(rawFrameFd>=0){
+		//The inference process has the camera, there's nothing to start
+		//We have to do the encoding ourselves
+		pipeline =
+				"( fdsrc fd="+std::to_string(rawFrameFd)+" name=picamsrc "+
+				" ! queue "+
+				" ! rawvideoparse format=yuy2 width=640 height=480 framerate=30/1 "+
+				" ! v4l2h264enc name=encoder extra-controls=\"controls,repeat_sequence_header=1\" "+
+				" ! video/x-h264,level=(string)4 "+
+				" ! h264parse config-interval=-1 "+
+				" ! rtph264pay name=pay0 config-interval=1 pt=96 )";
+	}
+	else{
+		startCapture(startRpicamVid());
+		//The stream is just another reader of the shared memory
+		const char *sprop_param_sets = "Z0LADdkBQfsBEAAAAwAQAAADAyDxgxqw,aM48gA=="; //For 640x480
+		pipeline =
+				std::string("( shmsrc socket-path=")+H264_SHM_SOCKET+" is-live=true do-timestamp=true "+
+				" ! video/x-h264,stream-format=byte-stream,alignment=au "+
+				" ! h264parse config-interval=-1 "+
+				" ! video/x-h264,stream-format=avc,alignment=au "+
+				" ! rtph264pay name=pay0 config-interval=1 pt=96 "+
+				" sprop-parameter-sets=\""+ sprop_param_sets +"\" )";
+	}
+
+	GstRTSPServer *server = gst_rtsp_server_new();
+	GstRTSPMountPoints *mounts = gst_rtsp_server_get_mount_points(server);
+	
+	GstRTSPMediaFactory *factory = gst_rtsp_media_factory_new();
+	gst_rtsp_media_factory_set_launch(factory,pipeline.c_str());
+	gst_rtsp_media_factory_set_shared(factory,TRUE);
+	gst_rtsp_media_factory_set_latency(factory,0);
+	
+	g_signal_connect(factory, "media-configure", (GCallback) Streamer::onMediaConfigure,NULL);
+
+	gst_rtsp_mount_points_add_factory(mounts,"/stream",factory);
+	g_object_unref(mounts);
+
+	gst_rtsp_server_attach(server,NULL);
+	logInfo("RTSP stream ready at rtsp://<pi-ip>:8554/stream");
+	GMainLoop *loop = g_main_loop_new(NULL,FALSE);
+	g_main_loop_run(loop);
+}
+
+void Streamer::onMediaConfigure(GstRTSPMediaFactory *factory,
+				GstRTSPMedia *media,
+				gpointer user_data){
+	GstElement *element = gst_rtsp_media_get_element(media);
+	if(!element) return;
+	GstElement *fd = gst_bin_get_by_name_recurse_up(GST_BIN(element),"picamsrc");
+	if(fd){
+		//is-live doesn't exist in here apparently - you get a warning at runtime
+		g_object_set(fd,"do-timestamp",TRUE,NULL);
+		gst_object_unref(fd);
+	}
+	GstElement *encoder = gst_bin_get_by_name_recurse_up(GST_BIN(element),"encoder");
+	if(encoder && LatencyStats::get()){
+		GstPad *encoderSink = gst_element_get_static_pad(encoder,"sink");
+		GstPad *encoderSrc = gst_element_get_static_pad(encoder,"src");
+		if(encoderSink && encoderSrc){
+			gst_pad_add_probe(encoderSink,GST_PAD_PROBE_TYPE_BUFFER,Streamer::onEncoderInput,NULL,NULL);
+			gst_pad_add_probe(encoderSrc,GST_PAD_PROBE_TYPE_BUFFER,Streamer::onEncoderOutput,NULL,NULL);
+		}
+		if(encoderSink) gst_object_unref(encoderSink);
+		if(encoderSrc) gst_object_unref(encoderSrc);
+	}
+	if(encoder) gst_object_unref(encoder);
+	gst_object_unref(element);
+}
+
+GstPadProbeReturn Streamer::onEncoderInput(GstPad *pad,GstPadProbeInfo *info,gpointer data){
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	if(buffer && GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(buffer))){
+		encoderInputs.start(GST_BUFFER_PTS(buffer),monotonicNow());
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn Streamer::onEncoderOutput(GstPad *pad,GstPadProbeInfo *info,gpointer data){
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	//The encoder keeps the PTS of the frame
+	if(buffer && GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(buffer))){
+		LatencyStats::get()->record(LATENCY_ENCODE,encoderInputs.take(GST_BUFFER_PTS(buffer)),monotonicNow());
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+int Streamer::startRpicamVid(){
 	//Set up the streaming pipe
 	int streamPipefd[2];
 	if(pipe(streamPipefd) == -1){
@@ -36,50 +130,28 @@ Streamer::Streamer(int *argcPtr,char ***argvPtr,int parentPipefd[2]){
 		);
 		throw std::runtime_error("execlp failed");
 	}
-	//Give the child PID to our parent (the grandparent)
-	write(parentPipefd[1],&pid,sizeof(pid_t));
-	close(parentPipefd[1]);
-
 	//We don't write anything
 	close(streamPipefd[1]);
+	return streamPipefd[0];
+}
 
-	GstRTSPServer *server = gst_rtsp_server_new();
-	GstRTSPMountPoints *mounts = gst_rtsp_server_get_mount_points(server);
-	
-	const char *sprop_param_sets = "Z0LADdkBQfsBEAAAAwAQAAADAyDxgxqw,aM48gA=="; //For 640x480
-	std::string pipeline =
-				"( fdsrc fd="+std::to_string(streamPipefd[0])+" name=picamsrc "+
+void Streamer::startCapture(int h264Fd){
+	//Whole access units with the SPS/PPS on every keyframe, so a reader can join at any point
+	//4MB is over a second of 640x480 H.264, shmsink waits for space so this is the slack a slow reader gets
+	const std::string desc =
+				"fdsrc fd="+std::to_string(h264Fd)+" do-timestamp=true "+
 				" ! queue "+
 				" ! h264parse config-interval=-1 "+
-				" ! video/x-h264,stream-format=avc,alignment=au "+
-				" ! rtph264pay name=pay0 config-interval=1 pt=96 "+
-				" sprop-parameter-sets=\""+ sprop_param_sets +"\" )";
-	GstRTSPMediaFactory *factory = gst_rtsp_media_factory_new();
-	gst_rtsp_media_factory_set_launch(factory,pipeline.c_str());
-	gst_rtsp_media_factory_set_shared(factory,TRUE);
-	gst_rtsp_media_factory_set_latency(factory,0);
-	
-	g_signal_connect(factory, "media-configure", (GCallback) Streamer::onMediaConfigure,NULL);
-
-	gst_rtsp_mount_points_add_factory(mounts,"/stream",factory);
-	g_object_unref(mounts);
-
-	gst_rtsp_server_attach(server,NULL);
-	std::cout << "RTSP stream ready at rtsp://<pi-ip>:8554/stream" << std::endl;
-	GMainLoop *loop = g_main_loop_new(NULL,FALSE);
-	g_main_loop_run(loop);
-}
-
-void Streamer::onMediaConfigure(GstRTSPMediaFactory *factory,
-				GstRTSPMedia *media,
-				gpointer user_data){
-	GstElement *element = gst_rtsp_media_get_element(media);
-	if(!element) return;
-	GstElement *fd = gst_bin_get_by_name_recurse_up(GST_BIN(element),"picamsrc");
-	if(fd){
-		//is-live doesn't exist in here apparently - you get a warning at runtime
-		g_object_set(fd,"do-timestamp",TRUE,NULL);
-		gst_object_unref(fd);
+				" ! video/x-h264,stream-format=byte-stream,alignment=au "+
+				" ! shmsink socket-path="+H264_SHM_SOCKET+" shm-size=4194304 wait-for-connection=false sync=false";
+	GError *error = nullptr;
+	GstElement *capture = gst_parse_launch(desc.c_str(),&error);
+	if(!capture){
+		std::string message = error->message;
+		g_error_free(error);
+		throw std::runtime_error("Capture pipeline error: "+message);
+	}
+	if(gst_element_set_state(capture,GST_STATE_PLAYING)==GST_STATE_CHANGE_FAILURE){
+		throw std::runtime_error("Could not start sharing frames at " H264_SHM_SOCKET);
 	}
-	gst_object_unref(element);
 }
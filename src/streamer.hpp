@@ -3,13 +3,23 @@
 
 #include <gst/gst.h>
 #include <gst/rtsp-server/rtsp-server.h>
+#include <string>
 
 class Streamer{
 	public:
-		Streamer(int *argcPtr,char ***argvPtr,int parentPipefd[2]);
+		//If rawFrameFd is given, YUYV 640x480 frames are read from it (see ViewFeed) instead of starting rpicam-vid
+		Streamer(int *argcPtr,char ***argvPtr,int rawFrameFd = -1);
 		static void onMediaConfigure(   GstRTSPMediaFactory *factory,
 						GstRTSPMedia *media,
 						gpointer user_data);
+	private:
+		//Returns the fd rpicam-vid writes its H.264 to
+		static int startRpicamVid();
+		//Runs whether or not anyone is watching, puts each access unit in shared memory for inference (see ShmSource) and the RTSP stream
+		static void startCapture(int h264Fd);
+		//Time spent in the encoder when we're doing it (see LatencyStats)
+		static GstPadProbeReturn onEncoderInput(GstPad *pad,GstPadProbeInfo *info,gpointer data);
+		static GstPadProbeReturn onEncoderOutput(GstPad *pad,GstPadProbeInfo *info,gpointer data);
 };
 
 #endif
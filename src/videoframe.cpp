@@ -0,0 +1,308 @@
+#include "videoframe.hpp"
+#include "yuyv.hpp"
+#include <arm_neon.h>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <time.h>
+
+uint64_t monotonicNow(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+size_t frameSize(frameFormat format,int height,int width){
+	const size_t pixels = (size_t)height*width;
+	switch(format){
+		case FRAME_RGB:
+		case FRAME_BGR:
+			return pixels*3;
+		case FRAME_YUYV:
+			return pixels*2;
+		case FRAME_I420:
+		case FRAME_NV12:
+			//Odd sizes round the chroma up
+			return pixels + 2*(size_t)((height+1)/2)*((width+1)/2);
+	}
+	throw std::invalid_argument("Unknown frame format");
+}
+
+frameFormat parseFrameFormat(const std::string& name){
+	if(name=="rgb") return FRAME_RGB;
+	if(name=="bgr") return FRAME_BGR;
+	if(name=="yuyv") return FRAME_YUYV;
+	if(name=="i420") return FRAME_I420;
+	if(name=="nv12") return FRAME_NV12;
+	throw std::invalid_argument("Unknown frame format \""+name+"\", expected rgb, bgr, yuyv, i420 or nv12");
+}
+
+void setUnpaddedPlanes(videoFrame& frame,const uint8_t *data){
+	frame.data = data;
+	switch(frame.format){
+		case FRAME_RGB:
+		case FRAME_BGR:
+			frame.stride = frame.width*3;
+			break;
+		case FRAME_YUYV:
+			frame.stride = frame.width*2;
+			break;
+		case FRAME_I420:{
+			const int chromaWidth = (frame.width+1)/2;
+			frame.stride = frame.width;
+			frame.chromaStride = chromaWidth;
+			frame.uData = data + (size_t)frame.height*frame.width;
+			frame.vData = frame.uData + (size_t)((frame.height+1)/2)*chromaWidth;
+			break;
+		}
+		case FRAME_NV12:
+			frame.stride = frame.width;
+			frame.chromaStride = 2*((frame.width+1)/2);
+			frame.uData = data + (size_t)frame.height*frame.width;
+			frame.vData = frame.uData+1;
+			break;
+	}
+}
+
+void copyUnpadded(const videoFrame& frame,uint8_t *out){
+	videoFrame unpadded = frame;
+	setUnpaddedPlanes(unpadded,out);
+	const size_t rowBytes = unpadded.stride;
+	for(int y=0;y<frame.height;y++){
+		memcpy(out+y*rowBytes,frame.data+(size_t)y*frame.stride,rowBytes);
+	}
+	if(frame.format==FRAME_I420 || frame.format==FRAME_NV12){
+		const int chromaHeight = (frame.height+1)/2;
+		uint8_t *u = out + (size_t)frame.height*rowBytes;
+		for(int y=0;y<chromaHeight;y++){
+			memcpy(u+y*unpadded.chromaStride,frame.uData+(size_t)y*frame.chromaStride,unpadded.chromaStride);
+		}
+		if(frame.format==FRAME_I420){
+			uint8_t *v = u + (size_t)chromaHeight*unpadded.chromaStride;
+			for(int y=0;y<chromaHeight;y++){
+				memcpy(v+y*unpadded.chromaStride,frame.vData+(size_t)y*frame.chromaStride,unpadded.chromaStride);
+			}
+		}
+	}
+}
+
+//----------------------------------------------------
+//CONVERSION
+
+//Every format is converted a row at a time into the three planes
+//Each channel is then v*scale+offset, which is either the normalisation or nothing
+
+//BT.601 limited range like GStreamer's videoconvert, so that the model sees the same colours as from an RGB appsink
+static const float yScale = 1.164383f;
+static const float yOffset = -16.0f*yScale;
+static const float vToR = 1.596027f;
+static const float uToG = -0.391762f;
+static const float vToG = -0.812968f;
+static const float uToB = 2.017232f;
+
+static inline float clip(float val){
+	return std::max(0.0f,std::min(255.0f,val));
+}
+
+static inline float32x4_t clip(float32x4_t val){
+	return vminq_f32(vmaxq_f32(val,vdupq_n_f32(0.0f)),vdupq_n_f32(255.0f));
+}
+
+static inline void widen(uint8x8_t vals,float32x4_t& low,float32x4_t& high){
+	const uint16x8_t vals16 = vmovl_u8(vals);
+	low = vcvtq_f32_u32(vmovl_u16(vget_low_u16(vals16)));
+	high = vcvtq_f32_u32(vmovl_high_u16(vals16));
+}
+
+//chromaStep is 1 for I420's separate planes and 2 for NV12's pairs
+static void yuv420Row(const uint8_t *yRow,const uint8_t *uRow,const uint8_t *vRow,int chromaStep,int width,
+	float *r,float *g,float *b,const float scale[3],const float offset[3]){
+	const float32x4_t rScale = vdupq_n_f32(scale[0]),gScale = vdupq_n_f32(scale[1]),bScale = vdupq_n_f32(scale[2]);
+	const float32x4_t rOffset = vdupq_n_f32(offset[0]),gOffset = vdupq_n_f32(offset[1]),bOffset = vdupq_n_f32(offset[2]);
+	const float32x4_t half = vdupq_n_f32(128.0f);
+	int x = 0;
+	//16 pixels and 8 chroma samples at a time
+	for(;x+16<=width;x+=16){
+		const uint8x16_t yBytes = vld1q_u8(yRow+x);
+		uint8x8_t uBytes,vBytes;
+		if(chromaStep==1){
+			uBytes = vld1_u8(uRow+x/2);
+			vBytes = vld1_u8(vRow+x/2);
+		}
+		else{
+			const uint8x8x2_t uv = vld2_u8(uRow+x);
+			uBytes = uv.val[0];
+			vBytes = uv.val[1];
+		}
+		float32x4_t ys[4],us[2],vs[2];
+		widen(vget_low_u8(yBytes),ys[0],ys[1]);
+		widen(vget_high_u8(yBytes),ys[2],ys[3]);
+		widen(uBytes,us[0],us[1]);
+		widen(vBytes,vs[0],vs[1]);
+		for(int k=0;k<2;k++){
+			const float32x4_t u = vsubq_f32(us[k],half);
+			const float32x4_t v = vsubq_f32(vs[k],half);
+			const float32x4_t rChroma = vmulq_n_f32(v,vToR);
+			const float32x4_t gChroma = vfmaq_n_f32(vmulq_n_f32(u,uToG),v,vToG);
+			const float32x4_t bChroma = vmulq_n_f32(u,uToB);
+			for(int h=0;h<2;h++){
+				//Each chroma sample is shared by two pixels
+				const float32x4_t rPair = h==0 ? vzip1q_f32(rChroma,rChroma) : vzip2q_f32(rChroma,rChroma);
+				const float32x4_t gPair = h==0 ? vzip1q_f32(gChroma,gChroma) : vzip2q_f32(gChroma,gChroma);
+				const float32x4_t bPair = h==0 ? vzip1q_f32(bChroma,bChroma) : vzip2q_f32(bChroma,bChroma);
+				const float32x4_t luma = vfmaq_n_f32(vdupq_n_f32(yOffset),ys[2*k+h],yScale);
+				const int i = x+8*k+4*h;
+				vst1q_f32(r+i,vfmaq_f32(rOffset,clip(vaddq_f32(luma,rPair)),rScale));
+				vst1q_f32(g+i,vfmaq_f32(gOffset,clip(vaddq_f32(luma,gPair)),gScale));
+				vst1q_f32(b+i,vfmaq_f32(bOffset,clip(vaddq_f32(luma,bPair)),bScale));
+			}
+		}
+	}
+	for(;x<width;x++){
+		const float u = uRow[(x/2)*chromaStep]-128.0f;
+		const float v = vRow[(x/2)*chromaStep]-128.0f;
+		const float luma = yRow[x]*yScale+yOffset;
+		r[x] = clip(luma+v*vToR)*scale[0]+offset[0];
+		g[x] = clip(luma+u*uToG+v*vToG)*scale[1]+offset[1];
+		b[x] = clip(luma+u*uToB)*scale[2]+offset[2];
+	}
+}
+
+//Converted to bytes first so that it's exactly the same as CameraImage::YUYVToRGB
+static void yuyvRow(const uint8_t *row,int width,float *r,float *g,float *b,const float scale[3],const float offset[3]){
+	const float32x4_t rScale = vdupq_n_f32(scale[0]),gScale = vdupq_n_f32(scale[1]),bScale = vdupq_n_f32(scale[2]);
+	const float32x4_t rOffset = vdupq_n_f32(offset[0]),gOffset = vdupq_n_f32(offset[1]),bOffset = vdupq_n_f32(offset[2]);
+	int x = 0;
+	for(;x+16<=width;x+=16){
+		uint8x16_t rBytes,gBytes,bBytes;
+		yuyvToRGB16(row+x*2,rBytes,gBytes,bBytes);
+		float32x4_t vals[4];
+		widen(vget_low_u8(rBytes),vals[0],vals[1]);
+		widen(vget_high_u8(rBytes),vals[2],vals[3]);
+		for(int k=0;k<4;k++) vst1q_f32(r+x+4*k,vfmaq_f32(rOffset,vals[k],rScale));
+		widen(vget_low_u8(gBytes),vals[0],vals[1]);
+		widen(vget_high_u8(gBytes),vals[2],vals[3]);
+		for(int k=0;k<4;k++) vst1q_f32(g+x+4*k,vfmaq_f32(gOffset,vals[k],gScale));
+		widen(vget_low_u8(bBytes),vals[0],vals[1]);
+		widen(vget_high_u8(bBytes),vals[2],vals[3]);
+		for(int k=0;k<4;k++) vst1q_f32(b+x+4*k,vfmaq_f32(bOffset,vals[k],bScale));
+	}
+	uint8_t rgb[6];
+	for(;x<width;x+=2){
+		const uint8_t *pair = row + x*2;
+		CameraImage::yuvToRGB(pair[0],pair[1],pair[3],rgb);
+		CameraImage::yuvToRGB(pair[2],pair[1],pair[3],rgb+3);
+		r[x] = rgb[0]*scale[0]+offset[0];
+		g[x] = rgb[1]*scale[1]+offset[1];
+		b[x] = rgb[2]*scale[2]+offset[2];
+		r[x+1] = rgb[3]*scale[0]+offset[0];
+		g[x+1] = rgb[4]*scale[1]+offset[1];
+		b[x+1] = rgb[5]*scale[2]+offset[2];
+	}
+}
+
+static void packedRow(const uint8_t *row,frameFormat format,int width,float *r,float *g,float *b,const float scale[3],const float offset[3]){
+	if(format==FRAME_YUYV){
+		yuyvRow(row,width,r,g,b,scale,offset);
+	}
+	else{
+		const int rIndex = format==FRAME_BGR ? 2 : 0;
+		for(int x=0;x<width;x++){
+			const uint8_t *pixel = row + x*3;
+			r[x] = pixel[rIndex]*scale[0]+offset[0];
+			g[x] = pixel[1]*scale[1]+offset[1];
+			b[x] = pixel[2-rIndex]*scale[2]+offset[2];
+		}
+	}
+}
+
+//The planes are channelSize apart and each row is rowSize after the last
+static void convertFrame(const videoFrame& frame,float *planes,int channelSize,int rowSize,const float scale[3],const float offset[3]){
+	if(frame.format==FRAME_YUYV && frame.width%2!=0){
+		throw std::runtime_error("YUYV frames must have an even width");
+	}
+	const bool yuv420 = frame.format==FRAME_I420 || frame.format==FRAME_NV12;
+	if(yuv420 && (frame.uData==nullptr || frame.vData==nullptr)){
+		throw std::invalid_argument("I420 and NV12 frames need their chroma planes");
+	}
+	for(int y=0;y<frame.height;y++){
+		const uint8_t *row = frame.data + (size_t)y*frame.stride;
+		float *r = planes + (size_t)y*rowSize;
+		float *g = r + channelSize;
+		float *b = g + channelSize;
+		if(yuv420){
+			const size_t chromaRow = (size_t)(y/2)*frame.chromaStride;
+			yuv420Row(row,frame.uData+chromaRow,frame.vData+chromaRow,frame.format==FRAME_NV12?2:1,frame.width,r,g,b,scale,offset);
+		}
+		else packedRow(row,frame.format,frame.width,r,g,b,scale,offset);
+	}
+}
+
+Tensor videoFrameToTensor(const videoFrame& frame){
+	Tensor result({3,frame.height,frame.width});
+	const float scale[3] = {1.0f,1.0f,1.0f};
+	const float offset[3] = {0.0f,0.0f,0.0f};
+	convertFrame(frame,result.getData(),result.getChildSizes()[0],frame.width,scale,offset);
+	return result;
+}
+
+CameraImage videoFrameToImage(const videoFrame& frame){
+	if(frame.format==FRAME_YUYV && frame.width%2!=0){
+		throw std::runtime_error("YUYV frames must have an even width");
+	}
+	const size_t rowSize = (size_t)frame.width*3;
+	std::unique_ptr<uint8_t[]> output(new uint8_t[rowSize*frame.height]);
+	for(int y=0;y<frame.height;y++){
+		const uint8_t *row = frame.data + (size_t)y*frame.stride;
+		uint8_t *out = output.get() + y*rowSize;
+		switch(frame.format){
+			case FRAME_RGB:
+				memcpy(out,row,rowSize);
+				break;
+			case FRAME_BGR:
+				for(int x=0;x<frame.width;x++){
+					out[x*3] = row[x*3+2];
+					out[x*3+1] = row[x*3+1];
+					out[x*3+2] = row[x*3];
+				}
+				break;
+			case FRAME_YUYV:
+				yuyvRowToRGB(row,frame.width,out);
+				break;
+			case FRAME_I420:
+			case FRAME_NV12:{
+				//Same colours as the CNN gets (see yuv420Row)
+				const int chromaStep = frame.format==FRAME_NV12 ? 2 : 1;
+				const uint8_t *uRow = frame.uData + (size_t)(y/2)*frame.chromaStride;
+				const uint8_t *vRow = frame.vData + (size_t)(y/2)*frame.chromaStride;
+				for(int x=0;x<frame.width;x++){
+					const float u = uRow[(x/2)*chromaStep]-128.0f;
+					const float v = vRow[(x/2)*chromaStep]-128.0f;
+					const float luma = row[x]*yScale+yOffset;
+					out[x*3] = (uint8_t) (clip(luma+v*vToR)+0.5f);
+					out[x*3+1] = (uint8_t) (clip(luma+u*uToG+v*vToG)+0.5f);
+					out[x*3+2] = (uint8_t) (clip(luma+u*uToB)+0.5f);
+				}
+				break;
+			}
+		}
+	}
+	return CameraImage(output,frame.height,frame.width);
+}
+
+void videoFrameToInput(const videoFrame& frame,const TensorView& input,const d2& pixelStats){
+	if(input.getNumDimens()!=3 || input.getDimen(0)!=3){
+		throw std::invalid_argument("The CNN's input must be 3 channels for a video frame");
+	}
+	if(input.getDimen(1)!=frame.height || input.getDimen(2)!=frame.width){
+		throw std::invalid_argument("The video frame must be the size of the CNN's input, use videoFrameToTensor otherwise");
+	}
+	//(v-mean)/stdDev
+	float scale[3];
+	float offset[3];
+	for(int c=0;c<3;c++){
+		scale[c] = 1.0f/pixelStats[1][c];
+		offset[c] = -pixelStats[0][c]/pixelStats[1][c];
+	}
+	convertFrame(frame,input.getData(),input.getChildSize(0),input.getChildSize(1),scale,offset);
+}
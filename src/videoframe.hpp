@@ -0,0 +1,55 @@
+#ifndef VIDEOFRAME_HPP
+#define VIDEOFRAME_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include "globals.hpp"
+#include "tensor.hpp"
+#include "tensorview.hpp"
+#include "cameraimage.hpp"
+
+//Byte order in memory
+typedef enum frameFormat{
+	FRAME_RGB,
+	FRAME_BGR,
+	FRAME_YUYV, //Y0,U,Y1,V for each pair of pixels
+	FRAME_I420, //Y plane then U and V planes at half the height and width
+	FRAME_NV12 //Y plane then one plane of U,V pairs at half the height and width
+} frameFormat;
+
+//One frame from wherever it came from (camera, RTSP, a file)
+//data belongs to the source and so it's only valid inside the function it's given to
+typedef struct videoFrame{
+	const uint8_t *data; //the only plane for packed formats, Y for I420 and NV12
+	int height;
+	int width;
+	int stride; //bytes per row of data
+	frameFormat format;
+	uint32_t sequence;
+	uint64_t timestamp; //ns, only comparable between frames from the same source
+	uint64_t captureTime; //ns on the monotonic clock (see monotonicNow) so it can be compared between processes
+	//I420 and NV12 only, NV12 has its U,V pairs in uData
+	const uint8_t *uData = nullptr;
+	const uint8_t *vData = nullptr;
+	int chromaStride = 0;
+}videoFrame;
+
+//CLOCK_MONOTONIC in ns, the clock the kernel, libcamera and GStreamer's system clock use
+uint64_t monotonicNow();
+//Including every plane, as they'd be in a file with no padding
+size_t frameSize(frameFormat format,int height,int width);
+frameFormat parseFrameFormat(const std::string& name);
+//Sets the plane pointers for a frame that's packed with no padding (see frameSize)
+void setUnpaddedPlanes(videoFrame& frame,const uint8_t *data);
+//The other way round, out must be frameSize bytes
+void copyUnpadded(const videoFrame& frame,uint8_t *out);
+//CHW floats from 0 to 255, ready for CNN::forwards
+Tensor videoFrameToTensor(const videoFrame& frame);
+//An RGB copy that outlives the frame, e.g. for saving as a JPEG
+CameraImage videoFrameToImage(const videoFrame& frame);
+//Converts and normalises straight into the CNN's input (see CNN::forwards with fillInput)
+//The frame must already be the input's size
+void videoFrameToInput(const videoFrame& frame,const TensorView& input,const d2& pixelStats);
+
+#endif
@@ -0,0 +1,74 @@
+#include "viewfeed.hpp"
+#include "logger.hpp"
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+
+ViewFeed::ViewFeed(int fd,int height,int width){
+	if(height<=0 || width<=0){
+		throw std::invalid_argument("ViewFeed dimensions must be positive");
+	}
+	this->fd = fd;
+	this->height = height;
+	this->width = width;
+	this->frameSize = (size_t)height*width*2;
+	pending = std::make_unique<uint8_t[]>(frameSize);
+	sending = std::make_unique<uint8_t[]>(frameSize);
+	writer = std::thread(&ViewFeed::writeLoop,this);
+}
+
+ViewFeed::~ViewFeed(){
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	condition.notify_one();
+	writer.join();
+	//The streamer sees EOF
+	close(fd);
+}
+
+void ViewFeed::push(const videoFrame& frame){
+	//The streamer's pipeline is fixed at YUYV of this size
+	if(frame.format!=FRAME_YUYV || frame.height!=height || frame.width!=width){
+		std::lock_guard<std::mutex> lock(mutex);
+		if(!disabled){
+			logError("Camera gives %dx%d frames in format %d, the view feed needs %dx%d YUYV and is disabled",frame.width,frame.height,frame.format,width,height);
+			disabled = true;
+		}
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		//Overwrites the last one if it hasn't been sent yet
+		const size_t rowSize = (size_t)width*2;
+		for(int y=0;y<height;y++){
+			memcpy(pending.get()+y*rowSize,frame.data+(size_t)y*frame.stride,rowSize);
+		}
+		hasPending = true;
+	}
+	condition.notify_one();
+}
+
+void ViewFeed::writeLoop(){
+	while(true){
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock,[this]{ return hasPending || stopping; });
+			if(stopping) return;
+			std::swap(pending,sending);
+			hasPending = false;
+		}
+		//Always whole frames, rawvideoparse has no way to resync
+		size_t written = 0;
+		while(written<frameSize){
+			ssize_t n = write(fd,sending.get()+written,frameSize-written);
+			if(n<0){
+				if(errno==EINTR) continue;
+				logError("View feed write failed, the stream has stopped");
+				return;
+			}
+			written += n;
+		}
+	}
+}
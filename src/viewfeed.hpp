@@ -0,0 +1,37 @@
+#ifndef VIEWFEED_HPP
+#define VIEWFEED_HPP
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include "videoframe.hpp"
+
+//Passes the camera's frames on to the streamer when this process owns the camera
+//push is called on the camera's thread and so it only copies, a separate thread does the (blocking) writes
+//If the streamer falls behind, the frames in between are dropped rather than queued
+class ViewFeed{
+	public:
+		//fd is the write end of the streamer's raw frame pipe, frames are YUYV height x width
+		ViewFeed(int fd,int height,int width);
+		~ViewFeed();
+		void push(const videoFrame& frame);
+	private:
+		int fd;
+		int height;
+		int width;
+		size_t frameSize;
+		//pending is filled by push, sending is written by the writer thread
+		std::unique_ptr<uint8_t[]> pending;
+		std::unique_ptr<uint8_t[]> sending;
+		bool hasPending = false;
+		bool stopping = false;
+		bool disabled = false;
+		std::mutex mutex;
+		std::condition_variable condition;
+		std::thread writer;
+
+		void writeLoop();
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef YUYV_HPP
+#define YUYV_HPP
+
+#include <arm_neon.h>
+#include <cstdint>
+#include "cameraimage.hpp"
+
+//NEON versions of CameraImage::yuvToRGB, they give exactly the same bytes
+
+//One channel of 8 pixels, (298*Y + dMul*D + eMul*E + 128) >> 8 clipped to 0-255
+static inline uint8x8_t yuyvChannel(int16x8_t y,int16x8_t d,int16x8_t e,int16_t dMul,int16_t eMul){
+	int32x4_t low = vmlal_n_s16(vmlal_n_s16(vmull_n_s16(vget_low_s16(y),298),vget_low_s16(d),dMul),vget_low_s16(e),eMul);
+	int32x4_t high = vmlal_n_s16(vmlal_n_s16(vmull_n_s16(vget_high_s16(y),298),vget_high_s16(d),dMul),vget_high_s16(e),eMul);
+	low = vshrq_n_s32(vaddq_s32(low,vdupq_n_s32(128)),8);
+	high = vshrq_n_s32(vaddq_s32(high,vdupq_n_s32(128)),8);
+	//The saturating narrows do the clipping
+	return vqmovn_u16(vcombine_u16(vqmovun_s32(low),vqmovun_s32(high)));
+}
+
+//16 pixels (32 bytes) into one register per channel, in pixel order
+static inline void yuyvToRGB16(const uint8_t *yuyv,uint8x16_t& r,uint8x16_t& g,uint8x16_t& b){
+	//Y0,U,Y1,V split into a register each
+	const uint8x8x4_t pairs = vld4_u8(yuyv);
+	const int16x8_t y0 = vreinterpretq_s16_u16(vmovl_u8(pairs.val[0]));
+	const int16x8_t y1 = vreinterpretq_s16_u16(vmovl_u8(pairs.val[2]));
+	const int16x8_t d = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(pairs.val[1])),vdupq_n_s16(128));
+	const int16x8_t e = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(pairs.val[3])),vdupq_n_s16(128));
+	//Even and odd pixels are done separately and then interleaved
+	uint8x8x2_t rs = vzip_u8(yuyvChannel(y0,d,e,0,409),yuyvChannel(y1,d,e,0,409));
+	uint8x8x2_t gs = vzip_u8(yuyvChannel(y0,d,e,-100,-208),yuyvChannel(y1,d,e,-100,-208));
+	uint8x8x2_t bs = vzip_u8(yuyvChannel(y0,d,e,516,0),yuyvChannel(y1,d,e,516,0));
+	r = vcombine_u8(rs.val[0],rs.val[1]);
+	g = vcombine_u8(gs.val[0],gs.val[1]);
+	b = vcombine_u8(bs.val[0],bs.val[1]);
+}
+
+//width must be even, rgb is packed
+static inline void yuyvRowToRGB(const uint8_t *yuyv,int width,uint8_t *rgb){
+	int x = 0;
+	for(;x+16<=width;x+=16){
+		uint8x16x3_t pixels;
+		yuyvToRGB16(yuyv+x*2,pixels.val[0],pixels.val[1],pixels.val[2]);
+		vst3q_u8(rgb+x*3,pixels);
+	}
+	for(;x<width;x+=2){
+		const uint8_t *pair = yuyv + x*2;
+		CameraImage::yuvToRGB(pair[0],pair[1],pair[3],rgb+x*3);
+		CameraImage::yuvToRGB(pair[2],pair[1],pair[3],rgb+x*3+3);
+	}
+}
+
+#endif